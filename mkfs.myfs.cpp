@@ -15,8 +15,13 @@
 const int USER_OPT_COUNT = 2;
 
 int main(int argc, char *argv[]) {
-	if (argc - 1 != USER_OPT_COUNT) {
-		fprintf(stdout, "Expected argument: <backing file> <file size in bytes>\n");
+	// -o odirect formats the disk through a buffer pool with O_DIRECT, the same way
+	// myfs mounts it with -o odirect
+	bool odirect = false;
+	if (argc - 1 == USER_OPT_COUNT + 2 && strcmp(argv[3], "-o") == 0 && strcmp(argv[4], "odirect") == 0) {
+		odirect = true;
+	} else if (argc - 1 != USER_OPT_COUNT) {
+		fprintf(stdout, "Expected argument: <backing file> <file size in bytes> [-o odirect]\n");
 		return 1;
 	}
 
@@ -40,7 +45,18 @@ int main(int argc, char *argv[]) {
 	}
 	
 	fprintf(stdout, "disk size in chunks is %d, chunk size %d, total size %llu\n", CHUNK_COUNT, CHUNK_SIZE, CHUNK_COUNT * CHUNK_SIZE);
-	disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
+	if (odirect) {
+		BufferPoolConfig pool_config;
+		pool_config.direct_io = true;
+		try {
+			disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, fh, pool_config));
+		} catch (const DiskException &e) {
+			fprintf(stdout, "failed to open the disk: %s\n", e.message.c_str());
+			return 1;
+		}
+	} else {
+		disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
+	}
 	fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
 	fs->superblock->init(0.1);
 	superblock = fs->superblock.get();
@@ -24,6 +24,7 @@
 #include <libgen.h>
 #include <math.h>
 #include <signal.h>
+#include <stddef.h>
 
 #include "filesystem.hpp"
 
@@ -31,6 +32,7 @@ std::mutex lock_g;
 std::unique_ptr<Disk> disk = nullptr;
 std::unique_ptr<FileSystem> fs = nullptr;
 SuperBlock *superblock = nullptr;
+uint8_t new_inode_mapping = INode::MAPPING_BLOCKS; // how files created from now on map their chunks
 
 /*
 	TODO: figure out why permissions are so incredibly broken right now 
@@ -209,6 +211,7 @@ static int myfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 	std::shared_ptr<INode> new_inode = nullptr;
 	try {
 		new_inode = superblock->inode_table->alloc_inode();	
+		new_inode->set_mapping(new_inode_mapping);
 	} catch (const FileSystemException &e) {
 		// the disk is out of room, can not allocate any more inodes
 		return -EDQUOT;
@@ -496,9 +499,132 @@ static int myfs_unlink(const char *path) {
 // 	return 0;
 // }
 
+static int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	fprintf(stdout, "myfs_fsync(%s)\n", path);
+	try {
+		disk->sync();
+	} catch (const DiskException &e) {
+		fprintf(stdout, "\tdisk exception: %s\n", e.message.c_str());
+		return -EIO;
+	}
+	return 0;
+}
+
+// answered from the counters the file system keeps, nothing is counted here
+static int myfs_statfs(const char *path, struct statvfs *stbuf) {
+	fprintf(stdout, "myfs_statfs(%s)\n", path);
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = superblock->disk_chunk_size;
+	stbuf->f_frsize = superblock->disk_chunk_size;
+	stbuf->f_blocks = superblock->disk_size_chunks;
+	stbuf->f_bfree = superblock->free_chunk_count();
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_files = superblock->inode_table->size_inodes();
+	stbuf->f_ffree = superblock->free_inode_count();
+	stbuf->f_favail = stbuf->f_ffree;
+	stbuf->f_namemax = NAME_MAX;
+	return 0;
+}
+
+// threads started before fuse_main would not survive it going into the background
+static void *myfs_init(struct fuse_conn_info *conn) {
+	fprintf(stdout, "myfs_init()\n");
+	superblock->cleaner->start(&lock_g);
+	return NULL;
+}
+
+static void myfs_destroy(void *private_data) {
+	fprintf(stdout, "myfs_destroy()\n");
+	// keeps the cleaner from moving chunks while the counters are stored
+	std::lock_guard<std::mutex> g(lock_g);
+	try {
+		superblock->store_counters(true);
+		disk->sync();
+	} catch (const DiskException &e) {
+		fprintf(stdout, "\tdisk exception: %s\n", e.message.c_str());
+	}
+}
+
 const int USER_OPT_COUNT = 2;
 std::vector<std::string> user_options;
 
+/*
+	mount options, passed as -o name=value
+		writeback_age_ms: how long a released chunk may stay dirty before it is written back
+		writeback_bytes: how many bytes of dirty chunks are allowed before write back is forced
+		pool_bytes: serve the disk from a buffer pool of this many bytes using pread/pwrite 
+			instead of mapping the whole backing file, 0 (the default) keeps using mmap
+		io_engine: how the buffer pool reads and writes the backing file, one of auto 
+			(the default, io_uring when available), uring or posix
+		odirect: read and write file data with O_DIRECT so it is only cached in the buffer 
+			pool, metadata still goes through the page cache. implies a buffer pool, of 
+			the default size unless pool_bytes is given
+		hugepages: ask for transparent huge pages on the memory mapped image
+		populate: prefault the whole memory mapped image at mount time
+		readahead_max: the largest readahead window in chunks, 0 turns readahead off
+		noaccess_hints: do not madvise the kernel about metadata regions and sequential 
+			runs of the memory mapped image
+		extents: files and directories created while mounted map their chunks with an 
+			extent tree rather than block pointers
+		cleaner_interval_ms: how often the segment cleaner checks for free segments in 
+			the background, 0 leaves cleaning to when a write runs out of segments
+		cleaner_low, cleaner_high: the cleaner starts when fewer than cleaner_low 
+			segments are free and stops once cleaner_high are
+		cleaner_greedy: clean the emptiest segment rather than weighing in its age
+		nohotcold: write tables and the chunks the cleaner moves into the same segments 
+			as the data of files
+		segment_writes: hold back the chunks of the segments being filled from write
+			back and write each segment to the backing file in one go once it is full,
+			or once it has waited writeback_age_ms
+		discard: punch the space that is freed out of the backing file in the 
+			background, so that a sparse image shrinks back
+		discard_rate: at most this many bytes a second are punched out, 0 for no limit
+*/
+struct myfs_config {
+	unsigned long writeback_age_ms;
+	unsigned long writeback_bytes;
+	unsigned long pool_bytes;
+	char *io_engine;
+	int odirect;
+	int hugepages;
+	int populate;
+	int noaccess_hints;
+	unsigned long readahead_max;
+	int extents;
+	unsigned long cleaner_interval_ms;
+	unsigned long cleaner_low;
+	unsigned long cleaner_high;
+	int cleaner_greedy;
+	int nohotcold;
+	int segment_writes;
+	int discard;
+	unsigned long discard_rate;
+};
+
+#define MYFS_OPT(t, p) { t, offsetof(struct myfs_config, p), 0 }
+
+static struct fuse_opt myfs_opts[] = {
+	MYFS_OPT("writeback_age_ms=%lu", writeback_age_ms),
+	MYFS_OPT("writeback_bytes=%lu", writeback_bytes),
+	MYFS_OPT("pool_bytes=%lu", pool_bytes),
+	MYFS_OPT("io_engine=%s", io_engine),
+	{ "odirect", offsetof(struct myfs_config, odirect), 1 },
+	{ "hugepages", offsetof(struct myfs_config, hugepages), 1 },
+	{ "populate", offsetof(struct myfs_config, populate), 1 },
+	{ "noaccess_hints", offsetof(struct myfs_config, noaccess_hints), 1 },
+	MYFS_OPT("readahead_max=%lu", readahead_max),
+	{ "extents", offsetof(struct myfs_config, extents), 1 },
+	MYFS_OPT("cleaner_interval_ms=%lu", cleaner_interval_ms),
+	MYFS_OPT("cleaner_low=%lu", cleaner_low),
+	MYFS_OPT("cleaner_high=%lu", cleaner_high),
+	{ "cleaner_greedy", offsetof(struct myfs_config, cleaner_greedy), 1 },
+	{ "nohotcold", offsetof(struct myfs_config, nohotcold), 1 },
+	{ "segment_writes", offsetof(struct myfs_config, segment_writes), 1 },
+	{ "discard", offsetof(struct myfs_config, discard), 1 },
+	MYFS_OPT("discard_rate=%lu", discard_rate),
+	FUSE_OPT_END
+};
+
 static int myfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
 	if (key == FUSE_OPT_KEY_NONOPT && user_options.size() != USER_OPT_COUNT) {
 		user_options.push_back(arg);
@@ -515,7 +641,28 @@ int main(int argc, char *argv[])
 
 	// parse arguments from the command line
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	fuse_opt_parse(&args, NULL, NULL, myfs_opt_proc);
+	struct myfs_config config;
+	WritebackConfig writeback_defaults;
+	config.writeback_age_ms = writeback_defaults.dirty_age_ms;
+	config.writeback_bytes = writeback_defaults.dirty_bytes;
+	config.pool_bytes = 0;
+	config.io_engine = NULL;
+	config.odirect = 0;
+	config.hugepages = 0;
+	config.populate = 0;
+	config.noaccess_hints = 0;
+	config.readahead_max = ReadaheadConfig().max_window_chunks;
+	config.extents = 0;
+	CleanerConfig cleaner_defaults;
+	config.cleaner_interval_ms = 1000;
+	config.cleaner_low = cleaner_defaults.low_free_segments;
+	config.cleaner_high = cleaner_defaults.high_free_segments;
+	config.cleaner_greedy = 0;
+	config.nohotcold = 0;
+	config.segment_writes = 0;
+	config.discard = 0;
+	config.discard_rate = DiscardConfig().bytes_per_second;
+	fuse_opt_parse(&args, &config, myfs_opts, myfs_opt_proc);
 
 	if (user_options.size() != USER_OPT_COUNT) {
 		fprintf(stdout, "Expected argument: <backing file> <file size in bytes>\n");
@@ -530,11 +677,58 @@ int main(int argc, char *argv[])
 
 	int fh = open(backing_file_path, O_RDWR);
 	//truncate("realdisk.myanfest", CHUNK_COUNT * CHUNK_SIZE);
-	disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
+	if (config.pool_bytes != 0 || config.odirect) {
+		BufferPoolConfig pool_config;
+		if (config.pool_bytes != 0)
+			pool_config.pool_bytes = config.pool_bytes;
+		pool_config.direct_io = config.odirect != 0;
+		if (config.io_engine != NULL && strcmp(config.io_engine, "posix") == 0) {
+			pool_config.io_engine = IO_ENGINE_POSIX;
+		} else if (config.io_engine != NULL && strcmp(config.io_engine, "uring") == 0) {
+			pool_config.io_engine = IO_ENGINE_URING;
+		} else if (config.io_engine != NULL && strcmp(config.io_engine, "auto") != 0) {
+			fprintf(stdout, "unknown io_engine %s, expected one of auto, uring or posix\n", config.io_engine);
+			return 1;
+		}
+		try {
+			disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, fh, pool_config));
+		} catch (const DiskException &e) {
+			fprintf(stdout, "failed to open the disk: %s\n", e.message.c_str());
+			return 1;
+		}
+	} else {
+		MmapConfig mmap_config;
+		mmap_config.hugepages = config.hugepages != 0;
+		mmap_config.populate = config.populate != 0;
+		mmap_config.access_hints = config.noaccess_hints == 0;
+		disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh, mmap_config));
+	}
+	WritebackConfig writeback_config;
+	writeback_config.dirty_age_ms = config.writeback_age_ms;
+	writeback_config.dirty_bytes = config.writeback_bytes;
+	disk->set_writeback_config(writeback_config);
+	DiscardConfig discard_config;
+	discard_config.enabled = config.discard != 0;
+	discard_config.bytes_per_second = config.discard_rate;
+	disk->set_discard_config(discard_config);
 	fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
 	//fs->superblock->init(0.1);
 	fs->superblock->load_from_disk();
 	superblock = fs->superblock.get();
+	ReadaheadConfig readahead_config;
+	readahead_config.max_window_chunks = config.readahead_max;
+	superblock->readahead->set_config(readahead_config);
+	if (config.extents) 
+		new_inode_mapping = INode::MAPPING_EXTENTS;
+	CleanerConfig cleaner_config;
+	cleaner_config.interval_ms = config.cleaner_interval_ms;
+	cleaner_config.low_free_segments = config.cleaner_low;
+	cleaner_config.high_free_segments = config.cleaner_high;
+	if (config.cleaner_greedy) 
+		cleaner_config.policy = CleanerConfig::GREEDY;
+	superblock->cleaner->set_config(cleaner_config);
+	superblock->segment_controller.separate_temperatures = config.nohotcold == 0;
+	superblock->segment_controller.segment_writes = config.segment_writes != 0;
 	
 	static struct fuse_operations myfs_oper;
 	myfs_oper.getattr = myfs_getattr;
@@ -546,6 +740,10 @@ int main(int argc, char *argv[])
 	myfs_oper.mkdir = myfs_mkdir;
 	myfs_oper.utimens = myfs_utimens;
 	myfs_oper.unlink = myfs_unlink;
+	myfs_oper.fsync = myfs_fsync;
+	myfs_oper.statfs = myfs_statfs;
+	myfs_oper.init = myfs_init;
+	myfs_oper.destroy = myfs_destroy;
 	
 	return fuse_main(args.argc, args.argv, &myfs_oper, NULL);
 }
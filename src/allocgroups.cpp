@@ -0,0 +1,39 @@
+#include <thread>
+#include <algorithm>
+#include <functional>
+
+#include "allocgroups.hpp"
+
+constexpr uint64_t ReservedRun::COUNT_BITS;
+constexpr uint64_t ReservedRun::MAX_COUNT;
+constexpr uint64_t AllocGroup::NONE;
+constexpr size_t AllocGroups::MAX_GROUPS;
+
+void AllocGroups::init(uint64_t space, uint64_t min_span) {
+	size_t count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	count = std::min(count, MAX_GROUPS);
+	if (min_span != 0)
+		count = std::min<uint64_t>(count, std::max<uint64_t>(space / min_span, 1));
+
+	this->groups = std::unique_ptr<AllocGroup[]>(new AllocGroup[count]);
+	this->group_count = count;
+	for (size_t idx = 0; idx < count; ++idx) {
+		AllocGroup &group = this->groups[idx];
+		group.first = group.search_idx = space * idx / count;
+		group.end = space * (idx + 1) / count;
+	}
+}
+
+bool AllocGroups::steal(uint64_t &idx) {
+	for (size_t group = 0; group < this->group_count; ++group) {
+		if (this->groups[group].reserved.claim(idx)) 
+			return true;
+	}
+	return false;
+}
+
+size_t AllocGroups::preferred() const {
+	static std::atomic<size_t> next_slot(0);
+	static thread_local size_t slot = next_slot++;
+	return this->group_count <= 1 ? 0 : slot % this->group_count;
+}
@@ -0,0 +1,138 @@
+#ifndef ALLOCGROUPS_HPP
+#define ALLOCGROUPS_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+
+/*
+	a run of reserved indexes, [start, start + count), packed into a single word so
+	that indexes can be claimed from it without taking a lock. the count gets the low
+	COUNT_BITS bits, which bounds how long a run can be
+*/
+struct ReservedRun {
+	static constexpr uint64_t COUNT_BITS = 20;
+	static constexpr uint64_t MAX_COUNT = ((uint64_t)1 << COUNT_BITS) - 1;
+
+	std::atomic<uint64_t> run;
+
+	ReservedRun() : run(0) { }
+
+	// claims the first index of the run, returns false if the run is empty
+	inline bool claim(uint64_t &idx) {
+		uint64_t current = run.load(std::memory_order_acquire);
+		while ((current & MAX_COUNT) != 0) {
+			// one further along, one fewer left
+			const uint64_t next = current + ((uint64_t)1 << COUNT_BITS) - 1;
+			if (run.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				idx = current >> COUNT_BITS;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// claims up to count indexes off the front of the run at once, count is set to 
+	// how many were. returns false if the run is empty
+	inline bool claim(uint64_t &idx, uint64_t &count) {
+		uint64_t current = run.load(std::memory_order_acquire);
+		while ((current & MAX_COUNT) != 0) {
+			const uint64_t claimed = std::min<uint64_t>(count, current & MAX_COUNT);
+			const uint64_t next = current + (claimed << COUNT_BITS) - claimed;
+			if (run.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				idx = current >> COUNT_BITS;
+				count = claimed;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// replaces the run, the caller must make sure nobody else refills it at the same
+	// time. claims only ever shrink a run so they can not race with this, runs that 
+	// are given back to have to be replaced instead
+	inline void refill(uint64_t start, uint64_t count) {
+		run.store(start << COUNT_BITS | count, std::memory_order_release);
+	}
+
+	// empties the run and returns what was left of it
+	inline uint64_t take(uint64_t &count) {
+		const uint64_t current = run.exchange(0, std::memory_order_acq_rel);
+		count = current & MAX_COUNT;
+		return current >> COUNT_BITS;
+	}
+
+	// replaces the run whoever else is refilling it, and returns what was left of the
+	// run it replaced so that the caller can give it back
+	inline uint64_t replace(uint64_t start, uint64_t count, uint64_t &old_count) {
+		const uint64_t old = run.exchange(start << COUNT_BITS | count, std::memory_order_acq_rel);
+		old_count = old & MAX_COUNT;
+		return old >> COUNT_BITS;
+	}
+
+	// puts [start, start + count) back in front of the run if that is where it was 
+	// claimed from, returns false if the run has moved on since
+	inline bool give_back(uint64_t start, uint64_t count) {
+		uint64_t current = run.load(std::memory_order_acquire);
+		while ((current >> COUNT_BITS) == start + count && (current & MAX_COUNT) + count <= MAX_COUNT) {
+			const uint64_t next = start << COUNT_BITS | ((current & MAX_COUNT) + count);
+			if (run.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_acquire)) 
+				return true;
+		}
+		return false;
+	}
+};
+
+/*
+	allocation groups split a space of indexes (inodes, or segments) into slices so
+	that threads allocating at the same time mostly stay out of each others way. there is a group
+	per cpu, each thread sticks to one of them and takes from the run that group has
+	reserved with a single compare and swap. the group's lock is only
+	taken when the run is used up and the group has to reserve another one, starting
+	from its own slice of the space
+*/
+struct AllocGroup {
+	static constexpr uint64_t NONE = ~(uint64_t)0;
+
+	std::mutex lock; // held while the run is being refilled
+	ReservedRun reserved;
+	uint64_t first = 0; // the slice of the space the group searches first
+	uint64_t end = 0;
+	uint64_t search_idx = 0; // where the next refill searches from
+	uint64_t current = NONE; // whatever the run was carved out of (a segment, say)
+	uint64_t previous = NONE; // and whatever it was carved out of before that
+	char padding[64]; // keep neighbouring groups off of the same cache line
+};
+
+class AllocGroups {
+private:
+	std::unique_ptr<AllocGroup[]> groups;
+	size_t group_count = 0;
+public:
+	static constexpr size_t MAX_GROUPS = 64;
+
+	// splits [0, space) into a group per cpu, but no more groups than leaves each of
+	// them at least min_span indexes
+	void init(uint64_t space, uint64_t min_span);
+
+	// takes an index from any group's run, for when the preferred group has run dry 
+	// and there is nothing left to refill it with
+	bool steal(uint64_t &idx);
+
+	inline size_t size() const {
+		return group_count;
+	}
+
+	inline AllocGroup &operator[](size_t idx) {
+		return groups[idx];
+	}
+
+	// the group the calling thread should allocate from. threads are dealt out to
+	// the groups round robin the first time they ask and then stay put (a thread that
+	// followed its cpu around would scatter a file it is writing over several groups)
+	size_t preferred() const;
+};
+
+#endif
@@ -0,0 +1,578 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include "bufferpool.hpp"
+
+BufferPool::BufferPool(int fd, Size chunk_size, Size frame_count, IOEngineType io_engine, int direct_fd)
+	: fd(fd), engine(IOEngine::create(direct_fd != -1 ? direct_fd : fd, io_engine)), 
+	chunk_size(chunk_size), frame_count(frame_count),
+	a1in_target(frame_count / 4 > 0 ? frame_count / 4 : 1), a1out_target(frame_count / 2),
+	hits(0), misses(0), evictions(0), write_backs(0), metadata_ios(0) {
+
+	if (direct_fd != -1) {
+		this->metadata_engine = IOEngine::create(fd, io_engine);
+	}
+
+	if (frame_count == 0 || frame_count >= NIL) {
+		throw DiskException("buffer pool frame count out of range");
+	}
+
+	// page aligned so that the frames can be handed straight to the kernel, the clean
+	// copies of the frames follow the frames themselves
+	void *memory = nullptr;
+	if (posix_memalign(&memory, sysconf(_SC_PAGESIZE), 2 * chunk_size * frame_count) != 0) {
+		throw DiskException("failed to allocate memory for the buffer pool");
+	}
+	this->memory = (Byte *)memory;
+
+	this->frames.resize(frame_count);
+	this->free_frames.reserve(frame_count);
+	for (uint32_t idx = frame_count; idx > 0; --idx) {
+		this->free_frames.push_back(idx - 1);
+	}
+	this->resident.reserve(frame_count * 2);
+}
+
+BufferPool::~BufferPool() {
+	free(this->memory);
+}
+
+void BufferPool::list_push_back(FrameList &list, uint32_t frame_idx) {
+	Frame &frame = frames[frame_idx];
+	frame.prev = list.tail;
+	frame.next = NIL;
+	if (list.tail != NIL) {
+		frames[list.tail].next = frame_idx;
+	} else {
+		list.head = frame_idx;
+	}
+	list.tail = frame_idx;
+	list.size++;
+}
+
+void BufferPool::list_remove(FrameList &list, uint32_t frame_idx) {
+	Frame &frame = frames[frame_idx];
+	if (frame.prev != NIL) {
+		frames[frame.prev].next = frame.next;
+	} else {
+		list.head = frame.next;
+	}
+	if (frame.next != NIL) {
+		frames[frame.next].prev = frame.prev;
+	} else {
+		list.tail = frame.prev;
+	}
+	frame.prev = frame.next = NIL;
+	list.size--;
+}
+
+void BufferPool::remember_evicted(Size chunk_idx) {
+	if (this->a1out_target == 0)
+		return ;
+
+	a1out_index[chunk_idx] = ++a1out_seq;
+	a1out.push_back(std::make_pair(chunk_idx, a1out_seq));
+	while (a1out_index.size() > a1out_target || a1out.size() > a1out_target * 2) {
+		std::pair<Size, uint64_t> oldest = a1out.front();
+		a1out.pop_front();
+		auto ref = a1out_index.find(oldest.first);
+		if (ref != a1out_index.end() && ref->second == oldest.second) {
+			a1out_index.erase(ref);
+		}
+	}
+}
+
+bool BufferPool::forget_evicted(Size chunk_idx) {
+	// the fifo entry is left behind, it is recognized as stale when it is popped
+	return a1out_index.erase(chunk_idx) != 0;
+}
+
+uint32_t BufferPool::take_victim(FrameList &list) {
+	// frames with a write back in flight are skipped, they are only ever pinned
+	// briefly so the next frame along is as good a victim
+	for (uint32_t frame_idx = list.head; frame_idx != NIL; frame_idx = frames[frame_idx].next) {
+		if (frames[frame_idx].io_count == 0) {
+			list_remove(list, frame_idx);
+			return frame_idx;
+		}
+	}
+	return NIL;
+}
+
+uint32_t BufferPool::claim_frame() {
+	if (!free_frames.empty()) {
+		uint32_t frame_idx = free_frames.back();
+		free_frames.pop_back();
+		return frame_idx;
+	}
+
+	// 2Q: evict from a1in while it is over its share of the pool, otherwise from
+	// the cold end of am, and fall back to the other list if one is empty
+	uint32_t frame_idx = NIL;
+	if (a1in.size > a1in_target || am.size == 0) {
+		frame_idx = take_victim(a1in);
+		if (frame_idx == NIL)
+			frame_idx = take_victim(am);
+	} else {
+		frame_idx = take_victim(am);
+		if (frame_idx == NIL)
+			frame_idx = take_victim(a1in);
+	}
+
+	if (frame_idx != NIL) {
+		if (frames[frame_idx].queue == A1IN) {
+			remember_evicted(frames[frame_idx].chunk_idx);
+		}
+		evictions++;
+	}
+	return frame_idx;
+}
+
+bool BufferPool::in_metadata_region(Size chunk_idx) const {
+	for (const MetadataRegion &region : metadata_regions) {
+		if (chunk_idx < region.first)
+			continue ;
+		const Size offset = chunk_idx - region.first;
+		if (offset % region.stride == 0 && offset / region.stride < region.count)
+			return true;
+	}
+	return false;
+}
+
+void BufferPool::add_metadata_region(Size first_chunk, Size count, Size stride) {
+	if (count == 0)
+		return ;
+	MetadataRegion region;
+	region.first = first_chunk;
+	region.count = count;
+	region.stride = stride > 0 ? stride : 1;
+
+	std::lock_guard<std::mutex> g(this->lock);
+	metadata_regions.push_back(region);
+}
+
+void BufferPool::submit(std::vector<IORequest> &requests) {
+	if (metadata_engine == nullptr || requests.empty()) {
+		engine->submit(requests.data(), requests.size());
+		return ;
+	}
+
+	std::vector<IORequest> data_requests;
+	std::vector<IORequest> metadata_requests;
+	std::vector<bool> is_metadata(requests.size());
+	{
+		std::lock_guard<std::mutex> g(this->lock);
+		for (size_t idx = 0; idx < requests.size(); ++idx) {
+			is_metadata[idx] = in_metadata_region(requests[idx].offset / chunk_size);
+		}
+	}
+	for (size_t idx = 0; idx < requests.size(); ++idx) {
+		(is_metadata[idx] ? metadata_requests : data_requests).push_back(requests[idx]);
+	}
+
+	engine->submit(data_requests.data(), data_requests.size());
+	metadata_engine->submit(metadata_requests.data(), metadata_requests.size());
+	metadata_ios += metadata_requests.size();
+
+	size_t data_idx = 0, metadata_idx = 0;
+	for (size_t idx = 0; idx < requests.size(); ++idx) {
+		requests[idx].result = is_metadata[idx] 
+			? metadata_requests[metadata_idx++].result 
+			: data_requests[data_idx++].result;
+	}
+}
+
+bool BufferPool::claim_for(Size chunk_idx, Claim &claim) {
+	const uint32_t frame_idx = claim_frame();
+	if (frame_idx == NIL)
+		return false;
+
+	Frame &frame = frames[frame_idx];
+	claim.frame_idx = frame_idx;
+	claim.chunk_idx = chunk_idx;
+	claim.had_chunk = frame.valid;
+	claim.was_dirty = frame.valid && frame.dirty;
+	claim.old_chunk_idx = frame.chunk_idx;
+	claim.old_queue = frame.queue;
+	claim.error = 0;
+
+	// the frame is now found under both the old and the new chunk index, so anyone
+	// looking for either one waits until we are done with it
+	frame.loading = true;
+	frame.dirty = false;
+	frame.pins = 1;
+	frame.queue = forget_evicted(chunk_idx) ? AM : A1IN;
+	resident[chunk_idx] = frame_idx;
+	return true;
+}
+
+void BufferPool::fill_claims(std::vector<Claim> &claims) {
+	std::vector<IORequest> requests;
+	std::vector<size_t> request_claims;
+	requests.reserve(claims.size());
+	request_claims.reserve(claims.size());
+
+	// step 1: write back the chunks being evicted, if they were modified
+	for (size_t idx = 0; idx < claims.size(); ++idx) {
+		const Claim &claim = claims[idx];
+		if (claim.was_dirty) {
+			IORequest request;
+			request.buffer = frame_data(claim.frame_idx);
+			request.offset = claim.old_chunk_idx * chunk_size;
+			request.length = chunk_size;
+			request.write = true;
+			requests.push_back(request);
+			request_claims.push_back(idx);
+		}
+	}
+	this->submit(requests);
+	for (size_t idx = 0; idx < requests.size(); ++idx) {
+		if (requests[idx].result < 0) {
+			claims[request_claims[idx]].error = -requests[idx].result;
+		} else {
+			write_backs++;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> g(this->lock);
+		for (Claim &claim : claims) {
+			Frame &frame = frames[claim.frame_idx];
+			if (claim.error != 0) {
+				// the old chunk could not be written back, so it keeps the frame
+				resident.erase(claim.chunk_idx);
+				frame.loading = false;
+				frame.dirty = true;
+				frame.pins = 0;
+				frame.queue = claim.old_queue;
+				list_push_back(list_for(claim.old_queue), claim.frame_idx);
+				continue ;
+			}
+			if (claim.had_chunk) {
+				resident.erase(claim.old_chunk_idx);
+			}
+			frame.valid = false;
+			frame.chunk_idx = claim.chunk_idx;
+		}
+		io_done.notify_all();
+	}
+
+	// step 2: read in the new chunks
+	requests.clear();
+	request_claims.clear();
+	for (size_t idx = 0; idx < claims.size(); ++idx) {
+		const Claim &claim = claims[idx];
+		if (claim.error != 0)
+			continue ;
+		IORequest request;
+		request.buffer = frame_data(claim.frame_idx);
+		request.offset = claim.chunk_idx * chunk_size;
+		request.length = chunk_size;
+		request.write = false;
+		requests.push_back(request);
+		request_claims.push_back(idx);
+	}
+	this->submit(requests);
+
+	for (size_t idx = 0; idx < requests.size(); ++idx) {
+		const uint32_t frame_idx = claims[request_claims[idx]].frame_idx;
+		if (requests[idx].result < 0) {
+			claims[request_claims[idx]].error = -requests[idx].result;
+		} else {
+			std::memcpy(clean_data(frame_idx), frame_data(frame_idx), chunk_size);
+		}
+	}
+
+	std::lock_guard<std::mutex> g(this->lock);
+	for (size_t idx = 0; idx < requests.size(); ++idx) {
+		Claim &claim = claims[request_claims[idx]];
+		Frame &frame = frames[claim.frame_idx];
+		if (claim.error != 0) {
+			resident.erase(claim.chunk_idx);
+			frame.loading = false;
+			frame.pins = 0;
+			frame.queue = FREE;
+			free_frames.push_back(claim.frame_idx);
+			continue ;
+		}
+		frame.valid = true;
+		frame.loading = false;
+	}
+	io_done.notify_all();
+}
+
+static void throw_claim_error(const char *what, Size chunk_idx, int error) {
+	char buff[1024];
+	sprintf(buff, "%s chunk %llu, error code %d", what, (unsigned long long)chunk_idx, error);
+	throw DiskException(buff);
+}
+
+Byte *BufferPool::pin(Size chunk_idx) {
+	std::unique_lock<std::mutex> g(this->lock);
+	std::vector<Claim> claims(1);
+
+	for (;;) {
+		auto ref = resident.find(chunk_idx);
+		if (ref == resident.end()) {
+			if (claim_for(chunk_idx, claims[0]))
+				break ;
+			if (writing_frames == 0) 
+				throw DiskException("buffer pool exhausted, every frame is pinned");
+			// a frame is free to take once its write back is done, by which time
+			// someone else may have loaded the chunk
+			io_done.wait(g);
+			continue ;
+		}
+
+		Frame &frame = frames[ref->second];
+		if (frame.loading) {
+			// either the chunk is being read in, or the frame is being written back to
+			// make room for another chunk, in both cases look again once it is done
+			io_done.wait(g);
+			continue ;
+		}
+
+		if (frame.pins++ == 0) {
+			list_remove(list_for(frame.queue), ref->second);
+		}
+		hits++;
+		return frame_data(ref->second);
+	}
+
+	misses++;
+	g.unlock();
+
+	fill_claims(claims);
+	if (claims[0].error != 0) {
+		throw_claim_error("failed to load", chunk_idx, claims[0].error);
+	}
+	return frame_data(claims[0].frame_idx);
+}
+
+void BufferPool::pin_many(const Size *chunk_idxs, size_t count, Byte **out) {
+	std::vector<Claim> claims;
+	std::vector<size_t> claim_positions;
+	std::vector<size_t> deferred;
+	bool exhausted = false;
+
+	std::unique_lock<std::mutex> g(this->lock);
+
+	// step 1: pin everything that is already resident. we only ever wait on other 
+	// threads here, before claiming any frames of our own, so that two batches can 
+	// never end up waiting on each other's loads
+	for (size_t idx = 0; idx < count; ++idx) {
+		out[idx] = nullptr;
+		for (;;) {
+			auto ref = resident.find(chunk_idxs[idx]);
+			if (ref == resident.end())
+				break ;
+
+			Frame &frame = frames[ref->second];
+			if (frame.loading) {
+				io_done.wait(g);
+				continue ;
+			}
+			if (frame.pins++ == 0) {
+				list_remove(list_for(frame.queue), ref->second);
+			}
+			hits++;
+			out[idx] = frame_data(ref->second);
+			break ;
+		}
+	}
+
+	// step 2: claim frames for the misses, anything that another thread started 
+	// loading while we were waiting is pinned once our own loads are done. waiting 
+	// on write backs is fine here, they never wait on anyone's loads
+	for (size_t idx = 0; idx < count && !exhausted; ++idx) {
+		if (out[idx] != nullptr)
+			continue ;
+
+		for (;;) {
+			auto ref = resident.find(chunk_idxs[idx]);
+			if (ref != resident.end()) {
+				Frame &frame = frames[ref->second];
+				if (frame.loading) {
+					deferred.push_back(idx);
+					break ;
+				}
+				if (frame.pins++ == 0) {
+					list_remove(list_for(frame.queue), ref->second);
+				}
+				hits++;
+				out[idx] = frame_data(ref->second);
+				break ;
+			}
+
+			Claim claim;
+			if (claim_for(chunk_idxs[idx], claim)) {
+				misses++;
+				claims.push_back(claim);
+				claim_positions.push_back(idx);
+				break ;
+			}
+			if (writing_frames == 0) {
+				exhausted = true;
+				break ;
+			}
+			io_done.wait(g);
+		}
+	}
+	g.unlock();
+
+	// step 3: one batch of write backs and reads for all of the misses
+	int error = 0;
+	Size error_chunk_idx = 0;
+	fill_claims(claims);
+	for (size_t idx = 0; idx < claims.size(); ++idx) {
+		if (claims[idx].error != 0) {
+			error = claims[idx].error;
+			error_chunk_idx = claims[idx].chunk_idx;
+		} else {
+			out[claim_positions[idx]] = frame_data(claims[idx].frame_idx);
+		}
+	}
+
+	if (!exhausted && error == 0) {
+		try {
+			for (size_t idx : deferred) {
+				out[idx] = this->pin(chunk_idxs[idx]);
+			}
+		} catch (const DiskException &e) {
+			exhausted = true;
+		}
+	}
+
+	if (exhausted || error != 0) {
+		for (size_t idx = 0; idx < count; ++idx) {
+			if (out[idx] != nullptr) {
+				this->unpin(chunk_idxs[idx], false);
+				out[idx] = nullptr;
+			}
+		}
+		if (error != 0) {
+			throw_claim_error("failed to load", error_chunk_idx, error);
+		}
+		throw DiskException("buffer pool exhausted, every frame is pinned");
+	}
+}
+
+void BufferPool::unpin(Size chunk_idx, bool compare) {
+	std::lock_guard<std::mutex> g(this->lock);
+	auto ref = resident.find(chunk_idx);
+	assert(ref != resident.end());
+
+	Frame &frame = frames[ref->second];
+	assert(frame.pins > 0);
+	if (compare && !frame.dirty && 
+		std::memcmp(frame_data(ref->second), clean_data(ref->second), chunk_size) != 0) {
+		frame.dirty = true;
+	}
+	if (--frame.pins == 0) {
+		list_push_back(list_for(frame.queue), ref->second);
+	}
+}
+
+void BufferPool::write_back(const std::vector<Size>& chunk_idxs) {
+	std::vector<uint32_t> frame_idxs;
+	std::vector<Size> frame_chunk_idxs;
+	std::vector<Size> busy_chunk_idxs;
+	{
+		std::lock_guard<std::mutex> g(this->lock);
+		for (Size chunk_idx : chunk_idxs) {
+			auto ref = resident.find(chunk_idx);
+			if (ref == resident.end())
+				continue ;
+
+			// a frame that is loading is either being read in (so it is clean) or is being
+			// written back by whoever is evicting it
+			Frame &frame = frames[ref->second];
+			if (frame.loading || !frame.valid)
+				continue ;
+			if (frame.io_count > 0) {
+				// another write back of the chunk may be going out of an older copy, the two
+				// must not be in flight together or the older one could land last
+				busy_chunk_idxs.push_back(chunk_idx);
+				continue ;
+			}
+			// whoever holds a pin may have written to the frame without letting go of it yet
+			if (!frame.dirty && (frame.pins == 0 || 
+				std::memcmp(frame_data(ref->second), clean_data(ref->second), chunk_size) == 0))
+				continue ;
+
+			// if the chunk is modified while we write it then it no longer matches its clean
+			// copy, so it is marked dirty again when it is unpinned and written again next time
+			std::memcpy(clean_data(ref->second), frame_data(ref->second), chunk_size);
+			frame.dirty = false;
+			if (frame.io_count++ == 0) 
+				writing_frames++;
+			frame_idxs.push_back(ref->second);
+			frame_chunk_idxs.push_back(chunk_idx);
+		}
+	}
+
+	std::vector<IORequest> requests(frame_idxs.size());
+	for (size_t idx = 0; idx < frame_idxs.size(); ++idx) {
+		IORequest &request = requests[idx];
+		request.buffer = clean_data(frame_idxs[idx]);
+		request.offset = frame_chunk_idxs[idx] * chunk_size;
+		request.length = chunk_size;
+		request.write = true;
+	}
+	this->submit(requests);
+
+	int error = 0;
+	Size error_chunk_idx = 0;
+	std::unique_lock<std::mutex> g(this->lock);
+	for (size_t idx = 0; idx < requests.size(); ++idx) {
+		if (requests[idx].result < 0) {
+			error = -requests[idx].result;
+			error_chunk_idx = frame_chunk_idxs[idx];
+			frames[frame_idxs[idx]].dirty = true;
+			continue ;
+		}
+		write_backs++;
+	}
+	for (uint32_t frame_idx : frame_idxs) {
+		if (--frames[frame_idx].io_count == 0) 
+			writing_frames--;
+	}
+	if (!frame_idxs.empty()) {
+		io_done.notify_all();
+	}
+
+	if (error != 0) {
+		throw_claim_error("failed to write back", error_chunk_idx, error);
+	}
+	if (busy_chunk_idxs.empty()) 
+		return ;
+
+	// only wait for the other write backs now that we hold none of our own, then look
+	// at those chunks again
+	io_done.wait(g, [this, &busy_chunk_idxs]() {
+		for (Size chunk_idx : busy_chunk_idxs) {
+			auto ref = resident.find(chunk_idx);
+			if (ref != resident.end() && frames[ref->second].io_count > 0) 
+				return false;
+		}
+		return true;
+	});
+	g.unlock();
+	this->write_back(busy_chunk_idxs);
+}
+
+void BufferPool::write_back_all() {
+	std::vector<Size> chunk_idxs;
+	{
+		std::lock_guard<std::mutex> g(this->lock);
+		chunk_idxs.reserve(resident.size());
+		for (auto &entry : resident) {
+			chunk_idxs.push_back(entry.first);
+		}
+	}
+	this->write_back(chunk_idxs);
+}
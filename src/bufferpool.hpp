@@ -0,0 +1,204 @@
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <stdint.h>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <memory>
+
+#include "diskinterface.hpp"
+#include "ioengine.hpp"
+
+/*
+	a fixed size pool of chunk sized frames which are filled with pread and written
+	back with pwrite, used in place of mapping the whole backing file into memory.
+
+	frames are replaced with the 2Q policy: a chunk seen for the first time goes on
+	the a1in fifo, and only a chunk that is referenced again after falling off of a1in
+	(i.e. it is remembered in the a1out ghost list) is promoted to the am lru. a
+	sequential scan therefore only ever churns a1in and can not push the hot set out.
+
+	a frame is pinned for as long as a Chunk refers to it and is never evicted while
+	pinned. writes through Chunk::data can not be seen, so every frame keeps a clean
+	copy of its chunk as of the last read or write back. when a Chunk lets go of its
+	pin the frame is compared with that copy and marked dirty if they differ, so a
+	chunk that was only read is never written back. write backs go out of the clean
+	copy, which is refreshed from the frame just before.
+
+	reads and write backs go through an IOEngine in batches, so a miss on many chunks
+	at once (pin_many) or the write back of many dirty chunks keeps all of them in
+	flight together rather than waiting on each one in turn.
+
+	when the pool is given a direct_fd, data chunks are read and written through it
+	with O_DIRECT and only the chunks in a metadata region go through fd and the page
+	cache. the bitmaps, inode table and segment summaries are small and hot, so it
+	is worth keeping them cached even once the pool evicts them.
+*/
+class BufferPool {
+private:
+	static constexpr uint32_t NIL = UINT32_MAX;
+
+	enum Queue : uint8_t { FREE = 0, A1IN = 1, AM = 2 };
+
+	struct Frame {
+		Size chunk_idx = 0;
+		uint32_t pins = 0;
+		uint32_t io_count = 0; // write backs in progress, a frame is not evicted under them
+		uint32_t prev = NIL;
+		uint32_t next = NIL;
+		Queue queue = FREE;
+		bool valid = false; // holds the contents of chunk_idx
+		bool dirty = false; // differed from its clean copy when it was last unpinned
+		bool loading = false; // being written back and/or refilled, waiters sleep on io_done
+	};
+
+	// intrusive list of unpinned frames threaded through Frame::prev and Frame::next
+	struct FrameList {
+		uint32_t head = NIL;
+		uint32_t tail = NIL;
+		size_t size = 0;
+	};
+
+	// a frame taken for a chunk that missed, along with what it held before
+	struct Claim {
+		uint32_t frame_idx = NIL;
+		Size chunk_idx = 0;
+		Size old_chunk_idx = 0;
+		Queue old_queue = FREE;
+		bool had_chunk = false;
+		bool was_dirty = false; // the old chunk has to be written back before the read
+		int error = 0; // errno of the read or write back that failed
+	};
+
+	// a run of count chunks starting at first, stride chunks apart
+	struct MetadataRegion {
+		Size first = 0;
+		Size count = 0;
+		Size stride = 1;
+	};
+
+	const int fd;
+	std::unique_ptr<IOEngine> engine;
+	std::unique_ptr<IOEngine> metadata_engine; // nullptr unless engine uses direct io
+	std::vector<MetadataRegion> metadata_regions;
+	const Size chunk_size;
+	const Size frame_count;
+	const size_t a1in_target; // a1in is allowed to grow to this before we evict from it first
+	const size_t a1out_target; // number of evicted chunks remembered in the ghost list
+
+	Byte *memory = nullptr;
+	std::vector<Frame> frames;
+	std::vector<uint32_t> free_frames;
+	std::unordered_map<Size, uint32_t> resident;
+	FrameList a1in;
+	FrameList am;
+
+	// the ghost list, a fifo of chunk indexes with a map to the sequence number they
+	// were pushed at so that stale fifo entries can be told apart from live ones
+	std::deque<std::pair<Size, uint64_t>> a1out;
+	std::unordered_map<Size, uint64_t> a1out_index;
+	uint64_t a1out_seq = 0;
+
+	size_t writing_frames = 0; // unpinned frames can all be busy with write backs for a while
+
+	std::mutex lock;
+	std::condition_variable io_done;
+
+	inline Byte *frame_data(uint32_t frame_idx) const {
+		return memory + frame_idx * chunk_size;
+	}
+
+	// the frame's chunk as it was last read in or written back, kept after the frames
+	inline Byte *clean_data(uint32_t frame_idx) const {
+		return memory + (frame_count + frame_idx) * chunk_size;
+	}
+
+	void list_push_back(FrameList &list, uint32_t frame_idx);
+	void list_remove(FrameList &list, uint32_t frame_idx);
+	inline FrameList &list_for(Queue queue) {
+		return queue == AM ? am : a1in;
+	}
+
+	void remember_evicted(Size chunk_idx);
+	bool forget_evicted(Size chunk_idx);
+
+	// must be called with the lock held, returns NIL if every frame is pinned or busy
+	uint32_t take_victim(FrameList &list);
+	uint32_t claim_frame();
+
+	// must be called with the lock held, takes a frame for chunk_idx and marks it as
+	// loading. returns false if every frame is pinned or being written back
+	bool claim_for(Size chunk_idx, Claim &claim);
+
+	// must be called WITHOUT the lock held, writes back whatever the claimed frames
+	// held before and reads in their new chunks, all as one batch. claims that fail
+	// are released again and have their error set
+	void fill_claims(std::vector<Claim> &claims);
+
+	// must be called with the lock held
+	bool in_metadata_region(Size chunk_idx) const;
+
+	// must be called WITHOUT the lock held, sends requests for metadata chunks to the
+	// metadata engine and everything else to the data engine
+	void submit(std::vector<IORequest> &requests);
+public:
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> evictions;
+	std::atomic<uint64_t> write_backs;
+	std::atomic<uint64_t> metadata_ios; // reads and writes that went through the page cache
+
+	// direct_fd is a handle on the same file opened with O_DIRECT, or -1 to do all 
+	// reads and writes through fd
+	BufferPool(int fd, Size chunk_size, Size frame_count, IOEngineType io_engine = IO_ENGINE_AUTO,
+		int direct_fd = -1);
+	~BufferPool();
+
+	// returns the frame holding the chunk, reading it in if it is not resident. every
+	// call must be balanced by a call to unpin
+	Byte *pin(Size chunk_idx);
+
+	// pins count distinct chunks, reading in all of the ones that miss as one batch.
+	// either every chunk is pinned and frames[i] holds chunk_idxs[i], or nothing is
+	// pinned and a DiskException is thrown
+	void pin_many(const Size *chunk_idxs, size_t count, Byte **frames);
+
+	// compare is true if the frame may have been written to while it was pinned, it is
+	// then checked against its clean copy to find out whether it is dirty
+	void unpin(Size chunk_idx, bool compare);
+
+	// writes back those of the chunks that are resident and have been modified, including
+	// ones that are still pinned
+	void write_back(const std::vector<Size>& chunk_idxs);
+	void write_back_all();
+
+	void add_metadata_region(Size first_chunk, Size count, Size stride = 1);
+
+	inline bool is_metadata(Size chunk_idx) {
+		std::lock_guard<std::mutex> g(lock);
+		return in_metadata_region(chunk_idx);
+	}
+
+	inline bool is_direct() const {
+		return metadata_engine != nullptr;
+	}
+
+	inline bool is_resident(Size chunk_idx) {
+		std::lock_guard<std::mutex> g(lock);
+		return resident.find(chunk_idx) != resident.end();
+	}
+
+	inline Size size_frames() const {
+		return frame_count;
+	}
+
+	inline const char *io_engine_name() const {
+		return engine->name();
+	}
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
+#include "cleaner.hpp"
+#include "filesystem.hpp"
+
+// set while a thread cleans, so that the allocations it makes to move chunks out
+// do not ask it to clean again when they run out
+static thread_local bool cleaning = false;
+
+struct CleaningScope {
+	CleaningScope() {
+		cleaning = true;
+	}
+	~CleaningScope() {
+		cleaning = false;
+	}
+};
+
+SegmentCleaner::SegmentCleaner(SuperBlock *superblock)
+	: superblock(superblock), segments_cleaned(0), chunks_moved(0), chunks_dropped(0), chunks_walked(0) {
+}
+
+SegmentCleaner::~SegmentCleaner() {
+	{
+		std::lock_guard<std::mutex> g(this->thread_lock);
+		this->stop = true;
+	}
+	this->wakeup.notify_all();
+	if (this->cleaner.joinable()) {
+		this->cleaner.join();
+	}
+}
+
+void SegmentCleaner::set_config(const CleanerConfig &config) {
+	std::lock_guard<std::mutex> g(this->lock);
+	this->config = config;
+	if (this->config.high_free_segments < this->config.low_free_segments)
+		this->config.high_free_segments = this->config.low_free_segments;
+}
+
+void SegmentCleaner::start(std::mutex *fs_lock) {
+	std::lock_guard<std::mutex> g(this->lock);
+	this->fs_lock = fs_lock;
+	if (this->config.interval_ms != 0 && !this->cleaner.joinable()) {
+		this->cleaner = std::thread(&SegmentCleaner::cleaner_main, this);
+	}
+}
+
+// how many of the emptiest segments are ranked by the policy. cost benefit can
+// prefer a fuller segment to an emptier one, but only among these
+static constexpr size_t CANDIDATES = 64;
+
+// the segments worth cleaning, best first
+static std::vector<std::pair<double, uint64_t>> rank_segments(SegmentController &segments, CleanerConfig::Policy policy) {
+	std::vector<std::pair<double, uint64_t>> ranked;
+	const uint64_t capacity = segments.segment_size - 1;
+
+	for (uint64_t segment : segments.cleaning_candidates(CANDIDATES)) {
+		const double utilization = (double)segments.get_segment_usage(segment) / capacity;
+		double score = 1.0 - utilization;
+		if (policy == CleanerConfig::COST_BENEFIT)
+			score = score * (segments.segment_age(segment) + 1) / (1.0 + utilization);
+		ranked.push_back(std::make_pair(score, segment));
+	}
+	std::sort(ranked.begin(), ranked.end(),
+		[](const std::pair<double, uint64_t> &a, const std::pair<double, uint64_t> &b) { return a.first > b.first; });
+	return ranked;
+}
+
+uint64_t SegmentCleaner::pick_victim() {
+	std::lock_guard<std::mutex> g(this->lock);
+	auto ranked = rank_segments(this->superblock->segment_controller, this->config.policy);
+	return ranked.empty() ? SegmentController::NONE : ranked[0].second;
+}
+
+bool SegmentCleaner::clean_segment(uint64_t segment) {
+	SegmentController &segments = this->superblock->segment_controller;
+	INodeTable &inodes = *this->superblock->inode_table;
+	Disk *disk = this->superblock->disk;
+	const uint64_t first = segments.data_offset + segment * segments.segment_size;
+	const uint64_t end = first + segments.segment_size;
+
+	// the live chunks by owner, with where they are in the owner's file. in the order
+	// they are on disk so that moving them keeps them in order
+	std::map<uint64_t, std::vector<std::pair<uint64_t, ChunkPosition>>> owners;
+	{
+		std::shared_ptr<Chunk> summary = disk->get_chunk(first);
+		const uint64_t *entries = (const uint64_t *)summary->data;
+		for (uint64_t chunk = first + 1; chunk < end; ++chunk) {
+			if (!segments.block_map->get(chunk))
+				continue ;
+			const uint64_t *entry = entries + (chunk - first) * segments.summary_words;
+			const uint64_t owner = entry[0];
+			if (inodes.inodecache.get(owner) != nullptr)
+				return false;
+			const ChunkPosition position = segments.summary_words >= 2 ? ChunkPosition::unpack(entry[1]) : ChunkPosition();
+			owners[owner].push_back(std::make_pair(chunk, position));
+		}
+	}
+
+	segments.begin_cleaning(segment);
+	std::vector<DiskBitMap::BitRange> released;
+	for (const auto &owned : owners) {
+		const uint64_t owner = owned.first;
+		std::shared_ptr<INode> inode;
+		if (owner < inodes.size_inodes() && inodes.used_inodes->get(owner))
+			inode = inodes.get_inode(owner);
+
+		std::unordered_map<uint64_t, uint64_t> moves;
+		if (inode != nullptr) {
+			try {
+				for (const auto &live : owned.second) {
+					const uint64_t to = segments.alloc_relocation(owner, live.second);
+					moves[live.first] = to;
+					std::shared_ptr<Chunk> from_chunk = disk->get_chunk(live.first);
+					std::shared_ptr<Chunk> to_chunk = disk->get_chunk(to);
+					std::memcpy(to_chunk->data, from_chunk->data, from_chunk->size_bytes);
+				}
+
+				// the pointer to a chunk is found by going down the tree from the top, 
+				// so tables and nodes are pointed at their copies before whatever is 
+				// below them. once a position turns out unknown or stale, that chunk 
+				// could be a table that the rest are below, and the whole file is looked
+				// through for what is left instead
+				std::vector<std::pair<uint64_t, ChunkPosition>> order(owned.second);
+				std::stable_sort(order.begin(), order.end(), 
+					[](const std::pair<uint64_t, ChunkPosition> &a, const std::pair<uint64_t, ChunkPosition> &b) {
+						return !b.second.known() ? false : !a.second.known() || a.second.level > b.second.level;
+					});
+				for (const auto &live : order) {
+					auto move = moves.find(live.first);
+					if (!inode->relocate_chunk(live.first, move->second, live.second))
+						break ;
+					moves.erase(move);
+					this->chunks_moved++;
+				}
+				if (!moves.empty()) {
+					const uint64_t walked = moves.size();
+					this->chunks_moved += inode->relocate_chunks(first, end, moves);
+					this->chunks_walked += walked;
+				}
+			} catch (const FileSystemException &e) {
+				// out of room to move to, the copies nobody refers to yet go back. what
+				// was moved already stays moved
+				for (const auto &move : moves) {
+					DiskBitMap::BitRange run;
+					run.start_idx = move.second;
+					run.bit_count = 1;
+					segments.release_runs(&run, 1);
+				}
+				if (!released.empty())
+					segments.release_runs(&released[0], released.size());
+				segments.abort_cleaning(segment);
+				return false;
+			}
+		}
+
+		// whatever the owner did not refer to is dead, and so are the copies of it
+		for (const auto &move : moves) {
+			DiskBitMap::BitRange run;
+			run.start_idx = move.second;
+			run.bit_count = 1;
+			segments.release_runs(&run, 1);
+		}
+		this->chunks_dropped += inode == nullptr ? owned.second.size() : moves.size();
+
+		for (const auto &live : owned.second) {
+			const uint64_t chunk = live.first;
+			if (!released.empty() && released.back().start_idx + released.back().bit_count == chunk) {
+				released.back().bit_count++;
+			} else {
+				DiskBitMap::BitRange run;
+				run.start_idx = chunk;
+				run.bit_count = 1;
+				released.push_back(run);
+			}
+		}
+	}
+
+	if (!released.empty())
+		segments.release_runs(&released[0], released.size());
+	segments.finish_cleaning(segment);
+	this->segments_cleaned++;
+	return true;
+}
+
+bool SegmentCleaner::clean_one_locked() {
+	for (const auto &candidate : rank_segments(this->superblock->segment_controller, this->config.policy)) {
+		if (this->clean_segment(candidate.second))
+			return true;
+	}
+	return false;
+}
+
+bool SegmentCleaner::clean_one() {
+	std::lock_guard<std::mutex> g(this->lock);
+	CleaningScope scope;
+	return this->clean_one_locked();
+}
+
+uint64_t SegmentCleaner::clean_until(uint64_t target_free_segments) {
+	std::lock_guard<std::mutex> g(this->lock);
+	CleaningScope scope;
+	uint64_t cleaned = 0;
+	while (this->superblock->segment_controller.free_segment_count() < target_free_segments && this->clean_one_locked()) {
+		cleaned++;
+	}
+	return cleaned;
+}
+
+bool SegmentCleaner::clean_for_allocation() {
+	if (cleaning)
+		return false;
+	return this->clean_one();
+}
+
+void SegmentCleaner::cleaner_main() {
+	std::unique_lock<std::mutex> g(this->thread_lock);
+	while (!this->stop) {
+		const CleanerConfig config = this->get_config();
+		this->wakeup.wait_for(g, std::chrono::milliseconds(std::max<uint64_t>(config.interval_ms, 1)));
+		if (this->stop)
+			break ;
+		g.unlock();
+
+		if (this->superblock->segment_controller.free_segment_count() < config.low_free_segments) {
+			std::unique_lock<std::mutex> fs;
+			if (this->fs_lock != nullptr)
+				fs = std::unique_lock<std::mutex>(*this->fs_lock);
+			this->clean_until(config.high_free_segments);
+		}
+
+		g.lock();
+	}
+}
@@ -0,0 +1,98 @@
+#ifndef CLEANER_HPP
+#define CLEANER_HPP
+
+#include <stdint.h>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+struct SuperBlock;
+
+/*
+	how the cleaner picks the segment to empty next, and when the background thread
+	runs. with COST_BENEFIT a segment is worth (1 - u) * age / (1 + u), u being the
+	fraction of it still in use: the space it gives back against the cost of reading
+	it and writing the live part out again, weighted by how long the data in it has
+	been left alone (old data is likely to stay put, so cleaning it is not wasted on
+	data that is about to die anyway). GREEDY just takes the emptiest segment
+*/
+struct CleanerConfig {
+	enum Policy : uint8_t { COST_BENEFIT = 0, GREEDY = 1 };
+
+	Policy policy = COST_BENEFIT;
+	uint64_t interval_ms = 0; // how often the background thread looks, 0 turns it off
+	uint64_t low_free_segments = 4; // it starts cleaning when fewer segments are free
+	uint64_t high_free_segments = 8; // and keeps going until this many are
+};
+
+/*
+	the segment cleaner. a victim's live chunks (the ones still marked in the block
+	map) are copied to chunks handed out as usual, and their owners, which the
+	segment summary names, are pointed at the copies. the summary also says where in
+	the file each chunk is, so the pointer to it is found by going down the owner's
+	tree rather than by looking through all of it. chunks whose owner does not refer
+	to them any more are dead and just dropped. then the whole segment is free.
+
+	moving chunks rewrites the owners' inodes and tables, so nobody may be using an
+	inode in a segment while it is cleaned: a segment that holds chunks of an inode
+	that is loaded (in the inode cache) is passed over. the background thread takes
+	the lock it is started with around each pass, the caller's lock for the whole
+	file system, since an inode that is about to be loaded is not in the cache yet
+*/
+class SegmentCleaner {
+private:
+	SuperBlock *superblock;
+	CleanerConfig config;
+
+	std::mutex lock; // held for a cleaning pass, and guards config
+	std::mutex *fs_lock = nullptr;
+
+	std::mutex thread_lock;
+	std::condition_variable wakeup;
+	std::thread cleaner;
+	bool stop = false;
+
+	void cleaner_main();
+
+	// the lock is held. false if no segment could be cleaned
+	bool clean_one_locked();
+	// false if the segment holds chunks of a loaded inode, nothing is moved then
+	bool clean_segment(uint64_t segment);
+public:
+	std::atomic<uint64_t> segments_cleaned;
+	std::atomic<uint64_t> chunks_moved; // live chunks copied, the cleaner's extra writes
+	std::atomic<uint64_t> chunks_dropped; // marked in use but not referred to by their owner
+	std::atomic<uint64_t> chunks_walked; // looked for in the whole of their owner's file
+
+	SegmentCleaner(SuperBlock *superblock);
+	~SegmentCleaner();
+
+	void set_config(const CleanerConfig &config);
+
+	inline CleanerConfig get_config() {
+		std::lock_guard<std::mutex> g(lock);
+		return config;
+	}
+
+	// starts the background thread if the config has an interval, it holds fs_lock
+	// (if there is one) while it cleans
+	void start(std::mutex *fs_lock);
+
+	// the segment the policy would clean next, SegmentController::NONE if there is
+	// nothing worth cleaning
+	uint64_t pick_victim();
+
+	// cleans the segment the policy picks (or the next best if that one can not be
+	// cleaned right now), returns false if none could be
+	bool clean_one();
+
+	// cleans until target segments are free, returns how many were cleaned
+	uint64_t clean_until(uint64_t target_free_segments);
+
+	// called by SegmentController::alloc_next when there is no room left. returns false
+	// straight away if it is the cleaner itself that ran out
+	bool clean_for_allocation();
+};
+
+#endif
@@ -1,65 +1,784 @@
 #include <bitset>
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
 
 #include "diskinterface.hpp"
+#include "bufferpool.hpp"
+
+static int64_t now_ms() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 Chunk::~Chunk() {
-	// whenever the last reference to a chunk is released, we flush the chunk
-	// out to the disk 
-	this->parent->flush_chunk(*this);
+	// whenever the last reference to a chunk is released, we mark it dirty so 
+	// that it is written back out to the disk by the flusher 
+	if (this->parent != nullptr) {
+		this->parent->release_chunk(*this);
+	}
 }
 
-std::shared_ptr<Chunk> Disk::get_chunk(Size chunk_idx) {
-	std::lock_guard<std::mutex> g(lock); // acquire the lock
+Disk::Disk(Size size_chunk_ctr, Size chunk_size_ctr, int flags, int fd, const MmapConfig& mmap_config) 
+	: _chunk_size(chunk_size_ctr), _size_chunks(size_chunk_ctr) {
+	
+	if (mmap_config.populate) 
+		flags |= MAP_POPULATE;
 
-	if (chunk_idx > this->size_chunks()) {
-		throw DiskException("chunk index out of bounds");
+	this->mapped_bytes = this->size_bytes();
+	void *data = MAP_FAILED;
+	if (mmap_config.hugepages && (flags & MAP_ANONYMOUS)) {
+		// hugetlb mappings must be a whole number of huge pages, and fail outright if
+		// the system has none reserved, in which case we fall back to THP below
+		constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+		const size_t huge_bytes = (this->size_bytes() + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		data = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, fd, 0);
+		if (data != MAP_FAILED) 
+			this->mapped_bytes = huge_bytes;
 	}
+	if (data == MAP_FAILED) {
+		data = mmap(NULL, this->mapped_bytes, PROT_READ | PROT_WRITE, flags, fd, 0);
+		if (data == MAP_FAILED) {
+			throw DiskException("failed to create the memory mapped file to back the disk");
+		}
+		if (mmap_config.hugepages) 
+			madvise(data, this->mapped_bytes, MADV_HUGEPAGE);
+	}
+	this->data = (Byte *)data;
+
+	// only a shared mapping of a real file has anything to write back to, or any
+	// readahead to tune
+	this->writeback_enabled = (flags & MAP_SHARED) && fd != -1;
+	if (this->writeback_enabled) 
+		this->fd = fd;
+	this->access_hints = mmap_config.access_hints && fd != -1 && !(flags & MAP_ANONYMOUS);
+}
+
+Disk::Disk(Size size_chunk_ctr, Size chunk_size_ctr, int fd, const BufferPoolConfig& pool_config) 
+	: _chunk_size(chunk_size_ctr), _size_chunks(size_chunk_ctr), fd(fd) {
 	
-	if (auto chunk_ref = this->chunk_cache.get(chunk_idx)) {
-		return chunk_ref;
+	// the pool has to be able to hold every chunk that is pinned at the same time, 
+	// bitmaps keep all of their chunks pinned so leave some headroom
+	constexpr Size MIN_FRAMES = 64;
+	Size frame_count = pool_config.pool_bytes / chunk_size_ctr;
+	if (frame_count < MIN_FRAMES) 
+		frame_count = MIN_FRAMES;
+	if (frame_count > size_chunk_ctr) 
+		frame_count = size_chunk_ctr;
+
+	if (pool_config.direct_io) {
+		// O_DIRECT transfers must be aligned to the logical block size of the device,
+		// frames are page aligned so only the size and offset need checking
+		constexpr Size DIRECT_IO_ALIGNMENT = 512;
+		if (chunk_size_ctr % DIRECT_IO_ALIGNMENT != 0) {
+			throw DiskException("direct io needs a chunk size that is a multiple of 512 bytes");
+		}
+
+		// reopen the same file rather than changing the flags on fd, which would also 
+		// change them for whoever handed it to us
+		char path[64];
+		sprintf(path, "/proc/self/fd/%d", fd);
+		this->direct_fd = open(path, O_RDWR | O_DIRECT);
+		if (this->direct_fd == -1) {
+			char buff[1024];
+			sprintf(buff, "failed to open the backing file for direct io, error code %d", errno);
+			throw DiskException(buff);
+		}
 	}
 
-	// initialize the new chunk
-	std::shared_ptr<Chunk> chunk(new Chunk);
-	chunk->parent = this; 
-	chunk->size_bytes = this->chunk_size();
-	chunk->chunk_idx = chunk_idx;
-	chunk->data = this->data + chunk_idx * this->chunk_size();
-	// chunk->data = std::unique_ptr<Byte[]>(new Byte[this->chunk_size()]);
-	// std::memcpy(chunk->data.get(), this->data + chunk_idx * this->chunk_size(), 
-	// 	this->chunk_size());
+	try {
+		this->pool = std::unique_ptr<BufferPool>(new BufferPool(fd, chunk_size_ctr, frame_count, 
+			pool_config.io_engine, this->direct_fd));
+	} catch (...) {
+		if (this->direct_fd != -1) 
+			close(this->direct_fd);
+		throw ;
+	}
+	this->writeback_enabled = true;
+}
 
-	// store it into the chunk cache so that it can be shared if requested again
-	this->chunk_cache.put(chunk_idx, chunk); 
-	return std::move(chunk);
+void Disk::add_metadata_region(Size first_chunk, Size count, Size stride) {
+	if (this->pool != nullptr) {
+		this->pool->add_metadata_region(first_chunk, count, stride);
+		return ;
+	}
+
+	// regions spread out with a stride (the segment summaries) are left alone, each 
+	// madvise range splits the mapping and a single chunk gains nothing from it
+	if (!this->access_hints || count == 0 || (count > 1 && stride != 1)) 
+		return ;
+	if (first_chunk >= this->size_chunks()) 
+		return ;
+	count = std::min(count, this->size_chunks() - first_chunk);
+
+	std::lock_guard<std::mutex> g(this->advice_lock);
+	this->random_regions.push_back(std::make_pair(first_chunk, count));
+	this->advise(first_chunk, count, MADV_RANDOM);
 }
 
-void Disk::flush_chunk(const Chunk& chunk) {
-	std::lock_guard<std::mutex> g(lock); // acquire the lock
+void Disk::advise(Size first_chunk, Size count, int advice) {
+	size_t start = (size_t)(this->data + first_chunk * this->_chunk_size);
+	size_t end = start + count * this->_chunk_size;
+	start &= ~(this->_mempage_size - 1);
+	end = (end + this->_mempage_size - 1) & ~(this->_mempage_size - 1);
+	madvise((void *)start, end - start, advice);
+}
+
+void Disk::note_load(Size chunk_idx) {
+	SequentialDetector::Hint hint = this->access_detector.access(chunk_idx);
+
+	if (hint.prefetch_count > 0 && hint.prefetch_first < this->size_chunks()) {
+		const Size count = std::min(hint.prefetch_count, this->size_chunks() - hint.prefetch_first);
+		this->advise(hint.prefetch_first, count, MADV_WILLNEED);
+		this->readahead_hints++;
+	}
+
+	if (hint.pattern != SequentialDetector::PATTERN_UNCHANGED) {
+		// advice on the whole mapping replaces whatever the metadata regions had, so
+		// put that back afterwards
+		std::lock_guard<std::mutex> g(this->advice_lock);
+		const bool sequential = hint.pattern == SequentialDetector::PATTERN_SEQUENTIAL;
+		this->advise(0, this->size_chunks(), sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+		for (const std::pair<Size, Size> &region : this->random_regions) {
+			this->advise(region.first, region.second, MADV_RANDOM);
+		}
+		this->sequential_advice = sequential;
+	}
+}
+
+constexpr size_t SequentialDetector::STREAM_COUNT;
+constexpr Size SequentialDetector::MIN_RUN;
+constexpr Size SequentialDetector::MIN_WINDOW;
+constexpr Size SequentialDetector::MAX_WINDOW;
+constexpr uint32_t SequentialDetector::EPOCH_LOADS;
+
+SequentialDetector::Hint SequentialDetector::access(Size chunk_idx) {
+	Hint hint;
+	std::unique_lock<std::mutex> g(this->lock, std::try_to_lock);
+	if (!g.owns_lock()) 
+		return hint;
+
+	this->clock++;
+
+	// a load continues a stream if it lands a little past where the stream expects,
+	// chunks that were still cached in between never reach us
+	Stream *stream = nullptr;
+	Stream *oldest = &this->streams[0];
+	for (Stream &candidate : this->streams) {
+		if (candidate.run > 0 && chunk_idx >= candidate.next && chunk_idx < candidate.next + MIN_RUN) {
+			stream = &candidate;
+			break ;
+		}
+		if (candidate.last_used < oldest->last_used) 
+			oldest = &candidate;
+	}
+
+	bool in_order = stream != nullptr;
+	if (stream == nullptr) {
+		stream = oldest;
+		*stream = Stream();
+	}
+	stream->run += 1;
+	stream->next = chunk_idx + 1;
+	stream->last_used = this->clock;
+
+	if (stream->run >= MIN_RUN && stream->next + stream->window / 2 >= stream->prefetched_to) {
+		hint.prefetch_first = std::max(stream->next, stream->prefetched_to);
+		hint.prefetch_count = stream->next + stream->window - hint.prefetch_first;
+		stream->prefetched_to = stream->next + stream->window;
+		stream->window = std::min(stream->window * 2, MAX_WINDOW);
+	}
+
+	this->epoch_loads++;
+	if (in_order) 
+		this->epoch_sequential++;
+	if (this->epoch_loads == EPOCH_LOADS) {
+		// a little hysteresis so that a mixed workload does not flip back and forth
+		const bool sequential = this->sequential 
+			? this->epoch_sequential * 2 >= this->epoch_loads 
+			: this->epoch_sequential * 4 >= this->epoch_loads * 3;
+		if (sequential != this->sequential) {
+			this->sequential = sequential;
+			hint.pattern = sequential ? PATTERN_SEQUENTIAL : PATTERN_RANDOM;
+		}
+		this->epoch_loads = 0;
+		this->epoch_sequential = 0;
+	}
+	return hint;
+}
+
+void Disk::zero_fill() {
+	if (this->pool != nullptr) {
+		for (Size idx = 0; idx < this->size_chunks(); ++idx) {
+			std::memset(this->get_chunk(idx)->data, 0, this->chunk_size());
+		}
+		return ;
+	}
+
+	// zero out the memory mapped file
+	std::memset(this->data, 0, this->size_bytes());
+}
+
+std::shared_ptr<Chunk> Disk::get_chunk(Size chunk_idx) {
+	if (chunk_idx >= this->size_chunks()) {
+		throw DiskException("chunk index out of bounds");
+	}
+
+	if (this->pool != nullptr) {
+		std::shared_ptr<Chunk> chunk = this->chunk_cache.get(chunk_idx);
+		if (chunk != nullptr) 
+			return chunk;
+
+		// pin before going into the cache, a miss reads the chunk in (and may write 
+		// back the frame it replaces) which must not happen under the shard lock
+		Byte *frame = this->pool->pin(chunk_idx);
+		bool created = false;
+		chunk = this->chunk_cache.get_or_create(chunk_idx, [this, chunk_idx, frame, &created](Chunk &chunk) {
+			chunk.data = frame;
+			chunk.size_bytes = this->chunk_size();
+			chunk.chunk_idx = chunk_idx;
+			chunk.parent = this; 
+			created = true;
+		});
+		if (!created) {
+			// someone else got the chunk in the meantime, and it holds its own pin
+			this->pool->unpin(chunk_idx, false);
+		}
+		return chunk;
+	}
+
+	// the cache takes the lock for the shard this chunk hashes to, so only lookups 
+	// of chunks on the same shard contend with each other
+	bool created = false;
+	std::shared_ptr<Chunk> chunk = this->chunk_cache.get_or_create(chunk_idx, [this, chunk_idx, &created](Chunk &chunk) {
+		// initialize the new chunk
+		chunk.parent = this; 
+		chunk.size_bytes = this->chunk_size();
+		chunk.chunk_idx = chunk_idx;
+		chunk.data = this->data + chunk_idx * this->chunk_size();
+		created = true;
+	});
+
+	// only loads that were not cached say anything about how the mapping is faulted in
+	if (created && this->access_hints) 
+		this->note_load(chunk_idx);
+	return chunk;
+}
+
+void Disk::get_chunks(const Size *chunk_idxs, size_t count, std::shared_ptr<Chunk> *chunks) {
+	if (this->pool == nullptr) {
+		for (size_t idx = 0; idx < count; ++idx) {
+			chunks[idx] = this->get_chunk(chunk_idxs[idx]);
+		}
+		return ;
+	}
+
+	// pick out the chunks that are not already referenced somewhere, those are the
+	// only ones that might need to be read in
+	std::vector<Size> missing;
+	for (size_t idx = 0; idx < count; ++idx) {
+		if (chunk_idxs[idx] >= this->size_chunks()) {
+			throw DiskException("chunk index out of bounds");
+		}
+		chunks[idx] = this->chunk_cache.get(chunk_idxs[idx]);
+		if (chunks[idx] == nullptr) {
+			missing.push_back(chunk_idxs[idx]);
+		}
+	}
+	if (missing.empty()) 
+		return ;
+
+	std::sort(missing.begin(), missing.end());
+	missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+	std::vector<Byte *> frames(missing.size());
+	this->pool->pin_many(missing.data(), missing.size(), frames.data());
+
+	std::vector<std::shared_ptr<Chunk>> loaded(missing.size());
+	for (size_t idx = 0; idx < missing.size(); ++idx) {
+		const Size chunk_idx = missing[idx];
+		Byte *frame = frames[idx];
+		bool created = false;
+		loaded[idx] = this->chunk_cache.get_or_create(chunk_idx, [this, chunk_idx, frame, &created](Chunk &chunk) {
+			chunk.data = frame;
+			chunk.size_bytes = this->chunk_size();
+			chunk.chunk_idx = chunk_idx;
+			chunk.parent = this; 
+			created = true;
+		});
+		if (!created) {
+			// someone else got the chunk in the meantime, and it holds its own pin
+			this->pool->unpin(chunk_idx, false);
+		}
+	}
+
+	for (size_t idx = 0; idx < count; ++idx) {
+		if (chunks[idx] == nullptr) {
+			auto ref = std::lower_bound(missing.begin(), missing.end(), chunk_idxs[idx]);
+			chunks[idx] = loaded[ref - missing.begin()];
+		}
+	}
+}
+
+void Disk::prefetch(Size *chunk_idxs, size_t count) {
+	std::sort(chunk_idxs, chunk_idxs + count);
+	count = std::unique(chunk_idxs, chunk_idxs + count) - chunk_idxs;
+	while (count > 0 && chunk_idxs[count - 1] >= this->size_chunks()) 
+		count--;
+
+	if (this->pool == nullptr) {
+		// one madvise per run of consecutive chunks
+		size_t run_start = 0;
+		for (size_t idx = 1; idx <= count; ++idx) {
+			if (idx == count || chunk_idxs[idx] != chunk_idxs[idx - 1] + 1) {
+				this->advise(chunk_idxs[run_start], idx - run_start, MADV_WILLNEED);
+				run_start = idx;
+			}
+		}
+		return ;
+	}
+
+	// never let a prefetch take more than a quarter of the pool, or it would push out
+	// the chunks it is meant to be getting ready
+	count = std::min<size_t>(count, std::max<size_t>(this->pool->size_frames() / 4, 1));
+	if (count == 0) 
+		return ;
+
+	std::vector<Byte *> frames(count);
+	this->pool->pin_many(chunk_idxs, count, frames.data());
+	for (size_t idx = 0; idx < count; ++idx) {
+		this->pool->unpin(chunk_idxs[idx], false);
+	}
+}
+
+void Disk::release_chunk(const Chunk& chunk) {
+	assert(chunk.parent == this);
+	if (this->pool != nullptr) {
+		// anything written through the chunk was written while it held its pin, the pool
+		// compares the frame with its clean copy so only chunks that changed get dirty
+		this->pool->unpin(chunk.chunk_idx, true);
+	}
+	if (!this->writeback_enabled) 
+		return ;
+	// the segment is written back as a whole
+	if (this->staged_count.load(std::memory_order_acquire) != 0 && this->is_staged(chunk.chunk_idx)) 
+		return ;
 
+	if (this->dirty_chunks.insert(chunk.chunk_idx, now_ms())) {
+		// make sure there is a flusher running, and kick it early if we have 
+		// gone over the dirty bytes threshold
+		if (!this->flusher_started.load(std::memory_order_acquire)) {
+			this->start_flusher();
+		} else if (this->dirty_chunks.size() * this->chunk_size() >= this->dirty_bytes_limit.load(std::memory_order_relaxed)) {
+			this->flusher_wakeup.notify_one();
+		}
+	}
+}
+
+void Disk::flush_chunk(const Chunk& chunk) {
+	// msync is safe to call concurrently, so no lock is needed here
 	assert(chunk.size_bytes == this->chunk_size());
 	assert(chunk.parent == this);
 
-	// std::memcpy(this->data + chunk.chunk_idx * this->chunk_size(), 
-	// 	chunk.data.get(), this->chunk_size());
-	size_t chunk_addr = (size_t)chunk.data;
-	chunk_addr &= ~(this->_mempage_size - 1);
+	std::vector<Size> chunk_idxs(1, chunk.chunk_idx);
+	this->write_back_chunks(chunk_idxs, MS_ASYNC);
+}
+
+void Disk::write_back_chunks(std::vector<Size>& chunk_idxs, int msync_flags) {
+	if (chunk_idxs.empty()) 
+		return ;
+
+	std::sort(chunk_idxs.begin(), chunk_idxs.end());
+
+	if (this->pool != nullptr) {
+		this->pool->write_back(chunk_idxs);
+		if ((msync_flags & MS_SYNC) && fdatasync(this->fd) != 0) {
+			char buff[1024];
+			sprintf(buff, "fdatasync failed to synchronize the disk, error code %d", errno);
+			throw DiskException(buff);
+		}
+		return ;
+	}
+
+	// walk the sorted chunks building up runs of whole pages, chunks that share a page 
+	// or that sit in neighbouring pages are merged into the same msync call
+	size_t range_start = 0;
+	size_t range_end = 0;
+	for (size_t idx = 0; idx <= chunk_idxs.size(); ++idx) {
+		size_t start = 0;
+		size_t end = 0;
+		if (idx < chunk_idxs.size()) {
+			start = (size_t)(this->data + chunk_idxs[idx] * this->_chunk_size);
+			end = start + this->_chunk_size;
+			start &= ~(this->_mempage_size - 1);
+			end = (end + this->_mempage_size - 1) & ~(this->_mempage_size - 1);
+
+			if (range_end != 0 && start <= range_end) {
+				range_end = std::max(range_end, end);
+				continue ;
+			}
+		}
+
+		if (range_end != 0) {
+			this->msyncs++;
+			int sync_retval = msync((void *)range_start, range_end - range_start, msync_flags);
+			if (sync_retval != 0) {
+				char buff[1024];
+				sprintf(buff, "msync failed to synchronize the chunk segment with the disk, error code %d for chunks starting at %llu", 
+					errno, (unsigned long long)((range_start - (size_t)this->data) / this->_chunk_size));
+				throw DiskException(buff);
+			}
+		}
+
+		range_start = start;
+		range_end = end;
+	}
+}
+
+void Disk::set_discard_config(const DiscardConfig& config) {
+	{
+		std::lock_guard<std::mutex> g(this->discard_lock);
+		this->discard_config = config;
+		// punching needs a file to punch, and one whose changes reach it
+		this->discard_enabled = config.enabled && this->fd != -1 && this->writeback_enabled;
+		if (!this->discard_enabled) 
+			this->pending_discards.clear();
+	}
+	this->flusher_wakeup.notify_one();
+}
+
+void Disk::discard(Size first_chunk, Size count) {
+	if (!this->discard_enabled.load(std::memory_order_acquire) || count == 0) 
+		return ;
+	if (first_chunk >= this->size_chunks() || count > this->size_chunks() - first_chunk) {
+		throw DiskException("discarded range out of bounds");
+	}
+
+	{
+		std::lock_guard<std::mutex> g(this->discard_lock);
+		Size start = first_chunk;
+		Size end = first_chunk + count;
+		// merge with whatever it touches on either side
+		auto next = this->pending_discards.lower_bound(start);
+		if (next != this->pending_discards.begin()) {
+			auto prev = std::prev(next);
+			if (prev->first + prev->second.count >= start) 
+				next = prev;
+		}
+		while (next != this->pending_discards.end() && next->first <= end) {
+			start = std::min(start, next->first);
+			end = std::max(end, next->first + next->second.count);
+			next = this->pending_discards.erase(next);
+		}
+		PendingDiscard &range = this->pending_discards[start];
+		range.count = end - start;
+		range.queued_ms = now_ms();
+	}
+	if (!this->flusher_started.load(std::memory_order_acquire)) 
+		this->start_flusher();
+}
+
+void Disk::cancel_discard(Size first_chunk, Size count) {
+	if (!this->discard_enabled.load(std::memory_order_acquire) || count == 0) 
+		return ;
+
+	{
+		std::lock_guard<std::mutex> g(this->discard_lock);
+		const Size end = first_chunk + count;
+		auto next = this->pending_discards.lower_bound(first_chunk);
+		if (next != this->pending_discards.begin() && std::prev(next)->first + std::prev(next)->second.count > first_chunk) 
+			next = std::prev(next);
+		while (next != this->pending_discards.end() && next->first < end) {
+			// keep whatever sticks out either side
+			const Size start = next->first;
+			const PendingDiscard range = next->second;
+			next = this->pending_discards.erase(next);
+			if (start < first_chunk) {
+				PendingDiscard &before = this->pending_discards[start];
+				before.count = first_chunk - start;
+				before.queued_ms = range.queued_ms;
+			}
+			if (start + range.count > end) {
+				PendingDiscard &after = this->pending_discards[end];
+				after.count = start + range.count - end;
+				after.queued_ms = range.queued_ms;
+				break ;
+			}
+		}
+	}
+	// the range may be in a batch that is being punched right now
+	std::lock_guard<std::mutex> punching(this->punch_lock);
+}
+
+int64_t Disk::issue_discards() {
+	std::lock_guard<std::mutex> punching(this->punch_lock);
+	std::vector<std::pair<Size, Size>> ranges;
+	int64_t next_ms = 0;
+	{
+		std::lock_guard<std::mutex> g(this->discard_lock);
+		const DiscardConfig &config = this->discard_config;
+		const int64_t now = now_ms();
+		const int64_t rate = config.bytes_per_second;
+		// the budget fills back up at the rate, to at most a second's worth
+		const int64_t elapsed_ms = std::min<int64_t>(now - this->discard_budget_ms, 1000);
+		this->discard_budget = std::min<int64_t>(rate, this->discard_budget + elapsed_ms * rate / 1000);
+		this->discard_budget_ms = now;
+
+		next_ms = std::max<int64_t>(config.delay_ms, 1);
+		for (auto it = this->pending_discards.begin(); it != this->pending_discards.end();) {
+			const int64_t age = now - it->second.queued_ms;
+			if (age < (int64_t)config.delay_ms) {
+				next_ms = std::min<int64_t>(next_ms, config.delay_ms - age);
+				++it;
+				continue ;
+			}
+			if (it->second.count < config.min_chunks) {
+				it = this->pending_discards.erase(it);
+				continue ;
+			}
+			// a range longer than a second's worth goes out once the budget is full
+			const int64_t bytes = it->second.count * this->chunk_size();
+			if (rate != 0 && bytes > this->discard_budget && this->discard_budget < rate) {
+				next_ms = std::min<int64_t>(next_ms, 
+					(std::min(bytes, rate) - this->discard_budget) * 1000 / rate + 1);
+				break ;
+			}
+			if (rate != 0) 
+				this->discard_budget -= bytes;
+			ranges.push_back(std::make_pair(it->first, it->second.count));
+			it = this->pending_discards.erase(it);
+		}
+	}
+
+	for (const std::pair<Size, Size> &range : ranges) {
+		if (fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+				range.first * this->chunk_size(), range.second * this->chunk_size()) != 0) {
+			const int error = errno;
+			if (error == EOPNOTSUPP) {
+				// the host file system can not punch holes, do not keep asking it to
+				DiscardConfig off;
+				off.enabled = false;
+				this->set_discard_config(off);
+				return 0;
+			}
+			char buff[1024];
+			sprintf(buff, "fallocate failed to punch out chunks starting at %llu, error code %d", 
+				(unsigned long long)range.first, error);
+			throw DiskException(buff);
+		}
+		this->discarded_chunks += range.second;
+	}
+	return next_ms;
+}
+
+bool Disk::is_staged(Size chunk_idx) {
+	std::lock_guard<std::mutex> g(this->staged_lock);
+	for (const StagedSegment &segment : this->staged_segments) {
+		if (chunk_idx >= segment.first_chunk && chunk_idx - segment.first_chunk < segment.count) 
+			return true;
+	}
+	return false;
+}
+
+void Disk::stage_segment(Size first_chunk, Size count) {
+	if (!this->writeback_enabled || count == 0) 
+		return ;
+	if (first_chunk >= this->size_chunks() || count > this->size_chunks() - first_chunk) {
+		throw DiskException("staged segment out of bounds");
+	}
+	{
+		std::lock_guard<std::mutex> g(this->staged_lock);
+		StagedSegment segment;
+		segment.first_chunk = first_chunk;
+		segment.count = count;
+		segment.written_ms = now_ms();
+		this->staged_segments.push_back(segment);
+		this->staged_count.store(this->staged_segments.size(), std::memory_order_release);
+	}
+	// the flusher is what writes back a segment that is taking a while to fill
+	if (!this->flusher_started.load(std::memory_order_acquire)) 
+		this->start_flusher();
+}
+
+void Disk::write_segment(Size first_chunk) {
+	std::vector<Size> chunk_idxs;
+	this->begin_write_back();
+	{
+		std::lock_guard<std::mutex> g(this->staged_lock);
+		auto ref = std::find_if(this->staged_segments.begin(), this->staged_segments.end(), 
+			[first_chunk](const StagedSegment &segment) { return segment.first_chunk == first_chunk; });
+		if (ref == this->staged_segments.end()) {
+			this->end_write_back();
+			return ;
+		}
+		// chunks released from here on are dirty like any other
+		for (Size idx = 0; idx < ref->count; ++idx) 
+			chunk_idxs.push_back(ref->first_chunk + idx);
+		this->staged_segments.erase(ref);
+		this->staged_count.store(this->staged_segments.size(), std::memory_order_release);
+	}
+	this->segment_writes++;
+	try {
+		this->write_back_chunks(chunk_idxs, MS_ASYNC);
+	} catch (...) {
+		this->end_write_back();
+		throw;
+	}
+	this->end_write_back();
+}
+
+int64_t Disk::write_staged_segments(int64_t age_ms, int msync_flags) {
+	std::vector<Size> chunk_idxs;
+	int64_t next_ms = age_ms;
+	{
+		std::lock_guard<std::mutex> g(this->staged_lock);
+		const int64_t now = now_ms();
+		for (StagedSegment &segment : this->staged_segments) {
+			const int64_t age = now - segment.written_ms;
+			if (age < age_ms) {
+				next_ms = std::min(next_ms, age_ms - age);
+				continue ;
+			}
+			// it stays staged, and is written again once it is full
+			for (Size idx = 0; idx < segment.count; ++idx) 
+				chunk_idxs.push_back(segment.first_chunk + idx);
+			segment.written_ms = now;
+			this->segment_writes++;
+		}
+	}
+	this->write_back_chunks(chunk_idxs, msync_flags);
+	return next_ms;
+}
+
+void Disk::sync() {
+	if (!this->writeback_enabled) 
+		return ;
+
+	// anything modified is either still referenced, has been released into the dirty 
+	// set or sits in a staged segment, so between the three of them we cover every chunk
+	std::vector<Size> chunk_idxs;
+	this->write_staged_segments(0, MS_ASYNC);
+	this->dirty_chunks.take_all(chunk_idxs);
+	this->chunk_cache.live_keys(chunk_idxs);
+	std::sort(chunk_idxs.begin(), chunk_idxs.end());
+	chunk_idxs.erase(std::unique(chunk_idxs.begin(), chunk_idxs.end()), chunk_idxs.end());
+	this->write_back_chunks(chunk_idxs, MS_ASYNC);
+
+	// the flusher (or a filled segment) may have taken chunks before we got to them, 
+	// those writes have to land before the file is synced
+	{
+		std::unique_lock<std::mutex> g(this->flusher_lock);
+		this->write_backs_done.wait(g, [this]() { return this->write_backs_in_flight == 0; });
+	}
+
+	// everything has been handed to the kernel now, make all of it durable at once. this
+	// also covers chunks that were written back asynchronously before the call
+	if (this->pool != nullptr) {
+		if (fdatasync(this->fd) != 0) {
+			char buff[1024];
+			sprintf(buff, "fdatasync failed to synchronize the disk, error code %d", errno);
+			throw DiskException(buff);
+		}
+	} else {
+		this->msyncs++;
+		if (msync(this->data, this->mapped_bytes, MS_SYNC) != 0) {
+			char buff[1024];
+			sprintf(buff, "msync failed to synchronize the disk, error code %d", errno);
+			throw DiskException(buff);
+		}
+	}
+}
+
+void Disk::begin_write_back() {
+	std::lock_guard<std::mutex> g(this->flusher_lock);
+	this->write_backs_in_flight++;
+}
 
-	size_t page_count = this->_chunk_size / this->_mempage_size;
-	if (this->_chunk_size % this->_mempage_size != 0) 
-		page_count++;
+void Disk::end_write_back() {
+	{
+		std::lock_guard<std::mutex> g(this->flusher_lock);
+		this->write_backs_in_flight--;
+	}
+	this->write_backs_done.notify_all();
+}
 
-	int sync_retval = msync((void *)chunk_addr, page_count * this->_mempage_size, MS_ASYNC);
-	if (sync_retval != 0) {
-		char buff[1024];
-		sprintf(buff, "msync failed to synchronize the chunk segment with the disk, error code %d for chunk %d", sync_retval, chunk.chunk_idx);
-		throw DiskException(buff);
+void Disk::set_writeback_config(const WritebackConfig& config) {
+	{
+		std::lock_guard<std::mutex> g(this->flusher_lock);
+		this->writeback_config = config;
+		this->dirty_bytes_limit.store(config.dirty_bytes, std::memory_order_relaxed);
+	}
+	this->flusher_wakeup.notify_one();
+}
+
+void Disk::start_flusher() {
+	std::lock_guard<std::mutex> g(this->flusher_lock);
+	if (this->flusher.joinable() || this->flusher_stop) 
+		return ;
+	this->flusher = std::thread(&Disk::flusher_main, this);
+	this->flusher_started.store(true, std::memory_order_release);
+}
+
+void Disk::flusher_main() {
+	std::unique_lock<std::mutex> g(this->flusher_lock);
+	std::vector<Size> chunk_idxs;
+
+	while (!this->flusher_stop) {
+		const int64_t age_limit = this->writeback_config.dirty_age_ms;
+		const uint64_t bytes_limit = this->writeback_config.dirty_bytes;
+		const uint64_t dirty_bytes = this->dirty_chunks.size() * this->chunk_size();
+		const int64_t age = this->dirty_chunks.size() == 0 ? 0 : now_ms() - this->dirty_chunks.oldest_ms();
+
+		// segments that are slow to fill do not wait for it any longer than a dirty chunk
+		int64_t segment_wait_ms = age_limit;
+		if (this->staged_count.load(std::memory_order_acquire) != 0) {
+			g.unlock();
+			try {
+				segment_wait_ms = this->write_staged_segments(std::max<int64_t>(age_limit, 1), MS_ASYNC);
+			} catch (const DiskException& e) {
+				fprintf(stdout, "disk flusher: %s\n", e.message.c_str());
+			}
+			g.lock();
+		}
+
+		// and freed space is punched out in the background as well
+		int64_t discard_wait_ms = age_limit;
+		if (this->discard_enabled.load(std::memory_order_acquire)) {
+			g.unlock();
+			try {
+				discard_wait_ms = this->issue_discards();
+			} catch (const DiskException& e) {
+				fprintf(stdout, "disk flusher: %s\n", e.message.c_str());
+			}
+			g.lock();
+		}
+
+		if (dirty_bytes == 0 || (age < age_limit && dirty_bytes < bytes_limit)) {
+			// sleep until the oldest chunk comes of age, or until someone kicks us
+			int64_t wait_ms = dirty_bytes == 0 ? age_limit : age_limit - age;
+			wait_ms = std::min(std::min(wait_ms, segment_wait_ms), discard_wait_ms);
+			this->flusher_wakeup.wait_for(g, std::chrono::milliseconds(std::max<int64_t>(wait_ms, 1)));
+			continue ;
+		}
+
+		// counted before the chunks leave the dirty set, so that sync waits for them
+		this->write_backs_in_flight++;
+		g.unlock();
+		chunk_idxs.clear();
+		this->dirty_chunks.take_all(chunk_idxs);
+		try {
+			this->write_back_chunks(chunk_idxs, MS_ASYNC);
+		} catch (const DiskException& e) {
+			fprintf(stdout, "disk flusher: %s\n", e.message.c_str());
+		}
+		g.lock();
+		this->write_backs_in_flight--;
+		this->write_backs_done.notify_all();
 	}
 }
 
 void Disk::try_close() {
-	std::lock_guard<std::mutex> g(lock); // acquire the lock
 	this->chunk_cache.sweep(true);
 	if (this->chunk_cache.size() > 0) {
 		throw DiskException("there are still chunks referenced in other parts of the program");
@@ -67,8 +786,37 @@ void Disk::try_close() {
 }
 
 Disk::~Disk() {
+	{
+		std::lock_guard<std::mutex> g(this->flusher_lock);
+		this->flusher_stop = true;
+	}
+	this->flusher_wakeup.notify_one();
+	if (this->flusher.joinable()) {
+		this->flusher.join();
+	}
+
+	if (this->writeback_enabled) {
+		// hand whatever is left over to the kernel before we unmap
+		std::vector<Size> chunk_idxs;
+		this->dirty_chunks.take_all(chunk_idxs);
+		try {
+			this->write_staged_segments(0, MS_ASYNC);
+			this->write_back_chunks(chunk_idxs, MS_ASYNC);
+			if (this->pool != nullptr) {
+				// chunks that are still pinned (e.g. by a bitmap) were never released
+				this->pool->write_back_all();
+			}
+		} catch (const DiskException& e) {
+			fprintf(stdout, "disk flusher: %s\n", e.message.c_str());
+		}
+	}
+
 	if (this->data != NULL) {
-		munmap(this->data, this->size_bytes());
+		munmap(this->data, this->mapped_bytes);
+	}
+	if (this->direct_fd != -1) {
+		this->pool = nullptr;
+		close(this->direct_fd);
 	}
 }
 
@@ -78,100 +826,674 @@ Disk::~Disk() {
 	Disk Bit Map Methods
 */
 
-DiskBitMap::DiskBitMap(Disk *disk, Size chunk_start, Size size_in_bits) {
+constexpr Size DiskBitMap::DEFAULT_RESIDENT_CHUNKS;
+
+DiskBitMap::DiskBitMap(Disk *disk, Size chunk_start, Size size_in_bits, Size max_resident_chunks) {
 	this->disk_chunk_size = disk->chunk_size();
 	this->size_in_bits = size_in_bits;
+	this->chunk_start = chunk_start;
 	this->disk = disk;
-	for (uint64_t idx = 0; idx < this->size_chunks(); ++idx) {
-		auto chunk = disk->get_chunk(idx + chunk_start);
-		chunk->lock.lock();
-		this->chunks.push_back(std::move(chunk));
+	if (chunk_start + this->size_chunks() > disk->size_chunks()) {
+		throw DiskException("chunk index out of bounds");
+	}
+	this->chunks.resize(this->size_chunks());
+	// a search walks two chunks at once when a word straddles them
+	this->max_resident_chunks = std::max<Size>(max_resident_chunks, 2);
+	this->resident.reserve(std::min(this->max_resident_chunks, this->size_chunks()));
+	this->build_summary();
+}
+
+std::shared_ptr<Chunk> DiskBitMap::load_chunk(Size chunk_idx) {
+	std::shared_ptr<Chunk> &chunk = this->chunks[chunk_idx];
+	if (chunk != nullptr) 
+		return chunk;
+
+	if (this->resident.size() < this->max_resident_chunks) {
+		this->resident.push_back(chunk_idx);
+	} else {
+		// whoever still holds the chunk keeps it alive, we only stop pinning it
+		this->chunks[this->resident[this->resident_head]] = nullptr;
+		this->resident[this->resident_head] = chunk_idx;
+		this->resident_head = (this->resident_head + 1) % this->resident.size();
 	}
+	chunk = this->disk->get_chunk(this->chunk_start + chunk_idx);
+	this->loads++;
+	return chunk;
 }
 
-DiskBitMap::~DiskBitMap() {
-	for (auto &chunk : chunks) {
-		chunk->lock.unlock();
+Size DiskBitMap::resident_chunks() {
+	std::lock_guard<std::mutex> g(this->block);
+	return this->resident.size();
+}
+
+Size DiskBitMap::chunk_loads() {
+	std::lock_guard<std::mutex> g(this->block);
+	return this->loads;
+}
+
+uint64_t DiskBitMap::Cursor::word(Size idx) {
+	if (map.disk_chunk_size % sizeof(uint64_t) == 0) 
+		return *(const uint64_t *)this->bytes(idx / 8);
+
+	// words straddle chunks, put them together a byte at a time
+	uint64_t word = 0;
+	for (uint64_t byte = 0; byte < sizeof(uint64_t); ++byte) {
+		word |= (uint64_t)this->byte(idx + byte * 8) << (byte * 8);
+	}
+	return word;
+}
+
+Byte DiskBitMap::get_byte_for_idx(Size idx) {
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	return cursor.byte(idx);
+}
+
+uint64_t DiskBitMap::get_word_for_idx(Size idx) {
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	return cursor.word(idx);
+}
+
+bool DiskBitMap::get(Size idx) {
+	if (idx >= size_in_bits) {
+		throw DiskException("BitMap index out of range");
+	}
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	return cursor.byte(idx) & (1 << (idx % 8));
+}
+
+void DiskBitMap::set_oob(Size idx) {
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	cursor.byte(idx) |= (1 << (idx % 8));
+	if (idx < size_in_bits) 
+		mark_dirty(idx);
+}
+
+void DiskBitMap::set(Size idx) {
+	if (idx >= size_in_bits) {
+		throw DiskException("BitMap index out of range");
 	}
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	cursor.byte(idx) |= (1 << (idx % 8));
+	mark_dirty(idx);
+}
+
+void DiskBitMap::clr(Size idx) {
+	if (idx >= size_in_bits) {
+		throw DiskException("BitMap index out of range");
+	}
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	cursor.byte(idx) &= ~(1 << (idx % 8));
+	mark_dirty(idx);
 }
 
 void DiskBitMap::clear_all() {
-	for (std::shared_ptr<Chunk>& chunk : chunks) {
-		std::memset(chunk->data, 0, chunk->size_bytes);
+	{
+		std::lock_guard<std::mutex> g(this->block);
+		Cursor cursor(*this);
+		for (Size idx = 0; idx < this->chunks.size(); ++idx) {
+			std::memset(cursor.bytes(idx * this->disk_chunk_size), 0, this->disk_chunk_size);
+		}
 	}
 
 	for (uint64_t idx = this->size_in_bits; idx < this->size_in_bits + 8; ++idx) {
 		this->set_oob(idx);
 	}
+
+	std::lock_guard<std::mutex> g(this->block);
+	this->build_summary();
+	this->summarise_all();
+}
+
+
+/*
+	scan kernels, each returns how many of the count words equal skip before the 
+	first one that does not
+*/
+typedef size_t (*ScanKernelFn)(const uint64_t *words, size_t count, uint64_t skip);
+
+static size_t scan_words_scalar(const uint64_t *words, size_t count, uint64_t skip) {
+	size_t idx = 0;
+	// four at a time so the compiler can keep a few loads in flight
+	for (; idx + 4 <= count; idx += 4) {
+		if ((words[idx] ^ skip) | (words[idx + 1] ^ skip) | (words[idx + 2] ^ skip) | (words[idx + 3] ^ skip)) 
+			break ;
+	}
+	while (idx < count && words[idx] == skip) 
+		idx++;
+	return idx;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BITMAP_HAVE_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static size_t scan_words_avx2(const uint64_t *words, size_t count, uint64_t skip) {
+	// what we are after is often only a few words away, which is cheaper to find
+	// without touching the vector unit
+	size_t idx = 0;
+	for (; idx < count && idx < 8; ++idx) {
+		if (words[idx] != skip) 
+			return idx;
+	}
+
+	const __m256i skip_vec = _mm256_set1_epi64x((long long)skip);
+	// 1024 bits per iteration, the first 256 that differ from skip end it
+	for (; idx + 16 <= count; idx += 16) {
+		const __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(words + idx)), skip_vec);
+		const __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(words + idx + 4)), skip_vec);
+		const __m256i c = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(words + idx + 8)), skip_vec);
+		const __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(words + idx + 12)), skip_vec);
+		const __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+		if (!_mm256_testz_si256(any, any)) 
+			break ;
+	}
+	for (; idx + 4 <= count; idx += 4) {
+		const __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(words + idx)), skip_vec);
+		if (!_mm256_testz_si256(a, a)) 
+			break ;
+	}
+	while (idx < count && words[idx] == skip) 
+		idx++;
+	return idx;
 }
+#endif
 
+static bool cpu_has_avx2() {
+#ifdef BITMAP_HAVE_AVX2
+	// we may run from a static initializer, before the cpu has been looked at
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
 
-std::array<DiskBitMap::BitRange, 256> DiskBitMap::find_unset_cache;
+static ScanKernelFn pick_scan_kernel() {
+#ifdef BITMAP_HAVE_AVX2
+	if (cpu_has_avx2()) 
+		return scan_words_avx2;
+#endif
+	return scan_words_scalar;
+}
 
-static bool bitmap_init_cache(std::array<DiskBitMap::BitRange, 256>& cache) {
-	for (Size idx = 0; idx < 256; ++idx) {
-		std::bitset<8> byte(idx);
+static ScanKernelFn scan_kernel = pick_scan_kernel();
 
-		for (Size j = 0; j < 8; ++j) {
-			if (!byte[j]) {
-				cache[idx].start_idx = j;
-				Size k = 1;
-				while (!byte[j + k] && j + k < 8) {
-					k++;
-				}
-				cache[idx].bit_count = k;
-				break;
-			}
+DiskBitMap::ScanKernel DiskBitMap::get_scan_kernel() {
+	return scan_kernel == scan_words_scalar ? SCAN_SCALAR : SCAN_AVX2;
+}
+
+bool DiskBitMap::set_scan_kernel(ScanKernel kernel) {
+	if (kernel == SCAN_SCALAR) {
+		scan_kernel = scan_words_scalar;
+		return true;
+	}
+#ifdef BITMAP_HAVE_AVX2
+	if (kernel == SCAN_AVX2 && cpu_has_avx2()) {
+		scan_kernel = scan_words_avx2;
+		return true;
+	}
+#endif
+	return false;
+}
+
+Size DiskBitMap::skip_words(Cursor &cursor, Size idx, Size to, uint64_t skip) {
+	if (this->disk_chunk_size % sizeof(uint64_t) != 0) 
+		return 0;
+
+	const uint64_t byte_idx = idx / 8;
+	const uint64_t offset = byte_idx % this->disk_chunk_size;
+	const uint64_t *words = (const uint64_t *)cursor.bytes(byte_idx);
+	const Size count = std::min<Size>((this->disk_chunk_size - offset) / sizeof(uint64_t), (to - idx + 63) / 64);
+	return scan_kernel(words, count, skip);
+}
+
+Size DiskBitMap::find_bit(Cursor &cursor, Size from, Size to, bool set) {
+	if (from >= to) 
+		return to;
+
+	// flip the words we look at so that we are always after a set bit
+	const uint64_t skip = set ? 0 : ~(uint64_t)0;
+	Size idx = from - from % 64;
+	uint64_t bits = (cursor.word(idx) ^ skip) & (~(uint64_t)0 << (from % 64));
+	while (bits == 0) {
+		idx += 64;
+		if (idx >= to) 
+			return to;
+		idx += 64 * this->skip_words(cursor, idx, to, skip);
+		if (idx >= to) 
+			return to;
+		bits = cursor.word(idx) ^ skip;
+	}
+	return std::min<Size>(idx + __builtin_ctzll(bits), to);
+}
+
+void DiskBitMap::check_ranges(const BitRange *ranges, size_t count) const {
+	for (size_t idx = 0; idx < count; ++idx) {
+		if (ranges[idx].start_idx > this->size_in_bits || ranges[idx].bit_count > this->size_in_bits - ranges[idx].start_idx) {
+			throw DiskException("BitMap range out of range");
 		}
 	}
-	return true;
 }
 
-static bool find_unset_cache_initialized = bitmap_init_cache(DiskBitMap::find_unset_cache);
+void DiskBitMap::apply_range(Cursor &cursor, Size start_idx, Size bit_count, bool value) {
+	if (bit_count == 0) 
+		return ;
+	const Size end_idx = start_idx + bit_count;
 
-DiskBitMap::BitRange DiskBitMap::find_unset_bits(Size length) {
-	using BitRange = DiskBitMap::BitRange;
-	
-	// fprintf(stdout, "SCANNING BITMAP (SIZE IN BITS): %llu\n", this->size_in_bits);
+	// bits up to the first whole byte
+	Size idx = start_idx;
+	while (idx < end_idx && idx % 8 != 0) {
+		const Size bits = std::min<Size>(8 - idx % 8, end_idx - idx);
+		const Byte mask = (Byte)(((1u << bits) - 1) << (idx % 8));
+		Byte &byte = cursor.byte(idx);
+		byte = value ? (byte | mask) : (byte & ~mask);
+		idx += bits;
+	}
 
-	BitRange retval;
-	for (Size idx = last_search_idx; idx < this->size_in_bits; idx += 8) {
-		const Byte byte = (size_t)this->get_byte_for_idx(idx);
-		BitRange res = find_unset_cache[byte];
-		res.start_idx += idx;
+	// whole bytes, a memset per chunk they fall in
+	while (end_idx - idx >= 8) {
+		const Size byte_idx = idx / 8;
+		const Size offset = byte_idx % this->disk_chunk_size;
+		const Size bytes = std::min<Size>((end_idx - idx) / 8, this->disk_chunk_size - offset);
+		std::memset(cursor.bytes(byte_idx), value ? 0xff : 0, bytes);
+		idx += bytes * 8;
+	}
 
-		// fprintf(stdout, "SCANNING %d : %x\n", idx, byte);
+	// and whatever is left of the last byte
+	if (idx < end_idx) {
+		const Byte mask = (Byte)((1u << (end_idx - idx)) - 1);
+		Byte &byte = cursor.byte(idx);
+		byte = value ? (byte | mask) : (byte & ~mask);
+	}
 
-		// if retval already set, the next set of bits must start immediately where the last one ends
-		if (retval.bit_count != 0 && res.start_idx != retval.start_idx + retval.bit_count) {
-			last_search_idx = idx;
-			break ;
+	for (Size block = start_idx / SUMMARY_BLOCK_BITS; block <= (end_idx - 1) / SUMMARY_BLOCK_BITS; ++block) {
+		this->mark_dirty(block * SUMMARY_BLOCK_BITS);
+	}
+}
+
+void DiskBitMap::set_range(Size start_idx, Size bit_count) {
+	BitRange range;
+	range.start_idx = start_idx;
+	range.bit_count = bit_count;
+	this->set_ranges(&range, 1);
+}
+
+void DiskBitMap::clr_range(Size start_idx, Size bit_count) {
+	BitRange range;
+	range.start_idx = start_idx;
+	range.bit_count = bit_count;
+	this->clr_ranges(&range, 1);
+}
+
+void DiskBitMap::set_ranges(const BitRange *ranges, size_t count) {
+	this->check_ranges(ranges, count);
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	for (size_t idx = 0; idx < count; ++idx) {
+		this->apply_range(cursor, ranges[idx].start_idx, ranges[idx].bit_count, true);
+	}
+}
+
+void DiskBitMap::clr_ranges(const BitRange *ranges, size_t count) {
+	this->check_ranges(ranges, count);
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	for (size_t idx = 0; idx < count; ++idx) {
+		this->apply_range(cursor, ranges[idx].start_idx, ranges[idx].bit_count, false);
+	}
+}
+
+/*
+	summary tree
+*/
+
+constexpr Size DiskBitMap::SUMMARY_BLOCK_BITS;
+constexpr Size DiskBitMap::SUMMARY_FANOUT;
+
+// folds the summaries of neighbouring nodes (or words) into one for all of them
+static void combine_summaries(const DiskBitMap::Summary *nodes, size_t count, DiskBitMap::Summary &out) {
+	out = DiskBitMap::Summary();
+	out.known = true;
+	Size running = 0; // the run of unset bits that reaches the end of the last node
+	bool all_free = true;
+	for (size_t idx = 0; idx < count; ++idx) {
+		const DiskBitMap::Summary &node = nodes[idx];
+		out.known = out.known && node.known;
+		out.bits += node.bits;
+		out.free += node.free;
+		if (all_free) 
+			out.prefix += node.prefix;
+		if (node.free == node.bits) {
+			running += node.bits;
+		} else {
+			all_free = false;
+			out.longest = std::max(out.longest, std::max(running + node.prefix, node.longest));
+			running = node.suffix;
+		}
+	}
+	out.longest = std::max(out.longest, running);
+	out.suffix = running;
+}
+
+DiskBitMap::Summary DiskBitMap::summarise_block(Cursor &cursor, Size block) {
+	const Size first = block * SUMMARY_BLOCK_BITS;
+	const Size end = std::min(first + SUMMARY_BLOCK_BITS, this->size_in_bits);
+
+	Summary words[SUMMARY_BLOCK_BITS / 64];
+	size_t count = 0;
+	for (Size idx = first; idx < end; idx += 64, ++count) {
+		uint64_t used = cursor.word(idx);
+		if (end - idx < 64) 
+			used |= ~(uint64_t)0 << (end - idx);
+
+		Summary &word = words[count];
+		word.bits = 64;
+		word.free = 64 - __builtin_popcountll(used);
+		if (used == 0) {
+			word.prefix = word.suffix = word.longest = 64;
+			continue ;
+		}
+		word.prefix = __builtin_ctzll(used);
+		word.suffix = __builtin_clzll(used);
+		// every step shortens each run of unset bits by one
+		for (uint64_t runs = ~used; runs != 0; runs &= runs << 1) {
+			word.longest++;
+		}
+	}
+
+	Summary out;
+	combine_summaries(words, count, out);
+	out.known = true;
+	return out;
+}
+
+void DiskBitMap::build_summary() {
+	const Size blocks = std::max<Size>((this->size_in_bits + SUMMARY_BLOCK_BITS - 1) / SUMMARY_BLOCK_BITS, 1);
+	this->summary.clear();
+	this->summary.push_back(std::vector<Summary>(blocks));
+	for (Size block = 0; block < blocks; ++block) {
+		// what we know without loading anything
+		this->summary[0][block].bits = SUMMARY_BLOCK_BITS;
+	}
+	while (this->summary.back().size() > 1) {
+		const std::vector<Summary> &below = this->summary.back();
+		std::vector<Summary> level((below.size() + SUMMARY_FANOUT - 1) / SUMMARY_FANOUT);
+		for (Size node = 0; node < level.size(); ++node) {
+			const Size first = node * SUMMARY_FANOUT;
+			combine_summaries(&below[first], std::min(SUMMARY_FANOUT, below.size() - first), level[node]);
+		}
+		this->summary.push_back(std::move(level));
+	}
+
+	this->summary_dirty.assign(blocks, 0);
+	this->dirty_blocks.clear();
+	// so that marking a block dirty never allocates
+	this->dirty_blocks.reserve(blocks);
+}
+
+void DiskBitMap::refresh_summary() {
+	if (this->dirty_blocks.empty()) 
+		return ;
+
+	// the dirty nodes of each level become the list for the next one up
+	std::vector<Size> &nodes = this->dirty_blocks;
+	Cursor cursor(*this);
+	for (Size block : nodes) {
+		if (this->summary_dirty[block] == 1) 
+			this->summary[0][block] = this->summarise_block(cursor, block);
+		this->summary_dirty[block] = 0;
+	}
+	for (size_t level = 1; level < this->summary.size(); ++level) {
+		for (Size &node : nodes) {
+			node /= SUMMARY_FANOUT;
+		}
+		std::sort(nodes.begin(), nodes.end());
+		nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+		const std::vector<Summary> &below = this->summary[level - 1];
+		for (Size node : nodes) {
+			const Size first = node * SUMMARY_FANOUT;
+			combine_summaries(&below[first], std::min(SUMMARY_FANOUT, below.size() - first), this->summary[level][node]);
 		}
+	}
+	nodes.clear();
+}
 
-		if (res.bit_count != 0) {
-			if (retval.bit_count == 0) {
-				retval = res;
+void DiskBitMap::summarise_all() {
+	if (this->summary.back()[0].known) 
+		return ;
+	for (Size block = 0; block < this->summary[0].size(); ++block) {
+		if (!this->summary[0][block].known) 
+			this->mark_dirty(block * SUMMARY_BLOCK_BITS);
+	}
+	this->refresh_summary();
+}
+
+Size DiskBitMap::count_unset_bits() {
+	std::lock_guard<std::mutex> g(this->block);
+	this->refresh_summary();
+	this->summarise_all();
+	return this->summary.back()[0].free;
+}
+
+Size DiskBitMap::longest_unset_run() {
+	std::lock_guard<std::mutex> g(this->block);
+	this->refresh_summary();
+	this->summarise_all();
+	return this->summary.back()[0].longest;
+}
+
+std::vector<DiskBitMap::BitRange> DiskBitMap::unset_runs(Size start_idx, Size bit_count) {
+	BitRange range;
+	range.start_idx = start_idx;
+	range.bit_count = bit_count;
+	this->check_ranges(&range, 1);
+
+	std::vector<BitRange> runs;
+	BitRange run;
+	const Size end = start_idx + bit_count;
+
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	for (Size idx = start_idx & ~(Size)63; idx < end; idx += 64) {
+		uint64_t used = cursor.word(idx);
+		if (start_idx > idx) 
+			used |= ~(~(uint64_t)0 << (start_idx - idx));
+		if (end - idx < 64) 
+			used |= ~(uint64_t)0 << (end - idx);
+
+		Size bit = 0;
+		while (bit < 64) {
+			const uint64_t rest_used = used >> bit;
+			if ((rest_used & 1) == 0) {
+				const Size length = rest_used == 0 ? 64 - bit : __builtin_ctzll(rest_used);
+				if (run.bit_count != 0 && run.start_idx + run.bit_count == idx + bit) {
+					// carried over from the word before
+					run.bit_count += length;
+				} else {
+					if (run.bit_count != 0) 
+						runs.push_back(run);
+					run.start_idx = idx + bit;
+					run.bit_count = length;
+				}
+				bit += length;
 			} else {
-				retval.bit_count += res.bit_count;
+				const uint64_t rest_free = ~rest_used;
+				bit += rest_free == 0 ? 64 - bit : __builtin_ctzll(rest_free);
 			}
-			
-			if (retval.bit_count >= length) {
-				last_search_idx = idx;
-				break;
+		}
+	}
+	if (run.bit_count != 0) 
+		runs.push_back(run);
+	return runs;
+}
+
+Size DiskBitMap::count_set_bits(Size start_idx, Size bit_count) {
+	BitRange range;
+	range.start_idx = start_idx;
+	range.bit_count = bit_count;
+	this->check_ranges(&range, 1);
+
+	Size count = 0;
+	const Size end = start_idx + bit_count;
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	for (Size idx = start_idx & ~(Size)63; idx < end; idx += 64) {
+		uint64_t used = cursor.word(idx);
+		if (start_idx > idx) 
+			used &= ~(uint64_t)0 << (start_idx - idx);
+		if (end - idx < 64) 
+			used &= ~(~(uint64_t)0 << (end - idx));
+		count += __builtin_popcountll(used);
+	}
+	return count;
+}
+
+bool DiskBitMap::find_run_in_block(Cursor &cursor, Size block, Size from, Size length, Size &running, Size &found) {
+	const Size first = block * SUMMARY_BLOCK_BITS;
+	const Size end = std::min(first + SUMMARY_BLOCK_BITS, this->size_in_bits);
+	for (Size idx = first; idx < end; idx += 64) {
+		if (idx + 64 <= from) 
+			continue ;
+		uint64_t used = cursor.word(idx);
+		if (end - idx < 64) 
+			used |= ~(uint64_t)0 << (end - idx);
+		if (from > idx) 
+			used |= ~(~(uint64_t)0 << (from - idx)); // nothing before from counts
+
+		// walk the word one run of set or unset bits at a time
+		Size bit = 0;
+		while (bit < 64) {
+			const uint64_t rest_used = used >> bit;
+			if ((rest_used & 1) == 0) {
+				const Size run = rest_used == 0 ? 64 - bit : __builtin_ctzll(rest_used);
+				running += run;
+				bit += run;
+				if (running >= length) {
+					found = idx + bit - running;
+					return true;
+				}
+			} else {
+				const uint64_t rest_free = ~rest_used;
+				bit += rest_free == 0 ? 64 - bit : __builtin_ctzll(rest_free);
+				running = 0;
 			}
 		}
 	}
+	return false;
+}
 
-	// bitcount should be limited to the length requested
-	if (retval.bit_count > length) {
-		retval.bit_count = length;
+bool DiskBitMap::find_run(Cursor &cursor, size_t level, Size node, Size from, Size length, Size &running, Size &found) {
+	const Size node_first = node * (SUMMARY_BLOCK_BITS << (6 * level));
+	if (node_first >= this->size_in_bits || node_first + (SUMMARY_BLOCK_BITS << (6 * level)) <= from) 
+		return false;
+
+	if (level == 0 && !this->summary[0][node].known && node_first >= from) {
+		// the first time we get to the block, its parents pick it up on the next refresh
+		this->summary[0][node] = this->summarise_block(cursor, node);
+		this->mark_dirty(node_first, 2);
 	}
 
-	if (retval.bit_count == 0 && last_search_idx != 0) {
-		this->last_search_idx = 0;
-		return this->find_unset_bits(length);
+	const Summary &summary = this->summary[level][node];
+	if (summary.known && node_first >= from) {
+		// the node is wholly after from, its summary says whether it is worth a look
+		if (running + summary.prefix >= length) {
+			found = node_first - running;
+			return true;
+		}
+		if (summary.longest < length) {
+			running = summary.free == summary.bits ? running + summary.bits : summary.suffix;
+			return false;
+		}
 	}
 
+	if (level == 0) 
+		return this->find_run_in_block(cursor, node, from, length, running, found);
+
+	const Size children = this->summary[level - 1].size();
+	for (Size child = node * SUMMARY_FANOUT; child < std::min((node + 1) * SUMMARY_FANOUT, children); ++child) {
+		if (this->find_run(cursor, level - 1, child, from, length, running, found)) 
+			return true;
+	}
+	return false;
+}
+
+Size DiskBitMap::find_run(Cursor &cursor, Size from, Size length) {
+	static_assert(SUMMARY_FANOUT == 64, "find_run shifts by 6 bits per level");
+	this->refresh_summary();
+	const Summary &root = this->summary.back()[0];
+	if (from >= this->size_in_bits || (root.known && root.longest < length)) 
+		return this->size_in_bits;
+
+	Size running = 0;
+	Size found = 0;
+	if (!this->find_run(cursor, this->summary.size() - 1, 0, from, length, running, found)) 
+		return this->size_in_bits;
+	return found;
+}
+
+DiskBitMap::BitRange DiskBitMap::find_unset_run(Size length) {
+	BitRange retval;
+	if (length == 0 || length > this->size_in_bits) 
+		return retval;
+
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	const Size from = std::min(this->last_search_idx, this->size_in_bits);
+	Size start = this->find_run(cursor, from, length);
+	if (start == this->size_in_bits && from != 0) 
+		start = this->find_run(cursor, 0, length);
+	if (start == this->size_in_bits) 
+		return retval;
+
+	retval.start_idx = start;
+	retval.bit_count = length;
+	this->last_search_idx = start + length;
 	return retval;
 }
 
+DiskBitMap::BitRange DiskBitMap::find_unset_bits(Cursor &cursor, Size length, Size &search_idx) {
+	BitRange retval;
+	if (length == 0) 
+		return retval;
+
+	// the first unset bit is the start of the first run at least 1 long
+	const Size from = std::min(search_idx, this->size_in_bits);
+	Size start = this->find_run(cursor, from, 1);
+	if (start == this->size_in_bits && from != 0) {
+		// nothing free after where the last search left off, look from the start
+		start = this->find_run(cursor, 0, 1);
+	}
+	if (start == this->size_in_bits) {
+		search_idx = 0;
+		return retval;
+	}
+
+	const Size limit = length >= this->size_in_bits - start ? this->size_in_bits : start + length;
+	const Size end = this->find_bit(cursor, start, limit, true);
+	retval.start_idx = start;
+	retval.bit_count = end - start;
+	search_idx = end;
+	return retval;
+}
+
+DiskBitMap::BitRange DiskBitMap::find_unset_bits(Size length) {
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	return this->find_unset_bits(cursor, length, this->last_search_idx);
+}
+
+DiskBitMap::BitRange DiskBitMap::claim_unset_bits(Size length, Size &search_idx) {
+	std::lock_guard<std::mutex> g(this->block);
+	Cursor cursor(*this);
+	BitRange retval = this->find_unset_bits(cursor, length, search_idx);
+	this->apply_range(cursor, retval.start_idx, retval.bit_count, true);
+	return retval;
+}
@@ -3,7 +3,12 @@
 
 #include <stdint.h>
 #include <mutex>
+#include <atomic>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <condition_variable>
 #include <string>
 #include <vector>
 #include <array>
@@ -19,6 +24,7 @@ typedef uint8_t Byte;
 typedef uint64_t Size;
 
 class Disk;
+class BufferPool;
 
 struct StorageException : public std::exception {
 	const std::string message;
@@ -29,17 +35,176 @@ struct DiskException : public StorageException {
 	DiskException(const std::string &message) : StorageException(message) { };
 };
 
+/*
+	a tiny spin lock that is used in place of a std::mutex on each chunk, chunks
+	are only ever locked for the duration of a memcpy so spinning is cheap, and it
+	keeps the chunk descriptor down to a single cache line
+*/
+struct ChunkLock {
+	std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+	inline void lock() {
+		while (flag.test_and_set(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+	}
+
+	inline bool try_lock() {
+		return !flag.test_and_set(std::memory_order_acquire);
+	}
+
+	inline void unlock() {
+		flag.clear(std::memory_order_release);
+	}
+};
+
 struct Chunk {
+	Byte *data = nullptr;
 	Disk *parent = nullptr;
-
-	std::mutex lock;
-	size_t size_bytes = 0;
 	size_t chunk_idx = 0;
-	Byte *data = nullptr;
+	uint32_t size_bytes = 0;
+	ChunkLock lock;
 
 	~Chunk();
 };
 
+/*
+	a small fixed size block allocator. blocks are carved out of slabs that are only
+	released when the pool is destroyed, and freed blocks are kept on a free list per
+	size class, so once the pool is warm allocating from it never touches the heap.
+	allocate is NOT thread safe, the owner is expected to hold a lock around it.
+	deallocate may be called from any thread though, since the last reference to an
+	object (and so its control block) can be dropped anywhere, blocks freed that way 
+	are pushed onto a lock free list which allocate takes over wholesale when the 
+	free list runs dry
+*/
+class SlabPool {
+private:
+	static constexpr size_t SIZE_CLASS_COUNT = 4;
+	static constexpr size_t MAX_BLOCK_SIZE = 256;
+	static constexpr size_t BLOCKS_PER_SLAB = 64;
+
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	struct SizeClass {
+		std::atomic<size_t> block_size;
+		FreeBlock *free_list = nullptr;
+		std::atomic<FreeBlock *> remote_free_list;
+
+		SizeClass() : block_size(0), remote_free_list(nullptr) { }
+	};
+
+	std::array<SizeClass, SIZE_CLASS_COUNT> classes;
+	std::vector<std::unique_ptr<char[]>> slabs;
+
+	static inline size_t round_size(size_t size) {
+		return (size + 15) & ~((size_t)15);
+	}
+
+	// returns the size class for blocks of this size, claiming a new one if there is room
+	SizeClass *class_for(size_t size, bool claim) {
+		for (SizeClass &cls : classes) {
+			size_t block_size = cls.block_size.load(std::memory_order_acquire);
+			if (block_size == size) {
+				return &cls;
+			}
+			if (block_size == 0) {
+				if (!claim)
+					return nullptr;
+				cls.block_size.store(size, std::memory_order_release);
+				return &cls;
+			}
+		}
+		return nullptr;
+	}
+
+public:
+	SlabPool() { }
+	SlabPool(const SlabPool&) = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+
+	void *allocate(size_t size) {
+		size = round_size(size);
+		SizeClass *cls = size <= MAX_BLOCK_SIZE ? class_for(size, true) : nullptr;
+		if (cls == nullptr) {
+			return ::operator new(size);
+		}
+
+		if (cls->free_list == nullptr) {
+			// only allocate ever pops, so taking the whole list at once can not race
+			cls->free_list = cls->remote_free_list.exchange(nullptr, std::memory_order_acquire);
+		}
+
+		if (cls->free_list == nullptr) {
+			std::unique_ptr<char[]> slab(new char[size * BLOCKS_PER_SLAB]);
+			for (size_t idx = 0; idx < BLOCKS_PER_SLAB; ++idx) {
+				FreeBlock *block = (FreeBlock *)(slab.get() + idx * size);
+				block->next = cls->free_list;
+				cls->free_list = block;
+			}
+			slabs.push_back(std::move(slab));
+		}
+
+		FreeBlock *block = cls->free_list;
+		cls->free_list = block->next;
+		return block;
+	}
+
+	void deallocate(void *ptr, size_t size) {
+		size = round_size(size);
+		SizeClass *cls = size <= MAX_BLOCK_SIZE ? class_for(size, false) : nullptr;
+		if (cls == nullptr) {
+			::operator delete(ptr);
+			return ;
+		}
+
+		FreeBlock *block = (FreeBlock *)ptr;
+		block->next = cls->remote_free_list.load(std::memory_order_relaxed);
+		while (!cls->remote_free_list.compare_exchange_weak(block->next, block, 
+				std::memory_order_release, std::memory_order_relaxed)) {
+		}
+	}
+
+	inline size_t slab_count() const {
+		return slabs.size();
+	}
+};
+
+/*
+	a standard library compatible allocator which hands out blocks from a SlabPool
+*/
+template<typename T>
+struct SlabAllocator {
+	typedef T value_type;
+
+	SlabPool *pool;
+
+	SlabAllocator(SlabPool *pool) : pool(pool) { }
+
+	template<typename U>
+	SlabAllocator(const SlabAllocator<U>& other) : pool(other.pool) { }
+
+	T *allocate(size_t n) {
+		return (T *)pool->allocate(n * sizeof(T));
+	}
+
+	void deallocate(T *ptr, size_t n) {
+		pool->deallocate(ptr, n * sizeof(T));
+	}
+
+	template<typename U>
+	bool operator==(const SlabAllocator<U>& other) const {
+		return pool == other.pool;
+	}
+
+	template<typename U>
+	bool operator!=(const SlabAllocator<U>& other) const {
+		return pool != other.pool;
+	}
+};
+
 
 template<typename K, typename V>
 class SharedObjectCache {
@@ -83,6 +248,314 @@ public:
 	}
 };
 
+/*
+	a SharedObjectCache split into independently locked shards, keys are hashed
+	onto a shard so that lookups of different keys rarely contend on the same mutex.
+	rather than periodically sweeping the whole map, each insert sweeps a few
+	buckets of its own shard so that the cost of eviction is spread out over time.
+	both the map nodes and the objects themselves (along with their shared_ptr
+	control blocks) are allocated out of a per shard SlabPool
+*/
+template<typename K, typename V>
+class ShardedObjectCache {
+private:
+	static constexpr size_t SHARD_COUNT = 64;
+	static constexpr size_t SWEEP_BUCKETS_PER_PUT = 4;
+
+	typedef std::pair<const K, std::weak_ptr<V>> Entry;
+	typedef std::unordered_map<K, std::weak_ptr<V>, std::hash<K>, std::equal_to<K>, SlabAllocator<Entry>> Map;
+
+	struct Shard {
+		std::mutex lock;
+		SlabPool pool; // must be declared before the map so that it outlives it
+		Map map;
+		size_t sweep_cursor = 0; // bucket at which the next incremental sweep resumes
+		char padding[64]; // keep neighbouring shard locks off of the same cache line
+
+		Shard() : map(16, std::hash<K>(), std::equal_to<K>(), SlabAllocator<Entry>(&pool)) { }
+	};
+
+	std::array<Shard, SHARD_COUNT> shards;
+
+	inline Shard &shard_for(const K& k) {
+		// mix the hash so that sequential keys do not all fall on neighbouring shards in lock step
+		uint64_t h = std::hash<K>()(k);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return shards[h % SHARD_COUNT];
+	}
+
+	// must be called with the shard's lock held
+	static void sweep_some(Shard &shard) {
+		const size_t bucket_count = shard.map.bucket_count();
+		K expired[16];
+		size_t expired_count = 0;
+		for (size_t step = 0; step < SWEEP_BUCKETS_PER_PUT; ++step) {
+			size_t bucket = shard.sweep_cursor++ % bucket_count;
+			for (auto it = shard.map.begin(bucket); it != shard.map.end(bucket); ++it) {
+				if (it->second.expired() && expired_count < 16) {
+					expired[expired_count++] = it->first;
+				}
+			}
+		}
+		for (size_t idx = 0; idx < expired_count; ++idx) {
+			shard.map.erase(expired[idx]);
+		}
+	}
+
+public:
+	// looks up the key, and if it is not present (or has expired) default constructs
+	// a new V from the shard's pool and passes it to init() while still holding the
+	// shard lock, so two callers never build the same object
+	template<typename Init>
+	std::shared_ptr<V> get_or_create(const K& k, Init init) {
+		Shard &shard = shard_for(k);
+		std::lock_guard<std::mutex> g(shard.lock);
+
+		auto ref = shard.map.find(k);
+		if (ref != shard.map.end()) {
+			if (std::shared_ptr<V> v = (*ref).second.lock()) {
+				return v;
+			}
+			std::shared_ptr<V> v = std::allocate_shared<V>(SlabAllocator<V>(&shard.pool));
+			init(*v);
+			(*ref).second = v;
+			return v;
+		}
+
+		std::shared_ptr<V> v = std::allocate_shared<V>(SlabAllocator<V>(&shard.pool));
+		init(*v);
+		shard.map.emplace(k, v);
+		sweep_some(shard);
+		return v;
+	}
+
+	// caches an object that was made elsewhere (so not out of the shard's pool, and 
+	// free to outlive the cache), replacing whatever was cached under the key
+	void put(const K& k, const std::shared_ptr<V>& v) {
+		Shard &shard = shard_for(k);
+		std::lock_guard<std::mutex> g(shard.lock);
+		shard.map[k] = v;
+		sweep_some(shard);
+	}
+
+	std::shared_ptr<V> get(const K& k) {
+		Shard &shard = shard_for(k);
+		std::lock_guard<std::mutex> g(shard.lock);
+
+		auto ref = shard.map.find(k);
+		if (ref != shard.map.end()) {
+			return (*ref).second.lock();
+		}
+		return nullptr;
+	}
+
+	void sweep(bool force) {
+		for (Shard &shard : shards) {
+			std::lock_guard<std::mutex> g(shard.lock);
+			if (!force) {
+				sweep_some(shard);
+				continue ;
+			}
+			for (auto it = shard.map.cbegin(); it != shard.map.cend();) {
+				if ((*it).second.expired()) {
+					shard.map.erase(it++);
+				} else {
+					++it;
+				}
+			}
+		}
+	}
+
+	size_t size() {
+		size_t total = 0;
+		for (Shard &shard : shards) {
+			std::lock_guard<std::mutex> g(shard.lock);
+			total += shard.map.size();
+		}
+		return total;
+	}
+
+	// appends the keys of every object that is still referenced somewhere
+	void live_keys(std::vector<K>& keys) {
+		for (Shard &shard : shards) {
+			std::lock_guard<std::mutex> g(shard.lock);
+			for (auto it = shard.map.cbegin(); it != shard.map.cend(); ++it) {
+				if (!(*it).second.expired()) {
+					keys.push_back((*it).first);
+				}
+			}
+		}
+	}
+};
+
+/*
+	the set of chunks which have been released since they were last written back,
+	split into shards the same way as the chunk cache so that releasing a chunk 
+	only contends with releases of chunks on the same shard
+*/
+class DirtyChunkSet {
+private:
+	static constexpr size_t SHARD_COUNT = 16;
+
+	typedef std::unordered_set<Size, std::hash<Size>, std::equal_to<Size>, SlabAllocator<Size>> Set;
+
+	struct Shard {
+		std::mutex lock;
+		SlabPool pool; // must be declared before the set so that it outlives it
+		Set chunks;
+		char padding[64];
+
+		Shard() : chunks(16, std::hash<Size>(), std::equal_to<Size>(), SlabAllocator<Size>(&pool)) { }
+	};
+
+	std::array<Shard, SHARD_COUNT> shards;
+	std::atomic<uint64_t> count;
+	std::atomic<int64_t> oldest_dirty_ms; // time at which the set last went from empty to non empty
+
+public:
+	DirtyChunkSet() : count(0), oldest_dirty_ms(0) { }
+
+	// returns true if the chunk was not already dirty
+	bool insert(Size chunk_idx, int64_t now_ms) {
+		Shard &shard = shards[chunk_idx % SHARD_COUNT];
+		std::lock_guard<std::mutex> g(shard.lock);
+		if (!shard.chunks.insert(chunk_idx).second) 
+			return false;
+		if (count.fetch_add(1) == 0) {
+			oldest_dirty_ms = now_ms;
+		}
+		return true;
+	}
+
+	// moves every dirty chunk index into chunk_idxs and empties the set
+	void take_all(std::vector<Size>& chunk_idxs) {
+		for (Shard &shard : shards) {
+			std::lock_guard<std::mutex> g(shard.lock);
+			chunk_idxs.insert(chunk_idxs.end(), shard.chunks.begin(), shard.chunks.end());
+			count -= shard.chunks.size();
+			shard.chunks.clear();
+		}
+	}
+
+	inline uint64_t size() const {
+		return count.load();
+	}
+
+	inline int64_t oldest_ms() const {
+		return oldest_dirty_ms.load();
+	}
+};
+
+/*
+	thresholds for the background write back of released chunks. chunks are written 
+	back once the oldest dirty chunk has been dirty for dirty_age_ms, or as soon as 
+	more than dirty_bytes worth of chunks are dirty, whichever comes first
+*/
+struct WritebackConfig {
+	uint64_t dirty_age_ms = 1000;
+	uint64_t dirty_bytes = 4 * 1024 * 1024;
+};
+
+/*
+	settings for punching the space the file system frees out of the backing file, so
+	that a sparse image shrinks back and dead data is never written back. a freed 
+	range waits delay_ms first, which leaves alone space that is reused straight away
+	and lets neighbouring ranges merge. ranges shorter than min_chunks are not worth
+	the call, and at most bytes_per_second are punched (0 for no limit)
+*/
+struct DiscardConfig {
+	bool enabled = false;
+	uint64_t delay_ms = 1000;
+	uint64_t min_chunks = 16;
+	uint64_t bytes_per_second = 256 * 1024 * 1024;
+};
+
+/*
+	settings for a memory mapped disk.
+		hugepages: back an anonymous disk with MAP_HUGETLB (falling back to transparent 
+			huge pages when none are reserved), a file backed disk asks for transparent
+			huge pages with MADV_HUGEPAGE
+		populate: prefault the whole image with MAP_POPULATE when the disk is created
+		access_hints: madvise the kernel about how a file backed disk is used, metadata
+			regions are MADV_RANDOM, runs of chunks loaded in order get MADV_WILLNEED
+			ahead of them, and while most loads are sequential the mapping is switched 
+			to MADV_SEQUENTIAL
+*/
+struct MmapConfig {
+	bool hugepages = false;
+	bool populate = false;
+	bool access_hints = true;
+};
+
+/*
+	spots runs of chunks that are loaded in ascending order. a handful of streams are
+	tracked at once so that interleaved readers each keep their own run. once a stream
+	is long enough it asks for a window of chunks ahead of it to be read in, and the 
+	window doubles every time it is used up, much like the kernel's own readahead.
+
+	loads are also counted in epochs, and the detector reports when the share of 
+	sequential loads crosses over so that the whole mapping can be advised to match
+*/
+class SequentialDetector {
+public:
+	static constexpr size_t STREAM_COUNT = 8;
+	static constexpr Size MIN_RUN = 4; // chunks in order before we read ahead
+	static constexpr Size MIN_WINDOW = 16;
+	static constexpr Size MAX_WINDOW = 1024;
+	static constexpr uint32_t EPOCH_LOADS = 256;
+
+	enum Pattern : uint8_t { PATTERN_UNCHANGED = 0, PATTERN_SEQUENTIAL = 1, PATTERN_RANDOM = 2 };
+
+	struct Hint {
+		Size prefetch_first = 0;
+		Size prefetch_count = 0; // 0 if there is nothing to read ahead
+		Pattern pattern = PATTERN_UNCHANGED;
+	};
+
+	// records a load of chunk_idx. loads that race with another thread's are simply
+	// not counted rather than waiting for the lock
+	Hint access(Size chunk_idx);
+private:
+	struct Stream {
+		Size next = 0; // the chunk we expect next
+		Size run = 0;
+		Size window = MIN_WINDOW;
+		Size prefetched_to = 0; // chunks below this were already asked for
+		uint64_t last_used = 0;
+	};
+
+	std::mutex lock;
+	Stream streams[STREAM_COUNT];
+	uint64_t clock = 0;
+
+	uint32_t epoch_loads = 0;
+	uint32_t epoch_sequential = 0;
+	bool sequential = false;
+};
+
+/*
+	settings for a disk that is served out of a BufferPool rather than mapped into
+	memory, pool_bytes bounds the memory used for cached chunks (the pool keeps a clean
+	copy of each one next to it, so it takes twice that) and io_engine picks
+	how the pool talks to the backing file. with direct_io the pool reads and writes
+	data chunks with O_DIRECT, so they are cached once (in the pool) rather than twice
+	(in the pool and in the page cache), while the chunks registered as metadata with
+	Disk::add_metadata_region still go through the page cache
+*/
+enum IOEngineType : uint8_t {
+	IO_ENGINE_AUTO = 0, // io_uring when the kernel supports it, otherwise posix
+	IO_ENGINE_POSIX = 1,
+	IO_ENGINE_URING = 2,
+};
+
+struct BufferPoolConfig {
+	uint64_t pool_bytes = 64 * 1024 * 1024;
+	IOEngineType io_engine = IO_ENGINE_AUTO;
+	bool direct_io = false; // needs a chunk size that is a multiple of 512 bytes
+};
+
 /*
 	acts as an interface onto the disk as well as a cache for chunks on disk
 	in this way the same chunk can be accessed and modified in multiple places
@@ -95,17 +568,95 @@ private:
 	const Size _chunk_size;
 	const size_t _mempage_size = sysconf(_SC_PAGESIZE); // get the memory page size;
 
-	Byte* data;
-
-	// a mutex which protects access to the disk
-	std::mutex lock;
-
-	// a cache of chunks that are loaded in
-	SharedObjectCache<Size, Chunk> chunk_cache;
-
-	// loops over weak pointers, if any of them are expired, it deletes 
-	// the entries from the unordered map 
-	void sweep_chunk_cache(); 
+	Byte* data = nullptr;
+	size_t mapped_bytes = 0; // the length of the mapping, rounded up for huge pages
+	int fd = -1;
+	int direct_fd = -1; // a second handle on fd opened with O_DIRECT, when asked for
+
+	// set when the disk is read and written through a buffer pool instead of mmap
+	std::unique_ptr<BufferPool> pool;
+
+	// a cache of chunks that are loaded in, sharded so that get_chunk calls from
+	// different threads do not all serialize on one lock
+	ShardedObjectCache<Size, Chunk> chunk_cache;
+
+	// chunks released since they were last written back, these are flushed in batches
+	// by the flusher thread rather than one msync per released chunk
+	bool writeback_enabled = false;
+	WritebackConfig writeback_config; // guarded by flusher_lock
+	std::atomic<uint64_t> dirty_bytes_limit{WritebackConfig().dirty_bytes}; // read by release_chunk without the lock
+	DirtyChunkSet dirty_chunks;
+
+	std::mutex flusher_lock;
+	std::condition_variable flusher_wakeup;
+	std::thread flusher;
+	std::atomic<bool> flusher_started{false}; // lets release_chunk check without taking flusher_lock
+	bool flusher_stop = false;
+
+	// batches of chunks that have been taken out of the dirty set or off of the staged
+	// segments but are not written back yet, sync has to wait for them as it can not
+	// see those chunks any more. guarded by flusher_lock
+	size_t write_backs_in_flight = 0;
+	std::condition_variable write_backs_done;
+
+	void begin_write_back();
+	void end_write_back();
+
+	void start_flusher();
+	void flusher_main();
+
+	// segments that are being filled, their chunks are kept out of the dirty set and 
+	// written back a whole segment at a time. there are only ever a handful, one for 
+	// each place the file system allocates from
+	struct StagedSegment {
+		Size first_chunk = 0;
+		Size count = 0;
+		int64_t written_ms = 0; // when the segment was staged, or last written back
+	};
+	std::mutex staged_lock;
+	std::vector<StagedSegment> staged_segments;
+	std::atomic<size_t> staged_count{0}; // lets release_chunk check without taking staged_lock
+	std::atomic<uint64_t> segment_writes{0};
+	std::atomic<uint64_t> msyncs{0};
+
+	// ranges of chunks waiting to be punched out of the backing file, by first chunk
+	struct PendingDiscard {
+		Size count = 0;
+		int64_t queued_ms = 0; // when the range was last added to
+	};
+	std::atomic<bool> discard_enabled{false};
+	DiscardConfig discard_config; // under discard_lock
+	std::mutex discard_lock;
+	std::mutex punch_lock; // held while a batch is being punched
+	std::map<Size, PendingDiscard> pending_discards;
+	int64_t discard_budget = 0; // bytes the rate limit allows right now
+	int64_t discard_budget_ms = 0; // and when it was last topped up
+	std::atomic<uint64_t> discarded_chunks{0};
+
+	// punches out the ranges that have waited long enough, as many as the rate limit 
+	// allows, and returns how long it is until the next one is due
+	int64_t issue_discards();
+
+	bool is_staged(Size chunk_idx);
+	// writes back the segments that have been staged for at least age_ms (all of them 
+	// if age_ms is 0), returns how long it is until the next one is due
+	int64_t write_staged_segments(int64_t age_ms, int msync_flags);
+
+	// writes back the given chunks, merging them into as few page ranges as possible
+	void write_back_chunks(std::vector<Size>& chunk_idxs, int msync_flags);
+
+	// madvise hints for a file backed mapping, see MmapConfig
+	bool access_hints = false;
+	SequentialDetector access_detector;
+	std::mutex advice_lock;
+	std::vector<std::pair<Size, Size>> random_regions; // first chunk and count, under advice_lock
+	std::atomic<uint64_t> readahead_hints{0};
+	std::atomic<bool> sequential_advice{false};
+
+	// madvise over the pages that hold the chunks, failures are ignored since these 
+	// are only hints
+	void advise(Size first_chunk, Size count, int advice);
+	void note_load(Size chunk_idx);
 public:
 
 	// when you just want a disk use 
@@ -114,18 +665,33 @@ public:
 	// flags: MAP_FILE | MAP_SHARED
 	// a good explanation of these flags can be found here: https://www.gnu.org/software/hurd/glibc/mmap.html
 	Disk(Size size_chunk_ctr, Size chunk_size_ctr, 
-		int flags = MAP_PRIVATE | MAP_ANONYMOUS, int fd = -1) 
-		: _chunk_size(chunk_size_ctr), _size_chunks(size_chunk_ctr) {
-		
-		this->data = (Byte *)mmap(NULL, this->size_bytes(), PROT_READ | PROT_WRITE, flags, fd, 0);
-		if (this->data == NULL) {
-			throw DiskException("failed to create the memory mapped file to back the disk");
-		}
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS, int fd = -1, 
+		const MmapConfig& mmap_config = MmapConfig());
+
+	// a disk backed by the file fd which is read with pread and written with pwrite,
+	// at most pool_config.pool_bytes worth of chunks are held in memory at once
+	Disk(Size size_chunk_ctr, Size chunk_size_ctr, int fd, const BufferPoolConfig& pool_config);
+
+	void zero_fill();
+
+	// marks count chunks starting at first_chunk, stride chunks apart, as holding file
+	// system metadata. these stay in the page cache when the disk uses direct io, and
+	// contiguous regions are advised MADV_RANDOM on a memory mapped disk with access hints
+	void add_metadata_region(Size first_chunk, Size count, Size stride = 1);
+
+	// the number of MADV_WILLNEED hints given ahead of sequential runs
+	inline uint64_t readahead_hint_count() const {
+		return readahead_hints;
+	}
+
+	// whether the mapping is currently advised MADV_SEQUENTIAL
+	inline bool sequential_advised() const {
+		return sequential_advice;
 	}
 
-	void zero_fill() {
-		// zero out the memory mapped file
-		std::memset(this->data, 0, this->size_bytes());
+	// the buffer pool the disk is served from, or nullptr if it is memory mapped
+	inline BufferPool *buffer_pool() {
+		return pool.get();
 	}
 
 	inline const Size size_bytes() const {
@@ -142,8 +708,68 @@ public:
 
 	std::shared_ptr<Chunk> get_chunk(Size chunk_idx);
 
+	// looks up count chunks at once, chunks[i] is set to chunk chunk_idxs[i]. on a buffer 
+	// pool backed disk every chunk that is not already loaded is read in as one batch
+	void get_chunks(const Size *chunk_idxs, size_t count, std::shared_ptr<Chunk> *chunks);
+
+	// starts loading chunks that are expected to be needed soon without handing out 
+	// references to them. a buffer pool reads them in and leaves them unpinned, a 
+	// memory mapped disk asks the kernel to read them ahead with MADV_WILLNEED. 
+	// chunk_idxs is sorted in place
+	void prefetch(Size *chunk_idxs, size_t count);
+
+	// called when the last reference to a chunk is dropped, marks it dirty so that the
+	// flusher thread writes it back
+	void release_chunk(const Chunk& chunk);
+
+	// immediately schedules write back of a single chunk
 	void flush_chunk(const Chunk& chunk);
 
+	// segment writes: while a segment is staged its chunks are left out of the write 
+	// back of released chunks, and the segment, summary chunk and all, is written back
+	// as one range by write_segment once it has filled up. a segment that is staged 
+	// for longer than dirty_age_ms is written back as it stands by the flusher. the 
+	// chunks are read and written in memory as always. does nothing on a disk that has
+	// nowhere to write back to
+	void stage_segment(Size first_chunk, Size count);
+	void write_segment(Size first_chunk);
+
+	inline uint64_t segment_write_count() const {
+		return segment_writes;
+	}
+
+	// how many msync calls write back has made on a memory mapped disk
+	inline uint64_t msync_count() const {
+		return msyncs;
+	}
+
+	// discards: the file system hands over the ranges it frees, which the flusher 
+	// punches out of the backing file in batches (see DiscardConfig). a range must be
+	// taken back with cancel_discard before it is written to again, which also waits
+	// for a batch that is being punched. ranges still waiting when the disk is closed
+	// are left as they are. does nothing on a disk without a backing file
+	void discard(Size first_chunk, Size count);
+	void cancel_discard(Size first_chunk, Size count);
+	void set_discard_config(const DiscardConfig& config);
+
+	inline uint64_t discarded_chunk_count() const {
+		return discarded_chunks;
+	}
+
+	// a durability barrier, when this returns every chunk that was modified before the
+	// call (released or still referenced) has been written to the backing file
+	void sync();
+
+	void set_writeback_config(const WritebackConfig& config);
+
+	inline const WritebackConfig& get_writeback_config() const {
+		return writeback_config;
+	}
+
+	inline uint64_t dirty_chunk_count() const {
+		return dirty_chunks.size();
+	}
+
 	void try_close();
 
 	~Disk();
@@ -152,18 +778,44 @@ public:
 /*
 	A utility class that implements a bitmap ontop of a range of chunks
 */
+/*
+	a bitmap kept in chunks of the disk. on top of the bits we keep a summary tree 
+	in memory: every block of SUMMARY_BLOCK_BITS bits has a Summary of the unset bits
+	in it, and every level above summarises SUMMARY_FANOUT nodes of the one below up 
+	to a single root. searches skip whole subtrees that can not hold what they are 
+	after, so finding a free run costs O(log n) rather than a scan of the bitmap.
+	set and clr only mark the block dirty, the summaries are brought up to date by
+	the next search
+*/
 struct DiskBitMap {
 	std::mutex block;
 
 	Disk *disk;
 	Size size_in_bits;
-	std::vector<std::shared_ptr<Chunk>> chunks;
+	Size chunk_start = 0;
 	Size last_search_idx = 0;
 	Size disk_chunk_size = 0;
-	
-	DiskBitMap(Disk *disk, Size chunk_start, Size size_in_bits);
 
-	~DiskBitMap();
+	static constexpr Size SUMMARY_BLOCK_BITS = 4096;
+	static constexpr Size SUMMARY_FANOUT = 64;
+	static constexpr Size DEFAULT_RESIDENT_CHUNKS = 64;
+
+	struct Summary {
+		Size bits = 0; // covered by the node, bits past the end of the map count as set
+		Size free = 0; // unset bits
+		Size prefix = 0; // unset bits at the start of the node
+		Size suffix = 0; // and at its end
+		Size longest = 0; // the longest run of unset bits
+		bool known = false; // every block under the node has been looked at
+	};
+	
+	/*
+		the chunks of the bitmap are loaded the first time they are touched, and at most
+		max_resident_chunks of them are kept loaded (the one loaded longest ago makes
+		room, it is written back like any other chunk). a chunk is only locked while the
+		bitmap reads or writes it, so nothing is loaded or locked until the bitmap is used
+	*/
+	DiskBitMap(Disk *disk, Size chunk_start, Size size_in_bits, Size max_resident_chunks = DEFAULT_RESIDENT_CHUNKS);
 
 	void clear_all();
 
@@ -176,69 +828,168 @@ struct DiskBitMap {
 		return this->size_bytes() / disk_chunk_size + 1;
 	}
 
-	inline const Byte get_byte_for_idx(Size idx) const {
-		uint64_t byte_idx = idx / 8;
-		Byte *data = this->chunks[byte_idx / disk_chunk_size]->data;
-		return data[byte_idx % disk_chunk_size];
-	}
+	// how many chunks are loaded right now, and how many times one has been loaded
+	Size resident_chunks();
+	Size chunk_loads();
 
-	inline Byte &get_byte_for_idx(Size idx) {
-		uint64_t byte_idx = idx / 8;
-		Byte *data = this->chunks[byte_idx / disk_chunk_size]->data;
-		return data[byte_idx % disk_chunk_size];
-	}
-
-	inline bool get(Size idx) const {
-		if (idx >= size_in_bits) {
-			throw DiskException("BitMap index out of range");
-		}
-		Byte byte = get_byte_for_idx(idx);
-		return byte & (1 << (idx % 8));
-	}
+	Byte get_byte_for_idx(Size idx);
+	// the 64 bits starting at idx, which must be a multiple of 64. bit i of the word is
+	// bit i % 8 of byte i / 8, as with get_byte_for_idx on a little endian machine
+	uint64_t get_word_for_idx(Size idx);
 
+	bool get(Size idx);
 	// allows setting 'out of bounds'
-	inline void set_oob(Size idx) {
-		Byte& byte = get_byte_for_idx(idx);
-		byte |= (1 << (idx % 8));
-	}
-
-	inline void set(Size idx) {
-		if (idx >= size_in_bits) {
-			throw DiskException("BitMap index out of range");
-		}
-		Byte& byte = get_byte_for_idx(idx);
-		byte |= (1 << (idx % 8));
-	}
-
-	inline void clr(Size idx) {
-		if (idx >= size_in_bits) {
-			throw DiskException("BitMap index out of range");
-		}
-		Byte& byte = get_byte_for_idx(idx);
-		byte &= ~(1 << (idx % 8));
-	}
+	void set_oob(Size idx);
+	void set(Size idx);
+	void clr(Size idx);
 
 	struct BitRange {
 		Size start_idx = 0;
 		Size bit_count = 0;
 
 		void set_range(DiskBitMap &map) {
-			for (Size idx = start_idx; idx < start_idx + bit_count; ++idx) {
-				map.set(idx);
-			}
+			map.set_range(start_idx, bit_count);
 		}
 
 		void clr_range(DiskBitMap &map) {
-			for (Size idx = start_idx; idx < start_idx + bit_count; ++idx) {
-				map.clr(idx);
-			}
+			map.clr_range(start_idx, bit_count);
 		}
 	};
 
-	static std::array<BitRange, 256> find_unset_cache;
-	static uint64_t find_last_byte_idx;
-	
+	// set or clear bit_count bits from start_idx on, a byte or a whole run of bytes
+	// at a time. throws if any of them is out of range, before changing anything
+	void set_range(Size start_idx, Size bit_count);
+	void clr_range(Size start_idx, Size bit_count);
+
+	// the same for a batch of ranges, which are all checked and then applied under a
+	// single acquisition of the bitmap's lock
+	void set_ranges(const BitRange *ranges, size_t count);
+	void clr_ranges(const BitRange *ranges, size_t count);
+
+	// finds the first unset bit at or after where the last search left off (wrapping
+	// around to the start if there is none) and returns the run of unset bits that 
+	// starts there, at most length long. bit_count is 0 if every bit is set
 	BitRange find_unset_bits(Size length);
+
+	// the same, but searching from search_idx (which is moved past the run) rather 
+	// than from where the last search left off. the run is set before anyone else can
+	// get at the bitmap, so callers searching from different places never collide
+	BitRange claim_unset_bits(Size length, Size &search_idx);
+
+	// finds the first run of at least length unset bits that starts at or after where
+	// the last search left off, wrapping around to the start. bit_count is length, or
+	// 0 if there is no such run anywhere in the bitmap
+	BitRange find_unset_run(Size length);
+
+	// the number of unset bits and the longest run of them, from the summary. the
+	// first call loads every chunk that has not been looked at yet
+	Size count_unset_bits();
+	Size longest_unset_run();
+
+	// every run of unset bits in [start_idx, start_idx + bit_count), in order, found a
+	// word at a time under a single acquisition of the lock
+	std::vector<BitRange> unset_runs(Size start_idx, Size bit_count);
+
+	// the number of set bits in [start_idx, start_idx + bit_count), a word at a time
+	Size count_set_bits(Size start_idx, Size bit_count);
+
+	/*
+		the searches skip over words that can not hold what they are looking for with 
+		a scan kernel, which is picked when the program starts from what the cpu 
+		supports. set_scan_kernel is there for benchmarks, it returns false if the cpu
+		can not run the kernel, and must not be called while bitmaps are being searched
+	*/
+	enum ScanKernel : uint8_t { SCAN_SCALAR = 0, SCAN_AVX2 = 1 };
+	static ScanKernel get_scan_kernel();
+	static bool set_scan_kernel(ScanKernel kernel);
+private:
+	std::vector<std::shared_ptr<Chunk>> chunks; // nullptr until the chunk is loaded
+	std::vector<Size> resident; // a ring of the loaded chunks, the oldest at resident_head
+	Size resident_head = 0;
+	Size max_resident_chunks;
+	Size loads = 0;
+
+	// loads the chunk if it is not already. the lock must be held
+	std::shared_ptr<Chunk> load_chunk(Size chunk_idx);
+
+	// the bytes of the bitmap, through whichever chunk they are in. the cursor keeps 
+	// the last chunk it was on loaded and locked, so that walking the bitmap takes each
+	// lock once
+	struct Cursor {
+		DiskBitMap &map;
+		std::shared_ptr<Chunk> chunk;
+		Size chunk_idx = 0;
+
+		Cursor(DiskBitMap &map) : map(map) {}
+		~Cursor() {
+			this->release();
+		}
+
+		void release() {
+			if (this->chunk != nullptr) {
+				this->chunk->lock.unlock();
+				this->chunk = nullptr;
+			}
+		}
+
+		// byte_idx and whatever follows it up to the end of its chunk
+		inline Byte *bytes(Size byte_idx) {
+			const Size idx = byte_idx / map.disk_chunk_size;
+			if (this->chunk == nullptr || idx != this->chunk_idx) {
+				this->release();
+				this->chunk = map.load_chunk(idx);
+				this->chunk->lock.lock();
+				this->chunk_idx = idx;
+			}
+			return this->chunk->data + byte_idx % map.disk_chunk_size;
+		}
+
+		inline Byte &byte(Size idx) {
+			return *this->bytes(idx / 8);
+		}
+
+		uint64_t word(Size idx);
+	};
+
+	std::vector<std::vector<Summary>> summary; // summary[0] has a node per block, the last level is the root
+	// per block, 1 if the block has changed and 2 if only its parents are out of date
+	std::vector<uint8_t> summary_dirty;
+	std::vector<Size> dirty_blocks;
+
+	inline void mark_dirty(Size idx, uint8_t how = 1) {
+		const Size block = idx / SUMMARY_BLOCK_BITS;
+		if (!summary_dirty[block]) 
+			dirty_blocks.push_back(block);
+		if (summary_dirty[block] != 1) 
+			summary_dirty[block] = how;
+	}
+
+	void check_ranges(const BitRange *ranges, size_t count) const;
+	// assumes the range has been checked, and that the lock is held
+	void apply_range(Cursor &cursor, Size start_idx, Size bit_count, bool value);
+
+	// lays out the summary without looking at any block (so every node is unknown), 
+	// and brings the dirty ones up to date
+	void build_summary();
+	void refresh_summary();
+	// looks at every block that has not been yet, which loads the whole bitmap
+	void summarise_all();
+	Summary summarise_block(Cursor &cursor, Size block);
+
+	BitRange find_unset_bits(Cursor &cursor, Size length, Size &search_idx);
+
+	// the first bit at or after from that starts a run of at least length unset bits,
+	// size_in_bits if there is none. running is the run of unset bits that ends where
+	// the node starts
+	Size find_run(Cursor &cursor, Size from, Size length);
+	bool find_run(Cursor &cursor, size_t level, Size node, Size from, Size length, Size &running, Size &found);
+	bool find_run_in_block(Cursor &cursor, Size block, Size from, Size length, Size &running, Size &found);
+
+	// the first bit in [from, to) that is set (or unset), to if there is none
+	Size find_bit(Cursor &cursor, Size from, Size to, bool set);
+	// the number of words from the word at idx on that all equal skip, stopping at the
+	// end of the chunk the word is in or at bit to
+	Size skip_words(Cursor &cursor, Size idx, Size to, uint64_t skip);
 };
 
 
@@ -1,4 +1,5 @@
 #include <bitset>
+#include <algorithm>
 #include <array>
 #include <vector>
 #include <memory>
@@ -14,8 +15,38 @@ using Size = uint64_t;
 
 const uint64_t INode::INDIRECT_TABLE_SIZES[4] = {DIRECT_ADDRESS_COUNT, INDIRECT_ADDRESS_COUNT, DOUBLE_INDIRECT_ADDRESS_COUNT, TRIPPLE_INDIRECT_ADDRESS_COUNT};
 
+size_t INode::get_chunk_batch(uint64_t starting_offset, uint64_t n, bool createIfNotExists, std::shared_ptr<Chunk> *chunks) {
+    const uint64_t chunk_size = this->superblock->disk_chunk_size;
+    const uint64_t first_chunk = starting_offset / chunk_size;
+    uint64_t count = (starting_offset + n - 1) / chunk_size - first_chunk + 1;
+    if (count > IO_BATCH_CHUNKS) {
+        count = IO_BATCH_CHUNKS;
+    }
+
+    // resolve where every chunk in the batch lives first, then hand the whole batch 
+    // to the disk so that it can load all of them at once
+    Size chunk_idxs[IO_BATCH_CHUNKS];
+    bool is_hole[IO_BATCH_CHUNKS];
+    std::shared_ptr<Chunk> loaded[IO_BATCH_CHUNKS];
+    size_t present = 0;
+    for (uint64_t idx = 0; idx < count; ++idx) {
+        Size chunk_idx = this->resolve_chunk_idx(first_chunk + idx, createIfNotExists);
+        is_hole[idx] = chunk_idx == 0;
+        if (chunk_idx != 0) {
+            chunk_idxs[present++] = chunk_idx;
+        }
+    }
+    this->superblock->disk->get_chunks(chunk_idxs, present, loaded);
+
+    size_t next = 0;
+    for (uint64_t idx = 0; idx < count; ++idx) {
+        chunks[idx] = is_hole[idx] ? nullptr : std::move(loaded[next++]);
+    }
+    return count;
+}
+
 uint64_t INode::read(uint64_t starting_offset, char *buf, uint64_t bytes_to_write) {
-	const uint64_t chunk_size = this->superblock->disk_chunk_size;
+    const uint64_t chunk_size = this->superblock->disk_chunk_size;
     int64_t n = bytes_to_write;
     uint64_t bytes_written = bytes_to_write;
 
@@ -26,57 +57,37 @@ uint64_t INode::read(uint64_t starting_offset, char *buf, uint64_t bytes_to_writ
 
         bytes_to_write = this->data.file_size - starting_offset;
     }
-    
-    // room to write for the first chunk
-    const uint64_t room_first_chunk = chunk_size - starting_offset % chunk_size;
-    uint64_t bytes_write_first_chunk = room_first_chunk;
-    if (n < room_first_chunk) {
-        bytes_write_first_chunk = n;
-    }
 
-    {
-        std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, false);
-        if (chunk == nullptr) {
-            std::memset(buf, 0, bytes_write_first_chunk);
-        } else {
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(buf, chunk->data + starting_offset % chunk_size, bytes_write_first_chunk);
-        }
-        
-        buf += bytes_write_first_chunk;
-        n -= bytes_write_first_chunk;
+    // a read that stays within one chunk reports the bytes up to the end of the file,
+    // anything longer reports the full length with the tail read back as zeros
+    if (n <= chunk_size - starting_offset % chunk_size) {
+        bytes_written = bytes_to_write;
     }
-    
 
-    if (n == 0) { // early return if we wrote less than a chunk
-        return bytes_to_write;
+    // let readahead see the read before we block on loading it, so that the next 
+    // window is already being fetched while we copy this one out
+    if (this->superblock->readahead != nullptr) {
+        this->superblock->readahead->on_read(*this, starting_offset, bytes_to_write);
     }
 
-    // fix the starting offset
-    starting_offset += bytes_write_first_chunk;
-    assert(starting_offset % chunk_size == 0);
+    std::shared_ptr<Chunk> chunks[IO_BATCH_CHUNKS];
+    while (n > 0) {
+        const size_t count = this->get_chunk_batch(starting_offset, n, false, chunks);
 
-    while (n > chunk_size) {
-        std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, false);
-        if (chunk == nullptr) {
-            std::memset(buf, 0, chunk_size);
-        } else {
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(buf, chunk->data, chunk_size);
-        }
+        for (size_t idx = 0; idx < count; ++idx) {
+            std::shared_ptr<Chunk>& chunk = chunks[idx];
+            const uint64_t offset_in_chunk = starting_offset % chunk_size;
+            const uint64_t length = std::min<uint64_t>(chunk_size - offset_in_chunk, n);
+            if (chunk == nullptr) {
+                std::memset(buf, 0, length);
+            } else {
+                std::lock_guard<ChunkLock> g(chunk->lock);
+                std::memcpy(buf, chunk->data + offset_in_chunk, length);
+            }
 
-        buf += chunk_size;
-        n -= chunk_size;
-        starting_offset += chunk_size;
-    }
-    
-    {
-        std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, false);
-        if (chunk == nullptr) {
-            std::memset(buf, 0, n);
-        } else {
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(buf, chunk->data, n);
+            buf += length;
+            n -= length;
+            starting_offset += length;
         }
     }
 
@@ -84,50 +95,32 @@ uint64_t INode::read(uint64_t starting_offset, char *buf, uint64_t bytes_to_writ
 }
 
 uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_to_write) {
+    // the write fills in the mappings it allocates as it goes
+    this->invalidate_block_map();
+
     const uint64_t original_starting_offset = starting_offset;
     const uint64_t chunk_size = this->superblock->disk_chunk_size;
     int64_t n = bytes_to_write;
     try {
-        // room to write for the first chunk
-        const uint64_t room_first_chunk = chunk_size - starting_offset % chunk_size;
-        uint64_t bytes_write_first_chunk = room_first_chunk;
-        if (n < room_first_chunk) {
-            bytes_write_first_chunk = n;
-        }
+        this->allocate_range(starting_offset, bytes_to_write);
+
+        std::shared_ptr<Chunk> chunks[IO_BATCH_CHUNKS];
+        while (n > 0) {
+            const size_t count = this->get_chunk_batch(starting_offset, n, true, chunks);
+
+            for (size_t idx = 0; idx < count; ++idx) {
+                std::shared_ptr<Chunk>& chunk = chunks[idx];
+                const uint64_t offset_in_chunk = starting_offset % chunk_size;
+                const uint64_t length = std::min<uint64_t>(chunk_size - offset_in_chunk, n);
+                {
+                    std::lock_guard<ChunkLock> g(chunk->lock);
+                    std::memcpy(chunk->data + offset_in_chunk, buf, length);
+                }
 
-        {
-            std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, true);
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(chunk->data + (starting_offset % chunk_size), buf, bytes_write_first_chunk);
-            buf += bytes_write_first_chunk;
-            n -= bytes_write_first_chunk;
-        }
-        
-        if (n == 0) { // early return if we wrote less than a chunk
-            // make sure the filesize at the end is correct no matter what happens
-            if (original_starting_offset + bytes_to_write > this->data.file_size) {
-                this->data.file_size = original_starting_offset + bytes_to_write;
+                buf += length;
+                n -= length;
+                starting_offset += length;
             }
-            return bytes_to_write;
-        }
-
-        // fix the starting offset
-        starting_offset += bytes_write_first_chunk;
-        assert(starting_offset % chunk_size == 0);
-
-        while (n > chunk_size) {
-            std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, true);
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(chunk->data, buf, chunk_size);
-            buf += chunk_size;
-            n -= chunk_size;
-            starting_offset += chunk_size;
-        }
-        
-        {
-            std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, true);
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(chunk->data, buf, n);
         }
     } catch (const FileSystemException& e) {
         // make sure the filesize at the end is correct no matter what happens
@@ -145,8 +138,131 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
     return bytes_to_write;
 }
 
+void INode::allocate_range(uint64_t starting_offset, uint64_t bytes) {
+    const uint64_t chunk_size = this->superblock->disk_chunk_size;
+    if (bytes == 0) 
+        return ;
+    const uint64_t end = starting_offset + bytes;
+    const uint64_t end_chunk = (end - 1) / chunk_size + 1;
+    // holes inside the file are left to the write, past the end of it is where a 
+    // large write finds most of its chunks missing
+    uint64_t chunk_number = std::max(starting_offset / chunk_size, this->data.file_size / chunk_size);
+    if (end_chunk < chunk_number + 2) 
+        return ;
+
+    try {
+        while (chunk_number < end_chunk) {
+            if (this->resolve_chunk_idx(chunk_number, false) != 0) {
+                chunk_number++;
+                continue ;
+            }
+            uint64_t hole_end = chunk_number + 1;
+            while (hole_end < end_chunk && this->resolve_chunk_idx(hole_end, false) == 0) 
+                hole_end++;
+
+            while (chunk_number < hole_end) {
+                const DiskBitMap::BitRange run = this->superblock->allocate_chunk_batch(inode_table_idx, 
+                    chunk_number, hole_end - chunk_number, &this->stream);
+                if (this->data.mapping == MAPPING_EXTENTS) {
+                    Extent extent;
+                    extent.logical = chunk_number;
+                    extent.physical = run.start_idx;
+                    extent.length = run.bit_count;
+                    this->extent_insert(extent);
+                } else {
+                    for (uint64_t idx = 0; idx < run.bit_count; ++idx) 
+                        this->walk_chunk_idx(chunk_number + idx, true, run.start_idx + idx);
+                }
+
+                // only the chunks at either end of the write can be written in part
+                for (uint64_t idx = 0; idx < run.bit_count; ++idx) {
+                    const uint64_t logical = chunk_number + idx;
+                    if ((logical == starting_offset / chunk_size && starting_offset % chunk_size != 0) || 
+                            (logical == end_chunk - 1 && end % chunk_size != 0)) {
+                        std::shared_ptr<Chunk> chunk = this->superblock->disk->get_chunk(run.start_idx + idx);
+                        std::memset((void *)chunk->data, 0, chunk->size_bytes);
+                    }
+                }
+                chunk_number += run.bit_count;
+            }
+        }
+    } catch (const FileSystemException &e) {
+        // out of space, the write runs into it again at the first chunk that was not 
+        // allocated, after it has filled in the ones before it
+    }
+}
+
 std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool createIfNotExists) {
+    const uint64_t chunk_idx = this->resolve_chunk_idx(chunk_number, createIfNotExists);
+    if (chunk_idx == 0) {
+        return nullptr;
+    }
+    return superblock->disk->get_chunk(chunk_idx);
+}
+
+constexpr size_t INode::BlockMapCache::LEAF_SLOTS;
+
+void INode::invalidate_block_map() {
+    if (this->block_map == nullptr) 
+        return ;
+    for (BlockMapCache::Leaf &leaf : this->block_map->leaves) {
+        leaf.addresses.clear();
+    }
+    this->block_map->extent = Extent();
+}
+
+uint64_t INode::resolve_chunk_idx(uint64_t chunk_number, bool createIfNotExists) {
+    if (this->data.mapping == MAPPING_EXTENTS) {
+        if (this->block_map == nullptr) {
+            this->block_map = std::unique_ptr<BlockMapCache>(new BlockMapCache);
+        }
+        const Extent &extent = this->block_map->extent;
+        if (chunk_number >= extent.logical && chunk_number - extent.logical < extent.length) {
+            this->block_map->hits++;
+            return extent.physical + chunk_number - extent.logical;
+        }
+
+        this->block_map->walks++;
+        const uint64_t chunk_idx = this->extent_lookup(chunk_number);
+        if (chunk_idx == 0 && createIfNotExists) {
+            return this->extent_alloc(chunk_number);
+        }
+        return chunk_idx;
+    }
+
+    if (chunk_number < DIRECT_ADDRESS_COUNT && (data.addresses[chunk_number] != 0 || !createIfNotExists)) {
+        return data.addresses[chunk_number];
+    }
+
+    if (this->block_map == nullptr) {
+        this->block_map = std::unique_ptr<BlockMapCache>(new BlockMapCache);
+    }
+    BlockMapCache &cache = *this->block_map;
+
+    // every last level table maps a run of chunks_per_table chunks, which are 
+    // numbered from the end of the direct addresses
+    const uint64_t chunks_per_table = superblock->disk_chunk_size / sizeof(uint64_t);
+    if (chunk_number >= DIRECT_ADDRESS_COUNT) {
+        const uint64_t table = (chunk_number - DIRECT_ADDRESS_COUNT) / chunks_per_table;
+        const BlockMapCache::Leaf &leaf = cache.leaves[table % BlockMapCache::LEAF_SLOTS];
+        if (!leaf.addresses.empty() && chunk_number >= leaf.first && chunk_number - leaf.first < leaf.addresses.size()) {
+            const uint64_t chunk_idx = leaf.addresses[chunk_number - leaf.first];
+            if (chunk_idx != 0) {
+                cache.hits++;
+                return chunk_idx;
+            }
+        }
+    }
+
+    // either the table has not been walked to yet or this is a hole, which the walk
+    // allocates if asked to
+    cache.walks++;
+    return this->walk_chunk_idx(chunk_number, createIfNotExists);
+}
+
+uint64_t INode::walk_chunk_idx(uint64_t chunk_number, bool createIfNotExists, uint64_t physical) {
     const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    const uint64_t logical_chunk_number = chunk_number;
     uint64_t indirect_address_count = 1;
 
 #ifdef DEBUG
@@ -176,10 +292,17 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
 #endif
             if (next_chunk_loc == 0){
                 if (!createIfNotExists) {
-                    return nullptr;
+                    return 0;
+                }
+                if (indirection == 0 && physical != 0) {
+                    indirect_table[indirect_table_idx] = physical;
+                    return physical;
                 }
 
-                std::shared_ptr<Chunk> newChunk = this->superblock->allocate_chunk(inode_table_idx);
+                // a table (or the data chunk when indirection is 0), mapping from the first
+                // chunk of the entry on
+                const ChunkPosition position(logical_chunk_number - chunk_number % indirect_address_count, indirection);
+                std::shared_ptr<Chunk> newChunk = this->superblock->allocate_chunk(inode_table_idx, position, &this->stream);
 #ifdef DEBUG 
                 fprintf(stdout, "next_chunk_loc was 0, so we created new "
                     "chunk id %zu/%llu and placed it in the table\n", 
@@ -195,6 +318,10 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
 #endif
             }
 
+            if (indirection == 0) {
+                return next_chunk_loc;
+            }
+
 #ifdef DEBUG
             fprintf(stdout, "chasing chunk through the indirection table:\n");
 #endif 
@@ -210,6 +337,7 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
                 uint64_t *lookup_table = (uint64_t *)chunk->data;
                 next_chunk_loc = lookup_table[chunk_number / indirect_address_count];
 
+
 #ifdef DEBUG 
                 fprintf(stdout, "\tfound next_chunk_loc %llu in table at index %llu\n"
                     "\t\tside note: indirect address count is %llu\n", 
@@ -220,31 +348,49 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
 
                 if (next_chunk_loc == 0) {
                     if (!createIfNotExists) {
-                        return nullptr;
+                        return 0;
                     }
 
-                    std::shared_ptr<Chunk> newChunk = this->superblock->allocate_chunk(inode_table_idx);
-                    std::memset((void *)newChunk->data, 0, newChunk->size_bytes);
-                    next_chunk_loc = newChunk->chunk_idx;
-                    lookup_table[chunk_number / indirect_address_count] = newChunk->chunk_idx;
+                    if (indirection == 1 && physical != 0) {
+                        next_chunk_loc = physical;
+                    } else {
+                        const ChunkPosition position(logical_chunk_number - chunk_number % indirect_address_count, indirection - 1);
+                        std::shared_ptr<Chunk> newChunk = this->superblock->allocate_chunk(inode_table_idx, position, &this->stream);
+                        std::memset((void *)newChunk->data, 0, newChunk->size_bytes);
+                        next_chunk_loc = newChunk->chunk_idx;
+                    }
+                    lookup_table[chunk_number / indirect_address_count] = next_chunk_loc;
 #ifdef DEBUG 
-                    fprintf(stdout, "\tnext_chunk_loc was 0, so we created new "
-                        "chunk id %zu/%llu and placed it in the table\n", 
-                        newChunk->chunk_idx, this->superblock->disk->size_chunks());
+                    fprintf(stdout, "\tnext_chunk_loc was 0, so we placed "
+                        "chunk id %llu/%llu in the table\n", 
+                        next_chunk_loc, this->superblock->disk->size_chunks());
 #endif 
                 }
 
-                chunk = superblock->disk->get_chunk(next_chunk_loc);
-                chunk_number %= indirect_address_count;
+                if (indirect_address_count == 1 && this->block_map != nullptr) {
+                    // this is the last table, keep a copy of it for the chunks either side of us
+                    const uint64_t first = logical_chunk_number - chunk_number;
+                    const uint64_t table = (first - DIRECT_ADDRESS_COUNT) / num_chunk_address_per_chunk;
+                    BlockMapCache::Leaf &leaf = this->block_map->leaves[table % BlockMapCache::LEAF_SLOTS];
+                    leaf.first = first;
+                    leaf.addresses.assign(lookup_table, lookup_table + num_chunk_address_per_chunk);
+                }
 
+                chunk_number %= indirect_address_count;
                 indirection--;
+
+                if (indirection == 0) {
+                    // the last table points at the data chunk itself, which the caller loads
+                    break ;
+                }
+                chunk = superblock->disk->get_chunk(next_chunk_loc);
             }
 
 #ifdef DEBUG 
-            fprintf(stdout, "found chunk with id %zu, parent disk %llx\n", chunk->chunk_idx, (unsigned long long)chunk->parent);
+            fprintf(stdout, "found chunk with id %llu\n", next_chunk_loc);
 #endif 
 
-            return chunk;
+            return next_chunk_loc;
         }
         chunk_number -= (indirect_address_count * INDIRECT_TABLE_SIZES[indirection]);
         indirect_table += INDIRECT_TABLE_SIZES[indirection];
@@ -255,20 +401,532 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
         fprintf(stdout, "\tERROR! THIS SHOULD NEVER HAPPEN. INODE INDIRECTION TABLE RAN OUT OF SPACE. TELL A PROGRAMMER\n");
         throw FileSystemException("INode indirection table ran out of space");
     }
-    return nullptr;
+    return 0;
+}
+
+/*
+    EXTENT TREE
+*/
+
+constexpr uint8_t INode::MAPPING_BLOCKS;
+constexpr uint8_t INode::MAPPING_EXTENTS;
+
+static_assert(sizeof(INode::ExtentHeader) == sizeof(uint64_t), "the root header takes the first address of the inode");
+
+struct INode::ExtentNode {
+    ExtentHeader *header = nullptr;
+    Byte *entries = nullptr;
+    size_t bytes = 0; // of room for entries
+    std::shared_ptr<Chunk> chunk; // nullptr for the root
+
+    template <typename Entry>
+    Entry *at() {
+        return (Entry *)entries;
+    }
+
+    template <typename Entry>
+    size_t capacity() const {
+        return bytes / sizeof(Entry);
+    }
+};
+
+// the position of the last entry that starts at or before logical, count if there is none
+template <typename Entry>
+static size_t find_extent_entry(const Entry *entries, size_t count, uint64_t logical) {
+    const Entry *next = std::upper_bound(entries, entries + count, logical, 
+        [](uint64_t logical, const Entry &entry) { return logical < entry.logical; });
+    return next == entries ? count : next - entries - 1;
+}
+
+INode::ExtentNode INode::extent_root() {
+    ExtentNode node;
+    node.header = (ExtentHeader *)this->data.addresses;
+    node.entries = (Byte *)(this->data.addresses + 1);
+    node.bytes = sizeof(this->data.addresses) - sizeof(ExtentHeader);
+    return node;
+}
+
+INode::ExtentNode INode::extent_node(std::shared_ptr<Chunk> chunk) {
+    ExtentNode node;
+    node.header = (ExtentHeader *)chunk->data;
+    node.entries = chunk->data + sizeof(ExtentHeader);
+    node.bytes = chunk->size_bytes - sizeof(ExtentHeader);
+    node.chunk = std::move(chunk);
+    return node;
+}
+
+void INode::set_mapping(uint8_t mapping) {
+    if (mapping != MAPPING_BLOCKS && mapping != MAPPING_EXTENTS) {
+        throw FileSystemException("Invalid INode mapping");
+    }
+    for (uint64_t address : this->data.addresses) {
+        if (address != 0) {
+            throw FileSystemException("The mapping of an INode can only change while it has no chunks");
+        }
+    }
+    this->invalidate_block_map();
+    this->data.mapping = mapping;
+}
+
+uint64_t INode::extent_lookup(uint64_t chunk_number) {
+    ExtentNode node = this->extent_root();
+    while (node.header->depth > 0) {
+        const ExtentIndex *indexes = node.at<ExtentIndex>();
+        const size_t idx = find_extent_entry(indexes, node.header->count, chunk_number);
+        if (idx == node.header->count) {
+            return 0;
+        }
+        node = this->extent_node(superblock->disk->get_chunk(indexes[idx].child));
+    }
+
+    const Extent *extents = node.at<Extent>();
+    const size_t idx = find_extent_entry(extents, node.header->count, chunk_number);
+    if (idx == node.header->count || chunk_number - extents[idx].logical >= extents[idx].length) {
+        return 0;
+    }
+    if (this->block_map != nullptr) {
+        this->block_map->extent = extents[idx];
+    }
+    return extents[idx].physical + chunk_number - extents[idx].logical;
+}
+
+uint64_t INode::extent_alloc(uint64_t chunk_number) {
+    std::shared_ptr<Chunk> chunk = this->superblock->allocate_chunk(inode_table_idx, ChunkPosition(chunk_number, 0), &this->stream);
+    std::memset((void *)chunk->data, 0, chunk->size_bytes);
+
+    Extent extent;
+    extent.logical = chunk_number;
+    extent.physical = chunk->chunk_idx;
+    extent.length = 1;
+    this->extent_insert(extent);
+    return extent.physical;
+}
+
+void INode::extent_insert(const Extent &extent) {
+    ExtentNode root = this->extent_root();
+    const size_t capacity = root.header->depth == 0 ? root.capacity<Extent>() : root.capacity<ExtentIndex>();
+    if (root.header->count == capacity) {
+        // the root can not be split, so when it is full it moves down into a chunk of
+        // its own and the tree grows by a level. the root then has room for whatever
+        // the insert below splits off
+        const ChunkPosition position(*(uint64_t *)root.entries, root.header->depth + 1);
+        std::shared_ptr<Chunk> chunk = this->superblock->allocate_chunk(inode_table_idx, position, &this->stream);
+        std::memset((void *)chunk->data, 0, chunk->size_bytes);
+        ExtentNode child = this->extent_node(chunk);
+        *child.header = *root.header;
+        std::memcpy(child.entries, root.entries, root.bytes);
+
+        ExtentIndex index;
+        index.logical = *(uint64_t *)root.entries; // both kinds of entry start with it
+        index.child = chunk->chunk_idx;
+        std::memset(root.entries, 0, root.bytes);
+        root.header->depth++;
+        root.header->count = 1;
+        root.at<ExtentIndex>()[0] = index;
+    }
+
+    ExtentIndex split;
+    const bool was_split = this->extent_insert(root, extent, &split);
+    assert(!was_split);
+}
+
+bool INode::extent_insert(ExtentNode &node, const Extent &extent, ExtentIndex *split) {
+    const size_t count = node.header->count;
+    if (node.header->depth > 0) {
+        ExtentIndex *indexes = node.at<ExtentIndex>();
+        size_t idx = find_extent_entry(indexes, count, extent.logical);
+        if (idx == count) {
+            // it comes before anything the tree maps so far, the first child takes it
+            idx = 0;
+            indexes[0].logical = extent.logical;
+        }
+
+        ExtentNode child = this->extent_node(superblock->disk->get_chunk(indexes[idx].child));
+        ExtentIndex child_split;
+        if (!this->extent_insert(child, extent, &child_split)) {
+            return false;
+        }
+        return this->extent_insert_entry(node, idx + 1, child_split, split);
+    }
+
+    // most of the time the chunk lands right after the one before it, on disk as well 
+    // as in the file, and the run just gets longer
+    Extent *extents = node.at<Extent>();
+    const size_t next = std::upper_bound(extents, extents + count, extent.logical, 
+        [](uint64_t logical, const Extent &entry) { return logical < entry.logical; }) - extents;
+    if (next > 0) {
+        Extent &prev = extents[next - 1];
+        if (prev.logical + prev.length == extent.logical && prev.physical + prev.length == extent.physical) {
+            prev.length += extent.length;
+            if (next < count && prev.logical + prev.length == extents[next].logical && 
+                prev.physical + prev.length == extents[next].physical) {
+                // it filled the gap between two runs
+                prev.length += extents[next].length;
+                std::memmove(extents + next, extents + next + 1, (count - next - 1) * sizeof(Extent));
+                node.header->count--;
+            }
+            return false;
+        }
+    }
+    if (next < count && extent.logical + extent.length == extents[next].logical && 
+        extent.physical + extent.length == extents[next].physical) {
+        extents[next].logical = extent.logical;
+        extents[next].physical = extent.physical;
+        extents[next].length += extent.length;
+        return false;
+    }
+    return this->extent_insert_entry(node, next, extent, split);
+}
+
+template <typename Entry>
+bool INode::extent_insert_entry(ExtentNode &node, size_t pos, const Entry &entry, ExtentIndex *split) {
+    Entry *entries = node.at<Entry>();
+    const size_t count = node.header->count;
+    if (count < node.capacity<Entry>()) {
+        std::memmove(entries + pos + 1, entries + pos, (count - pos) * sizeof(Entry));
+        entries[pos] = entry;
+        node.header->count++;
+        return false;
+    }
+
+    // the node is full, move the upper half of it to a new sibling. a file that grows
+    // at the end only ever appends, in which case the node is left full and the 
+    // sibling starts out empty
+    assert(node.chunk != nullptr);
+    const size_t keep = pos == count ? count : count / 2;
+    // both kinds of entry start with the logical chunk
+    const ChunkPosition position(keep == count ? entry.logical : entries[keep].logical, node.header->depth + 1);
+    std::shared_ptr<Chunk> chunk = this->superblock->allocate_chunk(inode_table_idx, position, &this->stream);
+    std::memset((void *)chunk->data, 0, chunk->size_bytes);
+    ExtentNode sibling = this->extent_node(chunk);
+    sibling.header->depth = node.header->depth;
+    sibling.header->count = count - keep;
+    std::memcpy(sibling.entries, entries + keep, (count - keep) * sizeof(Entry));
+    node.header->count = keep;
+
+    ExtentIndex unused;
+    if (pos <= keep && pos != count) {
+        this->extent_insert_entry(node, pos, entry, &unused);
+    } else {
+        this->extent_insert_entry(sibling, pos - keep, entry, &unused);
+    }
+
+    split->logical = sibling.at<Entry>()[0].logical;
+    split->child = chunk->chunk_idx;
+    return true;
+}
+
+uint64_t INode::extent_count() {
+    if (this->data.mapping != MAPPING_EXTENTS) 
+        return 0;
+    ExtentNode root = this->extent_root();
+    return this->extent_count(root);
+}
+
+uint64_t INode::extent_count(ExtentNode &node) {
+    if (node.header->depth == 0) 
+        return node.header->count;
+
+    uint64_t count = 0;
+    for (size_t idx = 0; idx < node.header->count; ++idx) {
+        ExtentNode child = this->extent_node(superblock->disk->get_chunk(node.at<ExtentIndex>()[idx].child));
+        count += this->extent_count(child);
+    }
+    return count;
+}
+
+void INode::extent_release(ExtentNode &node, std::vector<DiskBitMap::BitRange> &runs) {
+    for (size_t idx = 0; idx < node.header->count; ++idx) {
+        DiskBitMap::BitRange run;
+        if (node.header->depth == 0) {
+            const Extent &extent = node.at<Extent>()[idx];
+            run.start_idx = extent.physical;
+            run.bit_count = extent.length;
+        } else {
+            run.start_idx = node.at<ExtentIndex>()[idx].child;
+            run.bit_count = 1;
+            ExtentNode child = this->extent_node(superblock->disk->get_chunk(run.start_idx));
+            this->extent_release(child, runs);
+        }
+        runs.push_back(run);
+    }
+    node.header->count = 0;
+}
+
+void INode::table_release(uint64_t table_idx, uint64_t level, std::vector<DiskBitMap::BitRange> &runs) {
+    if (level > 1) {
+        std::shared_ptr<Chunk> table = this->superblock->disk->get_chunk(table_idx);
+        const uint64_t *addresses = (const uint64_t *)table->data;
+        for (size_t idx = 0; idx < table->size_bytes / sizeof(uint64_t); ++idx) {
+            if (addresses[idx] != 0) 
+                this->table_release(addresses[idx], level - 1, runs);
+        }
+    }
+    DiskBitMap::BitRange run;
+    run.start_idx = table_idx;
+    run.bit_count = 1;
+    runs.push_back(run);
 }
 
 void INode::release_chunks() {
+    this->invalidate_block_map();
+
+    // find every chunk the file has first (without loading any of them), then free
+    // them as runs in one go
+    std::vector<DiskBitMap::BitRange> runs;
+    if (this->data.mapping == MAPPING_EXTENTS) {
+        ExtentNode root = this->extent_root();
+        this->extent_release(root, runs);
+        std::memset(this->data.addresses, 0, sizeof(this->data.addresses));
+    } else {
+        uint64_t rough_chunk_count = this->data.file_size / this->superblock->disk->chunk_size() + 1;
+        for (size_t idx = 0; idx < rough_chunk_count; ++idx) {
+            const uint64_t chunk_idx = this->resolve_chunk_idx(idx, false);
+            if (chunk_idx == 0) 
+                continue ;
+            if (!runs.empty() && runs.back().start_idx + runs.back().bit_count == chunk_idx) {
+                runs.back().bit_count++;
+            } else {
+                DiskBitMap::BitRange run;
+                run.start_idx = chunk_idx;
+                run.bit_count = 1;
+                runs.push_back(run);
+            }
+        }
+
+        // and the tables that mapped them
+        uint64_t address = DIRECT_ADDRESS_COUNT;
+        for (uint64_t indirection = 1; indirection < sizeof(INDIRECT_TABLE_SIZES) / sizeof(uint64_t); ++indirection) {
+            for (uint64_t idx = 0; idx < INDIRECT_TABLE_SIZES[indirection]; ++idx, ++address) {
+                if (this->data.addresses[address] != 0) 
+                    this->table_release(this->data.addresses[address], indirection, runs);
+            }
+        }
+        std::memset(this->data.addresses, 0, sizeof(this->data.addresses));
+    }
+
     fprintf(stdout, "INode is releasing its allocated chunks: free'd chunks... ");
-    uint64_t rough_chunk_count = this->data.file_size / this->superblock->disk->chunk_size() + 1;
-    for (size_t idx = 0; idx < rough_chunk_count; ++idx) {
-        std::shared_ptr<Chunk> chunk = resolve_indirection(idx, false);
-        if (chunk == nullptr) 
-            continue ;
-        fprintf(stdout, "%d, ", chunk->chunk_idx);
-        this->superblock->free_chunk(std::move(chunk));
+    for (const DiskBitMap::BitRange &run : runs) {
+        fprintf(stdout, "%llu+%llu, ", (unsigned long long)run.start_idx, (unsigned long long)run.bit_count);
     }
     fprintf(stdout, ".\n");
+    this->superblock->free_chunk_runs(runs);
+    this->invalidate_block_map();
+}
+
+uint64_t INode::relocate_chunks(uint64_t first, uint64_t end, std::unordered_map<uint64_t, uint64_t> &moves) {
+    this->invalidate_block_map();
+
+    if (this->data.mapping == MAPPING_EXTENTS) {
+        // the leaves are only changed once the walk is over, remapping a chunk can
+        // split them
+        std::vector<Extent> remaps;
+        ExtentNode root = this->extent_root();
+        const uint64_t patched = this->extent_relocate(root, first, end, moves, remaps);
+        for (const Extent &extent : remaps) {
+            this->extent_remap(extent.logical, extent.physical);
+        }
+        this->invalidate_block_map();
+        return patched;
+    }
+
+    // every table is looked through, whatever it points at might have moved
+    uint64_t patched = 0;
+    for (uint64_t idx = 0; idx < ADDRESS_COUNT; ++idx) {
+        uint64_t &address = this->data.addresses[idx];
+        if (address >= first && address < end) {
+            auto move = moves.find(address);
+            if (move != moves.end()) {
+                address = move->second;
+                moves.erase(move);
+                patched++;
+            }
+        }
+        if (idx >= DIRECT_ADDRESS_COUNT && address != 0) {
+            patched += this->relocate_in_table(address, idx - DIRECT_ADDRESS_COUNT + 1, first, end, moves);
+        }
+    }
+    return patched;
+}
+
+uint64_t INode::relocate_in_table(uint64_t table_idx, uint64_t level, uint64_t first, uint64_t end, 
+        std::unordered_map<uint64_t, uint64_t> &moves) {
+    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(table_idx);
+    uint64_t *table = (uint64_t *)chunk->data;
+    const uint64_t entries = chunk->size_bytes / sizeof(uint64_t);
+
+    uint64_t patched = 0;
+    for (uint64_t idx = 0; idx < entries; ++idx) {
+        if (table[idx] >= first && table[idx] < end) {
+            auto move = moves.find(table[idx]);
+            if (move != moves.end()) {
+                table[idx] = move->second;
+                moves.erase(move);
+                patched++;
+            }
+        }
+        // the entries of the last level point at data
+        if (level > 1 && table[idx] != 0) {
+            patched += this->relocate_in_table(table[idx], level - 1, first, end, moves);
+        }
+    }
+    return patched;
+}
+
+uint64_t INode::extent_relocate(ExtentNode &node, uint64_t first, uint64_t end, 
+        std::unordered_map<uint64_t, uint64_t> &moves, std::vector<Extent> &remaps) {
+    uint64_t patched = 0;
+    if (node.header->depth > 0) {
+        ExtentIndex *indexes = node.at<ExtentIndex>();
+        for (size_t idx = 0; idx < node.header->count; ++idx) {
+            if (indexes[idx].child >= first && indexes[idx].child < end) {
+                auto move = moves.find(indexes[idx].child);
+                if (move != moves.end()) {
+                    indexes[idx].child = move->second;
+                    moves.erase(move);
+                    patched++;
+                }
+            }
+            ExtentNode child = this->extent_node(superblock->disk->get_chunk(indexes[idx].child));
+            patched += this->extent_relocate(child, first, end, moves, remaps);
+        }
+        return patched;
+    }
+
+    const Extent *extents = node.at<Extent>();
+    for (size_t idx = 0; idx < node.header->count; ++idx) {
+        const Extent &extent = extents[idx];
+        const uint64_t from = std::max(extent.physical, first);
+        const uint64_t to = std::min(extent.physical + extent.length, end);
+        for (uint64_t physical = from; physical < to; ++physical) {
+            auto move = moves.find(physical);
+            if (move != moves.end()) {
+                Extent remap;
+                remap.logical = extent.logical + physical - extent.physical;
+                remap.physical = move->second;
+                remap.length = 1;
+                remaps.push_back(remap);
+                moves.erase(move);
+                patched++;
+            }
+        }
+    }
+    return patched;
+}
+
+void INode::extent_remap(uint64_t logical, uint64_t physical) {
+    ExtentNode node = this->extent_root();
+    while (node.header->depth > 0) {
+        const ExtentIndex *indexes = node.at<ExtentIndex>();
+        const size_t idx = find_extent_entry(indexes, node.header->count, logical);
+        assert(idx != node.header->count);
+        node = this->extent_node(superblock->disk->get_chunk(indexes[idx].child));
+    }
+    Extent *extents = node.at<Extent>();
+    const size_t idx = find_extent_entry(extents, node.header->count, logical);
+    assert(idx != node.header->count && logical - extents[idx].logical < extents[idx].length);
+    Extent &extent = extents[idx];
+
+    if (extent.length == 1) {
+        extent.physical = physical;
+        return ;
+    }
+
+    // cut the chunk out of its extent and map it on its own, which joins it up with
+    // the chunk before it if that was moved just before it
+    if (logical == extent.logical) {
+        extent.logical++;
+        extent.physical++;
+        extent.length--;
+    } else if (logical == extent.logical + extent.length - 1) {
+        extent.length--;
+    } else {
+        Extent rest;
+        rest.logical = logical + 1;
+        rest.physical = extent.physical + rest.logical - extent.logical;
+        rest.length = extent.logical + extent.length - rest.logical;
+        extent.length = logical - extent.logical;
+        this->extent_insert(rest);
+    }
+
+    Extent moved;
+    moved.logical = logical;
+    moved.physical = physical;
+    moved.length = 1;
+    this->extent_insert(moved);
+}
+
+bool INode::relocate_chunk(uint64_t from, uint64_t to, const ChunkPosition &position) {
+    if (!position.known()) 
+        return false;
+    this->invalidate_block_map();
+
+    std::shared_ptr<Chunk> holder;
+    uint64_t *pointer = nullptr;
+    if (this->data.mapping == MAPPING_EXTENTS) {
+        if (position.level == 0) {
+            // data chunks are mapped by runs in the leaves, not by a pointer of their own
+            if (this->extent_lookup(position.logical) != from) 
+                return false;
+            this->extent_remap(position.logical, to);
+            this->invalidate_block_map();
+            return true;
+        }
+        pointer = this->extent_pointer(position.logical, position.level, holder);
+    } else {
+        pointer = this->block_pointer(position.logical, position.level, holder);
+    }
+
+    if (pointer == nullptr || *pointer != from) 
+        return false;
+    *pointer = to;
+    return true;
+}
+
+uint64_t *INode::block_pointer(uint64_t logical, uint64_t level, std::shared_ptr<Chunk> &holder) {
+    const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    uint64_t chunk_number = logical;
+    uint64_t indirect_address_count = 1;
+    uint64_t *indirect_table = data.addresses;
+    for (uint64_t indirection = 0; indirection < sizeof(INDIRECT_TABLE_SIZES) / sizeof(uint64_t); indirection++) {
+        if (chunk_number < indirect_address_count * INDIRECT_TABLE_SIZES[indirection]) {
+            // the inode points at tables of level indirection here, each level down 
+            // the tables map indirect_address_count times fewer chunks
+            if (level > indirection) 
+                return nullptr;
+            uint64_t *pointer = &indirect_table[chunk_number / indirect_address_count];
+            for (uint64_t at = indirection; at > level; --at) {
+                if (*pointer == 0) 
+                    return nullptr;
+                holder = superblock->disk->get_chunk(*pointer);
+                chunk_number %= indirect_address_count;
+                indirect_address_count /= num_chunk_address_per_chunk;
+                pointer = &((uint64_t *)holder->data)[chunk_number / indirect_address_count];
+            }
+            return pointer;
+        }
+        chunk_number -= (indirect_address_count * INDIRECT_TABLE_SIZES[indirection]);
+        indirect_table += INDIRECT_TABLE_SIZES[indirection];
+        indirect_address_count *= num_chunk_address_per_chunk;
+    }
+    return nullptr;
+}
+
+uint64_t *INode::extent_pointer(uint64_t logical, uint64_t level, std::shared_ptr<Chunk> &holder) {
+    ExtentNode node = this->extent_root();
+    // the root lives in the inode, nothing points at it
+    while (node.header->depth >= level) {
+        ExtentIndex *indexes = node.at<ExtentIndex>();
+        const size_t idx = find_extent_entry(indexes, node.header->count, logical);
+        if (idx == node.header->count) 
+            return nullptr;
+        if (node.header->depth == level) {
+            holder = node.chunk;
+            return &indexes[idx].child;
+        }
+        node = this->extent_node(superblock->disk->get_chunk(indexes[idx].child));
+    }
+    return nullptr;
 }
 
 std::string INode::to_string() {
@@ -281,6 +939,8 @@ std::string INode::to_string() {
     return out.str();
 }
 
+constexpr uint64_t INodeTable::RESERVE_INODES;
+
 INodeTable::INodeTable(SuperBlock *superblock, uint64_t offset, uint64_t inode_count) : superblock(superblock) {
     this->inode_count = inode_count;
     this->inode_table_offset = offset;
@@ -295,6 +955,21 @@ INodeTable::INodeTable(SuperBlock *superblock, uint64_t offset, uint64_t inode_c
     
     
     this->inode_table_size_chunks = this->used_inodes->size_chunks() + inode_count / inodes_per_chunk + 1;
+
+    this->groups.init(inode_count, 4 * RESERVE_INODES);
+}
+
+INodeTable::~INodeTable() {
+    this->release_reservations();
+}
+
+void INodeTable::release_reservations() {
+    for (size_t idx = 0; idx < this->groups.size(); ++idx) {
+        uint64_t count = 0;
+        const uint64_t first = this->groups[idx].reserved.take(count);
+        this->used_inodes->clr_range(first, count);
+        this->free_inodes += count;
+    }
 }
 
 void INodeTable::format_inode_table() {
@@ -308,26 +983,32 @@ uint64_t INodeTable::size_chunks() {
 }
 
 std::shared_ptr<INode> INodeTable::alloc_inode() {
-    std::lock_guard<std::recursive_mutex> g(this->lock);
-
-    DiskBitMap::BitRange range = this->used_inodes->find_unset_bits(1);
-    if (range.bit_count != 1) {
-        throw FileSystemException("INodeTable out of inodes -- no free inode available for allocation");
+    AllocGroup &group = this->groups[this->groups.preferred()];
+    uint64_t idx = 0;
+    if (!group.reserved.claim(idx)) {
+        std::lock_guard<std::mutex> g(group.lock);
+        // someone else may have refilled the run while we waited
+        if (!group.reserved.claim(idx)) {
+            DiskBitMap::BitRange range = this->used_inodes->claim_unset_bits(RESERVE_INODES, group.search_idx);
+            if (range.bit_count != 0) {
+                idx = range.start_idx;
+                group.reserved.refill(range.start_idx + 1, range.bit_count - 1);
+                this->free_inodes -= range.bit_count;
+            } else if (!this->groups.steal(idx)) {
+                throw FileSystemException("INodeTable out of inodes -- no free inode available for allocation");
+            }
+        }
     }
-    
+
     std::shared_ptr<INode> inode(new INode);
     inode->superblock = this->superblock;
-    inode->inode_table_idx = range.start_idx;
+    inode->inode_table_idx = idx;
 
     this->inodecache.put(inode->inode_table_idx, inode); 
-    used_inodes->set(inode->inode_table_idx);
-    
     return inode;
 }
 
 std::shared_ptr<INode> INodeTable::get_inode(uint64_t idx) {
-    std::lock_guard<std::recursive_mutex> g(this->lock);
-
     if (idx >= inode_count) 
         throw FileSystemException("INode index out of bounds");
     if (!used_inodes->get(idx)) 
@@ -341,15 +1022,19 @@ std::shared_ptr<INode> INodeTable::get_inode(uint64_t idx) {
     uint64_t chunk_idx = inode_ilist_offset + idx / inodes_per_chunk;
     uint64_t chunk_offset = idx % inodes_per_chunk;
     std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
-    std::memcpy((void *)(&(inode->data)), chunk->data + sizeof(INode::INodeData) * chunk_offset, sizeof(INode::INodeData));
+    {
+        std::lock_guard<ChunkLock> g(chunk->lock);
+        std::memcpy((void *)(&(inode->data)), chunk->data + sizeof(INode::INodeData) * chunk_offset, sizeof(INode::INodeData));
+    }
     inode->superblock = this->superblock;
     inode->inode_table_idx = idx;
+
+    // so that whoever else asks while we have it (the cleaner, say) sees our copy
+    this->inodecache.put(idx, inode);
     return inode;
 }
 
 void INodeTable::update_inode(const INode& inode) {
-    std::lock_guard<std::recursive_mutex> g(this->lock);
-    
     if (inode.inode_table_idx >= inode_count) 
         throw FileSystemException("INode index out of bounds");
     if (!used_inodes->get(inode.inode_table_idx)) 
@@ -358,12 +1043,11 @@ void INodeTable::update_inode(const INode& inode) {
     uint64_t chunk_idx = inode_ilist_offset + inode.inode_table_idx / inodes_per_chunk;
     uint64_t chunk_offset = inode.inode_table_idx % inodes_per_chunk;
     std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
+    std::lock_guard<ChunkLock> g(chunk->lock);
     std::memcpy((void *)(chunk->data + sizeof(INode::INodeData) * chunk_offset), (void *)(&(inode.data)), sizeof(INode::INodeData));
 }
 
 void INodeTable::free_inode(std::shared_ptr<INode> inode) {
-    std::lock_guard<std::recursive_mutex> g(this->lock);
-
     if (!inode.unique()) {
         throw FileSystemException("To free an inode you must hand a UNIQUE reference that no other thread currently holds to free_inode");
         // you may optionally spin until you can acquire a unique reference to the inode in order to remove it
@@ -376,12 +1060,424 @@ void INodeTable::free_inode(std::shared_ptr<INode> inode) {
     inode = nullptr;
 
     used_inodes->clr(index);
+    this->free_inodes += 1;
+}
+
+/*
+    SEGMENT CONTROLLER
+*/
+
+constexpr uint64_t SegmentController::NONE;
+constexpr uint64_t SegmentController::CHECKPOINT_SEGMENTS;
+constexpr uint64_t SegmentController::STREAM_CHUNKS;
+
+void SegmentController::checkpoint_usage() {
+    usage.checkpoint([this](uint64_t segment, uint64_t chunks) {
+        std::shared_ptr<Chunk> summary = disk->get_chunk(data_offset + segment * segment_size);
+        *(uint64_t *)summary->data = chunks;
+    });
+}
+
+void SegmentController::init_usage(bool loaded, bool summaries_trusted) {
+    free_segments = 0;
+    // pushed last to first, so that a group opens the segments of its slice in order
+    for (uint64_t segment = num_segments; segment-- > 0; ) {
+        const uint64_t first_chunk = data_offset + segment * segment_size;
+        if (loaded) {
+            const uint64_t chunks = block_map->count_set_bits(first_chunk + 1, segment_size - 1);
+            usage.set(segment, chunks);
+        }
+        if (loaded && block_map->get(first_chunk)) {
+            usage.push_used(segment);
+        } else {
+            usage.push_free(segment);
+            free_segments++;
+        }
+    }
+    if (!loaded || summaries_trusted) 
+        usage.checkpoint([](uint64_t, uint64_t) {});
+}
+
+void SegmentController::release_reservations() {
+    for (size_t idx = 0; idx < groups.size() + 2; ++idx) {
+        AllocGroup &group = idx < groups.size() ? groups[idx] : heads[idx - groups.size()];
+        std::lock_guard<std::mutex> lock(group.lock);
+        uint64_t count = 0;
+        const uint64_t start = group.reserved.take(count);
+        release_reserved(start, count);
+        if (!segment_writes) 
+            continue ;
+        for (uint64_t segment : {group.previous, group.current}) {
+            if (segment != AllocGroup::NONE) 
+                disk->write_segment(data_offset + segment * segment_size);
+        }
+        group.previous = AllocGroup::NONE;
+    }
+}
+
+void SegmentController::release_reserved(uint64_t start, uint64_t count) {
+    if (count == 0) 
+        return ;
+    std::lock_guard<std::mutex> g(extents_lock);
+    block_map->clr_range(start, count);
+    if (extents_built) 
+        free_extents.insert(start, count);
+    free_chunks += count;
+}
+
+void SegmentController::release_stream(ReservedRun &stream) {
+    uint64_t count = 0;
+    const uint64_t start = stream.take(count);
+    if (count == 0) 
+        return ;
+    // usually the group has not handed out anything since the stream was filled
+    for (size_t idx = 0; idx < groups.size(); ++idx) {
+        if (groups[idx].reserved.give_back(start, count)) 
+            return ;
+    }
+    release_reserved(start, count);
+}
+
+bool SegmentController::set_new_free_segment(AllocGroup &group) {
+    uint64_t finished = AllocGroup::NONE;
+    if (!open_free_segment(group, finished)) 
+        return false;
+    // chunks handed out of a segment are written to a while after, so the segment 
+    // goes out whole only once the group has filled the one after it as well. the 
+    // disk is left to it without holding up other groups opening segments
+    if (segment_writes && finished != AllocGroup::NONE) 
+        disk->write_segment(data_offset + finished * segment_size);
+    return true;
+}
+
+bool SegmentController::open_free_segment(AllocGroup &group, uint64_t &finished) {
+    std::lock_guard<std::mutex> lock(segment_controller_lock);
+    uint64_t segment = 0;
+    while (usage.pop_free(usage.slice_of(group.first), segment)) {
+        // the queue is not told when runs are handed out of a free segment
+        if (!segment_is_free(segment)) 
+            continue ;
+
+        const uint64_t first_chunk = data_offset + segment * segment_size;
+        if (group.current != AllocGroup::NONE) {
+            segment_open[group.current] = 0;
+            usage.push_used(group.current);
+            finished = group.previous;
+            group.previous = group.current;
+        }
+        if (segment_writes) 
+            disk->stage_segment(first_chunk, segment_size);
+        // it may have been freed not long ago, and must not be punched out under us
+        disk->cancel_discard(first_chunk, segment_size);
+        segment_open[segment] = 1;
+        group.current = group.search_idx = segment;
+        {
+            std::lock_guard<std::mutex> g(extents_lock);
+            block_map->set_range(first_chunk, segment_size);
+            if (extents_built) 
+                free_extents.remove(first_chunk, segment_size);
+            free_chunks -= segment_size;
+        }
+        free_segments--;
+        if (++write_clock % CHECKPOINT_SEGMENTS == 0) 
+            checkpoint_usage();
+        // chunk 0 holds the segment summary. a stream may have given chunks back to
+        // the end of the old run since the group's lock was taken
+        uint64_t old_count = 0;
+        const uint64_t old = group.reserved.replace(first_chunk + 1, segment_size - 1, old_count);
+        release_reserved(old, old_count);
+        return true;
+    }
+    return false;
+}
+
+std::vector<uint64_t> SegmentController::cleaning_candidates(size_t limit) {
+    const uint64_t capacity = segment_size - 1;
+    std::lock_guard<std::mutex> lock(segment_controller_lock);
+    // unmarked segments have nothing in them
+    return usage.emptiest(limit, [this, capacity](uint64_t segment) {
+        return !segment_open[segment] && get_segment_usage(segment) < capacity && 
+            block_map->get(data_offset + segment * segment_size);
+    });
+}
+
+uint64_t SegmentController::free_segment_count() {
+    return free_segments.load(std::memory_order_relaxed);
+}
+
+uint64_t SegmentController::alloc_next(uint64_t inode_number, const ChunkPosition &position, ReservedRun *stream, 
+        Temperature temperature) {
+    if (temperature == WARM && position.known() && position.level > 0) 
+        temperature = HOT;
+    if (!separate_temperatures) 
+        temperature = WARM;
+    // streams are for the data of a file
+    if (temperature != WARM) 
+        stream = nullptr;
+
+    uint64_t ret = 0;
+    if (stream == nullptr || !stream->claim(ret)) {
+        AllocGroup &group = temperature == WARM ? groups[groups.preferred()] : heads[temperature - 1];
+        // a file's first chunk is taken on its own, so that small files do not leave
+        // the rest of a stream behind as holes
+        const bool started = stream != nullptr && stream->run.load(std::memory_order_relaxed) != 0;
+        uint64_t count = 0;
+        claim_from_group(group, started ? STREAM_CHUNKS : 1, ret, count);
+
+        if (stream != nullptr) {
+            // the rest is the stream's (an empty one the first time, which marks it 
+            // started). a run never spans segments
+            const uint64_t segment = (ret - data_offset) / segment_size;
+            for (uint64_t chunk = ret + 1; chunk < ret + count; ++chunk) {
+                set_segment_chunk_to_inode(segment, (chunk - data_offset) % segment_size, inode_number, ChunkPosition());
+            }
+            // two writers of the file can refill it at once, one of them gives back
+            uint64_t old_count = 0;
+            const uint64_t old = stream->replace(ret + 1, count - 1, old_count);
+            release_reserved(old, old_count);
+        }
+    }
+
+    const uint64_t segment = (ret - data_offset) / segment_size;
+
+    //increment segment usage
+    add_segment_usage(segment, 1);
+    touch_segment(segment);
+
+    //set the inode mapping
+    set_segment_chunk_to_inode(segment, (ret - data_offset) % segment_size, inode_number, position);
+
+    return ret;
+}
+
+void SegmentController::claim_from_group(AllocGroup &group, uint64_t wanted, uint64_t &start, uint64_t &count) {
+    count = wanted;
+    while (!group.reserved.claim(start, count)) {
+        {
+            std::lock_guard<std::mutex> lock(group.lock);
+            // someone else may have opened a new segment for the group while we waited
+            if (group.reserved.claim(start, count)) 
+                return ;
+            if (set_new_free_segment(group) && group.reserved.claim(start, count)) 
+                return ;
+            count = 1;
+            if (groups.steal(start)) 
+                return ;
+        }
+
+        // every segment has something in it, have the cleaner empty one. the group's 
+        // lock is not held, the cleaner allocates as well
+        if (cleaner == nullptr || !cleaner->clean_for_allocation()) {
+            throw FileSystemException("FileSystem out of space -- unable to allocate a new chunk");
+        }
+        count = wanted;
+    }
+}
+
+DiskBitMap::BitRange SegmentController::alloc_next_run(uint64_t inode_number, uint64_t first_logical, uint64_t length, 
+        ReservedRun *stream) {
+    DiskBitMap::BitRange run;
+    if (length == 0) 
+        return run;
+
+    uint64_t start = 0;
+    uint64_t count = length;
+    // the stream first, what is left of it follows the file's last chunk
+    if (stream == nullptr || !stream->claim(start, count)) 
+        claim_from_group(groups[groups.preferred()], length, start, count);
+
+    run.start_idx = start;
+    run.bit_count = count;
+    note_run(inode_number, run, first_logical);
+    return run;
+}
+
+void SegmentController::note_run(uint64_t inode_number, const DiskBitMap::BitRange &run, uint64_t first_logical) {
+    const uint64_t segment = (run.start_idx - data_offset) / segment_size;
+    add_segment_usage(segment, run.bit_count);
+    touch_segment(segment);
+    // one pass over the summary for the whole run
+    std::shared_ptr<Chunk> summary = disk->get_chunk(data_offset + segment * segment_size);
+    uint64_t *entry = (uint64_t *)summary->data + (run.start_idx - data_offset) % segment_size * summary_words;
+    for (uint64_t idx = 0; idx < run.bit_count; ++idx, entry += summary_words) {
+        entry[0] = inode_number;
+        if (summary_words >= 2) {
+            ChunkPosition position;
+            if (first_logical != ChunkPosition::UNKNOWN) 
+                position.logical = first_logical + idx;
+            entry[1] = position.pack();
+        }
+    }
+}
+
+uint64_t SegmentController::alloc_relocation(uint64_t inode_number, const ChunkPosition &position) {
+    try {
+        return alloc_next(inode_number, position, nullptr, COLD);
+    } catch (const FileSystemException &e) {
+    }
+    const DiskBitMap::BitRange run = alloc_run(inode_number, 1, FreeExtents::BEST_FIT);
+    if (run.bit_count == 0) {
+        throw FileSystemException("FileSystem out of space -- nowhere to move a live chunk to");
+    }
+    const uint64_t segment = (run.start_idx - data_offset) / segment_size;
+    set_segment_chunk_to_inode(segment, (run.start_idx - data_offset) % segment_size, inode_number, position);
+    return run.start_idx;
+}
+
+void SegmentController::begin_cleaning(uint64_t segment) {
+    std::lock_guard<std::mutex> g(extents_lock);
+    cleaning_segment = segment;
+    if (extents_built) 
+        free_extents.remove(data_offset + segment * segment_size, segment_size);
+}
+
+void SegmentController::abort_cleaning(uint64_t segment) {
+    const uint64_t first_chunk = data_offset + segment * segment_size;
+    std::lock_guard<std::mutex> g(extents_lock);
+    // chunks that were marked but never handed out (the unused end of a segment that 
+    // was open when the file system went down) were released as well, count again
+    set_segment_usage(segment, block_map->count_set_bits(first_chunk + 1, segment_size - 1));
+    usage.push_used(segment);
+    cleaning_segment = NONE;
+    extents_built = false;
+}
+
+void SegmentController::finish_cleaning(uint64_t segment) {
+    const uint64_t first_chunk = data_offset + segment * segment_size;
+    std::shared_ptr<Chunk> summary = disk->get_chunk(first_chunk);
+    std::memset(summary->data, 0, summary->size_bytes);
+    set_segment_usage(segment, 0);
+
+    {
+        std::lock_guard<std::mutex> g(extents_lock);
+        block_map->clr(first_chunk);
+        free_chunks += 1;
+        cleaning_segment = NONE;
+        if (extents_built) 
+            free_extents.insert(first_chunk + 1, segment_size - 1);
+    }
+    // the summary stays, it is rewritten as soon as the segment is opened anyway
+    disk->discard(first_chunk + 1, segment_size - 1);
+    free_segments++;
+    usage.push_free(segment);
+}
+
+void SegmentController::build_free_extents() {
+    free_extents.clear();
+    for (uint64_t segment = 0; segment < num_segments; ++segment) {
+        // the holes of the segment being cleaned are about to be freed with the rest of it
+        if (segment == cleaning_segment) 
+            continue ;
+        // chunk 0 holds the segment summary, it is never handed out as data
+        const uint64_t first_chunk = data_offset + segment * segment_size + 1;
+        for (const DiskBitMap::BitRange &run : block_map->unset_runs(first_chunk, segment_size - 1)) {
+            free_extents.insert(run.start_idx, run.bit_count);
+        }
+    }
+    extents_built = true;
+}
+
+DiskBitMap::BitRange SegmentController::alloc_run(uint64_t inode_number, uint64_t length, FreeExtents::Policy policy, 
+        uint64_t first_logical) {
+    DiskBitMap::BitRange run;
+    std::lock_guard<std::mutex> lock(segment_controller_lock);
+    {
+        std::lock_guard<std::mutex> g(extents_lock);
+        if (!extents_built) 
+            build_free_extents();
+
+        FreeExtents::Extent taken;
+        if (!free_extents.take(length, policy, taken)) {
+            // nothing is long enough, make do with the longest there is
+            const FreeExtents::Extent longest = free_extents.longest();
+            if (longest.length == 0 || !free_extents.take(longest.length, FreeExtents::BEST_FIT, taken)) 
+                return run;
+        }
+        run.start_idx = taken.start;
+        run.bit_count = taken.length;
+
+        // the first run out of a segment nobody has opened marks its summary as well, 
+        // which keeps the segment from being opened
+        const uint64_t summary_chunk = run.start_idx - (run.start_idx - data_offset) % segment_size;
+        if (!block_map->get(summary_chunk)) {
+            block_map->set(summary_chunk);
+            free_chunks -= 1;
+            free_segments--;
+        }
+        block_map->set_range(run.start_idx, run.bit_count);
+        free_chunks -= run.bit_count;
+    }
+
+    disk->cancel_discard(run.start_idx, run.bit_count);
+    usage.push_used((run.start_idx - data_offset) / segment_size);
+    note_run(inode_number, run, first_logical);
+    return run;
+}
+
+void SegmentController::release_runs(const DiskBitMap::BitRange *runs, size_t count) {
+    uint64_t chunk_count = 0;
+    std::lock_guard<std::mutex> g(extents_lock);
+    block_map->clr_ranges(runs, count);
+    for (size_t idx = 0; idx < count; ++idx) {
+        // a run never spans segments, the summary chunk between them is never freed
+        const uint64_t segment = (runs[idx].start_idx - data_offset) / segment_size;
+        add_segment_usage(segment, -(int64_t)runs[idx].bit_count);
+        usage.push_used(segment);
+        if (segment != cleaning_segment) {
+            if (extents_built) 
+                free_extents.insert(runs[idx].start_idx, runs[idx].bit_count);
+            // queued before anyone can take the run again, whoever does takes it back
+            disk->discard(runs[idx].start_idx, runs[idx].bit_count);
+        }
+        chunk_count += runs[idx].bit_count;
+    }
+    free_chunks += chunk_count;
 }
 
 SuperBlock::SuperBlock(Disk *disk) 
     : disk(disk), disk_size_bytes(disk->size_bytes()), 
     disk_size_chunks(disk->size_chunks()),
-    disk_chunk_size(disk->chunk_size()) {
+    disk_chunk_size(disk->chunk_size()), cleaner(new SegmentCleaner(this)), 
+    readahead(new Readahead(this)) {
+}
+
+// written after the rest of the superblock's fields when the counters can be trusted
+static constexpr uint64_t COUNTERS_CLEAN = 0x636c65616e; // "clean"
+static constexpr uint64_t COUNTERS_OFFSET = 13 * sizeof(uint64_t);
+// set by init on images whose segment summaries record positions as well as owners
+static constexpr uint64_t SUMMARY_POSITIONS = 0x706f736974696f6e; // "position"
+static constexpr uint64_t SUMMARY_FORMAT_OFFSET = COUNTERS_OFFSET + 3 * sizeof(uint64_t);
+
+SuperBlock::~SuperBlock() {
+    // nothing may be moved around from here on
+    this->segment_controller.cleaner = nullptr;
+    this->cleaner = nullptr;
+
+    // nothing was initialized or loaded
+    if (this->inode_table == nullptr) 
+        return;
+    this->store_counters(true);
+}
+
+void SuperBlock::store_counters(bool clean) {
+    // what the groups did not hand out counts as in use, hand it back so a clean
+    // count is exact and the next mount sees it as free
+    if (clean) {
+        this->inode_table->release_reservations();
+        segment_controller.release_reservations();
+    }
+    segment_controller.checkpoint_usage();
+
+    auto sb_chunk = disk->get_chunk(0);
+    uint64_t *counters = (uint64_t *)(sb_chunk->data + COUNTERS_OFFSET);
+    counters[0] = clean ? COUNTERS_CLEAN : 0;
+    counters[1] = this->free_chunk_count();
+    counters[2] = this->free_inode_count();
+    disk->flush_chunk(*sb_chunk);
+}
+
+uint64_t SuperBlock::free_inode_count() const {
+    return this->inode_table->free_inodes.load(std::memory_order_relaxed);
 }
 
 void SuperBlock::init(double inode_table_size_rel_to_disk) {
@@ -408,7 +1504,7 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
     
     // initialize the inode table
     {   
-        uint64_t inodes_per_chunk = disk->chunk_size() / sizeof(INode);
+        uint64_t inodes_per_chunk = disk->chunk_size() / sizeof(INode::INodeData);
         uint64_t inode_count_to_request = (unsigned long)(inode_table_size_rel_to_disk * disk->size_chunks()) * inodes_per_chunk;
         
         this->inode_table_inode_count = inode_count_to_request;
@@ -425,26 +1521,41 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
 
     //set all metadata chunk bits to `used' a la Thomas
     //TODO: kill Thomas thing too
-    for(uint64_t bit_i = 0; bit_i < offset; ++bit_i) {
-        disk_block_map->set(bit_i);
-    }
+    disk_block_map->set_range(0, offset);
 
     this->data_offset = offset;
 
     //segment the free data block space
     num_segments = 0;
-    segment_size_chunks = 2 * (disk_chunk_size / 4);
+    // the summary chunk at the start of each segment holds an owner and a position 
+    // per chunk in the segment, so a segment can be at most disk_chunk_size / 16 
+    // chunks long
+    segment_size_chunks = 2 * (disk_chunk_size / (2 * sizeof(uint64_t)));
     while(num_segments < 20) {
         segment_size_chunks /= 2;
         num_segments = (disk_size_chunks - data_offset - 1) / segment_size_chunks;
     }
+
+    // the chunks after the last whole segment are never handed out
+    const uint64_t segments_end = data_offset + num_segments * segment_size_chunks;
+    disk_block_map->set_range(segments_end, disk_size_chunks - segments_end);
     
+    this->register_metadata_regions();
+
     segment_controller.disk = disk;
     segment_controller.data_offset = data_offset;
     segment_controller.segment_size = segment_size_chunks;
     segment_controller.num_segments = num_segments;
+    segment_controller.summary_words = 2;
+    segment_controller.block_map = disk_block_map.get();
+    segment_controller.cleaner = cleaner.get();
     segment_controller.clear_all_segments();
-    segment_controller.set_new_free_segment();
+    segment_controller.init_groups();
+    segment_controller.init_usage(false, true);
+
+    // everything is free but the metadata, the counters are kept up to date from here on
+    segment_controller.free_chunks = num_segments * segment_size_chunks;
+    inode_table->free_inodes = inode_table_inode_count;
     
     //setup root directory
     std::shared_ptr<INode> inode = this->inode_table->alloc_inode();
@@ -486,6 +1597,11 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
         offset += sizeof(uint64_t);
 
         *(uint64_t *)(sb_data+offset) = root_inode_index;
+        offset += sizeof(uint64_t);
+        // the counters get stored once the file system goes away
+        assert(offset == COUNTERS_OFFSET);
+        *(uint64_t *)(sb_data+offset) = 0;
+        *(uint64_t *)(sb_data+SUMMARY_FORMAT_OFFSET) = SUMMARY_POSITIONS;
         disk->flush_chunk(*sb_chunk);
         {
             auto sb_chunk = disk->get_chunk(0);
@@ -532,16 +1648,25 @@ void SuperBlock::load_from_disk() {
     offset += sizeof(uint64_t);
     uint64_t inode_table_inode_count = *(uint64_t *)(sb_data+offset);
     offset += sizeof(uint64_t);
-    data_offset = *(uint64_t *)(sb_data+offset);
+    uint64_t data_offset = *(uint64_t *)(sb_data+offset);
     offset += sizeof(uint64_t);
 
-    *(uint64_t *)(sb_data+offset) = segment_size_chunks;
+    this->segment_size_chunks = *(uint64_t *)(sb_data+offset);
     offset += sizeof(uint64_t);
-    *(uint64_t *)(sb_data+offset) = num_segments;
+    this->num_segments = *(uint64_t *)(sb_data+offset);
     offset += sizeof(uint64_t);
 
     this->root_inode_index = *(uint64_t *)(sb_data+offset);
 
+    // the layout is checked against what we compute below, so it is safe to register
+    // it before loading the bitmap and the inode table through it
+    this->disk_block_map_offset = disk_block_map_offset;
+    this->disk_block_map_size_chunks = disk_block_map_size_chunks;
+    this->inode_table_offset = inode_table_offset;
+    this->inode_table_size_chunks = inode_table_size_chunks;
+    this->data_offset = data_offset;
+    this->register_metadata_regions();
+
     offset = this->superblock_size_chunks;
 
     // initialize the disk block map
@@ -577,6 +1702,8 @@ void SuperBlock::load_from_disk() {
         }
     }
 
+    // the same margin of 1 chunk that init leaves
+    offset++;
     this->data_offset = offset;
 
     //initialize the segment controller
@@ -584,7 +1711,28 @@ void SuperBlock::load_from_disk() {
     segment_controller.data_offset = data_offset;
     segment_controller.segment_size = segment_size_chunks;
     segment_controller.num_segments = num_segments;
-    segment_controller.set_new_free_segment();
+    // older images only have room for the owner of each chunk in their summaries
+    segment_controller.summary_words = 
+        *(const uint64_t *)(sb_data + SUMMARY_FORMAT_OFFSET) == SUMMARY_POSITIONS ? 2 : 1;
+    segment_controller.block_map = disk_block_map.get();
+    segment_controller.cleaner = cleaner.get();
+    segment_controller.init_groups();
+
+    // the free space counters, if they were stored when the file system was last put
+    // away. otherwise (a crash, or an image from before they were kept) count them
+    {
+        const uint64_t *counters = (const uint64_t *)(sb_data + COUNTERS_OFFSET);
+        if (counters[0] == COUNTERS_CLEAN) {
+            segment_controller.free_chunks = counters[1];
+            inode_table->free_inodes = counters[2];
+        } else {
+            segment_controller.free_chunks = disk_block_map->count_unset_bits();
+            inode_table->free_inodes = inode_table->used_inodes->count_unset_bits();
+        }
+        segment_controller.init_usage(true, counters[0] == COUNTERS_CLEAN);
+        // until they are stored again, a crash leaves them untrusted
+        this->store_counters(false);
+    }
 
     // finally, these two values should add up
     if (this->data_offset != data_offset) {
@@ -599,6 +1747,13 @@ void SuperBlock::load_from_disk() {
     }
 }
 
+void SuperBlock::register_metadata_regions() {
+    disk->add_metadata_region(0, superblock_size_chunks);
+    disk->add_metadata_region(disk_block_map_offset, disk_block_map_size_chunks);
+    disk->add_metadata_region(inode_table_offset, inode_table_size_chunks);
+    disk->add_metadata_region(data_offset, num_segments, segment_size_chunks);
+}
+
 void FileSystem::printForDebug() {
   //TODO: write this function
   throw FileSystemException("thomas you idiot...");
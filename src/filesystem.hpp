@@ -8,9 +8,15 @@
 #include <cstdint>
 #include <string>
 #include <cassert>
+#include <unordered_map>
 #include <sys/stat.h>
 
 #include "diskinterface.hpp"
+#include "readahead.hpp"
+#include "allocgroups.hpp"
+#include "freeextents.hpp"
+#include "cleaner.hpp"
+#include "segmentusage.hpp"
 
 using Size = uint64_t;
 
@@ -23,33 +29,167 @@ struct FileSystemException : public StorageException {
 	FileSystemException(const std::string &message) : StorageException(message) { };
 };
 
+/*
+	where a chunk sits in the file that owns it, recorded next to the owner in the
+	segment summary so that the cleaner can go straight to the pointer to a chunk it
+	moves instead of walking the whole file. level 0 is a data chunk, logical being 
+	the chunk of the file it holds. a table of block pointers or a node of an extent 
+	tree is a level above what it points at, and logical is the first chunk of the 
+	file it mapped when it was allocated
+*/
+struct ChunkPosition {
+	static constexpr uint64_t UNKNOWN = ~(uint64_t)0;
+	static constexpr uint64_t LEVEL_BITS = 8;
+
+	uint64_t logical = UNKNOWN;
+	uint64_t level = 0;
+
+	ChunkPosition() { }
+	ChunkPosition(uint64_t logical, uint64_t level) : logical(logical), level(level) { }
+
+	inline bool known() const {
+		return logical != UNKNOWN;
+	}
+
+	// the word stored in the summary
+	inline uint64_t pack() const {
+		return known() ? logical << LEVEL_BITS | level : UNKNOWN;
+	}
+	static inline ChunkPosition unpack(uint64_t packed) {
+		return packed == UNKNOWN ? ChunkPosition() : 
+			ChunkPosition(packed >> LEVEL_BITS, packed & (((uint64_t)1 << LEVEL_BITS) - 1));
+	}
+};
+
+/*
+	hands out the chunks of the data region a segment at a time. every allocation 
+	group has a segment open, and the rest of it is the group's reserved run, so 
+	threads in different groups write to different segments without sharing a lock.
+	segment_controller_lock is only taken to pick a new segment for a group, or to 
+	hand out a run that is contiguous on disk.
+
+	a file being written has a stream, a run of STREAM_CHUNKS chunks it claims from
+	its group's run in one go (from its second chunk on) and then takes its chunks 
+	from, again without a lock.
+	files written at the same time from the same group end up in stretches of the
+	segment rather than a chunk each in turns. whatever a stream has not used yet 
+	names the file as its owner in the summary, so the cleaner leaves the segment 
+	alone while the file is loaded, and goes back when the inode does.
+
+	chunks that are likely to die at different times are kept in different segments,
+	so that a segment tends to empty out all at once rather than be left partly live.
+	the groups write the data of files (WARM). the tables and extent nodes of files 
+	(HOT) and the chunks the cleaner moves (COLD, they have outlived everything else
+	in their segment once already) each have a head of their own, a group that is 
+	not tied to a cpu.
+
+	a segment's usage is the number of its chunks that are in use, freeing chunks
+	takes them off again. a segment is free when nothing is in use and its summary
+	is not marked, and once every segment has been used the cleaner makes room by
+	moving what is left in a segment elsewhere.
+
+	the summary chunk at the start of a segment holds summary_words uint64_t per chunk
+	of the segment: the inode that owns the chunk, then its packed ChunkPosition. the 
+	first entry (for the summary chunk itself) holds a copy of the segment's usage.
+	images from before positions were recorded have one word, the owner
+*/
 struct SegmentController {
+	static constexpr uint64_t NONE = ~(uint64_t)0;
+	static constexpr uint64_t STREAM_CHUNKS = 16;
+
+	enum Temperature : uint8_t { WARM = 0, HOT = 1, COLD = 2 };
+
 	std::mutex segment_controller_lock;
 	Disk* disk;
 	uint64_t data_offset;
 	uint64_t segment_size;
 	uint64_t num_segments;
-	uint64_t current_segment;
-	uint64_t current_chunk;
+	uint64_t summary_words = 2;
+
+	AllocGroups groups;
+	AllocGroup heads[2]; // for HOT and COLD chunks, heads[temperature - 1]
+	bool separate_temperatures = true; // everything goes to the groups if not
+	// the disk holds back the segments groups are filling and writes each of them back
+	// in one go once it is full and written to, see Disk::stage_segment
+	bool segment_writes = false;
+	std::vector<uint8_t> segment_open; // per segment, whether a group is allocating from it
+
+	// data chunks are marked used in the block map a whole segment at a time, when a 
+	// group opens the segment. free_chunks follows the unset bits in the block map so
+	// that nobody has to count them
+	DiskBitMap *block_map = nullptr;
+	std::atomic<uint64_t> free_chunks{0};
+	// the segments whose summary is not marked, the ones a group could open
+	std::atomic<uint64_t> free_segments{0};
+
+	// the free runs of data chunks (never a segment summary), for handing out runs
+	// that are contiguous on disk. built from the block map the first time a run is
+	// asked for, changes to the block map take extents_lock once it is
+	std::mutex extents_lock;
+	FreeExtents free_extents;
+	bool extents_built = false;
+	// the segment being cleaned, which is kept out of the index. under extents_lock
+	uint64_t cleaning_segment = NONE;
+
+	// per segment, what write_clock read when a chunk was last handed out of it. the 
+	// clock ticks for every segment opened, so the difference is the age of the 
+	// segment's youngest data in segments written since. only kept in memory, every
+	// segment is as old as the others after a mount
+	std::vector<uint64_t> segment_written;
+	std::atomic<uint64_t> write_clock{0};
+
+	SegmentCleaner *cleaner = nullptr; // asked for room when there is none
+
+	// the usage of every segment, and the queues of free and used segments. the summary
+	// chunks keep a copy of the usage that is brought up to date by checkpoint_usage, 
+	// every CHECKPOINT_SEGMENTS segments opened and when the counters are stored
+	SegmentUsage usage;
+	static constexpr uint64_t CHECKPOINT_SEGMENTS = 64;
 
 	uint64_t get_segment_usage(uint64_t segment_number) {
-		std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
-		return *((uint64_t*)chunk->data);
+		return usage.get(segment_number);
 	}
 
 	void set_segment_usage(uint64_t segment_number, uint64_t segment_usage) {
-		std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
-		*((uint64_t*)chunk->data) = segment_usage;
+		usage.set(segment_number, segment_usage);
+	}
+
+	// groups can allocate from the same segment at once (when a run is stolen). chunks
+	// is negative when they are freed
+	void add_segment_usage(uint64_t segment_number, int64_t chunks) {
+		usage.add(segment_number, chunks);
+	}
+
+	// writes the usage of the segments that changed into their summary chunks
+	void checkpoint_usage();
+
+	inline void touch_segment(uint64_t segment_number) {
+		__atomic_store_n(&segment_written[segment_number], write_clock.load(std::memory_order_relaxed), __ATOMIC_RELAXED);
+	}
+
+	inline uint64_t segment_age(uint64_t segment_number) {
+		return write_clock.load(std::memory_order_relaxed) - __atomic_load_n(&segment_written[segment_number], __ATOMIC_RELAXED);
 	}
 
 	uint64_t get_segment_chunk_to_inode(uint64_t segment_number, uint64_t chunk_number) {
 		std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
-		return ((uint64_t*)chunk->data)[chunk_number];
+		return ((uint64_t*)chunk->data)[chunk_number * summary_words];
+	}
+
+	ChunkPosition get_segment_chunk_position(uint64_t segment_number, uint64_t chunk_number) {
+		if (summary_words < 2) 
+			return ChunkPosition();
+		std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
+		return ChunkPosition::unpack(((uint64_t*)chunk->data)[chunk_number * summary_words + 1]);
 	}
 
-	void set_segment_chunk_to_inode(uint64_t segment_number, uint64_t chunk_number, uint64_t inode_number) {
+	void set_segment_chunk_to_inode(uint64_t segment_number, uint64_t chunk_number, uint64_t inode_number, 
+			const ChunkPosition &position) {
 		std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
-		((uint64_t*)chunk->data)[chunk_number] = inode_number;
+		uint64_t *entry = (uint64_t*)chunk->data + chunk_number * summary_words;
+		entry[0] = inode_number;
+		if (summary_words >= 2) 
+			entry[1] = position.pack();
 	}
 
 	void clear_all_segments() {
@@ -59,54 +199,100 @@ struct SegmentController {
 		}
 	}
 
-	//Find a new free segment
-	void set_new_free_segment() {
-		for(int i = 0; i < num_segments; i++) {
-			if(get_segment_usage(i) == 0) {
-				current_segment = i;
-				current_chunk = 1;
-				return;
-			}
+	// sets up the allocation groups once the fields above are filled in
+	void init_groups() {
+		if (segment_size - 1 > ReservedRun::MAX_COUNT) {
+			throw FileSystemException("segments are too large to be reserved by an allocation group");
 		}
-		current_segment = -1;
+		groups.init(num_segments, 4);
+		// hot from the front of the disk and cold from the back, when their own slice 
+		// has nothing free they take from the others like any group
+		heads[HOT - 1].first = 0;
+		heads[COLD - 1].first = num_segments - 1;
+		segment_open.assign(num_segments, 0);
+		segment_written.assign(num_segments, 0);
+		usage.init(num_segments, groups.size());
 	}
 
-	uint64_t alloc_next(uint64_t inode_number) {
-		//lock the segment controller, releases automatically at function exit
-		std::lock_guard<std::mutex> lock(segment_controller_lock);
-
-		//make sure we still have chunks available in this segment
-		if(current_chunk == segment_size) {
-			set_new_free_segment();
-		}
-
-		//TODO: Try cleaning first?
-
-		//throw exception if disk full
-		if(current_segment == -1) {
-			throw FileSystemException("FileSystem out of space -- unable to allocate a new chunk");
-		}
-
-<<<<<<< HEAD
-		std::shared_ptr<Chunk> chunk = this->disk->get_chunk(range.start_idx);
-		this->disk_block_map->set(range.start_idx);
-		std::memset(chunk->data, 0, this->disk->chunk_size());
-=======
-		//increment segment usage
-		set_segment_usage(current_segment, get_segment_usage(current_segment) + 1);
-
-		//set the inode mapping
-		set_segment_chunk_to_inode(current_segment, current_chunk, inode_number);
->>>>>>> 12974fca3a9c6636b6049fec229036eadd34c94a
-
-		//compute absolute index of current chunk
-		uint64_t ret = data_offset + current_segment * segment_size + current_chunk;
+	// fills in the usage and queues every segment, once the groups are set up. on a new
+	// file system everything is free. a loaded one counts the marked chunks in each
+	// segment, which leaves the summary chunks alone: the groups give back what they
+	// did not hand out when the file system is put away, so whatever is marked is in
+	// use. if the copy in the summaries can not be trusted (a crash) it is rewritten
+	void init_usage(bool loaded, bool summaries_trusted);
+
+	// gives the rest of every group's open segment back, for when the file system is 
+	// put away
+	void release_reservations();
+	// chunks that were reserved but never handed out, so never counted in the usage
+	void release_reserved(uint64_t start, uint64_t count);
+
+	// whether a group could open the segment, the caller holds segment_controller_lock
+	bool segment_is_free(uint64_t segment) {
+		// a marked summary means the segment was opened before, or that runs have 
+		// been handed out of it
+		return !segment_open[segment] && get_segment_usage(segment) == 0 && 
+			!block_map->get(data_offset + segment * segment_size);
+	}
 
-		//update current chunk
-		current_chunk++;
+	uint64_t free_segment_count();
+
+	// opens a free segment for the group, from its own slice of the disk if there is 
+	// one free there. the caller holds the group's lock
+	bool set_new_free_segment(AllocGroup &group);
+
+	// for the cleaner: up to limit segments it could clean (neither open nor full), 
+	// the emptiest first
+	std::vector<uint64_t> cleaning_candidates(size_t limit);
+
+	// when every segment is in use, asks the cleaner to empty one. the chunk comes out
+	// of the stream if there is one, which is refilled from the group when it is empty.
+	// tables and extent nodes are HOT whatever temperature is asked for
+	uint64_t alloc_next(uint64_t inode_number, const ChunkPosition &position, ReservedRun *stream = nullptr, 
+		Temperature temperature = WARM);
+
+	// gives back what is left of the stream
+	void release_stream(ReservedRun &stream);
+
+	// hands out a run of up to length chunks that are contiguous on disk, all of them
+	// from one segment. the run is shorter than asked for if there is no free run that
+	// long, bit_count is 0 if there is nothing free at all. the run holds data, from 
+	// first_logical on in the file if that is known
+	DiskBitMap::BitRange alloc_run(uint64_t inode_number, uint64_t length, FreeExtents::Policy policy, 
+		uint64_t first_logical = ChunkPosition::UNKNOWN);
+
+	// the batch version of alloc_next for data: up to length chunks that are contiguous
+	// on disk, out of the stream while it lasts and then the group's open segment, with
+	// one claim and one pass over the summary. the run ends where the stream or the 
+	// segment does, so it can be shorter, but it is never empty
+	DiskBitMap::BitRange alloc_next_run(uint64_t inode_number, uint64_t first_logical, uint64_t length, 
+		ReservedRun *stream = nullptr);
+
+	// marks the runs free in the block map
+	void release_runs(const DiskBitMap::BitRange *runs, size_t count);
+
+	// for the cleaner: a chunk to move a live chunk of the segment being cleaned to, 
+	// out of a hole in another segment if no segment can be opened
+	uint64_t alloc_relocation(uint64_t inode_number, const ChunkPosition &position);
+
+	// for the cleaner: keeps the segment out of the free extent index while its live
+	// chunks are moved out, and then, once they all are, makes it free again. if the
+	// cleaner has to give up on the segment the index is built again
+	void begin_cleaning(uint64_t segment);
+	void finish_cleaning(uint64_t segment);
+	void abort_cleaning(uint64_t segment);
 
-		return ret;
-	}
+private:
+	// the caller holds extents_lock
+	void build_free_extents();
+	// set_new_free_segment under segment_controller_lock, finished is set to the 
+	// segment the group had open before the one it is done with, if it had one
+	bool open_free_segment(AllocGroup &group, uint64_t &finished);
+	// claims up to wanted chunks off the group's open segment, opening another one, 
+	// stealing a chunk or running the cleaner when it has none left
+	void claim_from_group(AllocGroup &group, uint64_t wanted, uint64_t &start, uint64_t &count);
+	// counts a run that was handed out in its segment's usage and summary
+	void note_run(uint64_t inode_number, const DiskBitMap::BitRange &run, uint64_t first_logical);
 };
 
 struct SuperBlock {
@@ -133,25 +319,76 @@ struct SuperBlock {
   
   SegmentController segment_controller;
 
+  // before the readahead, but after everything its background thread cleans
+  std::unique_ptr<SegmentCleaner> cleaner;
+
+  // declared last so that its prefetch thread is stopped before anything it uses goes away
+  std::unique_ptr<Readahead> readahead;
+
   SuperBlock(Disk *disk);
   
   void init(double inode_table_size_rel_to_disk);
   void load_from_disk();
+
+  // tells the disk which chunks hold metadata (the superblock, the bitmap, the inode 
+  // table and the segment summaries) so that they stay cached under direct io
+  void register_metadata_regions();
+
+  // the free space counters are written to the superblock when it goes away, and only
+  // trusted at the next load if that happened (otherwise the bitmaps are counted again)
+  ~SuperBlock();
+  void store_counters(bool clean);
+
+  uint64_t free_chunk_count() const {
+	return segment_controller.free_chunks.load(std::memory_order_relaxed);
+  }
+
+  uint64_t free_inode_count() const;
   
-  std::shared_ptr<Chunk> allocate_chunk(uint64_t inode_number) {
+  std::shared_ptr<Chunk> allocate_chunk(uint64_t inode_number, const ChunkPosition &position, ReservedRun *stream = nullptr) {
 	//Allocate the next chunk, does error handling internally
-	uint64_t chunk_index = segment_controller.alloc_next(inode_number);
+	uint64_t chunk_index = segment_controller.alloc_next(inode_number, position, stream);
 
 	//return the chunk
     std::shared_ptr<Chunk> chunk = this->disk->get_chunk(chunk_index);
     return std::move(chunk);
   }
 
+  // chunks first_logical on of the file, as many of count as follow each other on 
+  // disk. see alloc_next_run
+  DiskBitMap::BitRange allocate_chunk_batch(uint64_t inode_number, uint64_t first_logical, uint64_t count, 
+		ReservedRun *stream = nullptr) {
+	return segment_controller.alloc_next_run(inode_number, first_logical, count, stream);
+  }
+
+  // a run of chunks out of the holes in the segments. see alloc_run
+  DiskBitMap::BitRange allocate_chunk_run(uint64_t inode_number, uint64_t chunk_count, 
+		FreeExtents::Policy policy = FreeExtents::BEST_FIT, uint64_t first_logical = ChunkPosition::UNKNOWN) {
+	return segment_controller.alloc_run(inode_number, chunk_count, policy, first_logical);
+  }
+
   void free_chunk(std::shared_ptr<Chunk> chunk_to_free) {
 		if (!chunk_to_free.unique()) {
 			throw FileSystemException("FileSystem free chunk failed -- the chunk passed was not 'unique', something else is using it");
 		}
-		this->disk_block_map->clr(chunk_to_free->chunk_idx);
+		DiskBitMap::BitRange run;
+		run.start_idx = chunk_to_free->chunk_idx;
+		run.bit_count = 1;
+		this->segment_controller.release_runs(&run, 1);
+  }
+
+  // frees chunk_count chunks starting at first_chunk_idx without loading them
+  void free_chunk_run(uint64_t first_chunk_idx, uint64_t chunk_count) {
+		DiskBitMap::BitRange run;
+		run.start_idx = first_chunk_idx;
+		run.bit_count = chunk_count;
+		this->segment_controller.release_runs(&run, 1);
+  }
+
+  // frees a batch of runs at once
+  void free_chunk_runs(const std::vector<DiskBitMap::BitRange> &runs) {
+		if (!runs.empty()) 
+			this->segment_controller.release_runs(&runs[0], runs.size());
   }
 };
 
@@ -169,7 +406,8 @@ struct FileSystem {
 struct INode;
 
 struct INodeTable {
-	std::recursive_mutex lock;
+	// how many inodes an allocation group reserves from the bitmap at a time
+	static constexpr uint64_t RESERVE_INODES = 32;
 
 	SuperBlock *superblock = nullptr;
 	uint64_t inode_table_size_chunks = 0; // size of the inode table including used_inodes bitmap + ilist 
@@ -178,12 +416,24 @@ struct INodeTable {
 	uint64_t inode_count = 0;
 	uint64_t inodes_per_chunk = 0;
 
-	SharedObjectCache<uint64_t, INode> inodecache;
+	ShardedObjectCache<uint64_t, INode> inodecache;
 	std::unique_ptr<DiskBitMap> used_inodes;
 	// struct INode ilist[10]; //TODO: change the size
 
+	// inodes reserved by an allocation group are already marked used in the bitmap,
+	// whatever is left of the reservations is handed back when the table goes away
+	AllocGroups groups;
+
+	// inodes that are unset in used_inodes. like free_chunks, inodes reserved by a
+	// group count as used until they are handed back
+	std::atomic<uint64_t> free_inodes{0};
+
 	// size and offset are in chunks
 	INodeTable(SuperBlock *superblock, uint64_t offset_chunks, uint64_t inode_count);
+	~INodeTable();
+
+	// clears whatever is left of the groups' reserved runs in the bitmap
+	void release_reservations();
 
 	void format_inode_table();
 
@@ -218,6 +468,10 @@ struct INode {
 	static constexpr uint8_t FLAG_IF_DIR = 1;
 	static constexpr uint8_t FLAG_IF_REG = 2;
 
+	// how the inode maps the chunks of the file, see INodeData::mapping
+	static constexpr uint8_t MAPPING_BLOCKS = 0;
+	static constexpr uint8_t MAPPING_EXTENTS = 1;
+
 	struct INodeData {
 		// we store the data in a subclass so that it can be serialized independently 
 		// from data structures that INode needs to keep when loaded in memory
@@ -230,23 +484,158 @@ struct INode {
 		uint64_t addresses[ADDRESS_COUNT] = {0}; //8 direct
 		uint16_t permissions = 0644;
 		uint8_t file_type = 0;
+		// MAPPING_BLOCKS: addresses holds direct and indirect block pointers
+		// MAPPING_EXTENTS: addresses holds the root of an extent tree
+		uint8_t mapping = MAPPING_BLOCKS;
+	};
+
+	/*
+		the extent format maps runs of chunks, (logical start, physical start, length),
+		instead of every chunk on its own, so a file that was written in order takes one
+		entry per segment it spans rather than one pointer per chunk. the tree is rooted
+		in data.addresses and every other node fills a chunk. a node is an ExtentHeader
+		followed by its entries sorted by logical start, Extents in a leaf (depth 0) and
+		ExtentIndexes pointing at the next level down otherwise. an index entry's 
+		logical start is never above the first chunk its child maps
+	*/
+	struct ExtentHeader {
+		uint16_t count = 0; // entries in use
+		uint16_t depth = 0; // levels below this node
+		uint32_t reserved = 0;
+	};
+
+	struct Extent {
+		uint64_t logical = 0; // the first chunk of the file in the run
+		uint64_t physical = 0; // and where it is on disk
+		uint64_t length = 0; // in chunks
+	};
+
+	struct ExtentIndex {
+		uint64_t logical = 0;
+		uint64_t child = 0; // chunk index of the node
 	};
 	
+	/*
+		an in memory cache of where the file's chunks live, so that reads do not walk
+		the indirection tables again for every chunk. the direct addresses are in the
+		inode already, for everything else we keep copies of the last level tables (the
+		ones that point at data chunks) that the most recent walks ended at, so that a
+		chunk whose table is cached resolves with a single lookup. holes are never 
+		trusted, and the whole thing is dropped whenever the file is written or its 
+		chunks are released
+	*/
+	struct BlockMapCache {
+		static constexpr size_t LEAF_SLOTS = 32;
+
+		struct Leaf {
+			uint64_t first = 0; // the chunk number that addresses[0] maps
+			std::vector<uint64_t> addresses; // empty if the slot is unused
+		};
+		Leaf leaves[LEAF_SLOTS];
+
+		Extent extent; // the extent the last lookup found, for the extent format
+
+		uint64_t hits = 0;
+		uint64_t walks = 0;
+	};
+
 	std::mutex lock;
 	uint64_t inode_table_idx = 0;
 	INodeData data;
 	SuperBlock *superblock = nullptr;	
+	std::unique_ptr<BlockMapCache> block_map; // allocated by the first lookup
+	ReservedRun stream; // the chunks the file's writes take next, see SegmentController
 
 	~INode() {
 		if (this->superblock != nullptr) {
 			// stores the data for this inode back into the inode table now that it is 
 			// having its destructor called
 			this->superblock->inode_table->update_inode(*this);
+			this->superblock->segment_controller.release_stream(this->stream);
 		}
 	}
 
 	std::shared_ptr<Chunk> resolve_indirection(uint64_t chunk_number, bool createIfNotExists);
 
+	// the same walk of the indirection tables as resolve_indirection, but only returns
+	// the index of the data chunk (0 if there is none) without loading it
+	uint64_t resolve_chunk_idx(uint64_t chunk_number, bool createIfNotExists);
+
+	// drops everything the block map cache knows about the file
+	void invalidate_block_map();
+
+	// switches the inode between MAPPING_BLOCKS and MAPPING_EXTENTS, which is only 
+	// possible while the file has no chunks
+	void set_mapping(uint8_t mapping);
+
+	// the number of runs the extent tree maps and the number of levels below its root
+	uint64_t extent_count();
+	inline uint64_t extent_depth() const {
+		return ((const ExtentHeader *)data.addresses)->depth;
+	}
+
+	// lookups answered by the block map cache, and walks of the indirection tables
+	inline uint64_t block_map_hits() const {
+		return block_map == nullptr ? 0 : block_map->hits;
+	}
+	inline uint64_t block_map_walks() const {
+		return block_map == nullptr ? 0 : block_map->walks;
+	}
+
+	// read and write load up to IO_BATCH_CHUNKS chunks of the file at a time so that the
+	// disk can fetch them all at once, chunks[i] is set to the i'th chunk from 
+	// starting_offset (nullptr for holes) and the number of chunks is returned
+	static constexpr uint64_t IO_BATCH_CHUNKS = 32;
+	size_t get_chunk_batch(uint64_t starting_offset, uint64_t n, bool createIfNotExists, std::shared_ptr<Chunk> *chunks);
+private:
+	// the walk of the indirection tables behind resolve_chunk_idx. a hole is filled 
+	// with physical rather than a chunk of its own if that is given
+	uint64_t walk_chunk_idx(uint64_t chunk_number, bool createIfNotExists, uint64_t physical = 0);
+
+	// a write that runs past the end of the file allocates the chunks it needs there
+	// up front, a run at a time, instead of one chunk per call as it goes. the chunks
+	// that are written in full are not zeroed
+	void allocate_range(uint64_t starting_offset, uint64_t bytes);
+
+	// a node of the extent tree, the root or a chunk that is held for as long as the 
+	// node is
+	struct ExtentNode;
+	ExtentNode extent_root();
+	ExtentNode extent_node(std::shared_ptr<Chunk> chunk);
+
+	// the chunk index that chunk_number maps to, 0 for a hole
+	uint64_t extent_lookup(uint64_t chunk_number);
+	// allocates a chunk for the hole at chunk_number and maps it
+	uint64_t extent_alloc(uint64_t chunk_number);
+	void extent_insert(const Extent &extent);
+	// returns true if node was split, in which case split is the entry for the new
+	// sibling that the parent has to take
+	bool extent_insert(ExtentNode &node, const Extent &extent, ExtentIndex *split);
+	template <typename Entry>
+	bool extent_insert_entry(ExtentNode &node, size_t pos, const Entry &entry, ExtentIndex *split);
+	uint64_t extent_count(ExtentNode &node);
+	// collects the runs of chunks the tree maps, and the chunks of the nodes below the root
+	void extent_release(ExtentNode &node, std::vector<DiskBitMap::BitRange> &runs);
+	// collects the table and, below level 1, the tables it points at
+	void table_release(uint64_t table_idx, uint64_t level, std::vector<DiskBitMap::BitRange> &runs);
+
+	uint64_t relocate_in_table(uint64_t table_idx, uint64_t level, uint64_t first, uint64_t end, 
+		std::unordered_map<uint64_t, uint64_t> &moves);
+	// patches the nodes below node, and collects the (single chunk) extents that leaves
+	// have to map somewhere else instead
+	uint64_t extent_relocate(ExtentNode &node, uint64_t first, uint64_t end, 
+		std::unordered_map<uint64_t, uint64_t> &moves, std::vector<Extent> &remaps);
+	// maps the chunk at logical, which the tree maps already, to physical instead
+	void extent_remap(uint64_t logical, uint64_t physical);
+
+	// the pointer to the table (or data chunk) at level on the way down to logical, 
+	// nullptr if there is none. holder keeps the table the pointer is in loaded
+	uint64_t *block_pointer(uint64_t logical, uint64_t level, std::shared_ptr<Chunk> &holder);
+	// the same for the extent tree, the child pointer to the node at level (its depth
+	// plus one) that maps logical
+	uint64_t *extent_pointer(uint64_t logical, uint64_t level, std::shared_ptr<Chunk> &holder);
+public:
+
 	static uint64_t get_file_size();
 
 	// NOTE: read is NOT const, it will allocate chunks when reading inodes 
@@ -256,6 +645,18 @@ struct INode {
 	uint64_t write(uint64_t starting_offset, const char *buf, uint64_t n);
 	void release_chunks(); // use this before removing an inode from the inode table
 
+	// points the inode at copies of its chunks that the cleaner made. moves maps the
+	// old chunk index to the new one, and only old chunks in [first, end) are looked 
+	// for. returns how many of them the inode referred to, and leaves moves with the
+	// ones it did not
+	uint64_t relocate_chunks(uint64_t first, uint64_t end, std::unordered_map<uint64_t, uint64_t> &moves);
+
+	// the same for a single chunk whose position in the file the segment summary 
+	// recorded, going straight down the tree to the pointer to it. returns false (and
+	// changes nothing) if the pointer there is not to from, the position may be stale.
+	// tables and nodes have to be moved before the chunks below them
+	bool relocate_chunk(uint64_t from, uint64_t to, const ChunkPosition &position);
+
 	std::string to_string();
 
 	void set_type(mode_t type){
@@ -0,0 +1,107 @@
+#include <iterator>
+
+#include "freeextents.hpp"
+
+void FreeExtents::clear() {
+	this->by_address.clear();
+	this->by_length.clear();
+	this->total = 0;
+	this->next_fit = 0;
+}
+
+void FreeExtents::add(uint64_t start, uint64_t length) {
+	this->by_address[start] = length;
+	this->by_length.insert(std::make_pair(length, start));
+	this->total += length;
+}
+
+void FreeExtents::erase(std::map<uint64_t, uint64_t>::iterator extent) {
+	this->by_length.erase(std::make_pair(extent->second, extent->first));
+	this->total -= extent->second;
+	this->by_address.erase(extent);
+}
+
+void FreeExtents::insert(uint64_t start, uint64_t length) {
+	if (length == 0)
+		return ;
+
+	auto next = this->by_address.lower_bound(start);
+	if (next != this->by_address.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == start) {
+			start = prev->first;
+			length += prev->second;
+			this->erase(prev);
+		}
+	}
+	if (next != this->by_address.end() && next->first == start + length) {
+		length += next->second;
+		this->erase(next);
+	}
+	this->add(start, length);
+}
+
+void FreeExtents::remove(uint64_t start, uint64_t length) {
+	const uint64_t end = start + length;
+	auto extent = this->by_address.upper_bound(start);
+	if (extent != this->by_address.begin()) {
+		auto prev = std::prev(extent);
+		if (prev->first + prev->second > start)
+			extent = prev;
+	}
+
+	while (extent != this->by_address.end() && extent->first < end) {
+		const uint64_t extent_start = extent->first;
+		const uint64_t extent_end = extent->first + extent->second;
+		auto next = std::next(extent);
+		this->erase(extent);
+		// keep whatever sticks out either side
+		if (extent_start < start)
+			this->add(extent_start, start - extent_start);
+		if (extent_end > end)
+			this->add(end, extent_end - end);
+		extent = next;
+	}
+}
+
+bool FreeExtents::take(uint64_t length, Policy policy, Extent &taken) {
+	if (length == 0)
+		return false;
+
+	uint64_t start = 0;
+	if (policy == BEST_FIT) {
+		auto fit = this->by_length.lower_bound(std::make_pair(length, (uint64_t)0));
+		if (fit == this->by_length.end())
+			return false;
+		start = fit->second;
+	} else {
+		// from where the last run was taken to the end, then around from the start
+		auto from = this->by_address.lower_bound(this->next_fit);
+		auto fit = from;
+		while (fit != this->by_address.end() && fit->second < length)
+			++fit;
+		if (fit == this->by_address.end()) {
+			fit = this->by_address.begin();
+			while (fit != from && fit->second < length)
+				++fit;
+			if (fit == from)
+				return false;
+		}
+		start = fit->first;
+		this->next_fit = start + length;
+	}
+
+	this->remove(start, length);
+	taken.start = start;
+	taken.length = length;
+	return true;
+}
+
+FreeExtents::Extent FreeExtents::longest() const {
+	Extent extent;
+	if (!this->by_length.empty()) {
+		extent.length = this->by_length.rbegin()->first;
+		extent.start = this->by_length.rbegin()->second;
+	}
+	return extent;
+}
@@ -0,0 +1,62 @@
+#ifndef FREEEXTENTS_HPP
+#define FREEEXTENTS_HPP
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <utility>
+
+/*
+	the free runs of a space of indexes (chunks, say), kept twice: by where they start,
+	so that a freed run can find its neighbours and merge with them, and by how long
+	they are, so that the smallest run that fits a request is a single lookup. the
+	owner does the locking
+*/
+class FreeExtents {
+public:
+	enum Policy : uint8_t {
+		BEST_FIT = 0, // the shortest run that is long enough
+		NEXT_FIT = 1 // the first run long enough after where the last one was found
+	};
+
+	struct Extent {
+		uint64_t start = 0;
+		uint64_t length = 0;
+	};
+
+	void clear();
+
+	// adds a free run, merging it with whatever free runs it touches. the run must
+	// not overlap one that is already free
+	void insert(uint64_t start, uint64_t length);
+
+	// takes [start, start + length) out of the free runs, it does not have to be free
+	void remove(uint64_t start, uint64_t length);
+
+	// takes length from the start of a free run that is at least that long, returns
+	// false (and takes nothing) if there is none
+	bool take(uint64_t length, Policy policy, Extent &taken);
+
+	// the longest free run, length is 0 if there is nothing free
+	Extent longest() const;
+
+	inline size_t size() const {
+		return by_address.size();
+	}
+
+	// the total length of the free runs
+	inline uint64_t free_count() const {
+		return total;
+	}
+
+private:
+	std::map<uint64_t, uint64_t> by_address; // start -> length
+	std::set<std::pair<uint64_t, uint64_t>> by_length; // (length, start)
+	uint64_t total = 0;
+	uint64_t next_fit = 0; // where a next fit search starts
+
+	void add(uint64_t start, uint64_t length);
+	void erase(std::map<uint64_t, uint64_t>::iterator extent);
+};
+
+#endif
@@ -0,0 +1,292 @@
+#include <cassert>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ioengine.hpp"
+
+std::unique_ptr<IOEngine> IOEngine::create(int fd, IOEngineType type) {
+	if (type != IO_ENGINE_POSIX) {
+		try {
+			return std::unique_ptr<IOEngine>(new IOUringEngine(fd));
+		} catch (const DiskException &e) {
+			if (type == IO_ENGINE_URING) {
+				fprintf(stdout, "io_uring is not available, falling back to pread/pwrite: %s\n", e.message.c_str());
+			}
+		}
+	}
+	return std::unique_ptr<IOEngine>(new PosixIOEngine(fd));
+}
+
+/*
+	Posix engine
+*/
+
+void PosixIOEngine::perform(int fd, IORequest &request) {
+	Size done = 0;
+	while (done < request.length) {
+		ssize_t res = request.write
+			? pwrite(fd, request.buffer + done, request.length - done, request.offset + done)
+			: pread(fd, request.buffer + done, request.length - done, request.offset + done);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue ;
+			request.result = -errno;
+			return ;
+		}
+		if (res == 0) {
+			if (request.write) {
+				request.result = -EIO;
+				return ;
+			}
+			// past the end of the backing file, reads as zeros
+			std::memset(request.buffer + done, 0, request.length - done);
+			break ;
+		}
+		done += res;
+	}
+	request.result = request.length;
+}
+
+void PosixIOEngine::submit(IORequest *requests, size_t count) {
+	for (size_t idx = 0; idx < count; ++idx) {
+		perform(this->fd, requests[idx]);
+	}
+}
+
+/*
+	io_uring engine
+*/
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+struct IOUringEngine::Ring {
+	std::mutex lock;
+	int ring_fd = -1;
+
+	void *sq_ring = MAP_FAILED;
+	size_t sq_ring_size = 0;
+	void *cq_ring = MAP_FAILED;
+	size_t cq_ring_size = 0;
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+	size_t sqes_size = 0;
+
+	unsigned sq_entries = 0;
+	unsigned *sq_head = nullptr;
+	unsigned *sq_tail = nullptr;
+	unsigned *sq_mask = nullptr;
+	unsigned *sq_array = nullptr;
+
+	unsigned *cq_head = nullptr;
+	unsigned *cq_tail = nullptr;
+	unsigned *cq_mask = nullptr;
+	struct io_uring_cqe *cqes = nullptr;
+
+	Ring(unsigned entries) {
+		struct io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		this->ring_fd = sys_io_uring_setup(entries, &params);
+		if (this->ring_fd < 0) {
+			char buff[1024];
+			sprintf(buff, "io_uring_setup failed, error code %d", errno);
+			throw DiskException(buff);
+		}
+		this->sq_entries = params.sq_entries;
+
+		this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) {
+			this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+		}
+
+		this->sq_ring = mmap(NULL, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			this->ring_fd, IORING_OFF_SQ_RING);
+		if (this->sq_ring == MAP_FAILED) {
+			this->release();
+			throw DiskException("failed to map the io_uring submission queue");
+		}
+
+		if (single_mmap) {
+			this->cq_ring = this->sq_ring;
+		} else {
+			this->cq_ring = mmap(NULL, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				this->ring_fd, IORING_OFF_CQ_RING);
+			if (this->cq_ring == MAP_FAILED) {
+				this->release();
+				throw DiskException("failed to map the io_uring completion queue");
+			}
+		}
+
+		this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		this->sqes = (struct io_uring_sqe *)mmap(NULL, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			this->ring_fd, IORING_OFF_SQES);
+		if (this->sqes == MAP_FAILED) {
+			this->release();
+			throw DiskException("failed to map the io_uring submission entries");
+		}
+
+		Byte *sq = (Byte *)this->sq_ring;
+		this->sq_head = (unsigned *)(sq + params.sq_off.head);
+		this->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+		this->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+		this->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+		Byte *cq = (Byte *)this->cq_ring;
+		this->cq_head = (unsigned *)(cq + params.cq_off.head);
+		this->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+		this->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+		this->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	}
+
+	void release() {
+		if (this->sqes != MAP_FAILED)
+			munmap(this->sqes, this->sqes_size);
+		if (this->cq_ring != MAP_FAILED && this->cq_ring != this->sq_ring)
+			munmap(this->cq_ring, this->cq_ring_size);
+		if (this->sq_ring != MAP_FAILED)
+			munmap(this->sq_ring, this->sq_ring_size);
+		if (this->ring_fd >= 0)
+			close(this->ring_fd);
+		this->sqes = (struct io_uring_sqe *)MAP_FAILED;
+		this->sq_ring = this->cq_ring = MAP_FAILED;
+		this->ring_fd = -1;
+	}
+
+	~Ring() {
+		this->release();
+	}
+};
+
+IOUringEngine::IOUringEngine(int fd) : fd(fd) {
+	for (size_t idx = 0; idx < RING_COUNT; ++idx) {
+		this->rings.push_back(std::unique_ptr<Ring>(new Ring(RING_ENTRIES)));
+	}
+}
+
+IOUringEngine::~IOUringEngine() {
+}
+
+void IOUringEngine::submit(IORequest *requests, size_t count) {
+	if (count == 0)
+		return ;
+
+	// take whichever ring is free, starting from one picked by the thread so that
+	// threads tend to stick to their own ring
+	const size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % RING_COUNT;
+	for (size_t step = 0; step < RING_COUNT; ++step) {
+		Ring &ring = *this->rings[(start + step) % RING_COUNT];
+		std::unique_lock<std::mutex> g(ring.lock, std::try_to_lock);
+		if (g.owns_lock()) {
+			this->submit_on(ring, requests, count);
+			return ;
+		}
+	}
+
+	Ring &ring = *this->rings[start];
+	std::lock_guard<std::mutex> g(ring.lock);
+	this->submit_on(ring, requests, count);
+}
+
+void IOUringEngine::submit_on(Ring &ring, IORequest *requests, size_t count) {
+	// bytes transferred so far for each request, short transfers are resubmitted for
+	// whatever is left over
+	std::vector<Size> done(count, 0);
+	std::vector<size_t> pending;
+	pending.reserve(count);
+	for (size_t idx = count; idx > 0; --idx) {
+		requests[idx - 1].result = 0;
+		pending.push_back(idx - 1);
+	}
+
+	unsigned in_flight = 0;
+	unsigned unsubmitted = 0;
+	while (!pending.empty() || in_flight > 0) {
+		// fill the submission queue with as much as it will take
+		unsigned tail = *ring.sq_tail;
+		const unsigned mask = *ring.sq_mask;
+		while (!pending.empty() && in_flight < ring.sq_entries) {
+			const size_t idx = pending.back();
+			pending.pop_back();
+
+			IORequest &request = requests[idx];
+			struct io_uring_sqe *sqe = &ring.sqes[tail & mask];
+			std::memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = this->fd;
+			sqe->addr = (uint64_t)(uintptr_t)(request.buffer + done[idx]);
+			sqe->len = (uint32_t)(request.length - done[idx]);
+			sqe->off = request.offset + done[idx];
+			sqe->user_data = idx;
+			ring.sq_array[tail & mask] = tail & mask;
+			tail++;
+			in_flight++;
+			unsubmitted++;
+		}
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		int res = sys_io_uring_enter(ring.ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+		if (res < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue ;
+			char buff[1024];
+			sprintf(buff, "io_uring_enter failed, error code %d", errno);
+			throw DiskException(buff);
+		}
+		unsubmitted -= std::min<unsigned>(res, unsubmitted);
+
+		// reap every completion that is ready
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			const size_t idx = (size_t)cqe->user_data;
+			const int32_t result = cqe->res;
+			head++;
+			in_flight--;
+
+			IORequest &request = requests[idx];
+			if (result == -EINTR || result == -EAGAIN) {
+				pending.push_back(idx);
+			} else if (result == -EINVAL || result == -EOPNOTSUPP) {
+				// an older kernel without IORING_OP_READ/WRITE, do this one the slow way
+				Byte *buffer = request.buffer;
+				IORequest rest = request;
+				rest.buffer = buffer + done[idx];
+				rest.offset += done[idx];
+				rest.length -= done[idx];
+				PosixIOEngine::perform(this->fd, rest);
+				request.result = rest.result < 0 ? rest.result : (ssize_t)request.length;
+			} else if (result < 0) {
+				request.result = result;
+			} else if (result == 0) {
+				if (request.write) {
+					request.result = -EIO;
+				} else {
+					// past the end of the backing file, reads as zeros
+					std::memset(request.buffer + done[idx], 0, request.length - done[idx]);
+					request.result = request.length;
+				}
+			} else {
+				done[idx] += result;
+				if (done[idx] < request.length) {
+					pending.push_back(idx);
+				} else {
+					request.result = request.length;
+				}
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
@@ -0,0 +1,92 @@
+#ifndef IOENGINE_HPP
+#define IOENGINE_HPP
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <sys/types.h>
+
+#include "diskinterface.hpp"
+
+/*
+	a single read or write of length bytes at offset in the backing file. once the
+	request completes result holds length on success or -errno on failure, reads
+	that run past the end of the file are zero filled and count as complete
+*/
+struct IORequest {
+	Byte *buffer = nullptr;
+	Size offset = 0;
+	Size length = 0;
+	bool write = false;
+	ssize_t result = 0;
+};
+
+/*
+	performs batches of reads and writes against the backing file. submit blocks
+	until every request in the batch is complete, but an engine is free to have
+	all of them in flight at once
+*/
+class IOEngine {
+public:
+	virtual ~IOEngine() { }
+
+	virtual void submit(IORequest *requests, size_t count) = 0;
+
+	virtual const char *name() const = 0;
+
+	// returns the engine asked for, falling back to pread/pwrite when io_uring
+	// is asked for (or picked by IO_ENGINE_AUTO) but not available
+	static std::unique_ptr<IOEngine> create(int fd, IOEngineType type);
+};
+
+/*
+	one blocking pread or pwrite per request, i.e. a queue depth of 1
+*/
+class PosixIOEngine : public IOEngine {
+private:
+	const int fd;
+public:
+	PosixIOEngine(int fd) : fd(fd) { }
+
+	void submit(IORequest *requests, size_t count) override;
+
+	const char *name() const override {
+		return "posix";
+	}
+
+	// performs a single request synchronously, shared with the io_uring engine
+	// for requests that the kernel does not support
+	static void perform(int fd, IORequest &request);
+};
+
+/*
+	drives io_uring directly through its system calls, there is no dependency on
+	liburing. a batch is pushed onto the submission queue all at once and completions
+	are reaped as they arrive. a handful of rings are kept so that batches from
+	different threads do not wait on each other
+*/
+class IOUringEngine : public IOEngine {
+private:
+	static constexpr size_t RING_COUNT = 4;
+	static constexpr unsigned RING_ENTRIES = 64;
+
+	struct Ring;
+
+	const int fd;
+	std::vector<std::unique_ptr<Ring>> rings;
+
+	void submit_on(Ring &ring, IORequest *requests, size_t count);
+public:
+	// throws a DiskException if io_uring is not available
+	IOUringEngine(int fd);
+	~IOUringEngine();
+
+	void submit(IORequest *requests, size_t count) override;
+
+	const char *name() const override {
+		return "io_uring";
+	}
+};
+
+#endif
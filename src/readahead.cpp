@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <vector>
+
+#include "readahead.hpp"
+#include "filesystem.hpp"
+
+constexpr size_t Readahead::MAX_TRACKED_INODES;
+constexpr size_t Readahead::MAX_QUEUED_WINDOWS;
+constexpr size_t Readahead::ADDRESS_COUNT;
+
+static_assert(Readahead::ADDRESS_COUNT == INode::ADDRESS_COUNT, "a window snapshots every block pointer of the inode");
+
+Readahead::Readahead(SuperBlock *superblock)
+	: superblock(superblock), queue(MAX_QUEUED_WINDOWS), 
+	hits(0), misses(0), windows_issued(0), windows_dropped(0), prefetched_chunks(0) {
+}
+
+Readahead::~Readahead() {
+	{
+		std::lock_guard<std::mutex> g(this->lock);
+		this->stop = true;
+	}
+	this->queue_wakeup.notify_all();
+	if (this->prefetcher.joinable()) {
+		this->prefetcher.join();
+	}
+
+	// the scratch inode is only a copy, it must not be stored back to the inode table
+	if (this->scratch_inode != nullptr) {
+		this->scratch_inode->superblock = nullptr;
+	}
+}
+
+void Readahead::set_config(const ReadaheadConfig& config) {
+	std::lock_guard<std::mutex> g(this->lock);
+	this->config = config;
+	if (this->config.min_window_chunks == 0)
+		this->config.min_window_chunks = 1;
+	if (this->config.max_window_chunks < this->config.min_window_chunks)
+		this->config.min_window_chunks = this->config.max_window_chunks;
+}
+
+void Readahead::on_read(const INode &inode, uint64_t starting_offset, uint64_t n) {
+	const uint64_t chunk_size = this->superblock->disk_chunk_size;
+	if (n == 0)
+		return ;
+	const uint64_t first = starting_offset / chunk_size;
+	const uint64_t end = (starting_offset + n - 1) / chunk_size + 1;
+	const uint64_t file_chunks = (inode.data.file_size + chunk_size - 1) / chunk_size;
+
+	std::unique_lock<std::mutex> g(this->lock);
+	if (this->config.max_window_chunks == 0)
+		return ;
+
+	auto ref = this->states.find(inode.inode_table_idx);
+	if (ref == this->states.end()) {
+		if (this->states.size() >= MAX_TRACKED_INODES) {
+			this->states.erase(this->states.begin());
+		}
+		ref = this->states.insert(std::make_pair(inode.inode_table_idx, State())).first;
+	}
+	State &state = ref->second;
+
+	// a read that starts in the chunk the last one ended in is still in order, reads
+	// rarely line up with chunk boundaries
+	const bool in_order = state.pattern == INITIAL
+		? first == 0
+		: first == state.next_chunk || (state.next_chunk > 0 && first == state.next_chunk - 1);
+	state.next_chunk = end;
+
+	if (!in_order) {
+		state.pattern = RANDOM;
+		state.window = 0;
+		state.generation++;
+		return ;
+	}
+
+	if (state.pattern != SEQUENTIAL) {
+		state.pattern = SEQUENTIAL;
+		state.window = this->config.min_window_chunks;
+		state.generation++;
+		state.prefetch_start = state.requested_to = state.completed_to = state.async_mark = end;
+	} else {
+		for (uint64_t chunk = first; chunk < end; ++chunk) {
+			if (chunk >= state.prefetch_start && chunk < state.completed_to) {
+				hits++;
+			} else {
+				misses++;
+			}
+		}
+	}
+
+	// issue the next window when the reader has caught up with everything issued so
+	// far, or as soon as it enters the last window issued
+	const bool caught_up = state.requested_to <= end;
+	if (!(caught_up || end > state.async_mark) || state.requested_to >= file_chunks)
+		return ;
+
+	Window window;
+	window.inode_idx = inode.inode_table_idx;
+	window.from = std::max(state.requested_to, end);
+	window.to = std::min(window.from + state.window, file_chunks);
+	window.generation = state.generation;
+	if (window.from >= window.to)
+		return ;
+	if (this->queue_size >= MAX_QUEUED_WINDOWS) {
+		windows_dropped++;
+		return ;
+	}
+
+	if (caught_up) {
+		// whatever was prefetched before has been passed, start counting afresh
+		state.prefetch_start = state.completed_to = window.from;
+	}
+	state.async_mark = window.from;
+	state.requested_to = window.to;
+	state.window = std::min(state.window * 2, this->config.max_window_chunks);
+
+	std::copy(inode.data.addresses, inode.data.addresses + ADDRESS_COUNT, window.addresses);
+	window.mapping = inode.data.mapping;
+	this->queue[(this->queue_head + this->queue_size) % MAX_QUEUED_WINDOWS] = window;
+	this->queue_size++;
+	windows_issued++;
+
+	if (!this->prefetcher.joinable()) {
+		this->prefetcher = std::thread(&Readahead::prefetcher_main, this);
+	}
+	g.unlock();
+	this->queue_wakeup.notify_one();
+}
+
+void Readahead::prefetch_window(Window &window) {
+	if (this->scratch_inode == nullptr) {
+		// detached from the inode table (superblock is only set while we use it) so 
+		// that it is never stored back
+		this->scratch_inode = std::unique_ptr<INode>(new INode);
+	}
+	INode &inode = *this->scratch_inode;
+	if (this->scratch_inode_idx != window.inode_idx || inode.data.mapping != window.mapping ||
+		!std::equal(window.addresses, window.addresses + ADDRESS_COUNT, inode.data.addresses)) {
+		inode.invalidate_block_map();
+	}
+	std::copy(window.addresses, window.addresses + ADDRESS_COUNT, inode.data.addresses);
+	inode.data.mapping = window.mapping;
+	inode.inode_table_idx = this->scratch_inode_idx = window.inode_idx;
+	inode.superblock = this->superblock;
+
+	std::vector<uint64_t> &chunk_idxs = this->scratch_chunk_idxs;
+	chunk_idxs.clear();
+	try {
+		for (uint64_t chunk = window.from; chunk < window.to; ++chunk) {
+			const Size chunk_idx = inode.resolve_chunk_idx(chunk, false);
+			if (chunk_idx != 0) {
+				chunk_idxs.push_back(chunk_idx);
+			}
+		}
+		this->superblock->disk->prefetch(chunk_idxs.data(), chunk_idxs.size());
+		prefetched_chunks += chunk_idxs.size();
+	} catch (const DiskException &e) {
+		// readahead is only ever a hint, the reader loads whatever we missed
+	} catch (const FileSystemException &e) {
+	}
+	inode.superblock = nullptr;
+}
+
+void Readahead::prefetcher_main() {
+	std::unique_lock<std::mutex> g(this->lock);
+	while (!this->stop) {
+		if (this->queue_size == 0) {
+			this->queue_wakeup.wait(g);
+			continue ;
+		}
+
+		Window window = this->queue[this->queue_head];
+		this->queue_head = (this->queue_head + 1) % MAX_QUEUED_WINDOWS;
+		this->queue_size--;
+		this->prefetching = true;
+		g.unlock();
+
+		this->prefetch_window(window);
+
+		g.lock();
+		this->prefetching = false;
+		auto ref = this->states.find(window.inode_idx);
+		if (ref != this->states.end() && ref->second.generation == window.generation) {
+			ref->second.completed_to = std::max(ref->second.completed_to, window.to);
+		}
+		if (this->queue_size == 0) {
+			this->queue_drained.notify_all();
+		}
+	}
+	this->queue_drained.notify_all();
+}
+
+uint64_t Readahead::window_chunks(uint64_t inode_idx) {
+	std::lock_guard<std::mutex> g(this->lock);
+	auto ref = this->states.find(inode_idx);
+	if (ref == this->states.end() || ref->second.pattern != SEQUENTIAL)
+		return 0;
+	return ref->second.window;
+}
+
+Readahead::Pattern Readahead::pattern(uint64_t inode_idx) {
+	std::lock_guard<std::mutex> g(this->lock);
+	auto ref = this->states.find(inode_idx);
+	return ref == this->states.end() ? INITIAL : ref->second.pattern;
+}
+
+void Readahead::drain() {
+	std::unique_lock<std::mutex> g(this->lock);
+	while (!this->stop && (this->queue_size != 0 || this->prefetching)) {
+		this->queue_drained.wait(g);
+	}
+}
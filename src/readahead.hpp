@@ -0,0 +1,131 @@
+#ifndef READAHEAD_HPP
+#define READAHEAD_HPP
+
+#include <stdint.h>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+
+struct SuperBlock;
+struct INode;
+
+/*
+	bounds on the readahead window, in chunks. the window starts out at
+	min_window_chunks when a file is first read sequentially and doubles every time
+	it is used up until it reaches max_window_chunks. a max of 0 turns readahead off
+*/
+struct ReadaheadConfig {
+	uint64_t min_window_chunks = 4;
+	uint64_t max_window_chunks = 256;
+};
+
+/*
+	per inode readahead. every INode::read is reported here, and each inode keeps a
+	small state machine:
+		INITIAL: nothing read yet
+		SEQUENTIAL: reads pick up where the last one left off, a window of chunks
+			ahead of the reader is prefetched
+		RANDOM: the last read jumped somewhere else, nothing is prefetched until reads
+			are back in order
+
+	while an inode is sequential we stay one window ahead of the reader, i.e. as soon
+	as a read enters the window that was issued last the next (twice as large) window
+	is issued. windows are prefetched on a background thread which walks the inode's
+	indirection tables (loading the indirect blocks as it goes) and hands the data
+	chunks to Disk::prefetch, so a streaming reader should find its chunks already
+	in memory.
+
+	INodeTable::get_inode hands out the INode cached for an index, so callers can end
+	up sharing one. there is no per inode lock, callers that share a cached INode must
+	hold the file system lock (lock_g in myfs) while they use it, on_read included.
+	the cache may also drop an INode and load a fresh one later, so the state lives
+	here keyed by inode index rather than on the INode. the prefetcher never touches
+	a cached INode, it walks a snapshot of the block pointers taken in on_read
+*/
+class Readahead {
+public:
+	enum Pattern : uint8_t { INITIAL = 0, SEQUENTIAL = 1, RANDOM = 2 };
+
+	static constexpr size_t MAX_TRACKED_INODES = 1024;
+	static constexpr size_t MAX_QUEUED_WINDOWS = 64;
+	// INode::ADDRESS_COUNT, which we can not see from here. checked in readahead.cpp
+	static constexpr size_t ADDRESS_COUNT = 11;
+private:
+	struct State {
+		Pattern pattern = INITIAL;
+		uint64_t next_chunk = 0; // where the next read starts if it is sequential
+		uint64_t window = 0;
+		uint64_t async_mark = 0; // a read past this chunk issues the next window
+		uint64_t prefetch_start = 0;
+		uint64_t requested_to = 0; // windows have been issued up to here
+		uint64_t completed_to = 0; // and have been prefetched up to here
+		uint64_t generation = 0; // bumped whenever the stream restarts
+	};
+
+	// a window to prefetch, along with a snapshot of the reader's block pointers
+	struct Window {
+		uint64_t addresses[ADDRESS_COUNT];
+		uint8_t mapping = 0;
+		uint64_t inode_idx = 0;
+		uint64_t from = 0;
+		uint64_t to = 0;
+		uint64_t generation = 0;
+	};
+
+	SuperBlock *superblock;
+	ReadaheadConfig config;
+
+	std::mutex lock;
+	std::unordered_map<uint64_t, State> states;
+	std::vector<Window> queue; // a ring of MAX_QUEUED_WINDOWS windows
+	size_t queue_head = 0;
+	size_t queue_size = 0;
+	std::condition_variable queue_wakeup;
+	std::condition_variable queue_drained;
+	std::thread prefetcher;
+	bool prefetching = false; // a window is being prefetched outside of the lock
+	bool stop = false;
+
+	// only used by the prefetch thread, and kept between windows so that prefetching
+	// does not allocate. the inode keeps its block map cache while windows are for 
+	// the same file
+	std::unique_ptr<INode> scratch_inode;
+	uint64_t scratch_inode_idx = 0;
+	std::vector<uint64_t> scratch_chunk_idxs;
+
+	void prefetcher_main();
+	void prefetch_window(Window &window);
+public:
+	std::atomic<uint64_t> hits; // chunks read that were already prefetched
+	std::atomic<uint64_t> misses; // chunks read by a sequential reader that were not
+	std::atomic<uint64_t> windows_issued;
+	std::atomic<uint64_t> windows_dropped; // the queue was full
+	std::atomic<uint64_t> prefetched_chunks;
+
+	Readahead(SuperBlock *superblock);
+	~Readahead();
+
+	void set_config(const ReadaheadConfig& config);
+
+	inline ReadaheadConfig get_config() {
+		std::lock_guard<std::mutex> g(lock);
+		return config;
+	}
+
+	// called by INode::read with the byte range about to be read, which must lie
+	// within the file
+	void on_read(const INode &inode, uint64_t starting_offset, uint64_t n);
+
+	// the current window of the inode in chunks, 0 if it is not being read sequentially
+	uint64_t window_chunks(uint64_t inode_idx);
+	Pattern pattern(uint64_t inode_idx);
+
+	// blocks until every window issued so far has been prefetched
+	void drain();
+};
+
+#endif
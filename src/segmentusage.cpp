@@ -0,0 +1,83 @@
+#include <algorithm>
+
+#include "segmentusage.hpp"
+
+void SegmentUsage::init(uint64_t segment_count, size_t slice_count) {
+	std::lock_guard<std::mutex> g(this->lock);
+	this->segment_count = segment_count;
+	this->slice_count = std::max<size_t>(slice_count, 1);
+	this->usage.assign(segment_count, 0);
+	this->dirty.assign(segment_count, 0);
+	this->free.assign(this->slice_count, std::vector<uint32_t>());
+	this->used = decltype(this->used)();
+}
+
+void SegmentUsage::checkpoint(const std::function<void(uint64_t, uint64_t)> &store) {
+	for (uint64_t segment = 0; segment < this->segment_count; ++segment) {
+		if (__atomic_exchange_n(&this->dirty[segment], 0, __ATOMIC_RELAXED)) 
+			store(segment, this->get(segment));
+	}
+}
+
+void SegmentUsage::push_free(uint64_t segment) {
+	std::lock_guard<std::mutex> g(this->lock);
+	this->free[this->slice_of(segment)].push_back(segment);
+}
+
+bool SegmentUsage::pop_free(size_t slice, uint64_t &segment) {
+	std::lock_guard<std::mutex> g(this->lock);
+	for (size_t idx = 0; idx < this->slice_count; ++idx) {
+		std::vector<uint32_t> &stack = this->free[(slice + idx) % this->slice_count];
+		if (!stack.empty()) {
+			segment = stack.back();
+			stack.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+void SegmentUsage::push_used(uint64_t segment) {
+	std::lock_guard<std::mutex> g(this->lock);
+	this->used.push(std::make_pair((uint32_t)this->get(segment), (uint32_t)segment));
+	if (this->used.size() > 2 * this->segment_count + 64) 
+		this->compact_used();
+}
+
+std::vector<uint64_t> SegmentUsage::emptiest(size_t limit, const std::function<bool(uint64_t)> &usable) {
+	std::lock_guard<std::mutex> g(this->lock);
+	std::vector<uint64_t> segments;
+	std::vector<Entry> keep;
+	while (segments.size() < limit && !this->used.empty()) {
+		const Entry entry = this->used.top();
+		this->used.pop();
+		// the segment changed since, there is a newer entry for it
+		if (entry.first != this->get(entry.second)) 
+			continue ;
+		// the same segment pushed twice with the same usage
+		if (std::find(segments.begin(), segments.end(), entry.second) != segments.end()) 
+			continue ;
+		if (!usable(entry.second)) 
+			continue ;
+		segments.push_back(entry.second);
+		keep.push_back(entry);
+	}
+	for (const Entry &entry : keep) {
+		this->used.push(entry);
+	}
+	return segments;
+}
+
+void SegmentUsage::compact_used() {
+	std::vector<Entry> entries;
+	std::vector<uint8_t> seen(this->segment_count, 0);
+	while (!this->used.empty()) {
+		const Entry entry = this->used.top();
+		this->used.pop();
+		if (entry.first == this->get(entry.second) && !seen[entry.second]) {
+			seen[entry.second] = 1;
+			entries.push_back(entry);
+		}
+	}
+	this->used = decltype(this->used)(std::greater<Entry>(), std::move(entries));
+}
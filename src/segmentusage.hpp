@@ -0,0 +1,76 @@
+#ifndef SEGMENTUSAGE_HPP
+#define SEGMENTUSAGE_HPP
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include <queue>
+#include <functional>
+
+/*
+	the number of chunks in use in every segment, kept in memory so that nobody has
+	to load a segment's summary chunk to find out. a change marks the segment dirty,
+	and checkpoint hands the dirty ones over to be written back.
+
+	segments are also queued up for whoever is after one: free segments on a stack
+	per slice of the disk (a group takes from its own slice first), and segments that
+	are in use on a heap by usage, for the cleaner. nothing is taken out of a queue
+	when a segment changes, the caller checks what comes out and stale entries are
+	dropped. so a segment has to be pushed again whenever it changes
+*/
+class SegmentUsage {
+public:
+	// every segment starts out empty, and neither queue has anything in it
+	void init(uint64_t segment_count, size_t slice_count);
+
+	inline uint64_t get(uint64_t segment) const {
+		return __atomic_load_n(&usage[segment], __ATOMIC_RELAXED);
+	}
+
+	inline void set(uint64_t segment, uint64_t chunks) {
+		__atomic_store_n(&usage[segment], (uint32_t)chunks, __ATOMIC_RELAXED);
+		__atomic_store_n(&dirty[segment], 1, __ATOMIC_RELAXED);
+	}
+
+	// chunks is negative when they are freed
+	inline void add(uint64_t segment, int64_t chunks) {
+		__atomic_add_fetch(&usage[segment], (uint32_t)chunks, __ATOMIC_RELAXED);
+		__atomic_store_n(&dirty[segment], 1, __ATOMIC_RELAXED);
+	}
+
+	// calls store(segment, usage) for every segment that changed since the last
+	// checkpoint
+	void checkpoint(const std::function<void(uint64_t, uint64_t)> &store);
+
+	void push_free(uint64_t segment);
+	// a segment that was pushed free, out of slice if it has one and out of any other
+	// slice if not. the caller checks that the segment is still free
+	bool pop_free(size_t slice, uint64_t &segment);
+
+	// queues the segment up for cleaning with the usage it has now
+	void push_used(uint64_t segment);
+	// up to limit segments, emptiest first, that usable returns true for. they stay
+	// queued, the ones usable turns down are dropped until they are pushed again
+	std::vector<uint64_t> emptiest(size_t limit, const std::function<bool(uint64_t)> &usable);
+
+	inline size_t slice_of(uint64_t segment) const {
+		return ((segment + 1) * slice_count - 1) / segment_count;
+	}
+
+private:
+	typedef std::pair<uint32_t, uint32_t> Entry; // usage, segment
+
+	uint64_t segment_count = 0;
+	size_t slice_count = 1;
+	std::vector<uint32_t> usage;
+	std::vector<uint8_t> dirty;
+
+	std::mutex lock; // guards the queues
+	std::vector<std::vector<uint32_t>> free; // per slice
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> used;
+
+	// drops the stale entries of the heap once they outnumber the segments
+	void compact_used();
+};
+
+#endif
@@ -0,0 +1,328 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "catch.hpp"
+
+#include "diskinterface.hpp"
+#include "bufferpool.hpp"
+
+/*
+	benchmarks are tagged with [.] so that they are hidden from the default run,
+	run them explicitly with: ./cmake_test "[benchmark]"
+*/
+
+TEST_CASE( "Benchmark get_chunk throughput against thread count", "[.][benchmark][diskinterface]" ) {
+	constexpr uint64_t CHUNK_COUNT = 16 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t OPS_PER_THREAD = 1000000;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+
+	// a set of chunks that stay referenced for the whole run, the rest of the
+	// lookups hit chunks that are created and dropped again
+	std::vector<std::shared_ptr<Chunk>> hot_chunks;
+	for (uint64_t idx = 0; idx < CHUNK_COUNT; idx += 16) {
+		hot_chunks.push_back(disk->get_chunk(idx));
+	}
+
+	fprintf(stdout, "threads, ops/sec, ops/sec/thread\n");
+	for (size_t thread_count = 1; thread_count <= 16; thread_count *= 2) {
+		std::atomic<uint64_t> checksum(0);
+		std::vector<std::thread> threads;
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t t = 0; t < thread_count; ++t) {
+			threads.push_back(std::thread([&disk, &checksum, t]() {
+				uint64_t state = 0x9e3779b97f4a7c15ULL * (t + 1);
+				uint64_t sum = 0;
+				for (uint64_t op = 0; op < OPS_PER_THREAD; ++op) {
+					state ^= state << 13;
+					state ^= state >> 7;
+					state ^= state << 17;
+					std::shared_ptr<Chunk> chunk = disk->get_chunk(state % CHUNK_COUNT);
+					sum += chunk->data[0];
+				}
+				checksum += sum;
+			}));
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		double ops_per_sec = thread_count * OPS_PER_THREAD / elapsed.count();
+		fprintf(stdout, "%zu, %.0f, %.0f\n", thread_count, ops_per_sec, ops_per_sec / thread_count);
+		REQUIRE(checksum == 0);
+	}
+}
+
+TEST_CASE( "Benchmark buffer pool loads by io engine and batch size", "[.][benchmark][diskinterface][ioengine]" ) {
+	constexpr uint64_t CHUNK_COUNT = 16 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr size_t BATCH_SIZES[] = {1, 8, 32};
+
+	const char *path = "disk.benchmark.ioengine";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	{
+		std::vector<Byte> block(CHUNK_SIZE * 256, 1);
+		for (uint64_t offset = 0; offset < CHUNK_COUNT * CHUNK_SIZE; offset += block.size()) {
+			REQUIRE(pwrite(fd, block.data(), block.size(), offset) == (ssize_t)block.size());
+		}
+		fsync(fd);
+	}
+
+	fprintf(stdout, "engine, batch size, MB/s\n");
+	for (IOEngineType engine : {IO_ENGINE_POSIX, IO_ENGINE_URING}) {
+		for (size_t batch_size : BATCH_SIZES) {
+			// drop the file from the page cache so that the reads go to the device
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+			BufferPoolConfig config;
+			config.pool_bytes = 256 * CHUNK_SIZE;
+			config.io_engine = engine;
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+
+			// a strided pattern so that the kernel's own readahead does not hide the queue depth
+			std::vector<Size> chunk_idxs(batch_size);
+			std::vector<std::shared_ptr<Chunk>> chunks(batch_size);
+			uint64_t checksum = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (uint64_t idx = 0; idx < CHUNK_COUNT; idx += batch_size) {
+				for (size_t j = 0; j < batch_size; ++j) {
+					chunk_idxs[j] = ((idx + j) * 4099) % CHUNK_COUNT;
+				}
+				disk->get_chunks(chunk_idxs.data(), batch_size, chunks.data());
+				for (size_t j = 0; j < batch_size; ++j) {
+					checksum += chunks[j]->data[0];
+					chunks[j] = nullptr;
+				}
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			REQUIRE(checksum == CHUNK_COUNT);
+
+			fprintf(stdout, "%s, %zu, %.1f\n", disk->buffer_pool()->io_engine_name(), batch_size,
+				CHUNK_COUNT * CHUNK_SIZE / elapsed.count() / (1024 * 1024));
+		}
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+TEST_CASE( "Benchmark page faults and throughput of the mapping by madvise settings", "[.][benchmark][diskinterface][madvise]" ) {
+	constexpr uint64_t CHUNK_COUNT = 64 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+
+	const char *path = "disk.benchmark.madvise";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	{
+		std::vector<Byte> block(CHUNK_SIZE * 256, 1);
+		for (uint64_t offset = 0; offset < CHUNK_COUNT * CHUNK_SIZE; offset += block.size()) {
+			REQUIRE(pwrite(fd, block.data(), block.size(), offset) == (ssize_t)block.size());
+		}
+		fsync(fd);
+	}
+
+	struct Setting {
+		const char *name;
+		bool access_hints;
+		bool populate;
+		bool hugepages;
+	};
+	const Setting settings[] = {
+		{"none", false, false, false},
+		{"access hints", true, false, false},
+		{"populate", false, true, false},
+		{"hugepages", false, false, true},
+	};
+
+	fprintf(stdout, "setting, pattern, minor faults, major faults, MB/s\n");
+	for (const Setting &setting : settings) {
+		for (bool sequential : {true, false}) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+			MmapConfig config;
+			config.access_hints = setting.access_hints;
+			config.populate = setting.populate;
+			config.hugepages = setting.hugepages;
+
+			// populating happens in the constructor, so it is counted too
+			struct rusage before, after;
+			getrusage(RUSAGE_SELF, &before);
+			auto start = std::chrono::steady_clock::now();
+
+			uint64_t checksum = 0;
+			{
+				std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fd, config));
+				for (uint64_t idx = 0; idx < CHUNK_COUNT; ++idx) {
+					const Size chunk_idx = sequential ? idx : (idx * 4099) % CHUNK_COUNT;
+					checksum += disk->get_chunk(chunk_idx)->data[0];
+				}
+			}
+
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			getrusage(RUSAGE_SELF, &after);
+			REQUIRE(checksum == CHUNK_COUNT);
+
+			fprintf(stdout, "%s, %s, %ld, %ld, %.1f\n", setting.name, sequential ? "sequential" : "strided",
+				after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt,
+				CHUNK_COUNT * CHUNK_SIZE / elapsed.count() / (1024 * 1024));
+		}
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+TEST_CASE( "Benchmark DiskBitMap::find_unset_bits by scan kernel, fill level and fragmentation", "[.][benchmark][diskinterface][bitmap]" ) {
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr Size BITMAP_BITS = 64 * 1024 * 1024; // an 8MB bitmap, 256GB of 4K chunks
+	constexpr uint64_t BITMAP_CHUNKS = BITMAP_BITS / 8 / CHUNK_SIZE + 2;
+
+	std::unique_ptr<Disk> disk(new Disk(BITMAP_CHUNKS, CHUNK_SIZE));
+	std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 0, BITMAP_BITS));
+	const DiskBitMap::ScanKernel default_kernel = DiskBitMap::get_scan_kernel();
+
+	/*
+		prefix: everything below the fill level is used and everything above it free,
+			as on a disk that was filled from the start
+		scattered: the same fraction of bits used, but the free ones are spread at
+			random over the whole bitmap
+		clustered: used and free stretches of 64K bits, the free ones as rare as the
+			fill level asks for
+	*/
+	const char *patterns[] = {"prefix", "scattered", "clustered"};
+	const double fill_levels[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+	std::srand(12);
+
+	fprintf(stdout, "pattern, fill, kernel, searches, ns per search, Gbit/s scanned\n");
+	for (const char *pattern : patterns) {
+		for (double fill : fill_levels) {
+			bitmap->clear_all();
+			for (Size idx = 0; idx < BITMAP_BITS; ++idx) {
+				bool used = false;
+				if (pattern == patterns[0]) {
+					used = idx < fill * BITMAP_BITS;
+				} else if (pattern == patterns[1]) {
+					used = std::rand() < fill * ((double)RAND_MAX + 1);
+				} else {
+					const Size stretch = idx / (64 * 1024);
+					used = (stretch * 2654435761u) % 1000 < fill * 1000;
+				}
+				if (used) 
+					bitmap->set(idx);
+			}
+
+			for (int kernel = -1; kernel <= DiskBitMap::SCAN_AVX2; ++kernel) {
+				if (kernel >= 0 && !DiskBitMap::set_scan_kernel((DiskBitMap::ScanKernel)kernel)) 
+					continue ;
+
+				// every search starts over from the front so they all scan the same bits
+				uint64_t searches = 0;
+				uint64_t bits_scanned = 0;
+				auto start = std::chrono::steady_clock::now();
+				std::chrono::duration<double> elapsed;
+				do {
+					Size found = BITMAP_BITS;
+					if (kernel < 0) {
+						// what find_unset_bits did before, a byte at a time
+						for (Size idx = 0; idx < BITMAP_BITS; idx += 8) {
+							if (bitmap->get_byte_for_idx(idx) != 0xff) {
+								found = idx;
+								break ;
+							}
+						}
+					} else {
+						bitmap->last_search_idx = 0;
+						DiskBitMap::BitRange range = bitmap->find_unset_bits(8);
+						found = range.bit_count == 0 ? BITMAP_BITS : range.start_idx;
+					}
+					bits_scanned += found + 1;
+					searches++;
+					elapsed = std::chrono::steady_clock::now() - start;
+				} while (elapsed.count() < 0.2);
+
+				fprintf(stdout, "%s, %.3f, %s, %llu, %.1f, %.2f\n", pattern, fill,
+					kernel < 0 ? "bytes" : kernel == DiskBitMap::SCAN_SCALAR ? "scalar" : "avx2",
+					(unsigned long long)searches, elapsed.count() * 1e9 / searches,
+					bits_scanned / elapsed.count() / 1e9);
+			}
+		}
+	}
+	DiskBitMap::set_scan_kernel(default_kernel);
+}
+
+TEST_CASE( "Benchmark free run searches through the bitmap summary on a 95% full bitmap", "[.][benchmark][diskinterface][bitmap]" ) {
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr double FILL = 0.95;
+	std::srand(14);
+
+	/*
+		prefix: the first 95% is used, the free bits all at the end
+		scattered: 95% of the bits used at random, plus one free run of 256 bits near
+			the end so that every search length can be satisfied somewhere
+	*/
+	fprintf(stdout, "pattern, bits, run length, summary ns per search, linear scan ns per search\n");
+	for (Size bits : {Size(1) << 20, Size(1) << 23, Size(1) << 26}) {
+		std::unique_ptr<Disk> disk(new Disk(bits / 8 / CHUNK_SIZE + 2, CHUNK_SIZE));
+		std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 0, bits));
+		for (const char *pattern : {"prefix", "scattered"}) {
+			bitmap->clear_all();
+			for (Size idx = 0; idx < bits; ++idx) {
+				const bool used = pattern[0] == 'p' 
+					? idx < FILL * bits 
+					: std::rand() < FILL * ((double)RAND_MAX + 1) && (idx < bits - 1024 || idx >= bits - 768);
+				if (used) 
+					bitmap->set(idx);
+			}
+
+			for (Size length : {Size(1), Size(64), Size(256)}) {
+				double ns_per_search[2];
+				for (int linear = 0; linear < 2; ++linear) {
+					uint64_t searches = 0;
+					Size found = 0;
+					auto start = std::chrono::steady_clock::now();
+					std::chrono::duration<double> elapsed;
+					do {
+						if (linear) {
+							// the first run from the start, found a word at a time
+							Size running = 0;
+							for (Size idx = 0; idx < bits; idx += 64) {
+								const uint64_t used = bitmap->get_word_for_idx(idx);
+								if (used == 0) {
+									running += 64;
+								} else if (used == ~(uint64_t)0) {
+									running = 0;
+								} else {
+									for (Size bit = 0; bit < 64 && running < length; ++bit) 
+										running = (used >> bit) & 1 ? 0 : running + 1;
+								}
+								if (running >= length) {
+									found = idx;
+									break ;
+								}
+							}
+						} else {
+							bitmap->last_search_idx = 0;
+							found = bitmap->find_unset_run(length).start_idx;
+						}
+						searches++;
+						elapsed = std::chrono::steady_clock::now() - start;
+					} while (elapsed.count() < 0.1);
+					REQUIRE(found < bits);
+					ns_per_search[linear] = elapsed.count() * 1e9 / searches;
+				}
+				fprintf(stdout, "%s, %llu, %llu, %.1f, %.1f\n", pattern, (unsigned long long)bits, 
+					(unsigned long long)length, ns_per_search[0], ns_per_search[1]);
+			}
+		}
+	}
+}
@@ -0,0 +1,707 @@
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "catch.hpp"
+
+#include "diskinterface.hpp"
+#include "filesystem.hpp"
+
+/*
+	benchmarks are tagged with [.] so that they are hidden from the default run,
+	run them explicitly with: ./cmake_test "[benchmark]"
+*/
+
+// count every heap allocation made by the test binary so that benchmarks can
+// report how many allocations an operation costs
+static std::atomic<uint64_t> heap_allocation_count(0);
+
+void *operator new(size_t size) {
+	heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+	void *ptr = std::malloc(size == 0 ? 1 : size);
+	if (ptr == nullptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete[](void *ptr) noexcept {
+	std::free(ptr);
+}
+
+TEST_CASE( "Benchmark heap allocations per INode::read", "[.][benchmark][filesystem]" ) {
+	// small chunks so that a few MB of file reaches the triple indirect table
+	constexpr uint64_t CHUNK_COUNT = 100 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t FILE_SIZE = 8 * 1024 * 1024;
+	constexpr uint64_t READ_SIZE = 64 * 1024;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+
+	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+	std::vector<char> buffer(READ_SIZE, 'x');
+	for (uint64_t offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+		REQUIRE(inode->write(offset, &buffer[0], READ_SIZE) == READ_SIZE);
+	}
+
+	// one pass to warm up the chunk cache pools
+	for (uint64_t offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+		inode->read(offset, &buffer[0], READ_SIZE);
+	}
+
+	constexpr int PASSES = 4;
+	uint64_t reads = 0;
+	uint64_t bytes_read = 0;
+	uint64_t allocations_before = heap_allocation_count.load();
+	auto start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < PASSES; ++pass) {
+		for (uint64_t offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+			bytes_read += inode->read(offset, &buffer[0], READ_SIZE);
+			reads++;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	uint64_t allocations = heap_allocation_count.load() - allocations_before;
+	REQUIRE(bytes_read == reads * READ_SIZE);
+
+	fprintf(stdout, "INode::read of %llu bytes: %llu reads, %.3f heap allocations per read, %.1f MB/s\n",
+		(unsigned long long)READ_SIZE, (unsigned long long)reads,
+		(double)allocations / reads, reads * READ_SIZE / elapsed.count() / (1024 * 1024));
+}
+
+TEST_CASE( "Benchmark INode::read by indirection level with the block map cache", "[.][benchmark][filesystem][blockmap]" ) {
+	// 512 byte chunks hold 64 addresses, so the direct, single, double and triple
+	// indirect ranges start at these chunk numbers
+	constexpr uint64_t CHUNK_COUNT = 100 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t READ_SIZE = 4 * 1024; // as much as the direct range holds
+	constexpr int READS = 200000;
+	const uint64_t level_chunks[] = {0, 8, 8 + 64, 8 + 64 + 64 * 64};
+	const char *level_names[] = {"direct", "single indirect", "double indirect", "triple indirect"};
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+
+	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+	std::vector<char> buffer(1024 * 1024, 'x');
+	for (uint64_t chunk : level_chunks) {
+		REQUIRE(inode->write(chunk * CHUNK_SIZE, &buffer[0], READ_SIZE) == READ_SIZE);
+	}
+	// and a megabyte that lies wholly in the triple indirect range
+	const uint64_t big_offset = (level_chunks[3] + 1024) * CHUNK_SIZE;
+	REQUIRE(inode->write(big_offset, &buffer[0], buffer.size()) == buffer.size());
+
+	fprintf(stdout, "level, cache, table walks per read, MB/s\n");
+	const auto run = [&](const char *name, uint64_t offset, uint64_t length, int reads) {
+		for (bool warm : {false, true}) {
+			const uint64_t walks_before = inode->block_map_walks();
+			auto start = std::chrono::steady_clock::now();
+			uint64_t bytes_read = 0;
+			for (int read = 0; read < reads; ++read) {
+				// a cold read walks once for each last level table it touches, before the
+				// cache every chunk outside the direct range cost a walk
+				if (!warm) 
+					inode->invalidate_block_map();
+				bytes_read += inode->read(offset, &buffer[0], length);
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			REQUIRE(bytes_read == reads * length);
+
+			fprintf(stdout, "%s, %s, %.2f, %.1f\n", name, warm ? "warm" : "cold",
+				(double)(inode->block_map_walks() - walks_before) / reads,
+				bytes_read / elapsed.count() / (1024 * 1024));
+		}
+	};
+
+	for (size_t level = 0; level < 4; ++level) {
+		run(level_names[level], level_chunks[level] * CHUNK_SIZE, READ_SIZE, READS);
+	}
+	run("triple indirect 1MB", big_offset, buffer.size(), READS / 256);
+}
+
+TEST_CASE( "Benchmark INode::read with block pointers and with extents", "[.][benchmark][filesystem][extents]" ) {
+	constexpr uint64_t CHUNK_COUNT = 48 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_SIZE = 64 * 1024 * 1024;
+	constexpr uint64_t READ_SIZE = 128 * 1024;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.01);
+	ReadaheadConfig no_readahead;
+	no_readahead.max_window_chunks = 0;
+	fs->superblock->readahead->set_config(no_readahead);
+
+	std::vector<char> buffer(READ_SIZE, 'x');
+	fprintf(stdout, "mapping, extents, cold walks per read, cold MB/s, warm MB/s\n");
+	for (uint8_t mapping : {INode::MAPPING_BLOCKS, INode::MAPPING_EXTENTS}) {
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+		inode->set_mapping(mapping);
+		for (uint64_t offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+			REQUIRE(inode->write(offset, &buffer[0], READ_SIZE) == READ_SIZE);
+		}
+
+		double mb_per_s[2];
+		uint64_t cold_walks = 0;
+		for (bool warm : {false, true}) {
+			const uint64_t walks_before = inode->block_map_walks();
+			uint64_t bytes_read = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (int pass = 0; pass < 4; ++pass) {
+				for (uint64_t offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+					// cold reads find nothing cached and have to look every mapping up
+					if (!warm) 
+						inode->invalidate_block_map();
+					bytes_read += inode->read(offset, &buffer[0], READ_SIZE);
+				}
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			REQUIRE(bytes_read == 4 * FILE_SIZE);
+			mb_per_s[warm] = bytes_read / elapsed.count() / (1024 * 1024);
+			if (!warm) 
+				cold_walks = inode->block_map_walks() - walks_before;
+		}
+
+		fprintf(stdout, "%s, %llu, %.2f, %.1f, %.1f\n", 
+			mapping == INode::MAPPING_EXTENTS ? "extents" : "blocks",
+			(unsigned long long)inode->extent_count(),
+			(double)cold_walks / (4 * FILE_SIZE / READ_SIZE), mb_per_s[0], mb_per_s[1]);
+	}
+}
+
+TEST_CASE( "Benchmark INode::release_chunks of a large file", "[.][benchmark][filesystem][release]" ) {
+	constexpr uint64_t CHUNK_COUNT = 48 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_SIZE = 128 * 1024 * 1024;
+	constexpr uint64_t WRITE_SIZE = 1024 * 1024;
+
+	std::vector<char> buffer(WRITE_SIZE, 'x');
+	fprintf(stdout, "mapping, chunks, release ms\n");
+	for (uint8_t mapping : {INode::MAPPING_BLOCKS, INode::MAPPING_EXTENTS}) {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.01);
+
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+		inode->set_mapping(mapping);
+		for (uint64_t offset = 0; offset < FILE_SIZE; offset += WRITE_SIZE) {
+			REQUIRE(inode->write(offset, &buffer[0], WRITE_SIZE) == WRITE_SIZE);
+		}
+		const uint64_t free_before = fs->superblock->free_chunk_count();
+
+		auto start = std::chrono::steady_clock::now();
+		inode->release_chunks();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		REQUIRE(fs->superblock->free_chunk_count() >= free_before + FILE_SIZE / CHUNK_SIZE);
+
+		fprintf(stdout, "%s, %llu, %.2f\n", mapping == INode::MAPPING_EXTENTS ? "extents" : "blocks",
+			(unsigned long long)(FILE_SIZE / CHUNK_SIZE), elapsed.count() * 1000);
+		inode->superblock->inode_table->free_inode(std::move(inode));
+	}
+}
+
+TEST_CASE( "Benchmark parallel file creation", "[.][benchmark][filesystem][allocgroups]" ) {
+	constexpr uint64_t CHUNK_COUNT = 256 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr size_t FILES = 32 * 1024;
+
+	// each file gets an inode and a chunk of data, as a small file created through
+	// fuse would
+	std::vector<char> contents(CHUNK_SIZE, 'x');
+	fprintf(stdout, "threads (of %u cpus), files, files per second\n", std::thread::hardware_concurrency());
+	for (size_t thread_count : {1, 2, 4, 8}) {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		SuperBlock *superblock = fs->superblock.get();
+
+		std::atomic<uint64_t> written(0);
+		std::vector<std::thread> threads;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t thread = 0; thread < thread_count; ++thread) {
+			threads.push_back(std::thread([&]() {
+				for (size_t file = 0; file < FILES / thread_count; ++file) {
+					std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+					written += inode->write(0, &contents[0], contents.size());
+				}
+			}));
+		}
+		for (auto &thread : threads) 
+			thread.join();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		REQUIRE(written == (FILES / thread_count) * thread_count * CHUNK_SIZE);
+
+		fprintf(stdout, "%llu, %llu, %.0f\n", (unsigned long long)thread_count, 
+			(unsigned long long)FILES, FILES / elapsed.count());
+	}
+}
+
+TEST_CASE( "Benchmark contiguous run allocation on an aged disk", "[.][benchmark][filesystem][freeextents]" ) {
+	constexpr uint64_t CHUNK_COUNT = 256 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t REQUEST = 256; // a 1 MiB write
+	constexpr size_t REQUESTS = 64;
+
+	fprintf(stdout, "policy, index build ms, extents, pieces per request, us per request\n");
+	for (FreeExtents::Policy policy : {FreeExtents::BEST_FIT, FreeExtents::NEXT_FIT}) {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.01);
+		SuperBlock *superblock = fs->superblock.get();
+
+		// age the disk: fill most of it with runs of random lengths, then free half of them
+		srand(1234);
+		std::vector<DiskBitMap::BitRange> runs;
+		while (superblock->free_chunk_count() > CHUNK_COUNT / 50) {
+			runs.push_back(superblock->allocate_chunk_run(1, rand() % 64 + 1, policy));
+		}
+		for (size_t idx = 0; idx < runs.size(); ++idx) {
+			if (rand() % 2) 
+				superblock->free_chunk_run(runs[idx].start_idx, runs[idx].bit_count);
+		}
+
+		// the index is built on the first run asked for after a mount
+		fs = nullptr;
+		fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		superblock = fs->superblock.get();
+		auto start = std::chrono::steady_clock::now();
+		superblock->allocate_chunk_run(1, 1, policy);
+		std::chrono::duration<double> build = std::chrono::steady_clock::now() - start;
+		const size_t extent_count = superblock->segment_controller.free_extents.size();
+
+		size_t pieces = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t request = 0; request < REQUESTS; ++request) {
+			for (uint64_t left = REQUEST; left > 0; ++pieces) {
+				const DiskBitMap::BitRange run = superblock->allocate_chunk_run(1, left, policy);
+				REQUIRE(run.bit_count != 0);
+				left -= run.bit_count;
+			}
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		fprintf(stdout, "%s, %.2f, %llu, %.2f, %.2f\n", policy == FreeExtents::BEST_FIT ? "best fit" : "next fit",
+			build.count() * 1000, (unsigned long long)extent_count, (double)pieces / REQUESTS, 
+			elapsed.count() * 1e6 / REQUESTS);
+	}
+}
+
+TEST_CASE( "Benchmark write amplification of the segment cleaner", "[.][benchmark][filesystem][cleaner]" ) {
+	constexpr uint64_t CHUNK_COUNT = 16 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_CHUNKS = 8;
+	constexpr double UTILIZATION = 0.7;
+
+	std::vector<char> contents(FILE_CHUNKS * CHUNK_SIZE, 'x');
+	fprintf(stdout, "policy, overwrites, segments cleaned, chunks moved, write amplification, ms\n");
+	for (bool skewed : {false, true}) {
+		for (CleanerConfig::Policy policy : {CleanerConfig::GREEDY, CleanerConfig::COST_BENEFIT}) {
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.01);
+			SuperBlock *superblock = fs->superblock.get();
+			SegmentController &segments = superblock->segment_controller;
+			CleanerConfig config;
+			config.policy = policy;
+			superblock->cleaner->set_config(config);
+
+			// files filling the disk to the utilization, then overwritten (deleted and
+			// written again) until the disk has been written over several times. the
+			// skewed run sends nine overwrites out of ten to a tenth of the files
+			const uint64_t capacity = segments.num_segments * (segments.segment_size - 1);
+			const size_t file_count = capacity * UTILIZATION / FILE_CHUNKS;
+			const size_t overwrites = file_count * 8;
+			std::vector<uint64_t> files;
+			for (size_t file = 0; file < file_count; ++file) {
+				std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+				REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+				files.push_back(inode->inode_table_idx);
+			}
+
+			srand(1234);
+			auto start = std::chrono::steady_clock::now();
+			for (size_t overwrite = 0; overwrite < overwrites; ++overwrite) {
+				size_t file = rand() % file_count;
+				if (skewed && rand() % 10 != 0) 
+					file = rand() % (file_count / 10);
+				{
+					std::shared_ptr<INode> inode = superblock->inode_table->get_inode(files[file]);
+					inode->release_chunks();
+					superblock->inode_table->free_inode(std::move(inode));
+				}
+				std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+				REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+				files[file] = inode->inode_table_idx;
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			const uint64_t written = overwrites * FILE_CHUNKS;
+			const uint64_t moved = superblock->cleaner->chunks_moved;
+			fprintf(stdout, "%s%s, %llu, %llu, %llu, %.2f, %.1f\n", policy == CleanerConfig::GREEDY ? "greedy" : "cost benefit",
+				skewed ? " (skewed)" : "", (unsigned long long)overwrites, 
+				(unsigned long long)superblock->cleaner->segments_cleaned.load(), (unsigned long long)moved,
+				(double)(written + moved) / written, elapsed.count() * 1000);
+		}
+	}
+}
+
+TEST_CASE( "Benchmark cleaning throughput by file size", "[.][benchmark][filesystem][cleaner]" ) {
+	// small chunks make for short segments and many tables, the case where looking
+	// through the whole file for every segment hurts most
+	constexpr uint64_t CHUNK_COUNT = 64 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 512;
+
+	std::vector<char> contents(CHUNK_SIZE, 'x');
+	fprintf(stdout, "file chunks, segments cleaned, chunks moved, chunks walked, us per chunk moved\n");
+	for (uint64_t file_chunks : {512, 4096, 24576}) {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.01);
+		SuperBlock *superblock = fs->superblock.get();
+
+		// two files written a chunk at a time in turns, so that every segment holds half 
+		// of each, and then one of them deleted. cleaning moves the other one a few 
+		// chunks at a time
+		{
+			std::shared_ptr<INode> kept = superblock->inode_table->alloc_inode();
+			std::shared_ptr<INode> deleted = superblock->inode_table->alloc_inode();
+			for (uint64_t chunk = 0; chunk < file_chunks; ++chunk) {
+				REQUIRE(kept->write(chunk * CHUNK_SIZE, &contents[0], CHUNK_SIZE) == CHUNK_SIZE);
+				REQUIRE(deleted->write(chunk * CHUNK_SIZE, &contents[0], CHUNK_SIZE) == CHUNK_SIZE);
+			}
+			deleted->release_chunks();
+			superblock->inode_table->free_inode(std::move(deleted));
+		}
+
+		SegmentCleaner &cleaner = *superblock->cleaner;
+		auto start = std::chrono::steady_clock::now();
+		while (cleaner.clean_one()) {
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		fprintf(stdout, "%llu, %llu, %llu, %llu, %.2f\n", (unsigned long long)file_chunks, 
+			(unsigned long long)cleaner.segments_cleaned.load(), (unsigned long long)cleaner.chunks_moved.load(), 
+			(unsigned long long)cleaner.chunks_walked.load(), elapsed.count() * 1e6 / std::max<uint64_t>(cleaner.chunks_moved, 1));
+	}
+}
+
+TEST_CASE( "Benchmark opening segments after a load", "[.][benchmark][filesystem][segmentusage]" ) {
+	// nearly every segment is in use, so finding a free one is the whole cost
+	constexpr uint64_t CHUNK_COUNT = 256 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 512;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::vector<char> contents(CHUNK_SIZE, 'x');
+	uint64_t free_segments = 0;
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.01);
+		SuperBlock *superblock = fs->superblock.get();
+		SegmentController &segments = superblock->segment_controller;
+		const uint64_t keep_free = segments.num_segments / 16;
+		std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+		for (uint64_t chunk = 0; segments.free_segment_count() > keep_free; ++chunk) {
+			REQUIRE(inode->write(chunk * CHUNK_SIZE, &contents[0], CHUNK_SIZE) == CHUNK_SIZE);
+		}
+		free_segments = segments.free_segment_count();
+	}
+
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	auto start = std::chrono::steady_clock::now();
+	fs->superblock->load_from_disk();
+	std::chrono::duration<double> load = std::chrono::steady_clock::now() - start;
+	SuperBlock *superblock = fs->superblock.get();
+	SegmentController &segments = superblock->segment_controller;
+
+	// every segment left, opened one after the other by the same group
+	const uint64_t opened = free_segments - 1;
+	start = std::chrono::steady_clock::now();
+	for (uint64_t idx = 0; idx < opened; ++idx) {
+		AllocGroup &group = segments.groups[0];
+		std::lock_guard<std::mutex> lock(group.lock);
+		REQUIRE(segments.set_new_free_segment(group));
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	fprintf(stdout, "segments: %llu, opened: %llu, load: %.2f ms, us per segment opened: %.2f\n", 
+		(unsigned long long)segments.num_segments, (unsigned long long)opened, load.count() * 1e3, 
+		elapsed.count() * 1e6 / opened);
+}
+
+TEST_CASE( "Benchmark parallel sequential writes", "[.][benchmark][filesystem][allocgroups]" ) {
+	constexpr uint64_t CHUNK_COUNT = 256 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_CHUNKS = 2048;
+
+	// every writer appends to its own file a chunk at a time, the way writes come in
+	// through fuse. either a thread each, or all of them from one thread in turns 
+	// (which is what a single cpu makes of the threads anyway)
+	std::vector<char> contents(CHUNK_SIZE, 'x');
+	fprintf(stdout, "writers, threads (of %u cpus), MB per second, chunks per contiguous run\n", std::thread::hardware_concurrency());
+	for (bool in_turns : {false, true}) {
+		for (size_t writers : {1, 2, 4, 8}) {
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.1);
+			SuperBlock *superblock = fs->superblock.get();
+
+			std::vector<std::shared_ptr<INode>> inodes;
+			for (size_t writer = 0; writer < writers; ++writer) 
+				inodes.push_back(superblock->inode_table->alloc_inode());
+			auto start = std::chrono::steady_clock::now();
+			if (in_turns) {
+				for (uint64_t chunk = 0; chunk < FILE_CHUNKS; ++chunk) {
+					for (size_t writer = 0; writer < writers; ++writer) 
+						inodes[writer]->write(chunk * CHUNK_SIZE, &contents[0], CHUNK_SIZE);
+				}
+			} else {
+				std::vector<std::thread> threads;
+				for (size_t writer = 0; writer < writers; ++writer) {
+					threads.push_back(std::thread([&, writer]() {
+						for (uint64_t chunk = 0; chunk < FILE_CHUNKS; ++chunk) 
+							inodes[writer]->write(chunk * CHUNK_SIZE, &contents[0], CHUNK_SIZE);
+					}));
+				}
+				for (auto &thread : threads) 
+					thread.join();
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			uint64_t runs = 0;
+			for (std::shared_ptr<INode> &inode : inodes) {
+				uint64_t previous = 0;
+				for (uint64_t chunk = 0; chunk < FILE_CHUNKS; ++chunk) {
+					const uint64_t chunk_idx = inode->resolve_chunk_idx(chunk, false);
+					if (chunk == 0 || chunk_idx != previous + 1) 
+						runs++;
+					previous = chunk_idx;
+				}
+			}
+			fprintf(stdout, "%llu, %llu, %.0f, %.1f\n", (unsigned long long)writers, (unsigned long long)(in_turns ? 1 : writers),
+				writers * FILE_CHUNKS * CHUNK_SIZE / elapsed.count() / (1024 * 1024), 
+				(double)(writers * FILE_CHUNKS) / runs);
+		}
+	}
+}
+
+TEST_CASE( "Benchmark write amplification with hot and cold data kept apart", "[.][benchmark][filesystem][cleaner][hotcold]" ) {
+	constexpr uint64_t CHUNK_COUNT = 64 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_CHUNKS = 8;
+	constexpr double UTILIZATION = 0.75;
+
+	// as the write amplification benchmark, skewed: nine overwrites out of ten go to a
+	// tenth of the files. some files are large enough to have a table. the cleaner 
+	// runs either when a write has run out of segments, or ahead of time as the 
+	// background thread would (which is when the chunks it moves get segments of 
+	// their own, rather than filling holes)
+	std::vector<char> contents(4 * FILE_CHUNKS * CHUNK_SIZE, 'x');
+	fprintf(stdout, "cleaning, policy, separated, segments cleaned, chunks moved, write amplification\n");
+	for (bool background : {false, true}) for (CleanerConfig::Policy policy : {CleanerConfig::GREEDY, CleanerConfig::COST_BENEFIT}) {
+		for (bool separate : {false, true}) {
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.01);
+			SuperBlock *superblock = fs->superblock.get();
+			SegmentController &segments = superblock->segment_controller;
+			segments.separate_temperatures = separate;
+			CleanerConfig config;
+			config.policy = policy;
+			superblock->cleaner->set_config(config);
+
+			const auto file_size = [&](size_t file) {
+				return (file % 8 == 0 ? 4 : 1) * FILE_CHUNKS * CHUNK_SIZE;
+			};
+			const uint64_t capacity = segments.num_segments * (segments.segment_size - 1);
+			const size_t file_count = capacity * UTILIZATION / (FILE_CHUNKS * 11 / 8);
+			const size_t overwrites = file_count * 8;
+			std::vector<uint64_t> files;
+			for (size_t file = 0; file < file_count; ++file) {
+				std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+				REQUIRE(inode->write(0, &contents[0], file_size(file)) == file_size(file));
+				files.push_back(inode->inode_table_idx);
+			}
+
+			srand(1234);
+			uint64_t written = 0;
+			for (size_t overwrite = 0; overwrite < overwrites; ++overwrite) {
+				size_t file = rand() % file_count;
+				if (rand() % 10 != 0) 
+					file = rand() % (file_count / 10);
+				{
+					std::shared_ptr<INode> inode = superblock->inode_table->get_inode(files[file]);
+					inode->release_chunks();
+					superblock->inode_table->free_inode(std::move(inode));
+				}
+				std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+				REQUIRE(inode->write(0, &contents[0], file_size(file)) == file_size(file));
+				files[file] = inode->inode_table_idx;
+				written += file_size(file) / CHUNK_SIZE;
+				if (background && segments.free_segment_count() < config.low_free_segments) 
+					superblock->cleaner->clean_until(config.high_free_segments);
+			}
+
+			const uint64_t moved = superblock->cleaner->chunks_moved;
+			fprintf(stdout, "%s, %s, %s, %llu, %llu, %.2f\n", background ? "background" : "on demand", 
+				policy == CleanerConfig::GREEDY ? "greedy" : "cost benefit",
+				separate ? "yes" : "no", (unsigned long long)superblock->cleaner->segments_cleaned.load(), 
+				(unsigned long long)moved, (double)(written + moved) / written);
+		}
+	}
+}
+
+TEST_CASE( "Benchmark one large write", "[.][benchmark][filesystem][allocgroups]" ) {
+	constexpr uint64_t CHUNK_COUNT = 24 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t WRITE_SIZE = 64 * 1024 * 1024;
+	constexpr int ROUNDS = 5;
+
+	std::vector<char> buffer(WRITE_SIZE, 'x');
+	fprintf(stdout, "mapping, extents, write ms, MB/s\n");
+	for (uint8_t mapping : {INode::MAPPING_BLOCKS, INode::MAPPING_EXTENTS}) {
+		double best = 0;
+		uint64_t extents = 0;
+		for (int round = 0; round < ROUNDS; ++round) {
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.01);
+			std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+			inode->set_mapping(mapping);
+
+			auto start = std::chrono::steady_clock::now();
+			REQUIRE(inode->write(0, &buffer[0], WRITE_SIZE) == WRITE_SIZE);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			if (round == 0 || elapsed.count() < best) 
+				best = elapsed.count();
+			extents = inode->extent_count();
+		}
+		fprintf(stdout, "%s, %llu, %.2f, %.1f\n", mapping == INode::MAPPING_EXTENTS ? "extents" : "blocks",
+			(unsigned long long)extents, best * 1000, WRITE_SIZE / best / (1024 * 1024));
+	}
+}
+
+TEST_CASE( "Benchmark write back with and without segment writes", "[.][benchmark][filesystem][segmentwrites]" ) {
+	constexpr uint64_t CHUNK_COUNT = 24 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_COUNT = 4;
+	constexpr uint64_t FILE_SIZE = 16 * 1024 * 1024;
+	constexpr uint64_t WRITE_SIZE = 16 * 1024;
+
+	const char *path = "disk.benchmark.segmentwrites";
+	std::vector<char> buffer(WRITE_SIZE, 'x');
+	fprintf(stdout, "segment writes, msyncs while writing, KB per msync, segments written, msyncs to sync, ms\n");
+	for (bool segment_writes : {false, true}) {
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		REQUIRE(fd != -1);
+		REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+		{
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fd));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->segment_controller.segment_writes = segment_writes;
+			fs->superblock->init(0.01);
+			disk->sync();
+			const uint64_t msyncs_before = disk->msync_count();
+
+			// a few files written in turns, as a busy server would
+			std::shared_ptr<INode> inodes[FILE_COUNT];
+			for (auto &inode : inodes) 
+				inode = fs->superblock->inode_table->alloc_inode();
+			auto start = std::chrono::steady_clock::now();
+			for (uint64_t offset = 0; offset < FILE_SIZE; offset += WRITE_SIZE) {
+				for (auto &inode : inodes) 
+					REQUIRE(inode->write(offset, &buffer[0], WRITE_SIZE) == WRITE_SIZE);
+			}
+			// what the background write back did while the files were written, sync 
+			// then has the metadata to do either way
+			const uint64_t msyncs = disk->msync_count() - msyncs_before;
+			fs->superblock->segment_controller.release_reservations();
+			disk->sync();
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			fprintf(stdout, "%s, %llu, %.1f, %llu, %llu, %.1f\n", segment_writes ? "on" : "off", (unsigned long long)msyncs, 
+				(double)FILE_COUNT * FILE_SIZE / 1024 / std::max<uint64_t>(msyncs, 1), 
+				(unsigned long long)disk->segment_write_count(), 
+				(unsigned long long)(disk->msync_count() - msyncs_before - msyncs), elapsed.count() * 1000);
+			for (auto &inode : inodes) 
+				inode = nullptr;
+		}
+		close(fd);
+		unlink(path);
+	}
+}
+
+TEST_CASE( "Benchmark space given back to the host by discards", "[.][benchmark][filesystem][discard]" ) {
+	constexpr uint64_t CHUNK_COUNT = 24 * 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_COUNT = 4;
+	constexpr uint64_t FILE_SIZE = 16 * 1024 * 1024;
+	constexpr uint64_t WRITE_SIZE = 128 * 1024;
+
+	const char *path = "disk.benchmark.discard";
+	std::vector<char> buffer(WRITE_SIZE, 'x');
+	fprintf(stdout, "discard, MB allocated after writing, MB allocated after deleting half, chunks discarded, ms\n");
+	for (bool discard : {false, true}) {
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		REQUIRE(fd != -1);
+		REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+		{
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fd));
+			DiscardConfig config;
+			config.enabled = discard;
+			config.delay_ms = 10;
+			disk->set_discard_config(config);
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.01);
+
+			std::shared_ptr<INode> inodes[FILE_COUNT];
+			for (auto &inode : inodes) {
+				inode = fs->superblock->inode_table->alloc_inode();
+				for (uint64_t offset = 0; offset < FILE_SIZE; offset += WRITE_SIZE) 
+					REQUIRE(inode->write(offset, &buffer[0], WRITE_SIZE) == WRITE_SIZE);
+			}
+			disk->sync();
+			struct stat written;
+			REQUIRE(fstat(fd, &written) == 0);
+
+			auto start = std::chrono::steady_clock::now();
+			for (uint64_t file = 0; file < FILE_COUNT / 2; ++file) {
+				inodes[file]->release_chunks();
+				inodes[file] = nullptr;
+			}
+			// until the flusher has caught up with the freed space
+			const uint64_t freed_chunks = FILE_COUNT / 2 * FILE_SIZE / CHUNK_SIZE;
+			for (int i = 0; discard && i < 1000 && disk->discarded_chunk_count() < freed_chunks; ++i) 
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			disk->sync();
+			struct stat deleted;
+			REQUIRE(fstat(fd, &deleted) == 0);
+
+			fprintf(stdout, "%s, %.1f, %.1f, %llu, %.1f\n", discard ? "on" : "off", 
+				written.st_blocks * 512.0 / (1024 * 1024), deleted.st_blocks * 512.0 / (1024 * 1024), 
+				(unsigned long long)disk->discarded_chunk_count(), elapsed.count() * 1000);
+			for (auto &inode : inodes) 
+				inode = nullptr;
+		}
+		close(fd);
+		unlink(path);
+	}
+}
@@ -0,0 +1,265 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "diskinterface.hpp"
+#include "bufferpool.hpp"
+#include "filesystem.hpp"
+
+TEST_CASE( "Buffer pool should evict and write back chunks", "[bufferpool]" ) {
+	constexpr uint64_t CHUNK_COUNT = 1024;
+	constexpr uint64_t CHUNK_SIZE = 512;
+
+	const char *path = "disk.bufferpool.test";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+
+	BufferPoolConfig config;
+	config.pool_bytes = 64 * CHUNK_SIZE;
+
+	SECTION("every chunk reads back what was written even though most were evicted") {
+		{
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+			REQUIRE(disk->buffer_pool()->size_frames() == 64);
+
+			for (uint64_t idx = 0; idx < CHUNK_COUNT; ++idx) {
+				std::shared_ptr<Chunk> chunk = disk->get_chunk(idx);
+				std::memset(chunk->data, (int)(idx % 251), CHUNK_SIZE);
+			}
+			REQUIRE(disk->buffer_pool()->evictions > 0);
+
+			for (uint64_t idx = 0; idx < CHUNK_COUNT; ++idx) {
+				std::shared_ptr<Chunk> chunk = disk->get_chunk(idx);
+				REQUIRE(chunk->data[0] == idx % 251);
+				REQUIRE(chunk->data[CHUNK_SIZE - 1] == idx % 251);
+			}
+		}
+
+		// the disk writes back what is left in the pool when it is destroyed
+		for (uint64_t idx = 0; idx < CHUNK_COUNT; ++idx) {
+			Byte byte = 0;
+			REQUIRE(pread(fd, &byte, 1, idx * CHUNK_SIZE + 7) == 1);
+			REQUIRE(byte == idx % 251);
+		}
+	}
+
+	SECTION("only chunks whose contents changed are written back") {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+		for (uint64_t idx = 0; idx < 16; ++idx) {
+			std::memset(disk->get_chunk(idx)->data, 1, CHUNK_SIZE);
+		}
+		// enough reads to cycle every frame out of the pool at least once
+		for (uint64_t idx = 16; idx < CHUNK_COUNT; ++idx) {
+			REQUIRE(disk->get_chunk(idx)->data[0] == 0);
+		}
+		disk->sync();
+		REQUIRE(disk->buffer_pool()->write_backs == 16);
+
+		// a chunk that is still referenced is checked for changes whenever it is written back
+		std::shared_ptr<Chunk> held = disk->get_chunk(40);
+		disk->sync();
+		REQUIRE(disk->buffer_pool()->write_backs == 16);
+		held->data[0] = 2;
+		disk->sync();
+		REQUIRE(disk->buffer_pool()->write_backs == 17);
+		disk->sync();
+		REQUIRE(disk->buffer_pool()->write_backs == 17);
+
+		// a chunk that is changed and then changed back has nothing to write
+		{
+			std::shared_ptr<Chunk> chunk = disk->get_chunk(41);
+			chunk->data[0] = 3;
+			chunk->data[0] = 0;
+		}
+		disk->sync();
+		REQUIRE(disk->buffer_pool()->write_backs == 17);
+	}
+
+	SECTION("get_chunk fails cleanly once every frame is pinned") {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+		std::vector<std::shared_ptr<Chunk>> pinned;
+		for (uint64_t idx = 0; idx < 64; ++idx) {
+			pinned.push_back(disk->get_chunk(idx));
+		}
+		REQUIRE_THROWS_AS(disk->get_chunk(100), DiskException);
+
+		pinned.pop_back();
+		REQUIRE(disk->get_chunk(100) != nullptr);
+	}
+
+	SECTION("threads racing to load the same chunks leave no pins behind") {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+		std::atomic<size_t> mismatches(0);
+		std::vector<std::thread> threads;
+		for (int thread = 0; thread < 8; ++thread) {
+			threads.push_back(std::thread([&disk, &mismatches]() {
+				for (int round = 0; round < 200; ++round) {
+					for (Size idx = 0; idx < 32; ++idx) {
+						std::shared_ptr<Chunk> chunk = disk->get_chunk(idx + (round % 4) * 32);
+						if (chunk->chunk_idx != idx + (round % 4) * 32) 
+							mismatches++;
+					}
+				}
+			}));
+		}
+		for (std::thread &thread : threads) 
+			thread.join();
+		REQUIRE(mismatches == 0);
+
+		// every frame can be pinned again, so no pin was leaked
+		std::vector<std::shared_ptr<Chunk>> pinned;
+		for (uint64_t idx = 0; idx < 64; ++idx) {
+			pinned.push_back(disk->get_chunk(512 + idx));
+		}
+	}
+
+	SECTION("a sequential scan does not evict the hot set") {
+		BufferPool pool(fd, CHUNK_SIZE, 64);
+		const auto touch = [&pool](Size chunk_idx) {
+			pool.pin(chunk_idx);
+			pool.unpin(chunk_idx, false);
+		};
+
+		// reference the hot set, scan it out of a1in (but not so far that it also falls
+		// out of the ghost list), then reference it again so that it is promoted into am
+		for (Size idx = 0; idx < 16; ++idx)
+			touch(idx);
+		for (Size idx = 100; idx < 170; ++idx)
+			touch(idx);
+		for (Size idx = 0; idx < 16; ++idx)
+			touch(idx);
+
+		for (Size idx = 200; idx < CHUNK_COUNT; ++idx)
+			touch(idx);
+
+		uint64_t misses = pool.misses;
+		for (Size idx = 0; idx < 16; ++idx) {
+			REQUIRE(pool.is_resident(idx));
+			touch(idx);
+		}
+		REQUIRE(pool.misses == misses);
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+TEST_CASE( "A filesystem should work on a buffer pool backed disk", "[bufferpool][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 4096;
+	constexpr uint64_t CHUNK_SIZE = 512;
+
+	const char *path = "disk.bufferpool.test";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+
+	// a pool much smaller than the file so that file contents are evicted and reread
+	BufferPoolConfig config;
+	config.pool_bytes = 128 * CHUNK_SIZE;
+
+	std::vector<char> contents(64 * 1024);
+	for (size_t idx = 0; idx < contents.size(); ++idx) {
+		contents[idx] = 'a' + (idx * 7) % 26;
+	}
+
+	uint64_t inode_idx = 0;
+	{
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+		inode_idx = inode->inode_table_idx;
+		REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+	}
+
+	{
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
+		std::vector<char> read_back(contents.size());
+		REQUIRE(inode->read(0, &read_back[0], read_back.size()) == read_back.size());
+		REQUIRE(read_back == contents);
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+TEST_CASE( "A filesystem should work on a direct io disk with metadata in the page cache", "[bufferpool][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 4096;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+
+	const char *path = "disk.bufferpool.test";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+
+	// not every file system supports O_DIRECT (tmpfs for one)
+	int probe_fd = open(path, O_RDWR | O_DIRECT);
+	if (probe_fd == -1) {
+		WARN("O_DIRECT is not supported here, skipping");
+		close(fd);
+		unlink(path);
+		return ;
+	}
+	close(probe_fd);
+
+	BufferPoolConfig config;
+	config.pool_bytes = 128 * CHUNK_SIZE;
+	config.direct_io = true;
+
+	std::vector<char> contents(1024 * 1024);
+	for (size_t idx = 0; idx < contents.size(); ++idx) {
+		contents[idx] = 'a' + (idx * 7) % 26;
+	}
+
+	uint64_t inode_idx = 0;
+	{
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+		REQUIRE(disk->buffer_pool()->is_direct());
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+
+		SuperBlock *sb = fs->superblock.get();
+		BufferPool *pool = disk->buffer_pool();
+		REQUIRE(pool->is_metadata(0));
+		REQUIRE(pool->is_metadata(sb->disk_block_map_offset));
+		REQUIRE(pool->is_metadata(sb->inode_table_offset + sb->inode_table_size_chunks - 1));
+		REQUIRE(pool->is_metadata(sb->data_offset + sb->segment_size_chunks));
+		REQUIRE_FALSE(pool->is_metadata(sb->data_offset + sb->segment_size_chunks + 1));
+
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+		inode_idx = inode->inode_table_idx;
+		REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+		disk->sync();
+		REQUIRE(pool->metadata_ios > 0);
+	}
+
+	{
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		REQUIRE(disk->buffer_pool()->is_metadata(fs->superblock->data_offset));
+
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
+		std::vector<char> read_back(contents.size());
+		REQUIRE(inode->read(0, &read_back[0], read_back.size()) == read_back.size());
+		REQUIRE(read_back == contents);
+	}
+
+	// a chunk size that O_DIRECT can not transfer is refused up front
+	config.direct_io = true;
+	REQUIRE_THROWS_AS(Disk(CHUNK_COUNT, 100, fd, config), DiskException);
+
+	close(fd);
+	unlink(path);
+}
@@ -0,0 +1,405 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "catch.hpp"
+
+#include "diskinterface.hpp"
+#include "filesystem.hpp"
+
+// the contents of a file, different for every file and every chunk of it
+static std::vector<char> file_contents(uint64_t file, uint64_t size) {
+	std::vector<char> contents(size);
+	for (uint64_t idx = 0; idx < size; ++idx) {
+		contents[idx] = 'a' + (idx / 7 + file * 3) % 26;
+	}
+	return contents;
+}
+
+static void require_contents(SuperBlock *superblock, const std::map<uint64_t, std::vector<char>> &files) {
+	for (const auto &file : files) {
+		std::shared_ptr<INode> inode = superblock->inode_table->get_inode(file.first);
+		std::vector<char> read_back(file.second.size());
+		REQUIRE(inode->read(0, &read_back[0], read_back.size()) == read_back.size());
+		REQUIRE(read_back == file.second);
+	}
+}
+
+static void delete_file(SuperBlock *superblock, uint64_t inode_idx) {
+	std::shared_ptr<INode> inode = superblock->inode_table->get_inode(inode_idx);
+	inode->release_chunks();
+	superblock->inode_table->free_inode(std::move(inode));
+}
+
+TEST_CASE( "The cleaner moves the live chunks out of a segment and frees it", "[cleaner][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t FILES = 30;
+
+	for (uint8_t mapping : {INode::MAPPING_BLOCKS, INode::MAPPING_EXTENTS}) {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		std::map<uint64_t, std::vector<char>> files;
+		{
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.1);
+			SuperBlock *superblock = fs->superblock.get();
+			SegmentCleaner &cleaner = *superblock->cleaner;
+
+			// some of them large enough to go through the double indirect table
+			std::vector<uint64_t> inodes;
+			for (uint64_t file = 0; file < FILES; ++file) {
+				std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+				inode->set_mapping(mapping);
+				const uint64_t size = file % 10 == 3 ? 150 * CHUNK_SIZE : (file % 7 + 1) * 5 * CHUNK_SIZE - 100;
+				std::vector<char> contents = file_contents(file, size);
+				REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+				inodes.push_back(inode->inode_table_idx);
+				files[inode->inode_table_idx] = contents;
+			}
+			for (uint64_t file = 0; file < FILES; file += 2) {
+				delete_file(superblock, inodes[file]);
+				files.erase(inodes[file]);
+			}
+
+			// moving the live chunks out can open a segment, but the victim is free after
+			SegmentController &segments = superblock->segment_controller;
+			const uint64_t victim = cleaner.pick_victim();
+			REQUIRE(victim != SegmentController::NONE);
+			REQUIRE(cleaner.clean_one());
+			REQUIRE(cleaner.segments_cleaned == 1);
+			{
+				std::lock_guard<std::mutex> lock(segments.segment_controller_lock);
+				REQUIRE(segments.segment_is_free(victim));
+			}
+			require_contents(superblock, files);
+			REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+
+			// and then everything there is to clean
+			while (cleaner.clean_one()) {
+				REQUIRE(cleaner.segments_cleaned < segments.num_segments * 2);
+			}
+			REQUIRE(cleaner.chunks_moved > 0);
+			// the summaries said where every chunk was
+			REQUIRE(cleaner.chunks_walked == 0);
+			require_contents(superblock, files);
+			REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+		}
+
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		require_contents(fs->superblock.get(), files);
+	}
+}
+
+TEST_CASE( "Segment summaries record where in its file each chunk is", "[cleaner][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t ADDRESSES = CHUNK_SIZE / sizeof(uint64_t);
+	constexpr uint64_t FILE_CHUNKS = 150; // into the double indirect table
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+	SuperBlock *superblock = fs->superblock.get();
+	SegmentController &segments = superblock->segment_controller;
+	auto position = [&](uint64_t chunk) {
+		return segments.get_segment_chunk_position((chunk - segments.data_offset) / segments.segment_size, 
+			(chunk - segments.data_offset) % segments.segment_size);
+	};
+
+	for (uint8_t mapping : {INode::MAPPING_BLOCKS, INode::MAPPING_EXTENTS}) {
+		std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+		inode->set_mapping(mapping);
+		std::vector<char> contents = file_contents(0, FILE_CHUNKS * CHUNK_SIZE);
+		REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+
+		for (uint64_t logical = 0; logical < FILE_CHUNKS; ++logical) {
+			const ChunkPosition data = position(inode->resolve_chunk_idx(logical, false));
+			REQUIRE(data.logical == logical);
+			REQUIRE(data.level == 0);
+		}
+		if (mapping == INode::MAPPING_BLOCKS) {
+			const uint64_t direct = INode::DIRECT_ADDRESS_COUNT;
+			const uint64_t single = inode->data.addresses[direct];
+			REQUIRE(position(single).logical == direct);
+			REQUIRE(position(single).level == 1);
+			const uint64_t double_root = inode->data.addresses[direct + 1];
+			REQUIRE(position(double_root).logical == direct + ADDRESSES);
+			REQUIRE(position(double_root).level == 2);
+			const uint64_t second_table = ((uint64_t *)disk->get_chunk(double_root)->data)[1];
+			REQUIRE(position(second_table).logical == direct + 2 * ADDRESSES);
+			REQUIRE(position(second_table).level == 1);
+		}
+	}
+}
+
+TEST_CASE( "The cleaner passes over segments of loaded inodes", "[cleaner][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+	SuperBlock *superblock = fs->superblock.get();
+
+	std::vector<char> contents = file_contents(1, 20 * CHUNK_SIZE);
+	std::shared_ptr<INode> kept = superblock->inode_table->alloc_inode();
+	REQUIRE(kept->write(0, &contents[0], contents.size()) == contents.size());
+	const uint64_t first_chunk = kept->resolve_chunk_idx(0, false);
+	{
+		std::shared_ptr<INode> dropped = superblock->inode_table->alloc_inode();
+		REQUIRE(dropped->write(0, &contents[0], contents.size()) == contents.size());
+		dropped->release_chunks();
+		superblock->inode_table->free_inode(std::move(dropped));
+	}
+
+	while (superblock->cleaner->clean_one()) {
+	}
+	REQUIRE(kept->resolve_chunk_idx(0, false) == first_chunk);
+	std::vector<char> read_back(contents.size());
+	REQUIRE(kept->read(0, &read_back[0], read_back.size()) == read_back.size());
+	REQUIRE(read_back == contents);
+}
+
+TEST_CASE( "Allocation cleans segments once every one of them is in use", "[cleaner][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 4096;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t FILE_CHUNKS = 10;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+	SuperBlock *superblock = fs->superblock.get();
+	SegmentController &segments = superblock->segment_controller;
+
+	// fill every segment, then delete three files out of four
+	std::map<uint64_t, std::vector<char>> files;
+	std::vector<uint64_t> inodes;
+	uint64_t file = 0;
+	while (segments.free_segment_count() > 0) {
+		std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+		std::vector<char> contents = file_contents(file++, FILE_CHUNKS * CHUNK_SIZE);
+		REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+		inodes.push_back(inode->inode_table_idx);
+		files[inode->inode_table_idx] = contents;
+	}
+	for (size_t idx = 0; idx < inodes.size(); ++idx) {
+		if (idx % 4 != 0) {
+			delete_file(superblock, inodes[idx]);
+			files.erase(inodes[idx]);
+		}
+	}
+	REQUIRE(superblock->cleaner->segments_cleaned == 0);
+
+	// more than fits in whatever the open segments have left
+	const uint64_t rewrite = inodes.size() / 2;
+	for (uint64_t idx = 0; idx < rewrite; ++idx) {
+		std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+		std::vector<char> contents = file_contents(file++, FILE_CHUNKS * CHUNK_SIZE);
+		REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+		files[inode->inode_table_idx] = contents;
+	}
+	REQUIRE(superblock->cleaner->segments_cleaned > 0);
+	require_contents(superblock, files);
+	REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+}
+
+TEST_CASE( "Cost benefit cleaning prefers old segments to slightly emptier young ones", "[cleaner][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+	SuperBlock *superblock = fs->superblock.get();
+	SegmentController &segments = superblock->segment_controller;
+	const uint64_t capacity = segments.segment_size - 1;
+
+	// two whole segments, half of one and 40% of the other freed again
+	const DiskBitMap::BitRange young = superblock->allocate_chunk_run(42, capacity);
+	const DiskBitMap::BitRange old = superblock->allocate_chunk_run(42, capacity);
+	REQUIRE(young.bit_count == capacity);
+	REQUIRE(old.bit_count == capacity);
+	superblock->free_chunk_run(young.start_idx, capacity / 2);
+	superblock->free_chunk_run(old.start_idx, capacity * 2 / 5);
+
+	const uint64_t young_segment = (young.start_idx - segments.data_offset) / segments.segment_size;
+	const uint64_t old_segment = (old.start_idx - segments.data_offset) / segments.segment_size;
+	segments.write_clock = 100;
+	segments.segment_written[young_segment] = 100;
+	segments.segment_written[old_segment] = 0;
+
+	CleanerConfig config;
+	config.policy = CleanerConfig::GREEDY;
+	superblock->cleaner->set_config(config);
+	REQUIRE(superblock->cleaner->pick_victim() == young_segment);
+
+	config.policy = CleanerConfig::COST_BENEFIT;
+	superblock->cleaner->set_config(config);
+	REQUIRE(superblock->cleaner->pick_victim() == old_segment);
+}
+
+TEST_CASE( "The segment usage queues hand out free and emptiest segments", "[cleaner][segmentusage]" ) {
+	SegmentUsage usage;
+	usage.init(8, 2);
+	for (uint64_t segment = 8; segment-- > 0; ) {
+		usage.push_free(segment);
+	}
+
+	// a slice's own segments come first, in order, then the other slice's
+	uint64_t segment = 0;
+	REQUIRE(usage.pop_free(1, segment));
+	REQUIRE(segment == 4);
+	REQUIRE(usage.pop_free(1, segment));
+	REQUIRE(segment == 5);
+	for (uint64_t expected : {6, 7, 0}) {
+		REQUIRE(usage.pop_free(1, segment));
+		REQUIRE(segment == expected);
+	}
+
+	// a change leaves the old entry stale, it is passed over
+	usage.set(1, 10);
+	usage.push_used(1);
+	usage.set(2, 5);
+	usage.push_used(2);
+	usage.set(3, 7);
+	usage.push_used(3);
+	usage.add(1, -8);
+	const auto all = [](uint64_t) { return true; };
+	std::vector<uint64_t> emptiest = usage.emptiest(2, all);
+	REQUIRE(emptiest == std::vector<uint64_t>({2, 3}));
+	usage.push_used(1);
+	emptiest = usage.emptiest(8, all);
+	REQUIRE(emptiest == std::vector<uint64_t>({1, 2, 3}));
+
+	// turned down, until it is pushed again
+	emptiest = usage.emptiest(8, [](uint64_t segment) { return segment != 1; });
+	REQUIRE(emptiest == std::vector<uint64_t>({2, 3}));
+	REQUIRE(usage.emptiest(8, all) == std::vector<uint64_t>({2, 3}));
+
+	// only what changed since the last checkpoint is stored
+	std::map<uint64_t, uint64_t> stored;
+	const auto store = [&](uint64_t segment, uint64_t chunks) { stored[segment] = chunks; };
+	usage.checkpoint(store);
+	REQUIRE(stored == std::map<uint64_t, uint64_t>({{1, 2}, {2, 5}, {3, 7}}));
+	stored.clear();
+	usage.add(3, 1);
+	usage.checkpoint(store);
+	REQUIRE(stored == std::map<uint64_t, uint64_t>({{3, 8}}));
+}
+
+TEST_CASE( "Segment usage is counted again when the file system is loaded", "[cleaner][segmentusage][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t FILES = 30;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::vector<uint64_t> usage;
+	uint64_t free_segments = 0;
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		SuperBlock *superblock = fs->superblock.get();
+		for (uint64_t file = 0; file < FILES; ++file) {
+			std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+			std::vector<char> contents = file_contents(file, (file % 7 + 1) * 3 * CHUNK_SIZE);
+			REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+			if (file % 3 == 0) {
+				inode->release_chunks();
+				superblock->inode_table->free_inode(std::move(inode));
+			}
+		}
+		// a run out of a segment nobody had opened
+		REQUIRE(superblock->allocate_chunk_run(42, 40).bit_count > 0);
+		superblock->segment_controller.release_reservations();
+
+		SegmentController &segments = superblock->segment_controller;
+		for (uint64_t segment = 0; segment < segments.num_segments; ++segment) {
+			usage.push_back(segments.get_segment_usage(segment));
+		}
+		free_segments = segments.free_segment_count();
+	}
+
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->load_from_disk();
+	SegmentController &segments = fs->superblock->segment_controller;
+	uint64_t counted_free = 0;
+	for (uint64_t segment = 0; segment < segments.num_segments; ++segment) {
+		REQUIRE(segments.get_segment_usage(segment) == usage[segment]);
+		// the copy in the summary was brought up to date when the file system was put away
+		REQUIRE(*(const uint64_t *)disk->get_chunk(segments.data_offset + segment * segments.segment_size)->data == usage[segment]);
+		std::lock_guard<std::mutex> lock(segments.segment_controller_lock);
+		if (segments.segment_is_free(segment)) 
+			counted_free++;
+	}
+	REQUIRE(segments.free_segment_count() == free_segments);
+	REQUIRE(counted_free == free_segments);
+	// the first segment opened after the load is one of the free ones
+	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+	std::vector<char> contents = file_contents(0, CHUNK_SIZE);
+	REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+	REQUIRE(segments.free_segment_count() == free_segments - 1);
+}
+
+TEST_CASE( "Tables and the chunks the cleaner moves are kept apart from data", "[cleaner][hotcold][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t FILE_CHUNKS = 40; // past the direct addresses
+
+	for (bool separate : {true, false}) {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		SuperBlock *superblock = fs->superblock.get();
+		SegmentController &segments = superblock->segment_controller;
+		segments.separate_temperatures = separate;
+		const auto segment_of = [&](uint64_t chunk) {
+			return (chunk - segments.data_offset) / segments.segment_size;
+		};
+
+		// written in turns with a file that then dies, so that the segments they share 
+		// are worth cleaning
+		std::vector<char> contents = file_contents(2, FILE_CHUNKS * CHUNK_SIZE);
+		std::shared_ptr<INode> kept = superblock->inode_table->alloc_inode();
+		std::shared_ptr<INode> dropped = superblock->inode_table->alloc_inode();
+		for (uint64_t chunk = 0; chunk < FILE_CHUNKS; ++chunk) {
+			for (INode *inode : {kept.get(), dropped.get()}) 
+				REQUIRE(inode->write(chunk * CHUNK_SIZE, &contents[chunk * CHUNK_SIZE], CHUNK_SIZE) == CHUNK_SIZE);
+		}
+		const uint64_t table = kept->data.addresses[INode::INDIRECT_TABLE_SIZES[0]];
+		const uint64_t data = kept->resolve_chunk_idx(0, false);
+		REQUIRE(table != 0);
+		REQUIRE((segment_of(table) != segment_of(data)) == separate);
+
+		{
+			const uint64_t free_before = superblock->free_chunk_count();
+			dropped->release_chunks();
+			// the table goes with the data
+			REQUIRE(superblock->free_chunk_count() == free_before + FILE_CHUNKS + 1);
+			superblock->inode_table->free_inode(std::move(dropped));
+		}
+		const uint64_t kept_idx = kept->inode_table_idx;
+		kept = nullptr;
+
+		// what the cleaner moves goes to a segment of its own
+		std::set<uint64_t> open_before;
+		for (uint64_t segment = 0; segment < segments.num_segments; ++segment) {
+			if (segments.segment_open[segment]) 
+				open_before.insert(segment);
+		}
+		const uint64_t victim = segment_of(data);
+		while (superblock->cleaner->clean_one()) {
+			std::lock_guard<std::mutex> lock(segments.segment_controller_lock);
+			if (segments.segment_is_free(victim)) 
+				break ;
+		}
+		kept = superblock->inode_table->get_inode(kept_idx);
+		const uint64_t moved = kept->resolve_chunk_idx(0, false);
+		REQUIRE(moved != data);
+		REQUIRE((open_before.count(segment_of(moved)) == 0) == separate);
+		std::vector<char> read_back(contents.size());
+		REQUIRE(kept->read(0, &read_back[0], read_back.size()) == read_back.size());
+		REQUIRE(read_back == contents);
+	}
+}
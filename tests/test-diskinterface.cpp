@@ -1,4 +1,12 @@
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
 
 #include "catch.hpp"
 
@@ -180,4 +188,516 @@ TEST_CASE( "Disk bitmap should work", "[bitmap]" ) {
 			REQUIRE(range2.start_idx == 53);
 		}
 	}
-}
\ No newline at end of file
+
+	SECTION("word at a time searches find the same runs as a bit at a time search with every scan kernel") {
+		const DiskBitMap::ScanKernel default_kernel = DiskBitMap::get_scan_kernel();
+		std::srand(11);
+		for (DiskBitMap::ScanKernel kernel : {DiskBitMap::SCAN_SCALAR, DiskBitMap::SCAN_AVX2}) {
+			if (!DiskBitMap::set_scan_kernel(kernel)) 
+				continue ;
+
+			// 4 byte chunks split words across chunks, 512 byte ones give the kernels
+			// long stretches of whole words
+			for (Size chunk_size : {4, 512}) {
+				constexpr Size size = 20000;
+				std::unique_ptr<Disk> disk(new Disk(1024, chunk_size));
+				std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 1, size));
+				bitmap->clear_all();
+				// long used stretches with a few free bits scattered through them
+				std::vector<bool> used(size);
+				for (Size idx = 0; idx < size; ++idx) {
+					used[idx] = (idx / 3000) % 2 == 0 ? std::rand() % 500 != 0 : std::rand() % 3 != 0;
+					if (used[idx]) 
+						bitmap->set(idx);
+				}
+
+				Size from = 0;
+				for (int search = 0; search < 2000; ++search) {
+					const Size length = 1 + std::rand() % 5;
+					Size start = from;
+					while (start < size && used[start]) 
+						start++;
+					if (start == size) {
+						start = 0;
+						while (start < size && used[start]) 
+							start++;
+					}
+
+					auto range = bitmap->find_unset_bits(length);
+					if (start == size) {
+						REQUIRE(range.bit_count == 0);
+						break ;
+					}
+					Size count = 0;
+					while (count < length && start + count < size && !used[start + count]) 
+						count++;
+					REQUIRE(range.start_idx == start);
+					REQUIRE(range.bit_count == count);
+
+					// take one of the bits so that the next search has to move on
+					used[start] = true;
+					bitmap->set(start);
+					from = start + count;
+				}
+			}
+		}
+		DiskBitMap::set_scan_kernel(default_kernel);
+	}
+
+	SECTION("range and batched range updates change exactly the bits in the ranges") {
+		std::srand(15);
+		for (Size chunk_size : {4, 512}) {
+			constexpr Size size = 9000;
+			std::unique_ptr<Disk> disk(new Disk(1024, chunk_size));
+			std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 1, size));
+			bitmap->clear_all();
+			std::vector<bool> expected(size, false);
+
+			for (int round = 0; round < 300; ++round) {
+				const bool value = std::rand() % 2 == 0;
+				std::vector<DiskBitMap::BitRange> ranges(1 + std::rand() % 4);
+				for (DiskBitMap::BitRange &range : ranges) {
+					range.start_idx = std::rand() % size;
+					range.bit_count = std::min<Size>(std::rand() % 200, size - range.start_idx);
+					std::fill(expected.begin() + range.start_idx, expected.begin() + range.start_idx + range.bit_count, value);
+				}
+				if (ranges.size() == 1) {
+					if (value) 
+						ranges[0].set_range(*bitmap);
+					else 
+						ranges[0].clr_range(*bitmap);
+				} else if (value) {
+					bitmap->set_ranges(&ranges[0], ranges.size());
+				} else {
+					bitmap->clr_ranges(&ranges[0], ranges.size());
+				}
+			}
+			for (Size idx = 0; idx < size; ++idx) {
+				REQUIRE(bitmap->get(idx) == expected[idx]);
+			}
+			REQUIRE(bitmap->count_unset_bits() == (Size)std::count(expected.begin(), expected.end(), false));
+
+			// a batch with a bad range is turned down as a whole
+			DiskBitMap::BitRange bad[2];
+			bad[0].start_idx = 0;
+			bad[0].bit_count = 10;
+			bad[1].start_idx = size - 5;
+			bad[1].bit_count = 10;
+			REQUIRE_THROWS_AS(bitmap->set_ranges(bad, 2), DiskException);
+			for (Size idx = 0; idx < 10; ++idx) {
+				REQUIRE(bitmap->get(idx) == expected[idx]);
+			}
+		}
+	}
+
+	SECTION("the summary finds the first long enough free run and keeps count of the free bits") {
+		// enough bits for a summary a few levels deep
+		constexpr Size size = 3 * DiskBitMap::SUMMARY_BLOCK_BITS * DiskBitMap::SUMMARY_FANOUT + 1234;
+		std::unique_ptr<Disk> disk(new Disk(1024, 512));
+		std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 1, size));
+		bitmap->clear_all();
+		REQUIRE(bitmap->count_unset_bits() == size);
+		REQUIRE(bitmap->longest_unset_run() == size);
+
+		// mostly used, with free runs of every length up to 300 here and there
+		std::srand(13);
+		std::vector<bool> used(size, true);
+		for (Size idx = 0; idx < size; ++idx) 
+			bitmap->set(idx);
+		for (int hole = 0; hole < 500; ++hole) {
+			const Size start = std::rand() % size;
+			const Size length = std::min<Size>(1 + std::rand() % 300, size - start);
+			for (Size idx = start; idx < start + length; ++idx) {
+				used[idx] = false;
+				bitmap->clr(idx);
+			}
+		}
+
+		const auto first_run = [&](Size from, Size length) -> Size {
+			Size running = 0;
+			for (Size idx = from; idx < size; ++idx) {
+				running = used[idx] ? 0 : running + 1;
+				if (running == length) 
+					return idx + 1 - length;
+			}
+			return size;
+		};
+
+		Size from = 0;
+		for (int search = 0; search < 400; ++search) {
+			REQUIRE(bitmap->count_unset_bits() == (Size)std::count(used.begin(), used.end(), false));
+			const Size length = 1 + std::rand() % 400;
+			Size start = first_run(from, length);
+			if (start == size) 
+				start = first_run(0, length);
+
+			auto range = bitmap->find_unset_run(length);
+			if (start == size) {
+				REQUIRE(range.bit_count == 0);
+				continue ;
+			}
+			REQUIRE(range.start_idx == start);
+			REQUIRE(range.bit_count == length);
+			range.set_range(*bitmap);
+			for (Size idx = start; idx < start + length; ++idx) 
+				used[idx] = true;
+			from = start + length;
+		}
+	}
+
+	SECTION("chunks are loaded when they are first touched and only a few are kept loaded") {
+		// 512 bits to a chunk
+		constexpr Size size = 200 * 512;
+		constexpr Size max_resident = 8;
+		std::unique_ptr<Disk> disk(new Disk(1024, 64));
+		{
+			std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 1, size, max_resident));
+			REQUIRE(bitmap->chunk_loads() == 0);
+			bitmap->clear_all();
+			REQUIRE(bitmap->resident_chunks() == max_resident);
+			// everything is used but for a run at the very end
+			bitmap->set_range(0, size - 1000);
+		}
+
+		std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 1, size, max_resident));
+		REQUIRE(bitmap->resident_chunks() == 0);
+		REQUIRE(bitmap->get(5));
+		REQUIRE(bitmap->chunk_loads() == 1);
+
+		auto range = bitmap->find_unset_run(1000);
+		REQUIRE(range.start_idx == size - 1000);
+		REQUIRE(range.bit_count == 1000);
+		REQUIRE(bitmap->resident_chunks() <= max_resident);
+		REQUIRE(bitmap->count_unset_bits() == 1000);
+
+		// bits changed in chunks that have since been dropped are still there
+		for (Size idx = 0; idx < size; idx += 777) 
+			bitmap->clr(idx);
+		for (Size idx = 0; idx < size; ++idx) 
+			REQUIRE(bitmap->get(idx) == (idx < size - 1000 && idx % 777 != 0));
+		REQUIRE(bitmap->resident_chunks() <= max_resident);
+
+		// and threads can share the bitmap while it pages chunks in and out
+		std::vector<std::thread> threads;
+		for (Size thread = 0; thread < 4; ++thread) {
+			threads.push_back(std::thread([&bitmap, thread]() {
+				for (Size idx = thread; idx < size - 1000; idx += 4 * 97) 
+					bitmap->clr(idx);
+			}));
+		}
+		for (auto &thread : threads) 
+			thread.join();
+		for (Size idx = 0; idx < size - 1000; ++idx) 
+			REQUIRE(bitmap->get(idx) == (idx % 777 != 0 && (idx % (4 * 97)) >= 4));
+	}
+}
+TEST_CASE( "Disk chunk cache should be safe to use from many threads", "[diskinterface][threads]" ) {
+	std::unique_ptr<Disk> disk(new Disk(1024, 64));
+
+	SECTION("threads racing on the same chunks all get the same chunk object") {
+		std::shared_ptr<Chunk> held = disk->get_chunk(7);
+		std::vector<std::thread> threads;
+		std::atomic<size_t> mismatches(0);
+		for (size_t t = 0; t < 8; ++t) {
+			threads.push_back(std::thread([&disk, &held, &mismatches]() {
+				for (size_t i = 0; i < 10000; ++i) {
+					if (disk->get_chunk(7) != held) {
+						mismatches++;
+					}
+					disk->get_chunk(i % 1024)->data[0] = 1;
+				}
+			}));
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		REQUIRE(mismatches == 0);
+		held = nullptr;
+
+		for (size_t i = 0; i < 1024; ++i) {
+			REQUIRE(disk->get_chunk(i)->data[0] == 1);
+		}
+		disk->try_close();
+	}
+}
+
+TEST_CASE( "Disk should write back released chunks", "[diskinterface][writeback]" ) {
+	const char *path = "disk.writeback.test";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	REQUIRE(ftruncate(fd, 256 * 4096) == 0);
+
+	{
+		std::unique_ptr<Disk> disk(new Disk(256, 4096, MAP_FILE | MAP_SHARED, fd));
+
+		SECTION("released chunks are dirty until sync is called") {
+			WritebackConfig config;
+			config.dirty_age_ms = 60 * 1000;
+			disk->set_writeback_config(config);
+
+			for (size_t i = 0; i < 8; ++i) {
+				disk->get_chunk(i)->data[0] = 'a' + i;
+			}
+			REQUIRE(disk->dirty_chunk_count() == 8);
+
+			// chunks that are still referenced are written back by sync as well
+			std::shared_ptr<Chunk> held = disk->get_chunk(100);
+			held->data[0] = 'z';
+			disk->sync();
+			REQUIRE(disk->dirty_chunk_count() == 0);
+
+			char byte = 0;
+			REQUIRE(pread(fd, &byte, 1, 100 * 4096) == 1);
+			REQUIRE(byte == 'z');
+			REQUIRE(pread(fd, &byte, 1, 3 * 4096) == 1);
+			REQUIRE(byte == 'd');
+		}
+
+		SECTION("the flusher writes back chunks once they are old enough") {
+			WritebackConfig config;
+			config.dirty_age_ms = 10;
+			disk->set_writeback_config(config);
+
+			for (size_t i = 0; i < 8; ++i) {
+				disk->get_chunk(i * 3)->data[0] = 1;
+			}
+			for (int i = 0; i < 200 && disk->dirty_chunk_count() != 0; ++i) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			REQUIRE(disk->dirty_chunk_count() == 0);
+		}
+
+		SECTION("sync makes chunks durable that the flusher already wrote back") {
+			WritebackConfig config;
+			config.dirty_age_ms = 10;
+			disk->set_writeback_config(config);
+
+			for (size_t i = 0; i < 8; ++i) {
+				disk->get_chunk(i * 5)->data[0] = 'f';
+			}
+			for (int i = 0; i < 200 && disk->dirty_chunk_count() != 0; ++i) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			REQUIRE(disk->dirty_chunk_count() == 0);
+
+			// the flusher only started those writes, so sync still has to wait them out
+			// and msync the disk even though it has nothing left to write itself
+			const uint64_t msyncs = disk->msync_count();
+			disk->sync();
+			REQUIRE(disk->msync_count() == msyncs + 1);
+			char byte = 0;
+			REQUIRE(pread(fd, &byte, 1, 35 * 4096) == 1);
+			REQUIRE(byte == 'f');
+		}
+
+		SECTION("the flusher is kicked early once dirty_bytes is reached") {
+			WritebackConfig config;
+			config.dirty_age_ms = 60 * 1000;
+			config.dirty_bytes = 16 * 4096;
+			disk->set_writeback_config(config);
+
+			for (size_t i = 0; i < 64; ++i) {
+				disk->get_chunk(i)->data[0] = 1;
+			}
+			for (int i = 0; i < 200 && disk->dirty_chunk_count() >= 16; ++i) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			REQUIRE(disk->dirty_chunk_count() < 16);
+		}
+
+		SECTION("a staged segment is written back in one go") {
+			WritebackConfig config;
+			config.dirty_age_ms = 60 * 1000;
+			disk->set_writeback_config(config);
+
+			disk->stage_segment(64, 32);
+			for (size_t i = 64; i < 96; ++i) {
+				disk->get_chunk(i)->data[0] = 's';
+			}
+			disk->get_chunk(200)->data[0] = 'd';
+			// only the chunk outside of the segment is dirty
+			REQUIRE(disk->dirty_chunk_count() == 1);
+
+			const uint64_t msyncs = disk->msync_count();
+			disk->write_segment(64);
+			REQUIRE(disk->segment_write_count() == 1);
+			REQUIRE(disk->msync_count() == msyncs + 1);
+			char byte = 0;
+			REQUIRE(pread(fd, &byte, 1, 95 * 4096) == 1);
+			REQUIRE(byte == 's');
+
+			// and once it is written it is like any other chunk
+			disk->write_segment(64);
+			REQUIRE(disk->segment_write_count() == 1);
+			disk->get_chunk(70)->data[0] = 't';
+			REQUIRE(disk->dirty_chunk_count() == 2);
+		}
+
+		SECTION("a staged segment is written back by sync and by the flusher") {
+			WritebackConfig config;
+			config.dirty_age_ms = 60 * 1000;
+			disk->set_writeback_config(config);
+
+			disk->stage_segment(128, 32);
+			disk->get_chunk(130)->data[0] = 'x';
+			disk->sync();
+			char byte = 0;
+			REQUIRE(pread(fd, &byte, 1, 130 * 4096) == 1);
+			REQUIRE(byte == 'x');
+
+			// a segment that is slow to fill does not wait for it forever, and stays 
+			// staged after
+			config.dirty_age_ms = 10;
+			disk->set_writeback_config(config);
+			const uint64_t writes = disk->segment_write_count();
+			disk->get_chunk(131)->data[0] = 'y';
+			for (int i = 0; i < 200 && disk->segment_write_count() == writes; ++i) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			REQUIRE(disk->segment_write_count() > writes);
+			REQUIRE(pread(fd, &byte, 1, 131 * 4096) == 1);
+			REQUIRE(byte == 'y');
+			REQUIRE(disk->dirty_chunk_count() == 0);
+		}
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+TEST_CASE( "Disk should punch discarded ranges out of the backing file", "[diskinterface][discard]" ) {
+	const char *path = "disk.discard.test";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	REQUIRE(ftruncate(fd, 256 * 4096) == 0);
+	{
+		std::unique_ptr<Disk> disk(new Disk(256, 4096, MAP_FILE | MAP_SHARED, fd));
+		for (size_t i = 0; i < 256; ++i) {
+			std::memset(disk->get_chunk(i)->data, 'a', 4096);
+		}
+		disk->sync();
+		struct stat before;
+		REQUIRE(fstat(fd, &before) == 0);
+
+		// nothing happens on a disk that has discards turned off
+		disk->discard(16, 32);
+		REQUIRE(disk->discarded_chunk_count() == 0);
+
+		DiscardConfig config;
+		config.enabled = true;
+		config.delay_ms = 20;
+		config.min_chunks = 1;
+		disk->set_discard_config(config);
+		disk->discard(16, 16);
+		disk->discard(32, 16); // merged with the one before
+		disk->discard(100, 20);
+		// part of it is taken back before it is due, the rest still goes
+		disk->cancel_discard(105, 5);
+		for (int i = 0; i < 200 && disk->discarded_chunk_count() < 47; ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		REQUIRE(disk->discarded_chunk_count() == 47);
+
+		// what was punched reads back as zeros, through the mapping as well
+		REQUIRE(disk->get_chunk(16)->data[0] == 0);
+		REQUIRE(disk->get_chunk(47)->data[4095] == 0);
+		REQUIRE(disk->get_chunk(104)->data[0] == 0);
+		REQUIRE(disk->get_chunk(110)->data[0] == 0);
+		REQUIRE(disk->get_chunk(15)->data[4095] == 'a');
+		REQUIRE(disk->get_chunk(48)->data[0] == 'a');
+		REQUIRE(disk->get_chunk(105)->data[0] == 'a');
+		REQUIRE(disk->get_chunk(109)->data[0] == 'a');
+		struct stat after;
+		REQUIRE(fstat(fd, &after) == 0);
+		REQUIRE(after.st_size == before.st_size);
+		REQUIRE(after.st_blocks < before.st_blocks);
+
+		// ranges shorter than min_chunks are not worth punching
+		config.min_chunks = 8;
+		disk->set_discard_config(config);
+		disk->discard(200, 4);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		REQUIRE(disk->discarded_chunk_count() == 47);
+		REQUIRE(disk->get_chunk(200)->data[0] == 'a');
+	}
+	close(fd);
+	unlink(path);
+}
+
+TEST_CASE( "Disk should advise the kernel about how the mapping is used", "[diskinterface][madvise]" ) {
+	constexpr uint64_t CHUNK_COUNT = 4096;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+
+	SECTION("the detector reads ahead of runs and tracks the overall pattern") {
+		SequentialDetector detector;
+		SequentialDetector::Hint hint;
+		Size prefetched = 0;
+		for (Size idx = 1000; idx < 1000 + SequentialDetector::EPOCH_LOADS; ++idx) {
+			hint = detector.access(idx);
+			if (hint.prefetch_count > 0) {
+				// windows follow on from each other and always lie ahead of the load
+				REQUIRE(hint.prefetch_first > idx);
+				REQUIRE((prefetched == 0 || hint.prefetch_first == prefetched));
+				prefetched = hint.prefetch_first + hint.prefetch_count;
+			}
+		}
+		REQUIRE(prefetched > 1000 + SequentialDetector::EPOCH_LOADS);
+		REQUIRE(hint.pattern == SequentialDetector::PATTERN_SEQUENTIAL);
+
+		uint64_t state = 0x9e3779b97f4a7c15ULL;
+		for (Size idx = 0; idx < SequentialDetector::EPOCH_LOADS; ++idx) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			hint = detector.access(state % (1 << 30));
+			REQUIRE(hint.prefetch_count == 0);
+		}
+		REQUIRE(hint.pattern == SequentialDetector::PATTERN_RANDOM);
+	}
+
+	SECTION("a file backed disk gives readahead hints for sequential loads only") {
+		const char *path = "disk.madvise.test";
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		REQUIRE(fd != -1);
+		REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+
+		MmapConfig config;
+		config.populate = true;
+		config.hugepages = true;
+		{
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fd, config));
+			disk->add_metadata_region(0, 16);
+
+			for (Size idx = 0; idx < CHUNK_COUNT; idx += 97) {
+				disk->get_chunk(idx)->data[0] = 1;
+			}
+			REQUIRE(disk->readahead_hint_count() == 0);
+
+			for (Size idx = 0; idx < CHUNK_COUNT; ++idx) {
+				disk->get_chunk(idx)->data[1] = (Byte)idx;
+			}
+			REQUIRE(disk->readahead_hint_count() > 0);
+			REQUIRE(disk->sequential_advised());
+		}
+
+		Byte byte = 0;
+		REQUIRE(pread(fd, &byte, 1, 1234 * CHUNK_SIZE + 1) == 1);
+		REQUIRE(byte == (Byte)1234);
+		close(fd);
+		unlink(path);
+	}
+
+	SECTION("an anonymous disk works with huge pages asked for") {
+		MmapConfig config;
+		config.hugepages = true;
+		config.populate = true;
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_PRIVATE | MAP_ANONYMOUS, -1, config));
+		for (Size idx = 0; idx < CHUNK_COUNT; ++idx) {
+			disk->get_chunk(idx)->data[0] = (Byte)idx;
+		}
+		for (Size idx = 0; idx < CHUNK_COUNT; ++idx) {
+			REQUIRE(disk->get_chunk(idx)->data[0] == (Byte)idx);
+		}
+		REQUIRE(disk->readahead_hint_count() == 0);
+	}
+}
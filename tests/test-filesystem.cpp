@@ -2,6 +2,8 @@
 #include <cstdlib>
 #include <ctime>
 #include <vector>
+#include <algorithm>
+#include <thread>
 
 #include "catch.hpp"
 
@@ -44,6 +46,10 @@ TEST_CASE( "Making a filesystem should work", "[filesystem]" ) {
 		std::cout << "Load the filesystem from the disk" << std::endl;
 		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
 		fs->superblock->load_from_disk();
+		// the block map is read once to count what is in use in each segment (it is a 
+		// single chunk here), the inode bitmap is not looked at
+		REQUIRE(fs->superblock->disk_block_map->chunk_loads() == 1);
+		REQUIRE(fs->superblock->inode_table->used_inodes->chunk_loads() == 0);
 		fs = nullptr;
 	}
 }
@@ -339,6 +345,527 @@ TEST_CASE("INode write overlapping strings", "[INode]"){
 	}
 }
 
+TEST_CASE("INode block map cache should answer repeated lookups without walking", "[filesystem][INode][blockmap]") {
+	std::unique_ptr<Disk> disk(new Disk(10 * 1024, 512));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+
+	// with 512 byte chunks these land in the direct, single, double and triple 
+	// indirect ranges of the inode
+	const uint64_t offsets[] = {0, 16 * 512, 200 * 512, 5000 * 512};
+	const uint64_t length = 8 * 512;
+
+	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+	std::vector<std::vector<char>> contents;
+	for (uint64_t offset : offsets) {
+		contents.push_back(get_random_buffer(length));
+		REQUIRE(inode->write(offset, &contents.back()[0], length) == length);
+	}
+
+	const auto read_all = [&]() {
+		std::vector<char> read_back(length);
+		for (size_t idx = 0; idx < contents.size(); ++idx) {
+			REQUIRE(inode->read(offsets[idx], &read_back[0], length) == length);
+			REQUIRE(read_back == contents[idx]);
+		}
+	};
+
+	// the first pass walks once per indirect table, the second never walks at all
+	inode->invalidate_block_map();
+	const uint64_t walks_before = inode->block_map_walks();
+	read_all();
+	const uint64_t walks = inode->block_map_walks();
+	REQUIRE(walks - walks_before == 3);
+	read_all();
+	REQUIRE(inode->block_map_walks() == walks);
+	REQUIRE(inode->block_map_hits() > 0);
+
+	// a write moves nothing that is cached, but rewriting data and filling a hole
+	// must still read back correctly
+	contents[2] = get_random_buffer(length);
+	REQUIRE(inode->write(offsets[2], &contents[2][0], length) == length);
+	std::vector<char> hole(512, 0);
+	std::vector<char> filled = get_random_buffer(512);
+	REQUIRE(inode->read(offsets[3] - 512, &hole[0], 512) == 512);
+	REQUIRE(hole == std::vector<char>(512, 0));
+	REQUIRE(inode->write(offsets[3] - 512, &filled[0], 512) == 512);
+	REQUIRE(inode->read(offsets[3] - 512, &hole[0], 512) == 512);
+	REQUIRE(hole == filled);
+	read_all();
+}
+
+TEST_CASE("INodes using the extent format map runs of chunks", "[filesystem][INode][extents]") {
+	constexpr uint64_t CHUNK_SIZE = 512;
+	std::unique_ptr<Disk> disk(new Disk(10 * 1024, CHUNK_SIZE));
+	std::vector<char> sequential_contents = get_random_buffer(1000 * CHUNK_SIZE);
+	std::vector<char> interleaved_contents[2] = {
+		get_random_buffer(300 * CHUNK_SIZE), get_random_buffer(300 * CHUNK_SIZE)
+	};
+	std::vector<char> shuffled_contents = get_random_buffer(200 * CHUNK_SIZE);
+	uint64_t inode_idxs[4];
+
+	const auto read_back = [&](INode &inode, const std::vector<char> &contents) {
+		std::vector<char> buffer(contents.size());
+		REQUIRE(inode.read(0, &buffer[0], buffer.size()) == buffer.size());
+		REQUIRE(buffer == contents);
+	};
+
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		std::shared_ptr<INode> inodes[4];
+		for (size_t idx = 0; idx < 4; ++idx) {
+			inodes[idx] = fs->superblock->inode_table->alloc_inode();
+			inodes[idx]->set_mapping(INode::MAPPING_EXTENTS);
+			inode_idxs[idx] = inodes[idx]->inode_table_idx;
+		}
+
+		// written in order a file takes one extent per segment it runs through, and one
+		// more for each of the few chunks of the tree itself that land in between
+		REQUIRE(inodes[0]->write(0, &sequential_contents[0], sequential_contents.size()) == sequential_contents.size());
+		const uint64_t segments_spanned = 1000 / (fs->superblock->segment_size_chunks - 1) + 4;
+		REQUIRE(inodes[0]->extent_count() <= segments_spanned);
+		read_back(*inodes[0], sequential_contents);
+		REQUIRE_THROWS_AS(inodes[0]->set_mapping(INode::MAPPING_BLOCKS), FileSystemException);
+
+		// two files written a chunk at a time in turns still get a stream's worth of
+		// chunks in a row, bar where a segment ends
+		const uint64_t stream_chunks = SegmentController::STREAM_CHUNKS;
+		for (uint64_t chunk = 0; chunk < 300; ++chunk) {
+			for (size_t file = 0; file < 2; ++file) {
+				REQUIRE(inodes[1 + file]->write(chunk * CHUNK_SIZE, &interleaved_contents[file][chunk * CHUNK_SIZE], CHUNK_SIZE) == CHUNK_SIZE);
+			}
+		}
+		for (size_t file = 0; file < 2; ++file) {
+			REQUIRE(inodes[1 + file]->extent_count() <= 300 / (stream_chunks / 2));
+			read_back(*inodes[1 + file], interleaved_contents[file]);
+		}
+
+		// out of order writes fill holes in front of, between and behind runs, and next
+		// to nothing is in order on disk, which takes the tree a couple of levels deep
+		std::vector<uint64_t> order;
+		for (uint64_t chunk = 0; chunk < 200; ++chunk) {
+			order.push_back(chunk);
+		}
+		std::srand(10);
+		std::random_shuffle(order.begin(), order.end());
+		for (uint64_t chunk : order) {
+			REQUIRE(inodes[3]->write(chunk * CHUNK_SIZE, &shuffled_contents[chunk * CHUNK_SIZE], CHUNK_SIZE) == CHUNK_SIZE);
+			std::vector<char> buffer(CHUNK_SIZE);
+			REQUIRE(inodes[3]->read(chunk * CHUNK_SIZE, &buffer[0], CHUNK_SIZE) == CHUNK_SIZE);
+			REQUIRE(std::equal(buffer.begin(), buffer.end(), shuffled_contents.begin() + chunk * CHUNK_SIZE));
+		}
+		read_back(*inodes[3], shuffled_contents);
+		REQUIRE(inodes[3]->extent_count() >= 150);
+		REQUIRE(inodes[3]->extent_depth() >= 2);
+
+		for (std::shared_ptr<INode> &inode : inodes) {
+			inode = nullptr;
+		}
+		fs = nullptr;
+	}
+
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idxs[0]);
+		REQUIRE(inode->data.mapping == INode::MAPPING_EXTENTS);
+		read_back(*inode, sequential_contents);
+		for (size_t file = 0; file < 2; ++file) {
+			read_back(*fs->superblock->inode_table->get_inode(inode_idxs[1 + file]), interleaved_contents[file]);
+		}
+		read_back(*fs->superblock->inode_table->get_inode(inode_idxs[3]), shuffled_contents);
+
+		// releasing the chunks empties the tree, after which the format can change again
+		inode->release_chunks();
+		REQUIRE(inode->extent_count() == 0);
+		REQUIRE(inode->extent_depth() == 0);
+		inode->set_mapping(INode::MAPPING_BLOCKS);
+		inode = nullptr;
+		fs = nullptr;
+	}
+}
+
+TEST_CASE("Allocation groups hand out every inode and chunk once to threads racing for them", "[filesystem][allocgroups]") {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr size_t THREADS = 8;
+	constexpr size_t INODES_PER_THREAD = 100;
+	constexpr size_t CHUNKS_PER_THREAD = 200;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	uint64_t inode_count = 0;
+	std::vector<uint64_t> inodes[THREADS];
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		SuperBlock *superblock = fs->superblock.get();
+		inode_count = superblock->inode_table->size_inodes();
+
+		SegmentController &segments = superblock->segment_controller;
+		uint64_t usage_before = 0;
+		for (uint64_t segment = 0; segment < segments.num_segments; ++segment) 
+			usage_before += segments.get_segment_usage(segment);
+
+		std::vector<uint64_t> chunks[THREADS];
+		std::vector<std::thread> threads;
+		for (size_t thread = 0; thread < THREADS; ++thread) {
+			threads.push_back(std::thread([&, thread]() {
+				for (size_t idx = 0; idx < INODES_PER_THREAD; ++idx) {
+					inodes[thread].push_back(superblock->inode_table->alloc_inode()->inode_table_idx);
+				}
+				for (size_t idx = 0; idx < CHUNKS_PER_THREAD; ++idx) {
+					chunks[thread].push_back(superblock->segment_controller.alloc_next(inodes[thread][0], ChunkPosition()));
+				}
+			}));
+		}
+		for (auto &thread : threads) 
+			thread.join();
+
+		std::vector<uint64_t> all_inodes, all_chunks;
+		for (size_t thread = 0; thread < THREADS; ++thread) {
+			all_inodes.insert(all_inodes.end(), inodes[thread].begin(), inodes[thread].end());
+			all_chunks.insert(all_chunks.end(), chunks[thread].begin(), chunks[thread].end());
+		}
+		std::sort(all_inodes.begin(), all_inodes.end());
+		std::sort(all_chunks.begin(), all_chunks.end());
+		REQUIRE(std::unique(all_inodes.begin(), all_inodes.end()) == all_inodes.end());
+		REQUIRE(std::unique(all_chunks.begin(), all_chunks.end()) == all_chunks.end());
+
+		for (uint64_t inode_idx : all_inodes) 
+			REQUIRE(superblock->inode_table->used_inodes->get(inode_idx));
+		// no chunk is a segment summary, and each one is credited to its segment
+		for (uint64_t chunk_idx : all_chunks) {
+			REQUIRE(chunk_idx > superblock->data_offset);
+			REQUIRE((chunk_idx - superblock->data_offset) % segments.segment_size != 0);
+		}
+		uint64_t usage = 0;
+		for (uint64_t segment = 0; segment < segments.num_segments; ++segment) 
+			usage += segments.get_segment_usage(segment);
+		REQUIRE(usage == usage_before + THREADS * CHUNKS_PER_THREAD);
+	}
+
+	// whatever the groups had reserved but not handed out is free again
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->load_from_disk();
+	DiskBitMap &used_inodes = *fs->superblock->inode_table->used_inodes;
+	// (along with the root directory init made)
+	REQUIRE(used_inodes.count_unset_bits() == inode_count - THREADS * INODES_PER_THREAD - 1);
+	for (size_t thread = 0; thread < THREADS; ++thread) {
+		for (uint64_t inode_idx : inodes[thread]) 
+			REQUIRE(used_inodes.get(inode_idx));
+	}
+}
+
+TEST_CASE("Streams keep the chunks of files written at the same time together", "[filesystem][allocgroups]") {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr size_t THREADS = 4;
+	constexpr size_t FILES_PER_THREAD = 2;
+	constexpr size_t CHUNKS_PER_FILE = 150;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+	SuperBlock *superblock = fs->superblock.get();
+	SegmentController &segments = superblock->segment_controller;
+	uint64_t usage_before = 0;
+	for (uint64_t segment = 0; segment < segments.num_segments; ++segment) 
+		usage_before += segments.get_segment_usage(segment);
+
+	// every thread writes its files a chunk at a time in turns, all of them at once
+	ReservedRun streams[THREADS][FILES_PER_THREAD];
+	std::vector<uint64_t> chunks[THREADS][FILES_PER_THREAD];
+	std::vector<std::thread> threads;
+	for (size_t thread = 0; thread < THREADS; ++thread) {
+		threads.push_back(std::thread([&, thread]() {
+			for (size_t idx = 0; idx < CHUNKS_PER_FILE; ++idx) {
+				for (size_t file = 0; file < FILES_PER_THREAD; ++file) {
+					const uint64_t inode = thread * FILES_PER_THREAD + file;
+					chunks[thread][file].push_back(segments.alloc_next(inode, ChunkPosition(idx, 0), &streams[thread][file]));
+				}
+			}
+		}));
+	}
+	for (auto &thread : threads) 
+		thread.join();
+
+	const uint64_t stream_chunks = SegmentController::STREAM_CHUNKS;
+	std::vector<uint64_t> all_chunks;
+	for (size_t thread = 0; thread < THREADS; ++thread) {
+		for (size_t file = 0; file < FILES_PER_THREAD; ++file) {
+			const std::vector<uint64_t> &file_chunks = chunks[thread][file];
+			all_chunks.insert(all_chunks.end(), file_chunks.begin(), file_chunks.end());
+			// a file only jumps when its stream runs dry, or at the end of a segment
+			uint64_t jumps = 0;
+			for (size_t idx = 1; idx < file_chunks.size(); ++idx) {
+				if (file_chunks[idx] != file_chunks[idx - 1] + 1) 
+					jumps++;
+			}
+			REQUIRE(jumps <= CHUNKS_PER_FILE / (stream_chunks / 2));
+			const uint64_t segment = (file_chunks[0] - segments.data_offset) / segments.segment_size;
+			const ChunkPosition position = segments.get_segment_chunk_position(segment, (file_chunks[0] - segments.data_offset) % segments.segment_size);
+			REQUIRE(position.logical == 0);
+		}
+	}
+	std::sort(all_chunks.begin(), all_chunks.end());
+	REQUIRE(std::unique(all_chunks.begin(), all_chunks.end()) == all_chunks.end());
+
+	// what the streams have left is given back
+	for (size_t thread = 0; thread < THREADS; ++thread) {
+		for (size_t file = 0; file < FILES_PER_THREAD; ++file) 
+			segments.release_stream(streams[thread][file]);
+	}
+	segments.release_reservations();
+	REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+	// and only what was handed out is in use, the bitmap agrees
+	uint64_t usage = 0, marked = 0;
+	for (uint64_t segment = 0; segment < segments.num_segments; ++segment) {
+		usage += segments.get_segment_usage(segment);
+		marked += superblock->disk_block_map->count_set_bits(segments.data_offset + segment * segments.segment_size + 1, segments.segment_size - 1);
+	}
+	REQUIRE(usage == usage_before + THREADS * FILES_PER_THREAD * CHUNKS_PER_FILE);
+	REQUIRE(marked == usage);
+}
+
+TEST_CASE("A large write allocates its chunks a run at a time", "[filesystem][INode][allocgroups]") {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t OFFSET = 100;
+	constexpr uint64_t CHUNKS = 600;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+	SegmentController &segments = fs->superblock->segment_controller;
+	const std::vector<char> contents = get_random_buffer(CHUNKS * CHUNK_SIZE);
+
+	for (uint8_t mapping : {INode::MAPPING_BLOCKS, INode::MAPPING_EXTENTS}) {
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+		inode->set_mapping(mapping);
+		// starts and ends part of the way into a chunk
+		REQUIRE(inode->write(OFFSET, &contents[0], contents.size()) == contents.size());
+
+		// the data lands in runs that only break where a segment ends, the tables are
+		// kept elsewhere. every chunk knows where it is in the file
+		uint64_t jumps = 0;
+		uint64_t prev = 0;
+		for (uint64_t chunk = 0; chunk <= CHUNKS; ++chunk) {
+			const uint64_t chunk_idx = inode->resolve_chunk_idx(chunk, false);
+			REQUIRE(chunk_idx != 0);
+			if (chunk > 0 && chunk_idx != prev + 1) 
+				jumps++;
+			prev = chunk_idx;
+			const uint64_t segment = (chunk_idx - segments.data_offset) / segments.segment_size;
+			const uint64_t in_segment = (chunk_idx - segments.data_offset) % segments.segment_size;
+			REQUIRE(segments.get_segment_chunk_to_inode(segment, in_segment) == inode->inode_table_idx);
+			REQUIRE(segments.get_segment_chunk_position(segment, in_segment).logical == chunk);
+		}
+		REQUIRE(jumps <= CHUNKS / (segments.segment_size - 1) + 1);
+		if (mapping == INode::MAPPING_EXTENTS) 
+			REQUIRE(inode->extent_count() <= jumps + 1);
+
+		// what was not written reads back as zeros
+		std::vector<char> buffer(OFFSET + contents.size());
+		REQUIRE(inode->read(0, &buffer[0], buffer.size()) == buffer.size());
+		REQUIRE(std::count(buffer.begin(), buffer.begin() + OFFSET, 0) == OFFSET);
+		REQUIRE(std::equal(contents.begin(), contents.end(), buffer.begin() + OFFSET));
+		REQUIRE(inode->read(contents.size() + OFFSET, &buffer[0], 1) == 0);
+	}
+
+	// the batch on its own: one claim, cut short only where the segment ends
+	const DiskBitMap::BitRange first = fs->superblock->allocate_chunk_batch(42, 7, 5);
+	REQUIRE(first.bit_count >= 1);
+	REQUIRE(first.bit_count <= 5);
+	const DiskBitMap::BitRange second = fs->superblock->allocate_chunk_batch(42, 7 + first.bit_count, 5);
+	const uint64_t first_end = first.start_idx + first.bit_count;
+	REQUIRE((second.start_idx == first_end || (first_end - segments.data_offset) % segments.segment_size == 0));
+	for (uint64_t idx = 0; idx < first.bit_count; ++idx) {
+		const uint64_t in_segment = (first.start_idx + idx - segments.data_offset) % segments.segment_size;
+		const uint64_t segment = (first.start_idx - segments.data_offset) / segments.segment_size;
+		REQUIRE(segments.get_segment_chunk_to_inode(segment, in_segment) == 42);
+		REQUIRE(segments.get_segment_chunk_position(segment, in_segment).logical == 7 + idx);
+	}
+}
+
+TEST_CASE("Free chunk and inode counters agree with the bitmaps across reloads", "[filesystem][statfs]") {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr size_t FILES = 40;
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	uint64_t inode_count = 0;
+	uint64_t free_chunks = 0;
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		SuperBlock *superblock = fs->superblock.get();
+		inode_count = superblock->inode_table->size_inodes();
+		// inodes and chunks reserved by a group count as used, so both counters are
+		// exactly the unset bits in their bitmaps
+		REQUIRE(superblock->free_inode_count() == superblock->inode_table->used_inodes->count_unset_bits());
+		REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+
+		std::vector<std::shared_ptr<INode>> files;
+		for (size_t idx = 0; idx < FILES; ++idx) {
+			std::shared_ptr<INode> inode = superblock->inode_table->alloc_inode();
+			std::vector<char> data = get_random_buffer(CHUNK_SIZE * (idx % 20 + 1));
+			inode->write(0, &data[0], data.size());
+			files.push_back(inode);
+		}
+		REQUIRE(superblock->free_inode_count() == superblock->inode_table->used_inodes->count_unset_bits());
+		REQUIRE(superblock->free_inode_count() <= inode_count - 1 - FILES);
+		REQUIRE(superblock->free_inode_count() + INodeTable::RESERVE_INODES > inode_count - 1 - FILES);
+
+		// give back every other file
+		for (size_t idx = 0; idx < FILES; idx += 2) {
+			files[idx]->release_chunks();
+			superblock->inode_table->free_inode(std::move(files[idx]));
+		}
+		REQUIRE(superblock->free_inode_count() == superblock->inode_table->used_inodes->count_unset_bits());
+		REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+		free_chunks = superblock->free_chunk_count();
+	}
+
+	// put away cleanly, so the stored counters are used without counting anything
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		// the segment usage is counted from the block map, each chunk of it that covers
+		// a segment once
+		const SegmentController &segments = fs->superblock->segment_controller;
+		const uint64_t segments_end = segments.data_offset + segments.num_segments * segments.segment_size;
+		REQUIRE(fs->superblock->disk_block_map->chunk_loads() == (segments_end + CHUNK_SIZE * 8 - 1) / (CHUNK_SIZE * 8));
+		// and what the groups had not handed out was given back
+		REQUIRE(fs->superblock->free_chunk_count() > free_chunks);
+		REQUIRE(fs->superblock->free_chunk_count() == fs->superblock->disk_block_map->count_unset_bits());
+		free_chunks = fs->superblock->free_chunk_count();
+		REQUIRE(fs->superblock->free_inode_count() == inode_count - 1 - FILES / 2);
+		REQUIRE(fs->superblock->inode_table->used_inodes->count_unset_bits() == inode_count - 1 - FILES / 2);
+	}
+
+	// as if the file system had crashed, the counters on disk are not to be trusted
+	{
+		std::shared_ptr<Chunk> sb_chunk = disk->get_chunk(0);
+		uint64_t *words = (uint64_t *)sb_chunk->data;
+		words[13] = 0;
+		words[14] = 1;
+		words[15] = 1;
+	}
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->load_from_disk();
+	REQUIRE(fs->superblock->free_chunk_count() == free_chunks);
+	REQUIRE(fs->superblock->free_inode_count() == inode_count - 1 - FILES / 2);
+}
+
+TEST_CASE("The free extent index hands out runs that fit", "[filesystem][freeextents]") {
+	SECTION("free runs merge with their neighbours and are taken best fit or next fit") {
+		FreeExtents extents;
+		extents.insert(10, 5);
+		extents.insert(20, 3);
+		extents.insert(30, 8);
+		extents.insert(40, 2);
+		REQUIRE(extents.size() == 4);
+		// fills the gap between the first two
+		extents.insert(15, 5);
+		REQUIRE(extents.size() == 3);
+		REQUIRE(extents.free_count() == 23);
+		REQUIRE(extents.longest().start == 10);
+		REQUIRE(extents.longest().length == 13);
+
+		FreeExtents::Extent taken;
+		REQUIRE(extents.take(4, FreeExtents::BEST_FIT, taken));
+		REQUIRE(taken.start == 30);
+		REQUIRE(taken.length == 4);
+		REQUIRE(extents.take(2, FreeExtents::BEST_FIT, taken));
+		REQUIRE(taken.start == 40);
+		REQUIRE_FALSE(extents.take(14, FreeExtents::BEST_FIT, taken));
+
+		// next fit carries on from the last run it took, and wraps around
+		REQUIRE(extents.take(2, FreeExtents::NEXT_FIT, taken));
+		REQUIRE(taken.start == 10);
+		REQUIRE(extents.take(2, FreeExtents::NEXT_FIT, taken));
+		REQUIRE(taken.start == 12);
+		REQUIRE(extents.take(4, FreeExtents::NEXT_FIT, taken));
+		REQUIRE(taken.start == 14);
+		REQUIRE(extents.take(4, FreeExtents::NEXT_FIT, taken));
+		REQUIRE(taken.start == 18);
+		REQUIRE(extents.take(4, FreeExtents::NEXT_FIT, taken));
+		REQUIRE(taken.start == 34);
+		REQUIRE(extents.take(1, FreeExtents::NEXT_FIT, taken));
+		REQUIRE(taken.start == 22);
+		REQUIRE(extents.free_count() == 0);
+
+		// removing cuts whatever it overlaps
+		extents.insert(100, 50);
+		extents.insert(200, 10);
+		extents.remove(140, 65);
+		REQUIRE(extents.size() == 2);
+		REQUIRE(extents.free_count() == 45);
+		REQUIRE(extents.longest().start == 100);
+		REQUIRE(extents.longest().length == 40);
+	}
+
+	SECTION("runs are carved out of the block map and freed back into it") {
+		constexpr uint64_t CHUNK_COUNT = 8192;
+		constexpr uint64_t CHUNK_SIZE = 512;
+
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		DiskBitMap::BitRange hole;
+		{
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.1);
+			SuperBlock *superblock = fs->superblock.get();
+			SegmentController &segments = superblock->segment_controller;
+
+			// runs out of a fresh disk follow each other, the rest of the segment they
+			// came out of is the best fit for the next one
+			DiskBitMap::BitRange runs[5];
+			const uint64_t lengths[5] = {8, 3, 6, 4, 8};
+			for (size_t idx = 0; idx < 5; ++idx) {
+				runs[idx] = superblock->allocate_chunk_run(42, lengths[idx]);
+				REQUIRE(runs[idx].bit_count == lengths[idx]);
+				if (idx > 0) 
+					REQUIRE(runs[idx].start_idx == runs[idx - 1].start_idx + lengths[idx - 1]);
+				for (uint64_t chunk = 0; chunk < lengths[idx]; ++chunk) 
+					REQUIRE(superblock->disk_block_map->get(runs[idx].start_idx + chunk));
+			}
+			const uint64_t segment = (runs[0].start_idx - segments.data_offset) / segments.segment_size;
+			REQUIRE(segments.get_segment_usage(segment) == 29);
+			REQUIRE(segments.get_segment_chunk_to_inode(segment, (runs[2].start_idx - segments.data_offset) % segments.segment_size) == 42);
+			REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+
+			// the holes get filled by the runs that fit them best
+			superblock->free_chunk_run(runs[1].start_idx, runs[1].bit_count);
+			superblock->free_chunk_run(runs[3].start_idx, runs[3].bit_count);
+			REQUIRE(superblock->allocate_chunk_run(42, 4).start_idx == runs[3].start_idx);
+			REQUIRE(superblock->allocate_chunk_run(42, 3).start_idx == runs[1].start_idx);
+			REQUIRE(superblock->free_chunk_count() == superblock->disk_block_map->count_unset_bits());
+
+			// the segment a run came out of is never opened for single chunks
+			for (size_t idx = 0; idx < 100; ++idx) {
+				const uint64_t chunk = segments.alloc_next(42, ChunkPosition());
+				REQUIRE((chunk - segments.data_offset) / segments.segment_size != segment);
+			}
+
+			// nothing is that long, so the longest there is comes back
+			const DiskBitMap::BitRange longest = superblock->allocate_chunk_run(42, CHUNK_COUNT);
+			REQUIRE(longest.bit_count == segments.segment_size - 1);
+			superblock->free_chunk_run(longest.start_idx, longest.bit_count);
+
+			superblock->free_chunk_run(runs[2].start_idx, runs[2].bit_count);
+			hole = runs[2];
+		}
+
+		// the index is built again from the block map
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		const DiskBitMap::BitRange run = fs->superblock->allocate_chunk_run(42, hole.bit_count);
+		REQUIRE(run.start_idx == hole.start_idx);
+		REQUIRE(fs->superblock->free_chunk_count() == fs->superblock->disk_block_map->count_unset_bits());
+	}
+}
+
 TEST_CASE("INodes can be used to store and read directories", "[filesystem][idirectory]") {
 	std::unique_ptr<Disk> disk(new Disk(10 * 1024, 512));
 	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "diskinterface.hpp"
+#include "bufferpool.hpp"
+#include "ioengine.hpp"
+
+TEST_CASE( "IO engines should complete batches of reads and writes", "[ioengine]" ) {
+	constexpr uint64_t BLOCK_SIZE = 4096;
+	constexpr uint64_t BLOCK_COUNT = 200; // more than fits in one io_uring submission queue
+
+	const char *path = "disk.ioengine.test";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+
+	const auto check_engine = [fd](IOEngine &engine) {
+		REQUIRE(ftruncate(fd, 0) == 0);
+
+		std::vector<Byte> written(BLOCK_SIZE * BLOCK_COUNT);
+		std::vector<IORequest> requests(BLOCK_COUNT);
+		for (uint64_t idx = 0; idx < BLOCK_COUNT; ++idx) {
+			std::memset(&written[idx * BLOCK_SIZE], (int)(idx % 256), BLOCK_SIZE);
+			requests[idx].buffer = &written[idx * BLOCK_SIZE];
+			requests[idx].offset = idx * BLOCK_SIZE;
+			requests[idx].length = BLOCK_SIZE;
+			requests[idx].write = true;
+		}
+		engine.submit(requests.data(), requests.size());
+		for (IORequest &request : requests) {
+			REQUIRE(request.result == (ssize_t)BLOCK_SIZE);
+		}
+
+		// read everything back in reverse order, plus one block past the end of the file
+		std::vector<Byte> read_back(BLOCK_SIZE * (BLOCK_COUNT + 1), 0xff);
+		requests.resize(BLOCK_COUNT + 1);
+		for (uint64_t idx = 0; idx <= BLOCK_COUNT; ++idx) {
+			IORequest &request = requests[BLOCK_COUNT - idx];
+			request.buffer = &read_back[idx * BLOCK_SIZE];
+			request.offset = idx * BLOCK_SIZE;
+			request.length = BLOCK_SIZE;
+			request.write = false;
+		}
+		engine.submit(requests.data(), requests.size());
+		for (IORequest &request : requests) {
+			REQUIRE(request.result == (ssize_t)BLOCK_SIZE);
+		}
+		REQUIRE(std::equal(written.begin(), written.end(), read_back.begin()));
+		for (uint64_t idx = 0; idx < BLOCK_SIZE; ++idx) {
+			REQUIRE(read_back[BLOCK_COUNT * BLOCK_SIZE + idx] == 0);
+		}
+	};
+
+	SECTION("the posix engine") {
+		PosixIOEngine engine(fd);
+		check_engine(engine);
+	}
+
+	SECTION("the io_uring engine, when the kernel supports it") {
+		std::unique_ptr<IOEngine> engine = IOEngine::create(fd, IO_ENGINE_URING);
+		fprintf(stdout, "testing io engine: %s\n", engine->name());
+		check_engine(*engine);
+	}
+
+	SECTION("errors are reported per request") {
+		std::unique_ptr<IOEngine> engine = IOEngine::create(fd, IO_ENGINE_AUTO);
+		Byte buffer[16];
+		IORequest request;
+		request.buffer = buffer;
+		request.length = sizeof(buffer);
+		request.offset = (Size)-4096; // beyond any offset the kernel accepts
+		engine->submit(&request, 1);
+		REQUIRE(request.result < 0);
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+TEST_CASE( "get_chunks should load a batch of chunks through the buffer pool", "[ioengine][bufferpool]" ) {
+	constexpr uint64_t CHUNK_COUNT = 1024;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+
+	const char *path = "disk.ioengine.test";
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+	for (uint64_t idx = 0; idx < CHUNK_COUNT; ++idx) {
+		Byte byte = idx % 251;
+		REQUIRE(pwrite(fd, &byte, 1, idx * CHUNK_SIZE) == 1);
+	}
+
+	BufferPoolConfig config;
+	config.pool_bytes = 128 * CHUNK_SIZE;
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+
+	// some of the chunks are already referenced, and one is asked for twice
+	std::shared_ptr<Chunk> held = disk->get_chunk(10);
+	std::vector<Size> chunk_idxs;
+	for (Size idx = 0; idx < 64; ++idx) {
+		chunk_idxs.push_back(idx * 7 % CHUNK_COUNT);
+	}
+	chunk_idxs.push_back(7);
+
+	std::vector<std::shared_ptr<Chunk>> chunks(chunk_idxs.size());
+	disk->get_chunks(chunk_idxs.data(), chunk_idxs.size(), chunks.data());
+	for (size_t idx = 0; idx < chunk_idxs.size(); ++idx) {
+		REQUIRE(chunks[idx] != nullptr);
+		REQUIRE(chunks[idx]->chunk_idx == chunk_idxs[idx]);
+		REQUIRE(chunks[idx]->data[0] == chunk_idxs[idx] % 251);
+		REQUIRE(chunks[idx] == disk->get_chunk(chunk_idxs[idx]));
+	}
+	REQUIRE(chunks[1] == chunks.back());
+
+	// asking for more chunks than the pool holds fails without leaking any pins
+	chunk_idxs.clear();
+	for (Size idx = 500; idx < 700; ++idx) {
+		chunk_idxs.push_back(idx);
+	}
+	chunks.resize(chunk_idxs.size());
+	REQUIRE_THROWS_AS(disk->get_chunks(chunk_idxs.data(), chunk_idxs.size(), chunks.data()), DiskException);
+	chunks.clear();
+	held = nullptr;
+	for (Size idx = 0; idx < CHUNK_COUNT; ++idx) {
+		REQUIRE(disk->get_chunk(idx)->data[0] == idx % 251);
+	}
+
+	disk = nullptr;
+	close(fd);
+	unlink(path);
+}
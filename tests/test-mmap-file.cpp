@@ -3,6 +3,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <thread>
+#include <chrono>
 
 #include "catch.hpp"
 
@@ -84,6 +86,8 @@ TEST_CASE("INodes can be used to store and read directories on a mmap'd disk", "
 		disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
 		fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
 		fs->superblock->load_from_disk();
+		// the directory's inode outlived the old file system, point it at the new one
+		inode_dir->superblock = fs->superblock.get();
 
 		// step 2: read back each file 1 at a time checking that its contents matches the expected, and then removing it
 		for (int i = 0; i < 100; ++i) {
@@ -117,3 +121,102 @@ TEST_CASE("INodes can be used to store and read directories on a mmap'd disk", "
 		}
 	}
 }
+
+TEST_CASE("Segment writes write out the segments a file fills whole", "[mmap][segmentwrites]") {
+	constexpr uint64_t CHUNK_COUNT = 4096;
+	constexpr uint64_t CHUNK_SIZE = 512;
+	constexpr uint64_t FILE_CHUNKS = 1504; // in writes of 16 chunks
+
+	truncate("disk.myanfest", CHUNK_COUNT * CHUNK_SIZE);
+	int fh = open("disk.myanfest", O_RDWR | O_CREAT);
+	std::vector<char> contents(FILE_CHUNKS * CHUNK_SIZE);
+	for (size_t idx = 0; idx < contents.size(); ++idx) 
+		contents[idx] = 'a' + idx % 26;
+
+	uint64_t inode_idx = 0;
+	{
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
+		WritebackConfig config;
+		config.dirty_age_ms = 60 * 1000;
+		config.dirty_bytes = CHUNK_COUNT * CHUNK_SIZE;
+		disk->set_writeback_config(config);
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->segment_controller.segment_writes = true;
+		fs->superblock->init(0.1);
+
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+		inode_idx = inode->inode_table_idx;
+		for (uint64_t offset = 0; offset < contents.size(); offset += 16 * CHUNK_SIZE) {
+			REQUIRE(inode->write(offset, &contents[offset], 16 * CHUNK_SIZE) == 16 * CHUNK_SIZE);
+		}
+
+		// every segment the file filled went out in one go, and none of its chunks 
+		// were written back on their own
+		const uint64_t segment_size = fs->superblock->segment_size_chunks;
+		REQUIRE(disk->segment_write_count() >= FILE_CHUNKS / segment_size - 1);
+		REQUIRE(disk->dirty_chunk_count() < FILE_CHUNKS / 8);
+
+		inode = nullptr;
+		fs = nullptr;
+		disk = nullptr;
+	}
+
+	{
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
+		std::vector<char> buffer(contents.size());
+		REQUIRE(inode->read(0, &buffer[0], buffer.size()) == buffer.size());
+		REQUIRE(buffer == contents);
+	}
+	close(fh);
+}
+
+TEST_CASE("Freed space is punched out of the backing file", "[mmap][discard]") {
+	constexpr uint64_t CHUNK_COUNT = 2048;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t FILE_CHUNKS = 400;
+
+	truncate("disk.myanfest", CHUNK_COUNT * CHUNK_SIZE);
+	int fh = open("disk.myanfest", O_RDWR | O_CREAT);
+	{
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
+		DiscardConfig config;
+		config.enabled = true;
+		config.delay_ms = 200;
+		config.min_chunks = 1;
+		disk->set_discard_config(config);
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+
+		std::vector<char> contents(FILE_CHUNKS * CHUNK_SIZE, 'a');
+		std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+		disk->sync();
+		struct stat before;
+		REQUIRE(fstat(fh, &before) == 0);
+
+		inode->release_chunks();
+		// a run that is taken again before its discard is due keeps what is written to it
+		const DiskBitMap::BitRange reused = fs->superblock->allocate_chunk_run(42, 32);
+		REQUIRE(reused.bit_count == 32);
+		for (uint64_t idx = 0; idx < reused.bit_count; ++idx) 
+			disk->get_chunk(reused.start_idx + idx)->data[0] = 'b';
+
+		for (int i = 0; i < 300 && disk->discarded_chunk_count() < FILE_CHUNKS - 32; ++i) 
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		REQUIRE(disk->discarded_chunk_count() >= FILE_CHUNKS - 32);
+		for (uint64_t idx = 0; idx < reused.bit_count; ++idx) 
+			REQUIRE(disk->get_chunk(reused.start_idx + idx)->data[0] == 'b');
+		disk->sync();
+		struct stat after;
+		REQUIRE(fstat(fh, &after) == 0);
+		REQUIRE(after.st_blocks < before.st_blocks);
+
+		inode = nullptr;
+		fs = nullptr;
+		disk = nullptr;
+	}
+	close(fh);
+}
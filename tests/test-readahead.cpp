@@ -0,0 +1,103 @@
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "diskinterface.hpp"
+#include "bufferpool.hpp"
+#include "filesystem.hpp"
+
+TEST_CASE( "Readahead should follow sequential readers and ignore random ones", "[readahead][filesystem]" ) {
+	constexpr uint64_t CHUNK_COUNT = 8192;
+	constexpr uint64_t CHUNK_SIZE = 4096;
+	constexpr uint64_t READ_SIZE = 16 * 1024;
+
+	// large enough to go through the double indirect table
+	std::vector<char> contents(3 * 1024 * 1024);
+	for (size_t idx = 0; idx < contents.size(); ++idx) {
+		contents[idx] = 'a' + (idx * 7 + idx / CHUNK_SIZE) % 26;
+	}
+
+	const auto check_reads = [&](Disk *disk) {
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk));
+		fs->superblock->init(0.1);
+		Readahead *readahead = fs->superblock->readahead.get();
+		ReadaheadConfig config;
+		config.min_window_chunks = 4;
+		config.max_window_chunks = 64;
+		readahead->set_config(config);
+
+		uint64_t inode_idx = 0;
+		{
+			std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+			inode_idx = inode->inode_table_idx;
+			REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+		}
+
+		SECTION("a sequential reader gets a growing window and finds its chunks prefetched") {
+			std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
+			std::vector<char> read_back(contents.size());
+			for (uint64_t offset = 0; offset < contents.size(); offset += READ_SIZE) {
+				REQUIRE(inode->read(offset, &read_back[offset], READ_SIZE) == READ_SIZE);
+				// give the prefetcher a chance to keep up, as it would between reads of a 
+				// reader that does anything with its data
+				readahead->drain();
+			}
+			REQUIRE(read_back == contents);
+
+			REQUIRE(readahead->pattern(inode_idx) == Readahead::SEQUENTIAL);
+			REQUIRE(readahead->window_chunks(inode_idx) == 64);
+			REQUIRE(readahead->prefetched_chunks > 0);
+			// only the very first reads run ahead of the window
+			REQUIRE(readahead->misses <= READ_SIZE / CHUNK_SIZE);
+			REQUIRE(readahead->hits >= contents.size() / CHUNK_SIZE - 2 * READ_SIZE / CHUNK_SIZE);
+		}
+
+		SECTION("a random reader issues no windows") {
+			std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
+			std::vector<char> read_back(READ_SIZE);
+			for (uint64_t step = 1; step <= 64; ++step) {
+				const uint64_t offset = (step * 7919 * CHUNK_SIZE) % (contents.size() - READ_SIZE);
+				REQUIRE(inode->read(offset, &read_back[0], READ_SIZE) == READ_SIZE);
+				REQUIRE(std::equal(read_back.begin(), read_back.end(), contents.begin() + offset));
+			}
+			REQUIRE(readahead->pattern(inode_idx) == Readahead::RANDOM);
+			REQUIRE(readahead->window_chunks(inode_idx) == 0);
+			REQUIRE(readahead->windows_issued == 0);
+		}
+
+		SECTION("readahead can be turned off") {
+			config.max_window_chunks = 0;
+			readahead->set_config(config);
+			std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
+			std::vector<char> read_back(contents.size());
+			for (uint64_t offset = 0; offset < contents.size(); offset += READ_SIZE) {
+				REQUIRE(inode->read(offset, &read_back[offset], READ_SIZE) == READ_SIZE);
+			}
+			REQUIRE(read_back == contents);
+			REQUIRE(readahead->windows_issued == 0);
+		}
+	};
+
+	SECTION("on a memory mapped disk") {
+		std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+		check_reads(disk.get());
+	}
+
+	SECTION("on a buffer pool backed disk smaller than the file") {
+		const char *path = "disk.readahead.test";
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		REQUIRE(fd != -1);
+		REQUIRE(ftruncate(fd, CHUNK_COUNT * CHUNK_SIZE) == 0);
+		{
+			BufferPoolConfig config;
+			config.pool_bytes = 512 * CHUNK_SIZE;
+			std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE, fd, config));
+			check_reads(disk.get());
+		}
+		close(fd);
+		unlink(path);
+	}
+}